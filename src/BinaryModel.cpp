@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "BinaryModel.h"
+/// standard headers
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace tricrf {
+
+static const char BINARY_MAGIC[8] = "TRICRFB";
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+/// padding to 8 bytes
+static inline uint64_t align8(uint64_t size) {
+	return (size + 7) & ~(uint64_t)7;
+}
+
+/** Constructor.
+	@param filename	file to be written
+	@param type	model type
+*/
+BinaryModelWriter::BinaryModelWriter(const string& filename, const string& type) {
+	m_File.open(filename.c_str(), ios::out | ios::binary);
+	if (!m_File)
+		throw runtime_error("unable to open file to write");
+
+	BinaryModelHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+	header.version = BINARY_MODEL_VERSION;
+	header.byte_order = BYTE_ORDER_MARK;
+	strncpy(header.type, type.c_str(), sizeof(header.type) - 1);
+	m_File.write((const char*)&header, sizeof(header));
+	m_Size = 0;
+}
+
+/** Begin a section.
+	The size is filled by endSection().
+*/
+void BinaryModelWriter::beginSection(uint32_t tag) {
+	uint32_t reserved = 0;
+	m_Size = 0;
+	m_Section = m_File.tellp();
+	m_File.write((const char*)&tag, sizeof(tag));
+	m_File.write((const char*)&reserved, sizeof(reserved));
+	m_File.write((const char*)&m_Size, sizeof(m_Size));
+}
+
+void BinaryModelWriter::write(const void* data, size_t size) {
+	m_File.write((const char*)data, size);
+	m_Size += size;
+}
+
+/** End the section.
+	Pads the payload and writes back its size.
+*/
+void BinaryModelWriter::endSection() {
+	static const char padding[8] = {0, };
+	m_File.write(padding, align8(m_Size) - m_Size);
+
+	streampos end = m_File.tellp();
+	m_File.seekp(m_Section + (streamoff)(2 * sizeof(uint32_t)));
+	m_File.write((const char*)&m_Size, sizeof(m_Size));
+	m_File.seekp(end);
+}
+
+/** Write a string table (count, offsets and characters).
+*/
+void BinaryModelWriter::writeStrings(uint32_t tag, const vector<string>& vec) {
+	uint64_t count = vec.size();
+	vector<uint64_t> offset(count + 1, 0);
+	for (size_t i = 0; i < count; i++)
+		offset[i+1] = offset[i] + vec[i].size();
+
+	beginSection(tag);
+	write(&count, sizeof(count));
+	write(&offset[0], offset.size() * sizeof(uint64_t));
+	for (size_t i = 0; i < count; i++)
+		write(vec[i].data(), vec[i].size());
+	endSection();
+}
+
+/** Check whether the file is a binary model.
+	@param filename	model file
+	@return true if the file starts with the magic
+*/
+bool BinaryModelReader::isBinary(const string& filename) {
+	ifstream f(filename.c_str(), ios::in | ios::binary);
+	char magic[sizeof(BINARY_MAGIC)];
+	if (!f.read(magic, sizeof(magic)))
+		return false;
+	return memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0;
+}
+
+/** Constructor.
+	Maps the file and checks the header.
+	@param filename	model file
+*/
+BinaryModelReader::BinaryModelReader(const string& filename) {
+	m_Data = NULL;
+	m_Size = 0;
+	m_Pos = 0;
+	m_Fd = open(filename.c_str(), O_RDONLY);
+	if (m_Fd < 0)
+		throw runtime_error("fail to open model file");
+
+	struct stat st;
+	if (fstat(m_Fd, &st) != 0 || st.st_size < (off_t)sizeof(BinaryModelHeader)) {
+		close(m_Fd);
+		throw runtime_error("invalid binary model file");
+	}
+	m_Size = st.st_size;
+	void* data = mmap(NULL, m_Size, PROT_READ, MAP_PRIVATE, m_Fd, 0);
+	if (data == MAP_FAILED) {
+		close(m_Fd);
+		throw runtime_error("fail to map model file");
+	}
+	m_Data = (const char*)data;
+
+	const BinaryModelHeader* header = (const BinaryModelHeader*)m_Data;
+	if (memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) != 0
+		|| header->byte_order != BYTE_ORDER_MARK || header->version != BINARY_MODEL_VERSION) {
+		munmap((void*)m_Data, m_Size);
+		close(m_Fd);
+		throw runtime_error("unsupported binary model (version or byte order)");
+	}
+	m_Type = string(header->type, strnlen(header->type, sizeof(header->type)));
+	m_Pos = sizeof(BinaryModelHeader);
+}
+
+BinaryModelReader::~BinaryModelReader() {
+	munmap((void*)m_Data, m_Size);
+	close(m_Fd);
+}
+
+/** Read the next section.
+	@param tag	expected tag
+	@param data	payload (points into the mapped file)
+	@param size	payload size
+	@return false if the tag does not match or the file is truncated
+*/
+bool BinaryModelReader::nextSection(uint32_t tag, const char*& data, uint64_t& size) {
+	const size_t header_size = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+	if (m_Pos + header_size > m_Size)
+		return false;
+	const char* p = m_Data + m_Pos;
+	if (*(const uint32_t*)p != tag)
+		return false;
+	size = *(const uint64_t*)(p + 2 * sizeof(uint32_t));
+	if (m_Pos + header_size + size > m_Size)
+		return false;
+	data = p + header_size;
+	m_Pos += header_size + align8(size);
+	return true;
+}
+
+/** Read a string table.
+	@param tag	expected tag
+	@param vec	strings
+	@return success or failure
+*/
+bool BinaryModelReader::readStrings(uint32_t tag, vector<string>& vec) {
+	const char* data;
+	uint64_t size;
+	if (!nextSection(tag, data, size) || size < sizeof(uint64_t))
+		return false;
+	uint64_t count = *(const uint64_t*)data;
+	const uint64_t* offset = (const uint64_t*)(data + sizeof(uint64_t));
+	const char* chars = (const char*)(offset + count + 1);
+	if ((count + 2) * sizeof(uint64_t) > size || (count + 2) * sizeof(uint64_t) + offset[count] > size)
+		return false;
+
+	vec.clear();
+	vec.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		vec.push_back(string(chars + offset[i], offset[i+1] - offset[i]));
+	return true;
+}
+
+} // namespace tricrf
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __BINARYMODEL_H__
+#define __BINARYMODEL_H__
+
+/// standard headers
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdint.h>
+
+namespace tricrf {
+
+/** Binary model format.
+
+	header		magic "TRICRFB", version, byte order mark, model type
+	section*	tag (uint32), reserved (uint32), size (uint64), payload
+
+	Every payload is padded to 8 bytes, so that the arrays of the memory-mapped file are aligned
+	and can be read without parsing. Parameter::load() copies them into its own tables
+	(dictionaries, CSR index and weights), so the mapping is released after loading.
+	Payload of each section:
+
+	BIN_STATE, BIN_FEATURE	count (uint64), offset[count+1] (uint64), characters
+	BIN_PARAM_INDEX	rows (uint64), entries (uint64), row[rows+1] (uint64), label[entries] (uint32) ; CSR, fid = entry number
+	BIN_WEIGHT		count (uint64), weight[count] (double)
+	BIN_TOPIC_MAPPING	count (uint64), (z, y, yz)[count] (uint32)
+	BIN_TOPIC_TABLE	topics (uint64), labels (uint64), yz[topics][labels] (uint32) ; NO_STATE if y is not in the plane z
+	BIN_CORPUS_*	compiled corpus ; see compileCorpus() in Corpus.h
+
+	A Parameter is stored as STATE, FEATURE, PARAM_INDEX and WEIGHT sections,
+	and the models write their Parameters in the same order as the text format.
+*/
+enum BinarySection {
+	BIN_STATE = 1,
+	BIN_FEATURE,
+	BIN_PARAM_INDEX,
+	BIN_WEIGHT,
+	BIN_TOPIC_MAPPING,
+	BIN_CORPUS_TOKEN,
+	BIN_CORPUS_LINE,
+	BIN_CORPUS_SEQUENCE,
+	BIN_CORPUS_STRING,
+	BIN_TOPIC_TABLE
+};
+
+const uint32_t BINARY_MODEL_VERSION = 1;
+
+/** Header of the binary model.
+*/
+struct BinaryModelHeader {
+	char magic[8];			///< "TRICRFB"
+	uint32_t version;		///< BINARY_MODEL_VERSION
+	uint32_t byte_order;	///< 0x01020304 in the byte order of the writer
+	char type[16];			///< model type (MaxEnt, CRF, TriCRF1, ...)
+};
+
+/** Writer of the binary model.
+	@class BinaryModelWriter
+*/
+class BinaryModelWriter {
+private:
+	std::ofstream m_File;
+	std::streampos m_Section;	///< position of the current section header
+	uint64_t m_Size;			///< payload size of the current section
+
+public:
+	BinaryModelWriter(const std::string& filename, const std::string& type);
+
+	void beginSection(uint32_t tag);
+	void write(const void* data, size_t size);
+	void endSection();
+
+	/// helpers
+	void writeStrings(uint32_t tag, const std::vector<std::string>& vec);
+	bool good() { return m_File.good(); };
+	void close() { m_File.close(); };
+};
+
+/** Reader of the binary model.
+	The file is memory-mapped and the sections are read in order.
+	The mapping lives as long as the reader ; Parameter::load() copies the sections it keeps.
+	@class BinaryModelReader
+*/
+class BinaryModelReader {
+private:
+	int m_Fd;
+	const char* m_Data;	///< mapped file
+	size_t m_Size;
+	size_t m_Pos;		///< offset of the next section
+	std::string m_Type;
+
+	BinaryModelReader(const BinaryModelReader&);
+	BinaryModelReader& operator=(const BinaryModelReader&);
+
+public:
+	BinaryModelReader(const std::string& filename);
+	~BinaryModelReader();
+
+	static bool isBinary(const std::string& filename);	///< check the magic
+	const std::string& type() const { return m_Type; };
+	bool eof() const { return m_Pos >= m_Size; };
+
+	bool nextSection(uint32_t tag, const char*& data, uint64_t& size);
+	bool readStrings(uint32_t tag, std::vector<std::string>& vec);
+};
+
+} // namespace tricrf
+
+#endif
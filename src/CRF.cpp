@@ -7,15 +7,20 @@
 
 /// max headers
 #include "CRF.h"
+#include "BinaryModel.h"
 #include "Evaluator.h"
 #include "Utility.h"
+#include "Corpus.h"
 #include "LBFGS.h"
+#include "SGD.h"
+#include "Thread.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
 #include <cmath>
 #include <limits>
 #include <algorithm>
+#include <functional>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
@@ -56,20 +61,28 @@ bool	CRF::saveModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model saving]\n");
 
-	/// file stream
-    ofstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("unable to open file to write");
-
-    /// header
-    f << "# MAX: A C++ Library for Structured Prediction" << endl;
-	f << "# CRF Model file (text format)" << endl;
-	f << "# Do not edit this file" << endl;
-	f << "# " << endl << ":" << endl;
-	
-	bool ret = m_Param.save(f);
-	f.close();
+	bool ret;
+	if (m_BinaryModel) {
+		/// binary format
+		BinaryModelWriter f(filename, "CRF");
+		ret = m_Param.save(f);
+		f.close();
+	} else {
+		/// file stream
+		ofstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("unable to open file to write");
+
+		/// header
+		f << "# MAX: A C++ Library for Structured Prediction" << endl;
+		f << "# CRF Model file (text format)" << endl;
+		f << "# Do not edit this file" << endl;
+		f << "# " << endl << ":" << endl;
+
+		ret = m_Param.save(f);
+		f.close();
+	}
 	logger->report("  saving time = \t%.3f\n\n", stop_watch.elapsed());
 
 	return ret;
@@ -87,36 +100,48 @@ bool CRF::loadModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model loading]\n");
 
-	/// file stream
-    ifstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("fail to open model file");
-
-    /// header
-	size_t count = 0;
-    string line;
-    getline(f, line);
-    while (line.empty() || line[0] == '#') {
-		if (count == 1) {
-			vector<string> tok = tokenize(line);
-			if (tok.size() < 2 || tok[1] != "CRF") {
-				logger->report("|Error| Invalid model files ... \n");
-				return false;
+	bool ret;
+	if (BinaryModelReader::isBinary(filename)) {
+		/// binary format (memory-mapped)
+		BinaryModelReader f(filename);
+		if (f.type() != "CRF") {
+			logger->report("|Error| Invalid model files ... \n");
+			return false;
+		}
+		ret = m_Param.load(f);
+	} else {
+		/// file stream
+		ifstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("fail to open model file");
+
+		/// header
+		size_t count = 0;
+		string line;
+		getline(f, line);
+		while (line.empty() || line[0] == '#') {
+			if (count == 1) {
+				vector<string> tok = tokenize(line);
+				if (tok.size() < 2 || tok[1] != "CRF") {
+					logger->report("|Error| Invalid model files ... \n");
+					return false;
+				}
 			}
+			getline(f, line);
+			count++;
 		}
-        getline(f, line);
-		count++;
-	}
 
-	bool ret = m_Param.load(f);
-	f.close();
+		ret = m_Param.load(f);
+		f.close();
+	}
 	m_Param.print(logger);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 	
 	/// to be used in inference
 	m_Param.makeStateIndex();
 	m_state_size = m_Param.sizeStateVec();
+	calculateEdge();
 
 	return ret;
 }
@@ -124,35 +149,24 @@ bool CRF::loadModel(const std::string& filename) {
 /**	Read the data from file
 */
 void CRF::readTrainData(const string& filename) {
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
+	/// Corpus (text or compiled)
+	vector<StringRef> tokens;
+	CorpusReader corpus(filename, m_Pool);
 
 	// Make a state space Y
-	while ( getline(f, line) ) {
-		if ( !line.empty() ) {
-			vector<string> tokens = tokenize(line);
-			if (tokens.size() > 0) {
-				size_t index = 0;
-				string fstr(tokens[index]);
-				vector<string> tok = tokenize(fstr, ":");
-				float fval = 1.0;
-				if (tok.size() > 1) {
-					fval = atof(tok[1].c_str());	///< feature value
-					fstr = tok[0];
-				}
-				
-				m_Param.addNewState(fstr);	// outcome id
-								
-			}
+	while (corpus.next(tokens)) {
+		if (!tokens.empty()) {
+			size_t index = 0;
+			double fval = 1.0;
+			StringRef fstr = parseFeature(tokens[index], fval);	///< label and its value
+			
+			m_Param.addNewState(fstr);	// outcome id
+							
 		
 		}
 	}
 	
-	f.clear();
-	f.seekg(0, ios::beg);
+	corpus.rewind();
 			
 
 	/// initializing
@@ -165,26 +179,22 @@ void CRF::readTrainData(const string& filename) {
 	timer stop_watch;
 	logger->report("[Training data file loading]\n");
 
-	/// To reduce the storage and computation
-	map<vector<vector<string> >, size_t> train_data_map;
-	vector<vector<string> > token_list;
+	DuplicateFilter duplicate(corpus);	///< To reduce the storage and computation
 
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
-			if (train_data_map.find(token_list) == train_data_map.end()) {
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {	 ///< sequence break
+			size_t index = duplicate.find(m_TrainSetCount.size());
+			if (index == m_TrainSetCount.size()) {
 				m_TrainSet.append(seq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
 				m_TrainSetCount.push_back(1.0);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				m_TrainSetCount[index] += 1.0;
 			}
 			seq.clear();
-			token_list.clear();
 			prev_label = "";
 			++count;
 		} else {
-			token_list.push_back(tokens);
+			duplicate.add(tokens);
 
 			Event ev = packEvent(tokens);	///< observation features
 			seq.push_back(ev);						///< append
@@ -202,7 +212,7 @@ void CRF::readTrainData(const string& filename) {
 											
 				//m_Param.updateParam(ev.label, pid, ev.fval);
 			}
-			prev_label = tokens[0];
+			prev_label = tokens[0].str();
 		}	// else
 
 	}	// while
@@ -218,11 +228,9 @@ void CRF::readTrainData(const string& filename) {
 /**	Read the data from file
 */
 void CRF::readDevData(const string& filename) {
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
+	/// Corpus (text or compiled)
+	vector<StringRef> tokens;
+	CorpusReader corpus(filename, m_Pool);
 	
 	/// initializing
 	Sequence seq;
@@ -233,31 +241,27 @@ void CRF::readDevData(const string& filename) {
 	timer stop_watch;
 	logger->report("[Dev data file loading]\n");
 
-	/// To reduce the storage and computation
-	map<vector<vector<string> >, size_t> dev_data_map;
-	vector<vector<string> > token_list;
+	DuplicateFilter duplicate(corpus);	///< To reduce the storage and computation
 
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
-			if (dev_data_map.find(token_list) == dev_data_map.end()) {
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {	 ///< sequence break
+			size_t index = duplicate.find(m_DevSetCount.size());
+			if (index == m_DevSetCount.size()) {
 				m_DevSet.append(seq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
 				m_DevSetCount.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				m_DevSetCount[index] += 1.0;
 			}
 			seq.clear();
-			token_list.clear();
 			prev_label = "";
 			++count;
 		} else {
-			token_list.push_back(tokens);
+			duplicate.add(tokens);
 
 			Event ev = packEvent(tokens, &m_Param, true);	///< observation features
 			seq.push_back(ev);						///< append
 
-			prev_label = tokens[0];
+			prev_label = tokens[0].str();
 		}	// else
 
 	}	// while
@@ -271,12 +275,42 @@ void CRF::calculateEdge() {
 	double* theta = m_Param.getWeight();
 
 	// state transition is independent of time t and training set 
-	m_M2.resize(m_state_size * m_state_size);
-	fill(m_M2.begin(), m_M2.end(), 1.0);
-	vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
-	for (; iter != m_Param.m_StateIndex.end(); ++iter) {
-		m_M2[MAT2(iter->y1,iter->y2)] *= exp(theta[iter->fid] * iter->fval);	 
+	vector<double> score(m_state_size * m_state_size, 0.0);	///< linear scores
+	m_Tied.assign(m_state_size, 1.0);
+	if (m_Param.isTied()) {
+		/// a tied transition has the weight of its label (see Parameter::makeTiedPotential())
+		vector<StateParam>::iterator iter = m_Param.m_SelectedStateIndex.begin();
+		for (; iter != m_Param.m_SelectedStateIndex.end(); ++iter)
+			score[MAT2(iter->y1,iter->y2)] += theta[iter->fid] * iter->fval;
+		for (iter = m_Param.m_RemainStateIndex.begin(); iter != m_Param.m_RemainStateIndex.end(); ++iter)
+			score[MAT2(iter->y1,iter->y2)] += theta[m_Param.remain_fid[iter->y2]] * iter->fval;
+		for (size_t y = 0; y < m_state_size; y++)
+			m_Tied[y] = exp(theta[m_Param.remain_fid[y]]);
+	} else {
+		vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
+		for (; iter != m_Param.m_StateIndex.end(); ++iter) {
+			score[MAT2(iter->y1,iter->y2)] += theta[iter->fid] * iter->fval;	 
+		}
+	}
+	expScore(score, m_M2);
+
+	/// the transitions out of the active index are fixed to 1 (SPARSE_ACTIVE), 
+	/// so that every inference path sees the same model as the sparse forward-backward
+	if (m_SparseMode == SPARSE_ACTIVE) {
+		vector<long double> active(m_state_size * m_state_size, 1.0);
+		for (size_t y1 = 0; y1 < m_state_size; y1++) {
+			const vector<size_t> &selectedState = m_Param.m_SelectedStateList2[y1];
+			for (size_t x = 0; x < selectedState.size(); x++)
+				active[MAT2(y1, selectedState[x])] = m_M2[MAT2(y1, selectedState[x])];
+		}
+		m_M2.swap(active);
 	}
+
+	/// copy for the reduced precision kernels
+	if (m_Precision == LATTICE_DOUBLE)
+		m_M2d.assign(m_M2.begin(), m_M2.end());
+	else if (m_Precision == LATTICE_FLOAT)
+		m_M2f.assign(m_M2.begin(), m_M2.end());
 }
 
 /**	Calculate the factors.
@@ -284,24 +318,24 @@ void CRF::calculateEdge() {
 		1)	J. Lafferty et al., Conditional Random Fields: Probabilistic Models for Segmenting and Labeling Sequence Data, 2001, ICML. 
 		2) C. Sutton and A. McCallum, An Introduction to Conditional Random Fields for Relational Learning, 2006, Introduction to Statistical Relational Learning. Edited by Lise Getoor and Ben Taskar. MIT Press. 2006.
 */
-void CRF::calculateFactors(Sequence &seq) {
+void CRF::calculateFactors(const Sequence &seq, InferenceContext& ctx) const {
 	/// Initialization
-	m_seq_size = seq.size() + 1;	///< sequence length
-	double* theta = m_Param.getWeight();
+	ctx.seq_size = seq.size() + 1;	///< sequence length
+	const double* theta = m_Param.getWeight();
 
 	/// Factor matrix initialization
-	//m_M.resize(m_seq_size * m_state_size * m_state_size);
-	m_R.resize(m_seq_size * m_state_size);
+	//m_M.resize(ctx.seq_size * m_state_size * m_state_size);
+	ctx.score.resize(ctx.seq_size * m_state_size);
 	//fill(m_M.begin(), m_M.end(), 1.0);
-	fill(m_R.begin(), m_R.end(), 1.0);
+	fill(ctx.score.begin(), ctx.score.end(), 0.0);	///< linear scores ; exponentiated at the end
 
 	// for efficient alpha-beta
 	//m_IndexR.clear();
-	//m_IndexR.resize(m_seq_size-1);
+	//m_IndexR.resize(ctx.seq_size-1);
 
 	/// Calculation
 	double a = 0.0;
-	for (size_t i = 0; i < m_seq_size-1; i++) {
+	for (size_t i = 0; i < ctx.seq_size-1; i++) {
 
 		//vector<size_t> &pointer = m_IndexR[i];
 		//map<size_t, size_t> temp;
@@ -311,18 +345,18 @@ void CRF::calculateFactors(Sequence &seq) {
 		vector<ObsParam> obs_param = m_Param.makeObsIndex(seq[i].obs);
 		vector<ObsParam>::iterator iter = obs_param.begin();
 		for(; iter != obs_param.end(); ++iter) {
-			m_R[MAT2(i, iter->y)] *= exp(theta[iter->fid] * iter->fval);
+			ctx.R[MAT2(i, iter->y)] *= exp(theta[iter->fid] * iter->fval);
 			//if (temp.find(iter->y) == temp.end()) {
 			//	temp.insert(make_pair(iter->y, 1));
 			//	pointer.push_back(iter->y);
 			//}
 		}
 		*/
-		vector<pair<size_t, double> >::iterator iter = seq[i].obs.begin();
+		vector<pair<size_t, double> >::const_iterator iter = seq[i].obs.begin();
 		for (; iter != seq[i].obs.end(); iter++) {
-			vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
-			for (size_t j = 0; j < param.size(); ++j) {
-				m_R[MAT2(i, param[j].first)] *= exp(theta[param[j].second] * iter->second);
+			const ParamIndex& index = m_Param.m_ParamIndex;
+			for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j) {
+				ctx.score[MAT2(i, index.label[j])] += theta[index.fid[j]] * iter->second;
 			}
 		}
 
@@ -338,17 +372,48 @@ void CRF::calculateFactors(Sequence &seq) {
 
 	}	///< for 
 
+	if (m_Precision == LATTICE_LONG_DOUBLE)
+		expScore(ctx.score, ctx.R);
+	else
+		expScoreKernel(ctx);
+}
+
+/**	Exponentiate the scores into the reduced precision lattice.
+	The SIMD exp (see latticeExp()) fills the R rows that the forward and backward kernels read in place ;
+	ctx.R gets the same factors for the expectations and Viterbi.
+*/
+void CRF::expScoreKernel(InferenceContext& ctx) const {
+	vector<double>& R = ctx.lattice_d.R;
+	R.resize(ctx.score.size());
+	latticeExp(&ctx.score[0], &R[0], R.size());
+	ctx.R.assign(R.begin(), R.end());
+	if (m_Precision == LATTICE_FLOAT)
+		ctx.lattice_f.R.assign(R.begin(), R.end());
 }
 
 /**	Forward Recursion.
 	Computing and storing the alpha value.
+	Only the transitions in m_SelectedStateList1 are visited; the other transitions into j
+	have the potential m_Tied[j], which is added once since sum_k alpha[i-1][k] = 1 after scaling.
 */
-void CRF::forward() {
-	m_Alpha.resize(m_seq_size * m_state_size);
-	fill(m_Alpha.begin(), m_Alpha.end(), 0.0);
+void CRF::forward(InferenceContext& ctx) const {
+	if (useStateBeam()) {
+		forwardBeam(ctx);
+		return;
+	}
+	if (m_Precision == LATTICE_DOUBLE) {
+		forwardKernel(ctx, ctx.lattice_d, m_M2d);
+		return;
+	} else if (m_Precision == LATTICE_FLOAT) {
+		forwardKernel(ctx, ctx.lattice_f, m_M2f);
+		return;
+	}
 
-	scale.resize(m_seq_size);
-	fill(scale.begin(), scale.end(), 1.0);
+	ctx.Alpha.resize(ctx.seq_size * m_state_size);
+	fill(ctx.Alpha.begin(), ctx.Alpha.end(), 0.0);
+
+	ctx.scale.resize(ctx.seq_size);
+	fill(ctx.scale.begin(), ctx.scale.end(), 1.0);
 	
 	long double sum = 0.0;
 	for (size_t j = 0; j < m_state_size; j++) {
@@ -356,125 +421,383 @@ void CRF::forward() {
 	//for (size_t y = 0; y < indexR.size(); y++) {
 	//	size_t j = indexR[y];
 
-		m_Alpha[MAT2(0, j)] += m_R[MAT2(0, j)] * 1.0; //m_M[MAT3(0, m_default_oid,j)];  // <start>->j transition is 1.0
-		sum += m_Alpha[MAT2(0, j)];
+		ctx.Alpha[MAT2(0, j)] += ctx.R[MAT2(0, j)] * 1.0; //m_M[MAT3(0, m_default_oid,j)];  // <start>->j transition is 1.0
+		sum += ctx.Alpha[MAT2(0, j)];
 	}
 	for (size_t j = 0; j < m_state_size; j++) 
-		m_Alpha[MAT2(0, j)] /= sum;
-	scale[0] = sum;
+		ctx.Alpha[MAT2(0, j)] /= sum;
+	ctx.scale[0] = sum;
 	
-    for (size_t i = 1; i < m_seq_size-1; i++) {
-		long double sum = 0.0;
-        for (size_t j = 0; j < m_state_size; j++) {
-		//vector<size_t> &indexR = m_IndexR[i];
-		//for (size_t y = 0; y < indexR.size(); y++) {
-		//	size_t j = indexR[y];
-			size_t index = MAT2(i, j);
-            //for (size_t k = 0; k < m_state_size; k++) {
-			vector<size_t> &selectedState = m_Param.m_SelectedStateList1[j];
-			for (size_t x = 0; x < selectedState.size(); x++) {
-				size_t k = selectedState[x];
-                m_Alpha[index] += m_Alpha[MAT2(i-1, k)] * m_R[index] * (m_M2[MAT2(k,j)] - 1.0);
-           }
-			m_Alpha[index] += m_R[index];
-			sum += m_Alpha[index];
-        }
-		for (size_t j = 0; j < m_state_size; j++) 
-			m_Alpha[MAT2(i, j)] /= sum;
-		scale[i] = sum;
-    }
+    for (size_t i = 1; i < ctx.seq_size-1; i++)
+		ctx.scale[i] = forwardRow(&ctx.Alpha[MAT2(i-1, 0)], &ctx.R[MAT2(i, 0)], &ctx.Alpha[MAT2(i, 0)]);
 
 	for (size_t k = 0; k < m_state_size; k++) {
-		m_Alpha[MAT2(m_seq_size-1, m_default_oid)] += m_Alpha[MAT2(m_seq_size-2, k)]; 
+		ctx.Alpha[MAT2(ctx.seq_size-1, m_default_oid)] += ctx.Alpha[MAT2(ctx.seq_size-2, k)]; 
 	}
-	scale[m_seq_size-1] = m_Alpha[MAT2(m_seq_size-1, m_default_oid)];
+	ctx.scale[ctx.seq_size-1] = ctx.Alpha[MAT2(ctx.seq_size-1, m_default_oid)];
 
 }
 
 /**	Backward Recursion.
 	Computing and storing the beta value.
 */
-void CRF::backward() {
-	m_Beta.resize(m_seq_size * m_state_size);
-	fill(m_Beta.begin(), m_Beta.end(), 0.0);
+void CRF::backward(InferenceContext& ctx) const {
+	if (useStateBeam()) {
+		backwardBeam(ctx);
+		return;
+	}
+	if (m_Precision == LATTICE_DOUBLE) {
+		backwardKernel(ctx, ctx.lattice_d, m_M2d);
+		return;
+	} else if (m_Precision == LATTICE_FLOAT) {
+		backwardKernel(ctx, ctx.lattice_f, m_M2f);
+		return;
+	}
+
+	ctx.Beta.resize(ctx.seq_size * m_state_size);
+	fill(ctx.Beta.begin(), ctx.Beta.end(), 0.0);
 
-	scale2.resize(m_seq_size);
-	fill(scale2.begin(), scale2.end(), 1.0);
+	ctx.scale2.resize(ctx.seq_size);
+	fill(ctx.scale2.begin(), ctx.scale2.end(), 1.0);
 
-	m_Beta[MAT2(m_seq_size-1, m_default_oid)] = 1.0; // / scale[m_seq_size-1];
+	ctx.Beta[MAT2(ctx.seq_size-1, m_default_oid)] = 1.0; // / ctx.scale[ctx.seq_size-1];
 	long double sum = 0.0;
 
 	for (size_t k = 0; k < m_state_size; k++) {
-	//vector<size_t> &indexR = m_IndexR[m_seq_size-2];
+	//vector<size_t> &indexR = m_IndexR[ctx.seq_size-2];
 	//for (size_t y = 0; y < indexR.size(); y++) {
 	///	size_t k = indexR[y];
-		m_Beta[MAT2(m_seq_size-2, k)] += 1.0;
-		sum += m_Beta[MAT2(m_seq_size-2, k)];
+		ctx.Beta[MAT2(ctx.seq_size-2, k)] += 1.0;
+		sum += ctx.Beta[MAT2(ctx.seq_size-2, k)];
 	}
 	for (size_t k = 0; k < m_state_size; k++) 
-		m_Beta[MAT2(m_seq_size-2, k)] /= sum;
-	scale2[m_seq_size-2] = sum;
+		ctx.Beta[MAT2(ctx.seq_size-2, k)] /= sum;
+	ctx.scale2[ctx.seq_size-2] = sum;
+
+    for (int i = ctx.seq_size-2; i >= 1; i--)
+		ctx.scale2[i-1] = backwardRow(&ctx.Beta[MAT2(i, 0)], &ctx.R[MAT2(i, 0)], &ctx.Beta[MAT2(i-1, 0)]);
+}
+
+/**	One step of the forward recursion (position i > 0).
+	alpha[j] = R[j] * (sum_{k in m_SelectedStateList1[j]} prev[k] * (M[k][j] - tied[j]) + tied[j]),
+	normalized to sum 1.
+	@param prev	scaled alpha of the position i-1
+	@param R	factors of the position i
+	@param alpha	alpha of the position i (output)
+	@return	scaling factor of the position i
+*/
+long double CRF::forwardRow(const long double* prev, const long double* R, long double* alpha) const {
+	long double sum = 0.0;
+	for (size_t j = 0; j < m_state_size; j++) {
+		long double tied = m_Tied[j];	///< the other transitions into j
+		long double a = 0.0;
+		const vector<size_t> &selectedState = m_Param.m_SelectedStateList1[j];
+		for (size_t x = 0; x < selectedState.size(); x++) {
+			size_t k = selectedState[x];
+			a += prev[k] * R[j] * (m_M2[MAT2(k,j)] - tied);
+		}
+		a += R[j] * tied;
+		alpha[j] = a;
+		sum += a;
+	}
+	for (size_t j = 0; j < m_state_size; j++) 
+		alpha[j] /= sum;
+	return sum;
+}
+
+/**	One step of the backward recursion (position i-1 from i).
+	@param next	scaled beta of the position i
+	@param R	factors of the position i
+	@param beta	beta of the position i-1 (output)
+	@return	scaling factor of the position i-1
+*/
+long double CRF::backwardRow(const long double* next, const long double* R, long double* beta) const {
+	long double sum = 0.0;
+	long double constant = 0.0;
+	for (size_t k = 0; k < m_state_size; k++)
+		constant += R[k] * next[k] * m_Tied[k];
+
+	for (size_t j = 0; j < m_state_size; j++) {
+		long double b = 0.0;
+		const vector<size_t> &selectedState = m_Param.m_SelectedStateList2[j];
+		for (size_t x = 0; x < selectedState.size(); x++) {
+			size_t k = selectedState[x];
+			b += R[k] * (m_M2[MAT2(j, k)] - m_Tied[k]) * next[k];
+		}
+		b += constant;
+		beta[j] = b;
+		sum += b;
+	}
+	for (size_t j = 0; j < m_state_size; j++) 
+		beta[j] /= sum;
+	return sum;
+}
+
+/**	Forward recursion in reduced precision.
+	buf.R holds the factors (see expScoreKernel()) and the dense kernel (see Lattice.h) computes the scaled alpha;
+	the result is copied back so that the rest of the inference keeps using ctx.
+	It is the same recursion as forward() since sum_k alpha[i-1][k] = 1 after scaling.
+*/
+template <class T>
+void CRF::forwardKernel(InferenceContext& ctx, LatticeBuffer<T>& buf, const vector<T>& M) const {
+	size_t len = ctx.seq_size - 1;	///< without the end state
+	buf.Alpha.resize(len * m_state_size);
+	buf.scale.resize(len);
+	buf.work.resize(m_state_size);
+	scaledForward(&buf.R[0], &M[0], len, m_state_size, &buf.Alpha[0], &buf.scale[0], &buf.work[0]);
+
+	ctx.Alpha.resize(ctx.seq_size * m_state_size);
+	copy(buf.Alpha.begin(), buf.Alpha.end(), ctx.Alpha.begin());
+	fill(ctx.Alpha.begin() + len * m_state_size, ctx.Alpha.end(), 0.0);
+	ctx.scale.resize(ctx.seq_size);
+	copy(buf.scale.begin(), buf.scale.end(), ctx.scale.begin());
+
+	/// end state
+	long double sum = 0.0;
+	for (size_t k = 0; k < m_state_size; k++)
+		sum += ctx.Alpha[MAT2(len-1, k)];
+	ctx.Alpha[MAT2(len, m_default_oid)] = sum;
+	ctx.scale[len] = sum;
+}
+
+/**	Backward recursion in reduced precision.
+*/
+template <class T>
+void CRF::backwardKernel(InferenceContext& ctx, LatticeBuffer<T>& buf, const vector<T>& M) const {
+	size_t len = ctx.seq_size - 1;	///< without the end state
+	buf.Beta.resize(len * m_state_size);
+	buf.scale2.resize(len);
+	buf.work.resize(m_state_size);
+	scaledBackward(&buf.R[0], &M[0], len, m_state_size, &buf.Beta[0], &buf.scale2[0], &buf.work[0]);
+
+	ctx.Beta.resize(ctx.seq_size * m_state_size);
+	copy(buf.Beta.begin(), buf.Beta.end(), ctx.Beta.begin());
+	fill(ctx.Beta.begin() + len * m_state_size, ctx.Beta.end(), 0.0);
+	ctx.Beta[MAT2(len, m_default_oid)] = 1.0;
+	ctx.scale2.resize(ctx.seq_size);
+	copy(buf.scale2.begin(), buf.scale2.end(), ctx.scale2.begin());
+	ctx.scale2[len] = 1.0;
+}
+
+/**	Select the states of the beam at position i (state beam).
+	Keeps the m_state_beam best states by alpha and drops the states below the best one divided by m_state_beam_ratio ;
+	the alpha of the dropped states is set to zero.
+	References 
+		C. Pal, C. Sutton and A. McCallum, Sparse Forward-Backward using Minimum Divergence Beams for Fast Training of Conditional Random Fields, 2006, ICASSP.
+	@param ctx	inference context (alpha of the position i)
+	@param i	position
+	@return sum of alpha over the beam
+*/
+long double CRF::selectBeam(InferenceContext& ctx, size_t i) const {
+	long double* alpha = &ctx.Alpha[MAT2(i, 0)];
+	vector<pair<long double, size_t> >& order = ctx.state_beam.order;
+	order.clear();
+	long double best = 0.0;
+	for (size_t j = 0; j < m_state_size; j++) {
+		if (alpha[j] > 0) {
+			order.push_back(make_pair(alpha[j], j));
+			best = max(best, alpha[j]);
+		}
+	}
+	if (m_state_beam > 0 && order.size() > m_state_beam) {
+		nth_element(order.begin(), order.begin() + m_state_beam, order.end(), greater<pair<long double, size_t> >());
+		order.resize(m_state_beam);
+	}
+	long double threshold = (m_state_beam_ratio > 0 ? best / m_state_beam_ratio : 0.0);
+
+	char* in_beam = &ctx.state_beam.in_beam[MAT2(i, 0)];
+	for (size_t x = 0; x < order.size(); x++) {
+		if (order[x].first >= threshold)
+			in_beam[order[x].second] = 1;
+	}
+
+	vector<size_t>& beam = ctx.state_beam.states[i];
+	beam.clear();
+	long double sum = 0.0;
+	for (size_t j = 0; j < m_state_size; j++) {
+		if (in_beam[j]) {
+			beam.push_back(j);
+			sum += alpha[j];
+		} else {
+			alpha[j] = 0.0;
+		}
+	}
+	return sum;
+}
+
+/**	Forward recursion over the state beam.
+	Only the states in the beam of the position i-1 are expanded, so a position takes O(K*S) ;
+	the beam of every position is kept in ctx for the backward recursion and Viterbi.
+	The factors and scaling are the same as forward().
+*/
+void CRF::forwardBeam(InferenceContext& ctx) const {
+	size_t len = ctx.seq_size - 1;	///< without the end state
+	ctx.Alpha.assign(ctx.seq_size * m_state_size, 0.0);
+	ctx.scale.assign(ctx.seq_size, 1.0);
+	ctx.state_beam.states.resize(len);
+	ctx.state_beam.in_beam.assign(len * m_state_size, 0);
+
+	for (size_t i = 0; i < len; i++) {
+		long double* alpha = &ctx.Alpha[MAT2(i, 0)];
+		const long double* R = &ctx.R[MAT2(i, 0)];
+		if (i == 0) {
+			for (size_t j = 0; j < m_state_size; j++)
+				alpha[j] = R[j];	///< <start>->j transition is 1.0
+		} else {
+			const vector<size_t>& prev = ctx.state_beam.states[i-1];
+			for (size_t x = 0; x < prev.size(); x++) {
+				size_t k = prev[x];
+				long double a = ctx.Alpha[MAT2(i-1, k)];
+				const long double* M = &m_M2[MAT2(k, 0)];
+				for (size_t j = 0; j < m_state_size; j++)
+					alpha[j] += a * M[j];
+			}
+			for (size_t j = 0; j < m_state_size; j++)
+				alpha[j] *= R[j];
+		}
+
+		long double sum = selectBeam(ctx, i);
+		const vector<size_t>& beam = ctx.state_beam.states[i];
+		for (size_t x = 0; x < beam.size(); x++)
+			alpha[beam[x]] /= sum;
+		ctx.scale[i] = sum;
+	}
+
+	/// end state
+	long double sum = 0.0;
+	const vector<size_t>& last = ctx.state_beam.states[len-1];
+	for (size_t x = 0; x < last.size(); x++)
+		sum += ctx.Alpha[MAT2(len-1, last[x])];
+	ctx.Alpha[MAT2(len, m_default_oid)] = sum;
+	ctx.scale[len] = sum;
+}
+
+/**	Backward recursion over the state beam (of the forward recursion).
+	A position takes O(K^2) ; beta of the states out of the beam is zero.
+*/
+void CRF::backwardBeam(InferenceContext& ctx) const {
+	size_t len = ctx.seq_size - 1;	///< without the end state
+	ctx.Beta.assign(ctx.seq_size * m_state_size, 0.0);
+	ctx.scale2.assign(ctx.seq_size, 1.0);
+	ctx.Beta[MAT2(len, m_default_oid)] = 1.0;
+
+	const vector<size_t>& last = ctx.state_beam.states[len-1];
+	for (size_t x = 0; x < last.size(); x++)
+		ctx.Beta[MAT2(len-1, last[x])] = 1.0 / last.size();
+	ctx.scale2[len-1] = last.size();
+
+	vector<long double> w;	///< R * beta of the beam
+	for (size_t i = len-1; i >= 1; i--) {
+		const vector<size_t>& beam = ctx.state_beam.states[i];
+		const vector<size_t>& prev = ctx.state_beam.states[i-1];
+		w.resize(beam.size());
+		for (size_t x = 0; x < beam.size(); x++)
+			w[x] = ctx.R[MAT2(i, beam[x])] * ctx.Beta[MAT2(i, beam[x])];
 
-    for (int i = m_seq_size-2; i >= 1; i--) {
 		long double sum = 0.0;
-		long double constant = 0.0;
-		for (size_t k = 0; k < m_state_size; k++)
-			constant += m_R[MAT2(i,k)] * m_Beta[MAT2(i, k)];
+		for (size_t y = 0; y < prev.size(); y++) {
+			size_t j = prev[y];
+			const long double* M = &m_M2[MAT2(j, 0)];
+			long double b = 0.0;
+			for (size_t x = 0; x < beam.size(); x++)
+				b += M[beam[x]] * w[x];
+			ctx.Beta[MAT2(i-1, j)] = b;
+			sum += b;
+		}
+		for (size_t y = 0; y < prev.size(); y++)
+			ctx.Beta[MAT2(i-1, prev[y])] /= sum;
+		ctx.scale2[i-1] = sum;
+	}
+}
 
-		for (size_t j = 0; j < m_state_size; j++) {
-		//vector<size_t> &indexR = m_IndexR[i-1];
-		//for (size_t y = 0; y < indexR.size(); y++) {
-		//	size_t j = indexR[y];
-
-			size_t index = MAT2(i-1, j);
-			//for (size_t k = 0; k < m_state_size; k++) {
-			vector<size_t> &selectedState = m_Param.m_SelectedStateList2[j];
-			for (size_t x = 0; x < selectedState.size(); x++) {
-				size_t k = selectedState[x];
-                m_Beta[index] += m_R[MAT2(i,k)] * (m_M2[MAT2(j, k)] - 1.0) * m_Beta[MAT2(i, k)];
-           }
-			//m_Beta[MAT2(i-1, j)] /= scale[i-1];
-			m_Beta[MAT2(i-1, j)] += constant;
-			sum += m_Beta[index];
-        } // for j
-		for (size_t j = 0; j < m_state_size; j++) 
-			m_Beta[MAT2(i-1, j)] /= sum;
-		scale2[i-1] = sum;
+/**	Viterbi search over the state beam (of the forward recursion).
+	@param prob	probability of the best path (unnormalized)
+	@return best label sequence
+*/
+vector<size_t> CRF::viterbiBeam(const InferenceContext& ctx, long double& prob) const {
+	size_t len = ctx.seq_size - 1;	///< without the end state
+	vector<long double> delta(len * m_state_size, -10000.0);
+	vector<size_t> psi(len * m_state_size, m_default_oid);
+
+	for (size_t i = 0; i < len; i++) {
+		const vector<size_t>& beam = ctx.state_beam.states[i];
+		for (size_t x = 0; x < beam.size(); x++) {
+			size_t j = beam[x];
+			long double max = -10000.0;
+			size_t max_k = m_default_oid;
+			if (i == 0) {
+				max = 1.0;
+			} else {
+				const vector<size_t>& prev = ctx.state_beam.states[i-1];
+				for (size_t y = 0; y < prev.size(); y++) {
+					size_t k = prev[y];
+					double val = delta[MAT2(i-1, k)] * m_M2[MAT2(k, j)];
+					if (val > max) {
+						max = val;
+						max_k = k;
+					}
+				}
+			}
+			delta[MAT2(i, j)] = max * ctx.R[MAT2(i, j)];
+			psi[MAT2(i, j)] = max_k;
+		}
+	}
 
-    } // for i
+	/// last path
+	long double max = -10000.0;
+	size_t max_k = 0;
+	const vector<size_t>& last = ctx.state_beam.states[len-1];
+	for (size_t x = 0; x < last.size(); x++) {
+		double val = delta[MAT2(len-1, last[x])];
+		if (val > max) {
+			max = val;
+			max_k = last[x];
+		}
+	}
+
+	/// Back-tracking
+	vector<size_t> y_seq(len);
+	size_t y = max_k;
+	for (size_t i = len; i >= 1; i--) {
+		y_seq[i-1] = y;
+		y = psi[MAT2(i-1, y)];
+	}
+	prob = max;
+
+	return y_seq;
 }
 
 /**	Partition function (Z).
 	@return normalizing constant 
 */
-long double CRF::getPartitionZ() {
-    return m_Alpha[MAT2(m_seq_size-1, m_default_oid)];
+long double CRF::getPartitionZ(const InferenceContext& ctx) const {
+    return ctx.Alpha[MAT2(ctx.seq_size-1, m_default_oid)];
 }
 
 /** Calculate prob. of y* sequence.
 	@param seq			given data (y, x)
 	@return probability
 */
-long double CRF::calculateProb(Sequence& seq) {
-	long double z = getPartitionZ();
+long double CRF::calculateProb(const Sequence& seq, const InferenceContext& ctx) const {
+	long double z = getPartitionZ(ctx);
 
     long double seq_prob = 1.0;
 	long double tran = 1.0;
     size_t prev_y = m_default_oid;
     size_t y;
-    for (size_t i=0; i < m_seq_size; i++) {
-        if (i < m_seq_size-1) {
+    for (size_t i=0; i < ctx.seq_size; i++) {
+        if (i < ctx.seq_size-1) {
             y = seq[i].label;
 			if (i > 0)
 				tran = m_M2[MAT2(prev_y, y)];
-			seq_prob *= m_R[MAT2(i,y)] * tran;
+			seq_prob *= ctx.R[MAT2(i,y)] * tran;
         } else {
             y = m_default_oid;
         }
 
         prev_y = y;
        
-		seq_prob /= scale[i];
+		seq_prob /= ctx.scale[i];
 
     }
     if (seq_prob == 0.0) {
@@ -490,7 +813,10 @@ long double CRF::calculateProb(Sequence& seq) {
  @param prob		dummy probability vector
  @return outcome sequence
 */
-vector<size_t> CRF::viterbiSearch(long double& prob) {
+vector<size_t> CRF::viterbiSearch(const InferenceContext& ctx, long double& prob) const {
+	if (useStateBeam())
+		return viterbiBeam(ctx, prob);
+
 	/// Initialization
 	vector<vector<size_t> > psi;
     vector<vector<long double> > delta;
@@ -507,8 +833,8 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 	long double maxj = -10000.0;
 	size_t max_j = 0;
 	for (j=0; j < m_state_size; j++) {
-		long double max = m_R[MAT2(0, j)] * 1.0;
-		tmp_delta_i.push_back(max / scale[0]);
+		long double max = ctx.R[MAT2(0, j)] * 1.0;
+		tmp_delta_i.push_back(max / ctx.scale[0]);
 		tmp_psi_i.push_back(m_default_oid);
 		if (max > maxj) {
 			maxj = max;
@@ -523,7 +849,7 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 	*/
 	
 	// 1 ~ T
-    for (i=0; i < m_seq_size-1; i++) {
+    for (i=0; i < ctx.seq_size-1; i++) {
         vector<size_t> psi_i;
         vector<long double> delta_i;
 
@@ -556,7 +882,7 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 				}*/
             }
 
-			max = max * m_R[MAT2(i, j)]; // / scale[i];
+			max = max * ctx.R[MAT2(i, j)]; // / ctx.scale[i];
 
             delta_i.push_back(max);
             psi_i.push_back(max_k);
@@ -581,13 +907,13 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 	long double max = -10000.0;
 	size_t max_k = 0;
 	for (size_t k=0; k < m_state_size; k++) {
-		double val = delta[m_seq_size-2][k]; 
+		double val = delta[ctx.seq_size-2][k]; 
 		if (val > max) {
 			max = val;
 			max_k = k;
 		}
 	}
-	//max /= scale[m_seq_size-1];
+	//max /= ctx.scale[ctx.seq_size-1];
 	delta_i[m_default_oid] = max;
 	psi_i[m_default_oid] = max_k;
 	delta.push_back(delta_i);
@@ -596,23 +922,550 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 	/// Back-tracking
     vector<size_t> y_seq;
     size_t prev_y = m_default_oid;
-    for (i = m_seq_size-1; i >= 1; i--) {
+    for (i = ctx.seq_size-1; i >= 1; i--) {
         size_t y = psi[i][prev_y];
         y_seq.push_back(y);
         prev_y = y;
     }
     reverse(y_seq.begin(), y_seq.end());
-    prob = delta[m_seq_size-1][m_default_oid];
+    prob = delta[ctx.seq_size-1][m_default_oid];
 
 	return y_seq;
 }
 
+/** Accumulate the expectation of the node features of a position.
+	@param ev	event of the position
+	@param alpha	scaled alpha of the position
+	@param beta	scaled beta of the position
+	@param zval	Z (scaled)
+	@param factor	scaling factor of alpha * beta
+	@param in_beam	beam membership of the position (NULL: every state)
+	@param gradient	gradient vector to be accumulated
+	@param count	count of the sequence
+*/
+void CRF::accumulateNode(const Event& ev, const long double* alpha, const long double* beta, long double zval, long double factor, 
+	const char* in_beam, double* gradient, double count) const {
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	vector<pair<size_t, double> >::const_iterator iter = ev.obs.begin();
+	for (; iter != ev.obs.end(); iter++) {
+		for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j) {
+			size_t y = index.label[j];
+			if (in_beam && !in_beam[y])
+				continue;
+			long double prob =  alpha[y] * beta[y] / zval;
+			prob *= factor;
+			gradient[index.fid[j]] += prob * iter->second * count;
+		}
+	}
+}
+
+/** Accumulate the expected transitions of a position (i > 0).
+	The dense path sums alpha(i-1) outer (beta(i) * R(i) / Z) in ctx.grad.edge_exp (S x S, one SIMD axpy per row);
+	flushEdge() applies the potential M, which does not depend on i, and scatters the matrix into the gradient.
+	The tied path (SPARSE_TIED) visits only the selected transitions and one tied transition per label.
+	@param alpha	scaled alpha of the position i-1
+	@param beta	scaled beta of the position i
+	@param R	factors of the position i
+	@param zval	Z (scaled)
+	@param factor	scaling factor of alpha * beta * R
+	@param in_alpha	beam membership of the position i-1 (NULL: every state)
+	@param in_beta	beam membership of the position i (NULL: every state)
+*/
+void CRF::accumulateEdge(InferenceContext& ctx, const long double* alpha, const long double* beta, const long double* R, 
+	long double zval, long double factor, const char* in_alpha, const char* in_beta, double* gradient, double count) const {
+	if (m_Param.isTied()) {
+		vector<StateParam>::const_iterator iter = m_Param.m_SelectedStateIndex.begin();
+		for (; iter != m_Param.m_SelectedStateIndex.end(); ++iter) {
+			if (in_alpha && !(in_alpha[iter->y1] && in_beta[iter->y2]))
+				continue;
+			long double a_y = alpha[iter->y1];
+			long double b_y = beta[iter->y2];
+			long double m_yy = R[iter->y2] * m_M2[MAT2(iter->y1,iter->y2)];
+			long double prob = a_y * b_y * m_yy / zval;
+			prob *= factor;
+			gradient[iter->fid] += prob * iter->fval * count;
+		}
+
+		/// the tied transitions into y2 ; the alpha out of m_SelectedStateList1[y2] times the tied potential
+		long double a_sum = 0.0;
+		for (size_t y1 = 0; y1 < m_state_size; y1++)
+			a_sum += alpha[y1];
+		for (size_t y2 = 0; y2 < m_state_size; y2++) {
+			if (in_beta && !in_beta[y2])
+				continue;
+			long double a_y = a_sum;
+			const vector<size_t> &selectedState = m_Param.m_SelectedStateList1[y2];
+			for (size_t x = 0; x < selectedState.size(); x++)
+				a_y -= alpha[selectedState[x]];
+			long double prob = a_y * beta[y2] * R[y2] * m_Tied[y2] / zval;
+			prob *= factor;
+			gradient[m_Param.remain_fid[y2]] += prob * count;
+		}
+		return;
+	}
+
+	/// dense ; E[y1][y2] += alpha[y1] * beta[y2] * R[y2] / Z
+	vector<double>& edge = ctx.grad.edge_exp;
+	vector<double>& w = ctx.grad.edge_w;
+	if (edge.size() != m_state_size * m_state_size)
+		edge.assign(m_state_size * m_state_size, 0.0);
+	w.resize(m_state_size);
+	long double scale_factor = factor / zval;
+	for (size_t y2 = 0; y2 < m_state_size; y2++) {
+		if (in_beta && !in_beta[y2])
+			w[y2] = 0.0;
+		else
+			w[y2] = (double)(beta[y2] * R[y2] * scale_factor);
+	}
+	for (size_t y1 = 0; y1 < m_state_size; y1++) {
+		double a_y = (double)alpha[y1];
+		if (a_y == 0.0 || (in_alpha && !in_alpha[y1]))
+			continue;
+		latticeAxpy(a_y, &w[0], &edge[MAT2(y1, 0)], m_state_size);
+	}
+	ctx.grad.edge_used = true;
+}
+
+/** Scatter the expected transitions of a sequence into the gradient (dense path of accumulateEdge()).
+*/
+void CRF::flushEdge(InferenceContext& ctx, double* gradient, double count) const {
+	if (!ctx.grad.edge_used)
+		return;
+	vector<double>& edge = ctx.grad.edge_exp;
+	vector<StateParam>::const_iterator iter = m_Param.m_StateIndex.begin();
+	for (; iter != m_Param.m_StateIndex.end(); ++iter) {
+		size_t index = MAT2(iter->y1, iter->y2);
+		gradient[iter->fid] += edge[index] * m_M2[index] * iter->fval * count;
+	}
+	fill(edge.begin(), edge.end(), 0.0);
+	ctx.grad.edge_used = false;
+}
+
+/** Accumulate the expectation of a training sequence.
+	Runs forward-backward and Viterbi on the given context, adds the
+	model expectation (times count) to the gradient and appends the
+	sequence to the evaluator.
+	The sequences longer than the checkpoint length go to accumulateCheckpoint().
+	The time of each phase is added to ctx.grad.phase_time.
+	@param seq	training sequence
+	@param count	count of the sequence
+	@param ctx	inference context (lattice)
+	@param gradient	gradient vector to be accumulated
+	@param eval	evaluator
+*/
+void CRF::accumulateGradient(Sequence& seq, double count, InferenceContext& ctx, double* gradient, Evaluator& eval) {
+	if (useCheckpoint(seq.size())) {
+		accumulateCheckpoint(seq, count, ctx, gradient, eval);
+		return;
+	}
+
+	vector<size_t> reference, hypothesis;
+	wall_timer phase;
+
+	/// Forward-Backward
+	calculateFactors(seq, ctx);
+	ctx.grad.phase_time[PHASE_FACTOR] += phase.elapsed();
+	phase.restart();
+	forward(ctx);
+	backward(ctx);
+	long double zval = getPartitionZ(ctx);
+	ctx.grad.phase_time[PHASE_FORWARD_BACKWARD] += phase.elapsed();
+	phase.restart();
+
+	/// Evaluation
+	long double dummy_prob;
+	vector<size_t> y_seq = viterbiSearch(ctx, dummy_prob);
+
+	// calculate Y sequence
+	long double y_seq_prob = calculateProb(seq, ctx);
+	if (!finite((double)y_seq_prob)) {
+		cerr << "calculateProb:" << y_seq_prob << endl;
+	}
+	ctx.grad.phase_time[PHASE_VITERBI] += phase.elapsed();
+	phase.restart();
+
+	// for scaling factor
+	vector<long double> prod_scale, prod_scale2;
+	long double prod = 1.0;
+	for (int a = ctx.seq_size-1; a >= 0; a--) {
+		prod *= ctx.scale[a];
+		prod_scale.push_back(prod);
+	}
+	reverse(prod_scale.begin(), prod_scale.end());
+	prod = 1.0;
+	for (int a = ctx.seq_size-1; a >= 0; a--) {
+		prod *= ctx.scale2[a];
+		prod_scale2.push_back(prod);
+	}
+	reverse(prod_scale2.begin(), prod_scale2.end());
+
+	/// the states out of the beam have no expectation
+	bool beam = useStateBeam();
+
+	/// calculate the expectation
+	/// E[~p] - E[p]
+	for (size_t i = 0; i < seq.size(); ++i) {	 /// for each node
+		reference.push_back(seq[i].label);
+		hypothesis.push_back(y_seq[i]);
+
+		long double scale_factor = prod_scale2[i] / prod_scale[i+1];
+		accumulateNode(seq[i], &ctx.Alpha[MAT2(i, 0)], &ctx.Beta[MAT2(i, 0)], zval, scale_factor, 
+			(beam ? &ctx.state_beam.in_beam[MAT2(i, 0)] : NULL), gradient, count);
+	} ///< for sequence
+	ctx.grad.phase_time[PHASE_NODE] += phase.elapsed();
+	phase.restart();
+
+	for (size_t i = 1; i < seq.size(); ++i) {
+		long double scale_factor2 = prod_scale2[i] / prod_scale[i];
+		accumulateEdge(ctx, &ctx.Alpha[MAT2(i-1, 0)], &ctx.Beta[MAT2(i, 0)], &ctx.R[MAT2(i, 0)], zval, scale_factor2, 
+			(beam ? &ctx.state_beam.in_beam[MAT2(i-1, 0)] : NULL), (beam ? &ctx.state_beam.in_beam[MAT2(i, 0)] : NULL), gradient, count);
+	}
+	flushEdge(ctx, gradient, count);
+	ctx.grad.phase_time[PHASE_EDGE] += phase.elapsed();
+
+	for (size_t c = 0; c < count; c++) {
+		eval.addLikelihood(y_seq_prob);	/// loglikelihood
+		eval.append(reference, hypothesis);	/// evaluation (accuracy and f1 score)
+	}
+}
+
+/** Node factors of a position.
+	The same as calculateFactors() for a single position ; R[y] = exp(sum of the weights).
+*/
+void CRF::factorRow(const Event& ev, vector<double>& score, long double* R) const {
+	const double* theta = m_Param.getWeight();
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	score.assign(m_state_size, 0.0);
+	vector<pair<size_t, double> >::const_iterator iter = ev.obs.begin();
+	for (; iter != ev.obs.end(); iter++) {
+		for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j)
+			score[index.label[j]] += theta[index.fid[j]] * iter->second;
+	}
+	for (size_t y = 0; y < m_state_size; y++)
+		R[y] = (score[y] == 0.0) ? 1.0 : exp(score[y]);
+}
+
+/** One step of the Viterbi search, normalized by the maximum.
+	delta[j] = max_k prev[k] * M[k][j] * R[j] / max ; the same comparison as viterbiSearch().
+	@param prev	delta of the previous position (NULL: the start state)
+	@param R	factors of the position
+	@param delta	delta of the position (output)
+	@param psi	back pointers of the position (output)
+*/
+void CRF::viterbiRow(const long double* prev, const long double* R, long double* delta, size_t* psi) const {
+	long double maxj = 0.0;
+	for (size_t j = 0; j < m_state_size; j++) {
+		long double max = -10000.0;
+		size_t max_k = 0;
+		if (prev == NULL) {
+			max = 1.0;
+			max_k = m_default_oid;
+		} else {
+			for (size_t k = 0; k < m_state_size; k++) {
+				double val = prev[k] * m_M2[MAT2(k,j)];
+				if (val > max) {
+					max = val;
+					max_k = k;
+				}
+			}
+		}
+		delta[j] = max * R[j];
+		psi[j] = max_k;
+		if (delta[j] > maxj)
+			maxj = delta[j];
+	}
+	if (maxj > 0.0) {
+		for (size_t j = 0; j < m_state_size; j++)
+			delta[j] /= maxj;
+	}
+}
+
+/** Viterbi search with checkpoints (long sequences).
+	Only the delta before every segment of L = sqrt(T) positions is stored; the back pointers
+	of a segment are recomputed from its checkpoint during the back-tracking, so the memory is O(sqrt(T)*S).
+	Each delta is normalized by its maximum, which does not change the path and keeps a long sequence in range.
+	@param seq	sequence
+	@param ctx	inference context ; only the scores are used
+	@param check	segment buffers
+	@return outcome sequence
+*/
+vector<size_t> CRF::viterbiCheckpoint(const Sequence& seq, InferenceContext& ctx, CheckpointBuffer& check) const {
+	size_t n = seq.size();
+	size_t L = (size_t)ceil(sqrt((double)n));
+	size_t n_segment = (n + L - 1) / L;
+	size_t S = m_state_size;
+
+	check.alpha.resize(n_segment * S);	///< delta before each segment
+	check.seg_R.resize(L * S);
+	check.seg_alpha.resize((L + 1) * S);	///< delta of a segment (row 0: checkpoint)
+	check.seg_psi.resize(L * S);
+
+	/// forward ; checkpoints only
+	vector<long double> cur(S), prev(S);
+	vector<size_t> psi(S);
+	for (size_t i = 0; i < n; i++) {
+		if (i > 0 && i % L == 0)
+			copy(prev.begin(), prev.end(), check.alpha.begin() + (i / L) * S);
+		factorRow(seq[i], ctx.score, &check.seg_R[0]);
+		viterbiRow((i == 0 ? NULL : &prev[0]), &check.seg_R[0], &cur[0], &psi[0]);
+		cur.swap(prev);
+	}
+
+	/// last path
+	vector<size_t> y_seq(n);
+	double max = -10000.0;
+	for (size_t k = 0; k < S; k++) {
+		double val = prev[k];
+		if (val > max) {
+			max = val;
+			y_seq[n-1] = k;
+		}
+	}
+
+	/// back-tracking ; a segment at a time
+	for (size_t s = n_segment; s-- > 0; ) {
+		size_t b = s * L, e = min(n, b + L);
+		copy(check.alpha.begin() + s * S, check.alpha.begin() + (s + 1) * S, check.seg_alpha.begin());
+		for (size_t i = b; i < e; i++) {
+			factorRow(seq[i], ctx.score, &check.seg_R[0]);
+			viterbiRow((i == 0 ? NULL : &check.seg_alpha[(i - b) * S]), &check.seg_R[0], 
+				&check.seg_alpha[(i - b + 1) * S], &check.seg_psi[(i - b) * S]);
+		}
+		for (size_t i = e - 1; i >= b && i > 0; i--)
+			y_seq[i-1] = check.seg_psi[(i - b) * S + y_seq[i]];
+	}
+
+	return y_seq;
+}
+
+/** Forward recursion with checkpoints (long sequences).
+	Keeps only the scaling factors (ctx.scale, the last one is Z) and the alpha before every segment 
+	of L = sqrt(T) positions (check.alpha).
+	@param seq	sequence
+	@param ctx	inference context
+	@param y_seq	label sequence
+	@param check	segment buffers
+	@return Prob(y_seq|x) ; the same as calculateProb()
+*/
+long double CRF::forwardCheckpoint(const Sequence& seq, InferenceContext& ctx, const vector<size_t>& y_seq, CheckpointBuffer& check) const {
+	size_t n = seq.size();
+	size_t L = (size_t)ceil(sqrt((double)n));
+	size_t n_segment = (n + L - 1) / L;
+	size_t S = m_state_size;
+
+	ctx.seq_size = n + 1;
+	ctx.scale.resize(n + 1);
+	check.alpha.resize(n_segment * S);
+	check.seg_R.resize(L * S);
+	vector<long double> prev(S), cur(S);
+	long double* R = &check.seg_R[0];
+	long double seq_prob = 1.0;
+	size_t prev_y = m_default_oid;
+	for (size_t i = 0; i < n; i++) {
+		if (i > 0 && i % L == 0)
+			copy(prev.begin(), prev.end(), check.alpha.begin() + (i / L) * S);
+		factorRow(seq[i], ctx.score, R);
+		if (i == 0) {
+			long double sum = 0.0;
+			for (size_t j = 0; j < S; j++) {
+				cur[j] = R[j] * 1.0;
+				sum += cur[j];
+			}
+			for (size_t j = 0; j < S; j++) 
+				cur[j] /= sum;
+			ctx.scale[0] = sum;
+		} else
+			ctx.scale[i] = forwardRow(&prev[0], R, &cur[0]);
+
+		size_t y = y_seq[i];
+		seq_prob *= R[y] * (i > 0 ? m_M2[MAT2(prev_y, y)] : 1.0);
+		seq_prob /= ctx.scale[i];
+		prev_y = y;
+		cur.swap(prev);
+	}
+	long double zval = 0.0;
+	for (size_t k = 0; k < S; k++)
+		zval += prev[k];
+	ctx.scale[n] = zval;
+	seq_prob /= ctx.scale[n];
+
+	return seq_prob / zval;
+}
+
+/** Accumulate the expectation of a long training sequence with checkpoints.
+	The forward pass keeps only the scaling factors and the alpha before every segment 
+	of L = sqrt(T) positions. The backward sweep then goes over the segments from the end;
+	the factors and the alpha of a segment are recomputed from its checkpoint, and the beta
+	and the expectations are computed position by position. The memory is O(sqrt(T)*S) 
+	instead of O(T*S) for each of R, alpha and beta, for about one more forward pass.
+	The scaling factors of the expectation are carried as a running ratio, so that the products
+	of the scaling factors over a long sequence do not overflow.
+	The recursions are the long double ones, whatever the lattice precision.
+	@param seq	training sequence
+	@param count	count of the sequence
+	@param ctx	inference context ; only the scores and the scaling factors are used
+	@param gradient	gradient vector to be accumulated
+	@param eval	evaluator
+*/
+void CRF::accumulateCheckpoint(Sequence& seq, double count, InferenceContext& ctx, double* gradient, Evaluator& eval) {
+	size_t n = seq.size();
+	size_t L = (size_t)ceil(sqrt((double)n));
+	size_t n_segment = (n + L - 1) / L;
+	size_t S = m_state_size;
+	wall_timer phase;
+	CheckpointBuffer check;
+
+	/// Evaluation ; first, since it uses the same segment buffers
+	vector<size_t> y_seq = viterbiCheckpoint(seq, ctx, check);
+	ctx.grad.phase_time[PHASE_VITERBI] += phase.elapsed();
+	phase.restart();
+
+	/// Forward ; the scaling factors, the checkpoints and Prob(y|x)
+	vector<size_t> reference;
+	for (size_t i = 0; i < n; ++i)
+		reference.push_back(seq[i].label);
+	long double y_seq_prob = forwardCheckpoint(seq, ctx, reference, check);
+	long double zval = ctx.scale[n];
+	if (!finite((double)y_seq_prob)) {
+		cerr << "calculateProb:" << y_seq_prob << endl;
+	}
+	ctx.grad.phase_time[PHASE_FORWARD_BACKWARD] += phase.elapsed();
+	phase.restart();
+
+	/// Backward sweep ; a segment at a time from the end
+	/// node factor = prod_scale2[i] / prod_scale[i+1], edge factor = prod_scale2[i] / prod_scale[i]
+	check.seg_alpha.resize(L * S);
+	vector<long double> beta(S), next(S), next_R(S);
+	long double node_factor = 1.0;
+	double time_node = 0.0, time_edge = 0.0;
+	for (size_t s = n_segment; s-- > 0; ) {
+		size_t b = s * L, e = min(n, b + L);
+
+		/// factors and alpha of the segment
+		for (size_t i = b; i < e; i++) {
+			long double* R_i = &check.seg_R[(i - b) * S];
+			long double* alpha_i = &check.seg_alpha[(i - b) * S];
+			factorRow(seq[i], ctx.score, R_i);
+			if (i == 0) {
+				long double sum = 0.0;
+				for (size_t j = 0; j < S; j++) {
+					alpha_i[j] = R_i[j] * 1.0;
+					sum += alpha_i[j];
+				}
+				for (size_t j = 0; j < S; j++) 
+					alpha_i[j] /= sum;
+			} else
+				forwardRow((i == b ? &check.alpha[s * S] : alpha_i - S), R_i, alpha_i);
+		}
+
+		for (size_t i = e; i-- > b; ) {
+			/// beta of the position i
+			long double scale2;
+			if (i == n - 1) {
+				scale2 = 0.0;
+				for (size_t k = 0; k < S; k++) {
+					beta[k] = 1.0;
+					scale2 += beta[k];
+				}
+				for (size_t k = 0; k < S; k++)
+					beta[k] /= scale2;
+				node_factor = scale2 / ctx.scale[n];	///< scale2[n] = 1
+			} else {
+				scale2 = backwardRow(&next[0], (i + 1 == e ? &next_R[0] : &check.seg_R[(i + 1 - b) * S]), &beta[0]);
+				node_factor *= scale2 / ctx.scale[i+1];
+			}
+
+			/// expectation
+			wall_timer step;
+			accumulateNode(seq[i], &check.seg_alpha[(i - b) * S], &beta[0], zval, node_factor, NULL, gradient, count);
+			time_node += step.elapsed();
+			step.restart();
+			if (i > 0)
+				accumulateEdge(ctx, (i == b ? &check.alpha[s * S] : &check.seg_alpha[(i - 1 - b) * S]), &beta[0], 
+					&check.seg_R[(i - b) * S], zval, node_factor / ctx.scale[i], NULL, NULL, gradient, count);
+			time_edge += step.elapsed();
+			beta.swap(next);
+		}
+		copy(check.seg_R.begin(), check.seg_R.begin() + S, next_R.begin());	///< R of the position b
+	}
+	wall_timer step;
+	flushEdge(ctx, gradient, count);
+	time_edge += step.elapsed();
+	ctx.grad.phase_time[PHASE_NODE] += time_node;
+	ctx.grad.phase_time[PHASE_EDGE] += time_edge;
+	ctx.grad.phase_time[PHASE_FORWARD_BACKWARD] += phase.elapsed() - time_node - time_edge;
+
+	for (size_t c = 0; c < count; c++) {
+		eval.addLikelihood(y_seq_prob);	/// loglikelihood
+		eval.append(reference, y_seq);	/// evaluation (accuracy and f1 score)
+	}
+}
+
+/** Gradient job.
+	The training set is split into contiguous blocks, one per thread.
+	Each thread has its own lattice, gradient buffer and evaluator;
+	thread 0 accumulates directly into the parameter gradient.
+	@class CRFGradientJob
+*/
+class CRFGradientJob : public ThreadJob {
+private:
+	CRF* m_Model;
+	double* m_Gradient;
+	vector<InferenceContext>& m_Context;
+	vector<vector<double> >& m_Buffer;
+	vector<Evaluator>& m_Eval;
+public:
+	CRFGradientJob(CRF* model, double* gradient, vector<InferenceContext>& ctx, vector<vector<double> >& buffer, vector<Evaluator>& eval)
+		: m_Model(model), m_Gradient(gradient), m_Context(ctx), m_Buffer(buffer), m_Eval(eval) {}
+	void run(size_t tid, size_t n_threads) {
+		double* gradient = m_Gradient;
+		if (tid > 0) {
+			fill(m_Buffer[tid].begin(), m_Buffer[tid].end(), 0.0);
+			gradient = &m_Buffer[tid][0];
+		}
+		m_Eval[tid].initialize();
+
+		size_t begin, end;
+		splitRange(m_Model->m_TrainSet.size(), tid, n_threads, begin, end);
+		for (size_t i = begin; i < end; ++i)
+			m_Model->accumulateGradient(m_Model->m_TrainSet[i], m_Model->m_TrainSetCount[i], m_Context[tid], gradient, m_Eval[tid]);
+	}
+};
+
+/** Report the time of the gradient phases (summed over the threads).
+*/
+static void reportPhases(Logger* logger, const vector<InferenceContext>& ctx) {
+	double phase_time[GRADIENT_PHASES];
+	fill(phase_time, phase_time + GRADIENT_PHASES, 0.0);
+	for (size_t i = 0; i < ctx.size(); i++)
+		for (size_t p = 0; p < GRADIENT_PHASES; p++)
+			phase_time[p] += ctx[i].grad.phase_time[p];
+	logger->report("  gradient time = \tfactors %.3f, forward-backward %.3f, viterbi %.3f, node %.3f, edge %.3f\n",
+		phase_time[PHASE_FACTOR], phase_time[PHASE_FORWARD_BACKWARD], phase_time[PHASE_VITERBI],
+		phase_time[PHASE_NODE], phase_time[PHASE_EDGE]);
+}
+
+/** Report the inference of the training (beam and sparse forward-backward).
+*/
+void CRF::reportInference() {
+	logger->report("[Inference]\n");
+	if (useStateBeam())
+		logger->report("  Method = \t\tBeam (%d states, ratio %g)\n", m_state_beam, (double)m_state_beam_ratio);
+	else
+		logger->report("  Method = \t\tStandard\n");
+	if (m_Param.isTied())
+		logger->report("  Sparse = \t\tTied (K = %g, %d / %d transitions)\n", m_sparse_threshold, 
+			m_Param.m_SelectedStateIndex.size(), m_Param.m_StateIndex.size());
+	else if (m_SparseMode == SPARSE_ACTIVE)
+		logger->report("  Sparse = \t\tActive (eta = %g)\n", m_sparse_threshold);
+}
+
 /** Training with LBFGS optimizer.
 	@param max_iter	maximum number of iteration
 	@param sigma	Gaussian prior variance
 */
 bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta) {
-	LBFGS lbfgs;	///< LBFGS optimizer
+	LBFGS lbfgs(m_lbfgs_history, m_lbfgs_float);	///< LBFGS optimizer
 	double* theta = m_Param.getWeight();
 	double* gradient = m_Param.getGradient();
 
@@ -622,163 +1475,48 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 	/// Reporting
 	m_Param.print(logger);
 	logger->report("[Parameter estimation]\n");
-	logger->report("  Method = \t\tLBFGS\n");
+	logger->report("  Method = \t\t%s\n", (sigma && L1 ? "OWL-QN" : "LBFGS"));
+	if (m_lbfgs_history != 5 || m_lbfgs_float)
+		logger->report("  History = \t\t%d%s\n", (int)m_lbfgs_history, (m_lbfgs_float ? " (float)" : ""));
 	logger->report("  Regularization = \t%s\n", (sigma ? (L1 ? "L1":"L2") : "none"));
 	logger->report("  Penalty value = \t%.2f\n\n", sigma);
-	logger->report("[Inference]\n");
-	logger->report("  Method = \t\tStandard\n");
+	reportInference();
+	logger->report("  Threads = \t\t%d\n", sizeThreads());
 	logger->report("[Iterations]\n");
 	logger->report("%4s %15s %8s %8s %8s %8s\n", "iter", "loglikelihood", "acc", "micro-f1", "macro-f1", "sec");
-	
+
 	double old_obj = 1e+37;
 	int converge = 0;
 
+	/// Per-thread workspace
+	size_t n_threads = sizeThreads();
+	vector<InferenceContext> thread_ctx(n_threads);
+	vector<vector<double> > thread_gradient(n_threads);
+	vector<Evaluator> thread_eval(n_threads, eval);
+	for (size_t i = 1; i < n_threads; i++)
+		thread_gradient[i].resize(m_Param.size());
+
 	/// Training iteration
-	m_Param.makeActiveIndex(0.0);
+	makeSparseIndex();
 
     for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
-		
+
 		/// Initializing local variables
         timer t2;	///< elapsed time for one iteration
 		m_Param.initializeGradient();	///< gradient vector initialization
 		eval.initialize();	///< evaluator intialization
-		double time_for_inference = 0.0;
-		double time_for_inference2 = 0.0;
-		double time_for_factor = 0.0;
-		double time_for_estimation = 0.0;
-		double time_for_viterbi = 0.0;
-		timer time_for_fb;
 
-		
 		calculateEdge();
 
 		/// for each training set
-        vector<Sequence>::iterator sit = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; sit != m_TrainSet.end(); ++sit, ++count_it) {
-			Sequence::iterator it = sit->begin();
-			double count = *count_it;
-			vector<size_t> reference, hypothesis;
-
-			/// Forward-Backward  
-			timer stop_watch;
-			calculateFactors(*sit);
-			time_for_factor += stop_watch.elapsed();
-			stop_watch.restart();
-			forward();
-			time_for_inference += stop_watch.elapsed();
-			stop_watch.restart();
-			backward();
-			time_for_inference2 += stop_watch.elapsed();
-			long double zval = getPartitionZ();
-			
-			/// Evaluation
-			stop_watch.restart();
-            long double dummy_prob;
-			vector<size_t> y_seq = viterbiSearch(dummy_prob);
-			time_for_viterbi += stop_watch.elapsed();
-
-			// calculate Y sequence
-			long double y_seq_prob = calculateProb(*sit);
-            if (!finite((double)y_seq_prob)) {
-                cerr << "calculateProb:" << y_seq_prob << endl;
-            }
-			
-			// for scaling factor
-			vector<long double> prod_scale, prod_scale2;
-			prod_scale.clear();
-			prod_scale2.clear();
-			long double prod = 1.0;
-			for (int a = m_seq_size-1; a >= 0; a--) {
-				prod *= scale[a];
-				prod_scale.push_back(prod);
-			}
-			reverse(prod_scale.begin(), prod_scale.end());
-			prod = 1.0;
-			for (int a = m_seq_size-1; a >= 0; a--) {
-				prod *= scale2[a];
-				prod_scale2.push_back(prod);
-			}
-			reverse(prod_scale2.begin(), prod_scale2.end());
+		CRFGradientJob job(this, gradient, thread_ctx, thread_gradient, thread_eval);
+		runParallel(job);
 
-			stop_watch.restart();
-			size_t prev_outcome = 0;
-			size_t i = 0;
-			for (; it != sit->end(); ++it, ++i) {	 /// for each node
-				size_t outcome = it->label;
-				reference.push_back(it->label);
-				hypothesis.push_back(y_seq[i]);
-
-				/// calculate the expectation
-				/// E[~p] - E[p]
-				
-				long double scale_factor = prod_scale2[i] / prod_scale[i+1];
-				long double scale_factor2 = prod_scale2[i] / prod_scale[i];
-				
-				/*
-				vector<ObsParam> obs_param = m_Param.makeObsIndex(it->obs);
-				vector<ObsParam>::iterator iter = obs_param.begin();
-				for(; iter != obs_param.end(); ++iter) {
-					long double prob =  m_Alpha[MAT2(i, iter->y)] * m_Beta[MAT2(i, iter->y)] / zval;
-					prob *= scale_factor;
-					//prob *= scale[i];
-					gradient[iter->fid] += prob * iter->fval * count;
-				}
-				*/
-				vector<pair<size_t, double> >::iterator iter = it->obs.begin();
-				for (; iter != it->obs.end(); iter++) {
-					vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
-					for (size_t j = 0; j < param.size(); ++j) {
-						long double prob =  m_Alpha[MAT2(i, param[j].first)] * m_Beta[MAT2(i, param[j].first)] / zval;
-						prob *= scale_factor;
-						//prob *= scale[i];
-						gradient[param[j].second] += prob * iter->second * count;
-					}
-				}
-
-				if (i > 0) {
-
-					vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
-					for (; iter != m_Param.m_StateIndex.end(); ++iter) {
-						long double a_y;
-						//if (i == 0) {
-						//	if (iter->y1 == m_default_oid) 
-						//		a_y = 1.0;
-						//	else 
-						//		a_y = 0.0;
-						//} else {
-							a_y = m_Alpha[MAT2(i-1, iter->y1)];
-						//}
-						long double b_y = m_Beta[MAT2(i, iter->y2)];
-						long double m_yy = m_R[MAT2(i,iter->y2)] * m_M2[MAT2(iter->y1,iter->y2)];
-						long double prob = a_y * b_y * m_yy / zval;
-						prob *= scale_factor2;
-						gradient[iter->fid] += prob * iter->fval * count;
-					}
-				}
-
-				prev_outcome = outcome;
-		
-			} ///< for sequence
-			time_for_estimation += stop_watch.elapsed();
-
-			for (size_t c = 0; c < count; c++) {
-				eval.addLikelihood(y_seq_prob);	/// loglikelihood
-				eval.append(reference, hypothesis);	/// evaluation (accuracy and f1 score)
-			}
-			
-		} ///< for m_TrainSet
-		
-		/*
-		cout << "time for factor : " << time_for_factor << endl; 
-		cout << "time for alpha : " << time_for_inference << endl; 
-		cout << "time for beta : " << time_for_inference2 <<  endl;
-		cout << "time for viterbi : " << time_for_viterbi << endl;
-		//cout << "avg. state : "  << (double)xxx / (double)yyy << endl;
-		cout << "time for estimation : " << time_for_estimation <<  endl;
-		cout << "total : " << time_for_fb.elapsed() << endl;
-		*/
-		time_for_inference = 0.0;
+		/// reduce the thread-local gradients and evaluators (in thread order)
+		ReduceJob reduce(gradient, m_Param.size(), thread_gradient);
+		runParallel(reduce);
+		for (size_t i = 0; i < n_threads; i++)
+			eval.merge(thread_eval[i]);
 
 		/////////////////////////////////////////////////////////////////////////////////
 		/// Evaluation for dev set 
@@ -788,16 +1526,16 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 		timer stop_watch;
 		double time_for_dev = 0.0;
 		/// for each dev data
-        sit = m_DevSet.begin();
-		count_it = m_DevSetCount.begin();
+        vector<Sequence>::iterator sit = m_DevSet.begin();
+		vector<double>::iterator count_it = m_DevSetCount.begin();
         for (; sit != m_DevSet.end(); ++sit, ++count_it) {
 			Sequence::iterator it = sit->begin();
 			double count = *count_it;
-			calculateFactors(*sit);
-  			forward();
-			long double zval = getPartitionZ();
+			calculateFactors(*sit, m_Context);
+  			forward(m_Context);
+			long double zval = getPartitionZ(m_Context);
             long double dummy_prob;
-			vector<size_t> y_seq = viterbiSearch(dummy_prob);
+			vector<size_t> y_seq = viterbiSearch(m_Context, dummy_prob);
 			assert(y_seq.size() == sit->size());
 
 			vector<size_t> reference, hypothesis;
@@ -844,8 +1582,10 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 		int ret = lbfgs.optimize(m_Param.size(), theta, eval.getObjFunc(), gradient, L1, sigma);
 		if (ret < 0)
 			return false;
-		else if (ret == 0)
+		else if (ret == 0) {
+			reportPhases(logger, thread_ctx);
 			return true;
+		}
 
 		eval.calculateF1();
 		if (m_DevSet.size() > 0) {
@@ -859,22 +1599,175 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 				eval.getAccuracy(), eval.getMicroF1()[2], eval.getMacroF1()[2], t2.elapsed());
 		}
 
-		m_Param.makeActiveIndex(0.0);
+		makeSparseIndex();
 
 	} ///< for iter
 
+	reportPhases(logger, thread_ctx);
 	logger->report("  training time = \t%.3f\n\n", t.elapsed());
 
 	return true;
 
 }
 
+/** Subtract the empirical counts of a training sequence from the gradient.
+	The features of the labels of the sequence: the observations and the transitions.
+	@param edge_fid	weight id of each transition (S x S, the tied weight for a tied transition)
+*/
+void CRF::accumulateEmpirical(const Sequence& seq, const vector<size_t>& edge_fid, double* gradient, double count) const {
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	for (size_t i = 0; i < seq.size(); ++i) {
+		uint32_t y = (uint32_t)seq[i].label;
+		vector<pair<size_t, double> >::const_iterator iter = seq[i].obs.begin();
+		for (; iter != seq[i].obs.end(); ++iter) {
+			/// the labels of a row are sorted
+			vector<uint32_t>::const_iterator first = index.label.begin() + index.begin(iter->first);
+			vector<uint32_t>::const_iterator last = index.label.begin() + index.end(iter->first);
+			vector<uint32_t>::const_iterator found = lower_bound(first, last, y);
+			if (found != last && *found == y)
+				gradient[index.fid[found - index.label.begin()]] -= iter->second * count;
+		}
+		if (i > 0 && edge_fid[MAT2(seq[i-1].label, y)] != (size_t)-1)
+			gradient[edge_fid[MAT2(seq[i-1].label, y)]] -= count;
+	}
+}
+
+/// the transitions are in every sequence
+void CRF::onlineDense(vector<vector<size_t> >& dense) {
+	vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
+	for (; iter != m_Param.m_StateIndex.end(); ++iter)
+		dense[0].push_back(iter->fid);
+	dense[0].insert(dense[0].end(), m_Param.remain_fid.begin(), m_Param.remain_fid.end());
+}
+
+void CRF::onlineBegin(size_t n_workers) {
+	m_EdgeFid.assign(m_state_size * m_state_size, (size_t)-1);
+	vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
+	for (; iter != m_Param.m_StateIndex.end(); ++iter)
+		m_EdgeFid[MAT2(iter->y1, iter->y2)] = iter->fid;
+	for (iter = m_Param.m_RemainStateIndex.begin(); iter != m_Param.m_RemainStateIndex.end(); ++iter)
+		m_EdgeFid[MAT2(iter->y1, iter->y2)] = m_Param.remain_fid[iter->y2];
+	m_WorkerContext.assign(n_workers > 1 ? n_workers : 0, InferenceContext());
+}
+
+/// the weights move at every step, so the index without the threshold keeps every transition
+/// (the active index is an approximation of the epoch)
+void CRF::onlineEpoch() {
+	if (m_SparseMode == SPARSE_ACTIVE || m_Param.isTied())
+		makeSparseIndex();
+	else
+		m_Param.makeActiveIndex(-1.0);
+}
+
+void CRF::reportParam() {
+	m_Param.print(logger);
+	reportInference();
+}
+
+/// the expectation of a sequence (accumulateGradient()) minus its empirical counts
+void CRF::gradientSample(SGD& sgd, size_t worker, size_t s, vector<Evaluator>& eval, size_t) {
+	Sequence& seq = m_TrainSet[s];
+	double* gradient = sgd.gradient(worker, 0);
+	accumulateGradient(seq, 1.0, workerContext(worker), gradient, eval[0]);
+	accumulateEmpirical(seq, m_EdgeFid, gradient, 1.0);
+}
+
+/** Write f(x,y^) - f(x,y) of a predicted path y^ into the gradient and touch the weights (perceptron, MIRA).
+	Only the positions and the transitions where the two paths differ are visited.
+	@param y_seq	predicted path
+	@param edge_fid	weight id of each transition (see accumulateEmpirical())
+	@return	number of the wrong labels
+*/
+size_t CRF::accumulateMistake(const Sequence& seq, const vector<size_t>& y_seq, const vector<size_t>& edge_fid, double* gradient) {
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	size_t n_wrong = 0;
+	for (size_t i = 0; i < seq.size(); ++i) {
+		uint32_t y = (uint32_t)seq[i].label;
+		uint32_t y_hat = (uint32_t)y_seq[i];
+		if (y != y_hat) {
+			++n_wrong;
+			vector<pair<size_t, double> >::const_iterator iter = seq[i].obs.begin();
+			for (; iter != seq[i].obs.end(); ++iter) {
+				vector<uint32_t>::const_iterator first = index.label.begin() + index.begin(iter->first);
+				vector<uint32_t>::const_iterator last = index.label.begin() + index.end(iter->first);
+				vector<uint32_t>::const_iterator found = lower_bound(first, last, y_hat);
+				if (found != last && *found == y_hat) {
+					gradient[index.fid[found - index.label.begin()]] += iter->second;
+					m_Perceptron.touch(0, index.fid[found - index.label.begin()]);
+				}
+				found = lower_bound(first, last, y);
+				if (found != last && *found == y) {
+					gradient[index.fid[found - index.label.begin()]] -= iter->second;
+					m_Perceptron.touch(0, index.fid[found - index.label.begin()]);
+				}
+			}
+		}
+		if (i == 0 || (y == y_hat && seq[i-1].label == y_seq[i-1]))
+			continue;
+		size_t fid = edge_fid[MAT2(y_seq[i-1], y_hat)];
+		if (fid != (size_t)-1) {
+			gradient[fid] += 1.0;
+			m_Perceptron.touch(0, fid);
+		}
+		fid = edge_fid[MAT2(seq[i-1].label, y)];
+		if (fid != (size_t)-1) {
+			gradient[fid] -= 1.0;
+			m_Perceptron.touch(0, fid);
+		}
+	}
+	return n_wrong;
+}
+
+/** A sequence is decoded by Viterbi with the current weights (perceptron, MIRA) ;
+	the loss of MIRA is the number of the wrong labels.
+	@return	1 if a label is wrong
+*/
+size_t CRF::mistakeSample(size_t s, vector<Evaluator>& eval, bool& changed) {
+	Sequence& seq = m_TrainSet[s];
+	InferenceContext& ctx = m_Context;
+
+	/// Viterbi only ; the forward pass is needed for the state beam
+	vector<size_t> y_seq;
+	if (useCheckpoint(seq.size())) {
+		CheckpointBuffer check;
+		y_seq = viterbiCheckpoint(seq, ctx, check);
+	} else {
+		long double dummy_prob;
+		calculateFactors(seq, ctx);
+		if (useStateBeam())
+			forward(ctx);
+		y_seq = viterbiSearch(ctx, dummy_prob);
+	}
+
+	vector<size_t> reference;
+	for (size_t i = 0; i < seq.size(); ++i)
+		reference.push_back(seq[i].label);
+	eval[0].append(reference, y_seq);
+
+	size_t n_wrong = accumulateMistake(seq, y_seq, m_EdgeFid, m_Param.getGradient());
+	changed = m_Perceptron.update((double)n_wrong);
+	return (n_wrong > 0 ? 1 : 0);
+}
+
+bool CRF::evaluateDev(vector<Evaluator>& dev_eval) {
+	for (size_t d = 0; d < m_DevSet.size(); ++d) {
+		long double prob;
+		vector<size_t> y_seq = decode(m_DevSet[d], m_Context, prob);
+		vector<size_t> reference;
+		for (size_t i = 0; i < m_DevSet[d].size(); ++i)
+			reference.push_back(m_DevSet[d][i].label);
+		for (size_t c = 0; c < m_DevSetCount[d]; c++)
+			dev_eval[0].append(reference, y_seq);
+	}
+	return m_DevSet.size() > 0;
+}
+
 /** Training with Pseudo-Likelihood
 	@param max_iter	maximum number of iteration
 	@param sigma	Gaussian prior variance
 */
 bool CRF::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
-	LBFGS lbfgs;	///< LBFGS optimizer
+	LBFGS lbfgs(m_lbfgs_history, m_lbfgs_float);	///< LBFGS optimizer
 	double* theta = m_Param.getWeight();
 	double* gradient = m_Param.getGradient();
 
@@ -925,9 +1818,9 @@ bool CRF::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
 				}*/
 				vector<pair<size_t, double> >::iterator iter = it->obs.begin();
 				for (; iter != it->obs.end(); iter++) {
-					vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
-					for (size_t j = 0; j < param.size(); ++j) {
-						q[param[j].first] += theta[param[j].second] * iter->second;
+					const ParamIndex& index = m_Param.m_ParamIndex;
+					for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j) {
+						q[index.label[j]] += theta[index.fid[j]] * iter->second;
 					}
 				}
 
@@ -967,9 +1860,9 @@ bool CRF::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
 				*/
 				iter = it->obs.begin();
 				for (; iter != it->obs.end(); iter++) {
-					vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
-					for (size_t j = 0; j < param.size(); ++j) {
-						gradient[param[j].second] += q[param[j].first] * iter->second * count;
+					const ParamIndex& index = m_Param.m_ParamIndex;
+					for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j) {
+						gradient[index.fid[j]] += q[index.label[j]] * iter->second * count;
 					}
 				}
 
@@ -1058,123 +1951,243 @@ bool CRF::pretrain(size_t max_iter, double sigma, bool L1) {
 }
 
 bool CRF::train(size_t max_iter, double sigma, bool L1) { 
-		return estimateWithLBFGS(max_iter, sigma, L1); 
+	if (m_SparseMode == SPARSE_TIED)
+		m_Param.makeTiedPotential(m_sparse_threshold);
+	bool ret;
+	if (m_Estimator == ESTIMATE_SGD)
+		ret = estimateWithSGD(max_iter, sigma, L1);
+	else if (m_Estimator == ESTIMATE_PERCEPTRON || m_Estimator == ESTIMATE_MIRA)
+		ret = estimateWithPerceptron(max_iter);
+	else
+		ret = estimateWithLBFGS(max_iter, sigma, L1); 
+	endSparse();
+	return ret;
 }
 
-void CRF::evals(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob) {
+/** Select the transitions of the sparse forward-backward from the current weights.
+	The selection of SPARSE_TIED is fixed by the counts (see Parameter::makeTiedPotential()).
+*/
+void CRF::makeSparseIndex() {
+	if (m_SparseMode == SPARSE_ACTIVE)
+		m_Param.makeActiveIndex(m_sparse_threshold);
+	else if (!m_Param.isTied())
+		m_Param.makeActiveIndex(0.0);
+}
+
+/** Store the sparse model as an ordinary CRF after the training.
+	The tied weights are copied to the tied transitions (SPARSE_TIED) and 
+	the inactive transitions get the weight 0 (SPARSE_ACTIVE), so the saved model 
+	is the one that has been trained and does not depend on the sparse setting.
+*/
+void CRF::endSparse() {
+	if (m_SparseMode == SPARSE_NONE)
+		return;
+	if (m_Param.isTied())
+		m_Param.untiePotential();
+	else if (m_SparseMode == SPARSE_ACTIVE) {
+		double* theta = m_Param.getWeight();
+		vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
+		for (; iter != m_Param.m_StateIndex.end(); ++iter) {
+			if (abs(exp(theta[iter->fid]) - 1.0) <= m_sparse_threshold)
+				theta[iter->fid] = 0.0;
+		}
+	}
+	m_Param.makeActiveIndex(0.0);
 	calculateEdge();
-	calculateFactors(seq);
-	forward();
+}
 
-	long double zval = getPartitionZ();
-    long double dummy_prob;
-	vector<size_t> y_seq = viterbiSearch(dummy_prob);
+/** Decode a sequence.
+	Reentrant ; the model is not modified and the lattice is kept in ctx.
+	@param seq	sequence to be decoded
+	@param ctx	inference context (one per thread)
+	@param prob	probability of the best path
+	@return best label sequence
+*/
+vector<size_t> CRF::decode(const Sequence& seq, InferenceContext& ctx, long double& prob) const {
+	if (useCheckpoint(seq.size())) {
+		CheckpointBuffer check;
+		vector<size_t> y_seq = viterbiCheckpoint(seq, ctx, check);
+		prob = forwardCheckpoint(seq, ctx, y_seq, check);
+		return y_seq;
+	}
+
+	calculateFactors(seq, ctx);
+	forward(ctx);
+
+	long double zval = getPartitionZ(ctx);
+	vector<size_t> y_seq = viterbiSearch(ctx, prob);
 	assert(y_seq.size() == seq.size());
-	
-	Sequence::iterator it = seq.begin();
+
+	for (size_t i = 0; i < ctx.seq_size - 1; i++)
+		prob /= ctx.scale[i];
+	prob /= zval;
+
+	return y_seq;
+}
+
+/** Local confidence of the decoded labels.
+	p(y_i | y_{i-1}, x) normalized over the states at each position.
+	@param seq	decoded sequence
+	@param ctx	inference context where the sequence was decoded
+	@param y_seq	decoded label sequence
+	@return confidence for each position
+*/
+vector<double> CRF::getConfidence(const Sequence& seq, InferenceContext& ctx, const vector<size_t>& y_seq) const {
+	vector<double> confidence;
 	size_t prev_y = m_default_oid;
-	for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-		string y_seq_s = m_Param.getState().second[y_seq[i]];
-		output.push_back(y_seq_s);
+	bool checkpoint = useCheckpoint(seq.size());	///< the factors are not stored
+	vector<long double> row_R(checkpoint ? m_state_size : 0);	///< factors of a position (checkpoint)
+	for (size_t i = 0; i < y_seq.size(); i++) {
+		const long double* R;
+		if (checkpoint) {
+			factorRow(seq[i], ctx.score, &row_R[0]);
+			R = &row_R[0];
+		} else
+			R = &ctx.R[MAT2(i, 0)];
+		double norm = 0.0;
+		for (size_t j = 0; j < m_state_size; j++) {
+			if (i > 0)
+				norm += R[j] * m_M2[MAT2(prev_y, j)];
+			else
+				norm += R[j];
+		}
+		double prob;
+		if (i > 0)
+			prob = R[y_seq[i]] * m_M2[MAT2(prev_y,y_seq[i])] / norm;
+		else
+			prob = R[y_seq[i]] / norm;
+		confidence.push_back(prob);
+		prev_y = y_seq[i];
 	}
-	
+	return confidence;
+}
+
+void CRF::evals(const Sequence& seq, InferenceContext& ctx, std::vector<std::string> &output, std::vector<long double> &prob) const {
+	calculateFactors(seq, ctx);
+	forward(ctx);
+
+	long double zval = getPartitionZ(ctx);
+    long double dummy_prob;
+	vector<size_t> y_seq = viterbiSearch(ctx, dummy_prob);
+	assert(y_seq.size() == seq.size());
+
+	const vector<string>& state_vec = m_Param.getStateVec();
+	for (size_t i = 0; i < seq.size(); ++i) {	 /// for each node
+		output.push_back(state_vec[y_seq[i]]);
+	}
+
 	prob.clear();
 	for (size_t i = 0; i < m_state_size; i++) {
-		prob.push_back(m_Alpha[MAT2(m_seq_size-2, i)] / zval);		
+		prob.push_back(ctx.Alpha[MAT2(ctx.seq_size-2, i)] / zval);
 	}
 
 }
 
-void CRF::eval(Sequence seq, std::vector<std::string> &output, long double &prob) {
-	calculateEdge();
-	calculateFactors(seq);
-	forward();
+void CRF::eval(const Sequence& seq, InferenceContext& ctx, std::vector<std::string> &output, long double &prob) const {
+	vector<size_t> y_seq = decode(seq, ctx, prob);
 
-	long double zval = getPartitionZ();
-    long double dummy_prob;
-	vector<size_t> y_seq = viterbiSearch(dummy_prob);
-	assert(y_seq.size() == seq.size());
-	
-	Sequence::iterator it = seq.begin();
-	size_t prev_y = m_default_oid;
-	for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-		string y_seq_s = m_Param.getState().second[y_seq[i]];
-		output.push_back(y_seq_s);
+	const vector<string>& state_vec = m_Param.getStateVec();
+	for (size_t i = 0; i < seq.size(); ++i) {	 /// for each node
+		output.push_back(state_vec[y_seq[i]]);
 	}
-	
-	for (size_t i = 0; i < m_seq_size - 1; i++)
-		dummy_prob /= scale[i];
-		//zval *= scale[i];
-	prob =  dummy_prob / zval;
-
 }
 
-void CRF::eval(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob) {
-	calculateEdge();
-	calculateFactors(seq);
-	forward();
-	backward();
+void CRF::eval(const Sequence& seq, InferenceContext& ctx, std::vector<std::string> &output, std::vector<long double> &prob) const {
+	calculateFactors(seq, ctx);
+	forward(ctx);
+	backward(ctx);
 
 	output.clear();
 	prob.clear();
-	
-	long double zval = getPartitionZ();
+
+	long double zval = getPartitionZ(ctx);
     long double dummy_prob;
-	vector<size_t> y_seq = viterbiSearch(dummy_prob);
+	vector<size_t> y_seq = viterbiSearch(ctx, dummy_prob);
 	assert(y_seq.size() == seq.size());
 
-
 	// scale factor
 	vector<long double> prod_scale, prod_scale2;
-	prod_scale.clear();
-	prod_scale2.clear();
 	long double prod = 1.0;
-	for (int a = m_seq_size-1; a >= 0; a--) {
-		prod *= scale[a];
+	for (int a = ctx.seq_size-1; a >= 0; a--) {
+		prod *= ctx.scale[a];
 		prod_scale.push_back(prod);
 	}
 	reverse(prod_scale.begin(), prod_scale.end());
 	prod = 1.0;
-	for (int a = m_seq_size-1; a >= 0; a--) {
-		prod *= scale2[a];
+	for (int a = ctx.seq_size-1; a >= 0; a--) {
+		prod *= ctx.scale2[a];
 		prod_scale2.push_back(prod);
 	}
 	reverse(prod_scale2.begin(), prod_scale2.end());
 
-	
-	Sequence::iterator it = seq.begin();
-	size_t prev_y = m_default_oid;
-	for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-		string y_seq_s = m_Param.getState().second[y_seq[i]];
-		output.push_back(y_seq_s);
-		
-		size_t outcome = it->label;
+	const vector<string>& state_vec = m_Param.getStateVec();
+	for (size_t i = 0; i < seq.size(); ++i) {	 /// for each node
+		output.push_back(state_vec[y_seq[i]]);
+
 		long double scale_factor = prod_scale2[i] / prod_scale[i+1];
-					
-		long double p =  m_Alpha[MAT2(i, y_seq[i])] * m_Beta[MAT2(i, y_seq[i])] / zval;
-		p *= scale_factor;	
+		long double p =  ctx.Alpha[MAT2(i, y_seq[i])] * ctx.Beta[MAT2(i, y_seq[i])] / zval;
+		p *= scale_factor;
 		prob.push_back(p);
-		
 	}
-	
 }
-	
+
+void CRF::evals(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob) {
+	calculateEdge();
+	evals(seq, m_Context, output, prob);
+}
+
+void CRF::eval(Sequence seq, std::vector<std::string> &output, long double &prob) {
+	calculateEdge();
+	eval(seq, m_Context, output, prob);
+}
+
+void CRF::eval(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob) {
+	calculateEdge();
+	eval(seq, m_Context, output, prob);
+}
+
+/** Decoding job.
+	Decodes a batch of sequences with the shared model; each thread has its own context.
+	@class CRFDecodeJob
+*/
+class CRFDecodeJob : public ThreadJob {
+private:
+	const CRF* m_Model;
+	vector<Sequence>& m_Batch;
+	vector<InferenceContext>& m_Context;
+	vector<vector<size_t> >& m_Output;
+	vector<vector<double> >* m_Confidence;	///< NULL if not required
+public:
+	CRFDecodeJob(const CRF* model, vector<Sequence>& batch, vector<InferenceContext>& ctx, vector<vector<size_t> >& output, vector<vector<double> >* confidence)
+		: m_Model(model), m_Batch(batch), m_Context(ctx), m_Output(output), m_Confidence(confidence) {}
+	void run(size_t tid, size_t n_threads) {
+		size_t begin, end;
+		splitRange(m_Batch.size(), tid, n_threads, begin, end);
+		for (size_t i = begin; i < end; ++i) {
+			long double prob;
+			m_Output[i] = m_Model->decode(m_Batch[i], m_Context[tid], prob);
+			if (m_Confidence != NULL)
+				(*m_Confidence)[i] = m_Model->getConfidence(m_Batch[i], m_Context[tid], m_Output[i]);
+		}
+	}
+};
+
 bool CRF::test(const std::string& filename, const std::string& outputfile, bool confidence) {
 	/// File stream
 	string line;
+	vector<StringRef> tokens;	///< tokens of the line (refer to the line)
 	ifstream f(filename.c_str());
 	if (!f)
 		throw runtime_error("cannot open data file");
 
 	/// output
 	ofstream out;
-	vector<string> state_vec;
+	const vector<string>& state_vec = m_Param.getStateVec();
 	if (outputfile != "") {
 		out.open(outputfile.c_str());
 		out.precision(20);
-		state_vec = m_Param.getState().second;
 	}
-	
+
 	/// initializing
 	size_t count = 0;
 	Sequence seq;
@@ -1184,69 +2197,68 @@ bool CRF::test(const std::string& filename, const std::string& outputfile, bool
 	test_eval.initialize(); ///< Evaluator intialization
 
 	calculateEdge();
-	
-	/// reading the text
-	while (getline(f,line)) {
-		if (line.empty()) {
-			/// test
-			calculateFactors(seq);
-  			forward();
-
-			long double zval = getPartitionZ();
-            long double dummy_prob;
-			vector<size_t> y_seq = viterbiSearch(dummy_prob);
-			assert(y_seq.size() == seq.size());
 
+	/// the sequences are decoded in batches (in parallel) and written in order
+	size_t batch_size = 256 * sizeThreads();
+	vector<Sequence> batch;
+	vector<vector<size_t> > batch_output;
+	vector<vector<double> > batch_confidence;
+	vector<InferenceContext> thread_ctx(sizeThreads());
+	bool eof = false;
+
+	while (!eof) {
+		/// reading the text
+		batch.clear();
+		while (batch.size() < batch_size) {
+			if (!getline(f,line)) {
+				eof = true;
+				break;
+			}
+			if (line.empty()) {
+				batch.push_back(seq);
+				seq.clear();
+			} else {
+				tokenize(StringRef(line), " 	", tokens);
+				Event ev = packEvent(tokens, &m_Param, true);	///< observation features
+				seq.push_back(ev);						///< append
+			}	///< else
+		}	///< while
+
+		/// test
+		batch_output.resize(batch.size());
+		batch_confidence.resize(batch.size());
+		CRFDecodeJob job(this, batch, thread_ctx, batch_output, (outputfile != "" && confidence ? &batch_confidence : NULL));
+		runParallel(job);
+
+		for (size_t n = 0; n < batch.size(); n++) {
+			Sequence& seq = batch[n];
+			vector<size_t>& y_seq = batch_output[n];
 			vector<string> reference, hypothesis;
-			
-			Sequence::iterator it = seq.begin();
-			size_t prev_y = m_default_oid;
 
+			Sequence::iterator it = seq.begin();
 			for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-
 				string outcome_s;
-				if (m_Param.sizeStateVec() <= it->label) 
+				if (m_Param.sizeStateVec() <= it->label)
 					outcome_s = "!OUT_OF_CLASS!";
 				else
-					outcome_s = m_Param.getState().second[it->label];
-				string y_seq_s = m_Param.getState().second[y_seq[i]];
+					outcome_s = state_vec[it->label];
+				string y_seq_s = state_vec[y_seq[i]];
 				reference.push_back(outcome_s);
 				hypothesis.push_back(y_seq_s);
 
 				if (outputfile != "") {
 					out << state_vec[y_seq[i]];
-					if (confidence) {
-						double norm = 0.0;
-						for (size_t j = 0; j < m_state_size; j++) {
-							if (i > 0)
-								norm += m_R[MAT2(i, j)] * m_M2[MAT2(prev_y, j)];
-							else
-								norm += m_R[MAT2(i, j)];
-						}
-						double prob;
-						if (i > 0)
-							prob = m_R[MAT2(i,y_seq[i])] * m_M2[MAT2(prev_y,y_seq[i])] / norm;
-						else
-							prob = m_R[MAT2(i,y_seq[i])] / norm;
-						out << " " << prob;
-						prev_y = y_seq[i];
-					}
-					out << endl; 
+					if (confidence)
+						out << " " << batch_confidence[n][i];
+					out << endl;
 				}
 			}
 			if (outputfile != "")
 				out << endl;
 
-				
-			test_eval.append(m_Param, reference, hypothesis);	
-			seq.clear();
+			test_eval.append(m_Param, reference, hypothesis);
 			++count;
-		} else {
-			vector<string> tokens = tokenize(line);
-			Event ev = packEvent(tokens, &m_Param, true);	///< observation features
-			seq.push_back(ev);						///< append
-
-		}	///< else
+		}
 	}	///< while
 
 	test_eval.calculateF1();
@@ -1256,6 +2268,8 @@ bool CRF::test(const std::string& filename, const std::string& outputfile, bool
 	logger->report("  MicroF1 = \t\t%8.3f\n", test_eval.getMicroF1()[2]);
 	//logger->report("  MacroF1 = \t\t%8.3f\n", test_eval.getMacroF1()[2]);
 	test_eval.Print(logger);
+
+	return true;
 }
 
 
@@ -16,9 +16,88 @@
 #include <string>
 #include <map>
 #include <valarray>
+#include <algorithm>
 
 namespace tricrf {
 
+class Evaluator;
+
+/// phases of the gradient computation (timing)
+enum GradientPhase { PHASE_FACTOR = 0, PHASE_FORWARD_BACKWARD, PHASE_VITERBI, PHASE_NODE, PHASE_EDGE, GRADIENT_PHASES };
+
+/** Topic planes of a triangular-chain model (one lattice per topic, see TriCRF).
+	@class TopicLattice
+*/
+struct TopicLattice {
+	std::vector<std::vector<long double> > ZR;		///< R matrix of each topic
+	std::vector<std::vector<long double> > ZAlpha;	///< Alpha matrix of each topic
+	std::vector<std::vector<long double> > ZBeta;	///< Beta matrix of each topic
+	std::vector<long double> Gamma;			///< Gamma matrix ; topic prior
+	std::vector<std::pair<long double, size_t> > prune;	///< sorted topic posterior (pruning)
+	std::vector<long double> bound;	///< log upper bound of each topic plane (topic beam)
+	std::vector<size_t> active;	///< topic planes kept by the topic beam (forward)
+	ThreadPool* pool;	///< threads for the topic planes of a sequence (NULL: sequential)
+
+	TopicLattice() : pool(NULL) {}
+};
+
+/** State beam of the sparse forward-backward (see CRF::selectBeam).
+	@class StateBeam
+*/
+struct StateBeam {
+	std::vector<std::vector<size_t> > states;	///< states in the beam at each position (ascending)
+	std::vector<char> in_beam;	///< beam membership (position x state)
+	std::vector<std::pair<long double, size_t> > order;	///< scratch for the selection
+};
+
+/** Scratch of the gradient of a sequence (see CRF::accumulateGradient).
+	@class GradientScratch
+*/
+struct GradientScratch {
+	std::vector<double> edge_exp;	///< expected transitions of the sequence (S x S, without the potential)
+	std::vector<double> edge_w;	///< beta * R / Z of a position
+	bool edge_used;	///< edge_exp has to be scattered (see CRF::flushEdge)
+	double phase_time[GRADIENT_PHASES];	///< seconds spent in each phase (GradientPhase)
+
+	GradientScratch() : edge_used(false) { std::fill(phase_time, phase_time + GRADIENT_PHASES, 0.0); }
+};
+
+/** Buffers of the checkpointed forward-backward of a long sequence.
+	They live for one sequence in CRF::accumulateCheckpoint (or the decoding),
+	which passes them to viterbiCheckpoint() and forwardCheckpoint().
+	@class CheckpointBuffer
+*/
+struct CheckpointBuffer {
+	std::vector<long double> alpha;	///< alpha (or delta) before each segment
+	std::vector<long double> seg_R;		///< factors of a segment
+	std::vector<long double> seg_alpha;	///< alpha (or delta) of a segment
+	std::vector<size_t> seg_psi;		///< back pointers of a segment
+};
+
+/** Inference context.
+	Lattice of a single sequence (factors, alpha, beta and scaling factors)
+	and the scratch of the inference options that need one per thread.
+	It is separated from the model so that each thread owns its own.
+	@class InferenceContext
+*/
+struct InferenceContext {
+	size_t seq_size;		///< sequence length (+1 for the end state)
+	std::vector<long double> R;			///< R matrix ; node observation
+	std::vector<long double> Alpha;	///< Alpha matrix
+	std::vector<long double> Beta;		///< Beta matrix
+	std::vector<long double> scale;	///< scaling factor (forward)
+	std::vector<long double> scale2;	///< scaling factor (backward)
+	std::vector<double> score;		///< linear scores of the factors (before exponentiation)
+
+	TopicLattice topic;		///< triangular-chain models
+	StateBeam state_beam;	///< beam forward-backward (CRF)
+	GradientScratch grad;	///< gradient of a sequence (CRF)
+
+	/// reduced precision lattices (see LatticePrecision)
+	LatticeBuffer<double> lattice_d;
+	LatticeBuffer<float> lattice_f;
+};
+
 /** (Linear-chain) Conditional Random Fields.
 	@class CRF
 */
@@ -26,9 +105,10 @@ class CRF : public MaxEnt {
 protected:
 	std::vector<long double> m_M;			///< M matrix ; edge transition 
 	std::vector<long double> m_M2;			///< M matrix ; edge transition 
-	std::vector<long double> m_R;			///< R matrix ; node observation
-	std::vector<long double> m_Alpha;	///< Alpha matrix
-	std::vector<long double> m_Beta;		///< Beta matrix
+	std::vector<double> m_M2d;			///< M matrix in double (LATTICE_DOUBLE)
+	std::vector<float> m_M2f;			///< M matrix in float (LATTICE_FLOAT)
+	std::vector<long double> m_Tied;	///< potential of the transitions into y out of m_SelectedStateList1[y] (1 if untied)
+	InferenceContext m_Context;		///< lattice for the single-threaded inference
 	
 	/* too slow
 	virtual inline size_t MAT3(size_t I, size_t X, size_t Y) {
@@ -46,21 +126,64 @@ protected:
 
 	/// Inference
 	virtual void calculateEdge();	///< Calculating the factors
-	virtual void calculateFactors(Sequence &seq);	///< Calculating the factors
-	virtual void forward();	 ///< Forward recursion
-	virtual void backward();	///< Backward recursion
-	virtual long double getPartitionZ();	///< Z
-	virtual std::vector<size_t> viterbiSearch(long double& prob);	///< Find the best path
+	virtual void calculateFactors(const Sequence &seq, InferenceContext& ctx) const;	///< Calculating the factors
+	virtual void forward(InferenceContext& ctx) const;	 ///< Forward recursion
+	virtual void backward(InferenceContext& ctx) const;	///< Backward recursion
+	long double forwardRow(const long double* prev, const long double* R, long double* alpha) const;
+	long double backwardRow(const long double* next, const long double* R, long double* beta) const;
+	void expScoreKernel(InferenceContext& ctx) const;	///< factors of the reduced precision lattice
+	template <class T> void forwardKernel(InferenceContext& ctx, LatticeBuffer<T>& buf, const std::vector<T>& M) const;
+	template <class T> void backwardKernel(InferenceContext& ctx, LatticeBuffer<T>& buf, const std::vector<T>& M) const;
+	virtual long double getPartitionZ(const InferenceContext& ctx) const;	///< Z
+	virtual std::vector<size_t> viterbiSearch(const InferenceContext& ctx, long double& prob) const;	///< Find the best path
+
+	/// State beam (sparse forward-backward)
+	bool useStateBeam() const { return m_state_beam > 0 || m_state_beam_ratio > 0; };
+	long double selectBeam(InferenceContext& ctx, size_t i) const;
+	void forwardBeam(InferenceContext& ctx) const;
+	void backwardBeam(InferenceContext& ctx) const;
+	std::vector<size_t> viterbiBeam(const InferenceContext& ctx, long double& prob) const;
+	std::vector<double> getConfidence(const Sequence& seq, InferenceContext& ctx, const std::vector<size_t>& y_seq) const;
+	friend class CRFDecodeJob;
+
+	/// Sparse forward-backward (see SparseMode)
+	void makeSparseIndex();
+	void endSparse();
+
+	/// Checkpointed forward-backward (long sequences)
+	bool useCheckpoint(size_t length) const { return m_checkpoint_length > 0 && length >= m_checkpoint_length && !useStateBeam(); };
+	void factorRow(const Event& ev, std::vector<double>& score, long double* R) const;
+	void viterbiRow(const long double* prev, const long double* R, long double* delta, size_t* psi) const;
+	std::vector<size_t> viterbiCheckpoint(const Sequence& seq, InferenceContext& ctx, CheckpointBuffer& check) const;
+	long double forwardCheckpoint(const Sequence& seq, InferenceContext& ctx, const std::vector<size_t>& y_seq, CheckpointBuffer& check) const;
+	void accumulateCheckpoint(Sequence& seq, double count, InferenceContext& ctx, double* gradient, Evaluator& eval);
 
 	/// Parameter Estimation
+	void accumulateNode(const Event& ev, const long double* alpha, const long double* beta, long double zval, long double factor,
+		const char* in_beam, double* gradient, double count) const;
+	void accumulateEdge(InferenceContext& ctx, const long double* alpha, const long double* beta, const long double* R,
+		long double zval, long double factor, const char* in_alpha, const char* in_beta, double* gradient, double count) const;
+	void flushEdge(InferenceContext& ctx, double* gradient, double count) const;
+	void accumulateGradient(Sequence& seq, double count, InferenceContext& ctx, double* gradient, Evaluator& eval);
+	friend class CRFGradientJob;
+	void accumulateEmpirical(const Sequence& seq, const std::vector<size_t>& edge_fid, double* gradient, double count) const;
+	void reportInference();
 	virtual bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
 	virtual bool estimateWithPL(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
-	virtual bool averageParam() {};
+	size_t accumulateMistake(const Sequence& seq, const std::vector<size_t>& y_seq, const std::vector<size_t>& edge_fid, double* gradient);
+
+	/// Online estimation (see MaxEnt::estimateWithSGD)
+	std::vector<size_t> m_EdgeFid;	///< weight id of each transition (see accumulateEmpirical())
+	std::vector<InferenceContext> m_WorkerContext;	///< lattices of the Hogwild workers
+	InferenceContext& workerContext(size_t worker) { return (m_WorkerContext.empty() ? m_Context : m_WorkerContext[worker]); };
+	void onlineDense(std::vector<std::vector<size_t> >& dense);
+	void onlineBegin(size_t n_workers);
+	void onlineEpoch();
+	void reportParam();
+	void gradientSample(SGD& sgd, size_t worker, size_t s, std::vector<Evaluator>& eval, size_t epoch);
+	size_t mistakeSample(size_t s, std::vector<Evaluator>& eval, bool& changed);
+	bool evaluateDev(std::vector<Evaluator>& dev_eval);
 	
-	std::vector<std::vector<size_t> > m_Beam;
-	std::vector<std::map<size_t, size_t> > m_BeamMap;
-	std::vector<long double> scale;
-	std::vector<long double> scale2;
 	std::vector<std::vector<size_t> > m_IndexR;
 	
 public:
@@ -80,12 +203,19 @@ public:
 	virtual void eval(Sequence seq, std::vector<std::string> &output, long double &prob);
 	virtual void eval(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob);
 	virtual void evals(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob);
+
+	/// Reentrant inference ; the model is read-only and all the scratch memory is in ctx, 
+	/// so that the threads can share one model (calculateEdge() should be called once before)
+	std::vector<size_t> decode(const Sequence& seq, InferenceContext& ctx, long double& prob) const;
+	void eval(const Sequence& seq, InferenceContext& ctx, std::vector<std::string> &output, long double &prob) const;
+	void eval(const Sequence& seq, InferenceContext& ctx, std::vector<std::string> &output, std::vector<long double> &prob) const;
+	void evals(const Sequence& seq, InferenceContext& ctx, std::vector<std::string> &output, std::vector<long double> &prob) const;
 		
 	/// Training 
 	virtual void clear();
 	virtual bool pretrain(size_t max_iter = 100, double sigma = 20, bool L1 = false);
 	virtual bool train(size_t max_iter = 100, double sigma = 20, bool L1 = false); 
-	virtual long double calculateProb(Sequence& seq);	///< Prob(y|x)
+	virtual long double calculateProb(const Sequence& seq, const InferenceContext& ctx) const;	///< Prob(y|x)
 
 };	///< CRF
 
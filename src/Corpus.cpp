@@ -0,0 +1,548 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Corpus.h"
+#include "Dictionary.h"
+#include "Thread.h"
+#include "Utility.h"
+/// standard headers
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace tricrf {
+
+static const uint64_t C1 = 0x87C37B91114253D5ULL;
+static const uint64_t C2 = 0x4CF5AD432745937FULL;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	k *= 0xC4CEB9FE1A85EC53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+void Fingerprint::mix(uint64_t k1, uint64_t k2) {
+	k1 *= C1; k1 = rotl(k1, 31); k1 *= C2; h1 ^= k1;
+	h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+	k2 *= C2; k2 = rotl(k2, 33); k2 *= C1; h2 ^= k2;
+	h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+}
+
+void Fingerprint::update(const void* data, size_t len) {
+	const char* p = (const char*)data;
+	uint64_t k[2];
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		memcpy(k, p + i, 16);
+		mix(k[0], k[1]);
+	}
+	k[0] = k[1] = 0;
+	if (i < len)
+		memcpy(k, p + i, len - i);
+	mix(k[0], k[1]);
+	mix((uint64_t)len, C1);
+}
+
+void Fingerprint::digest(uint64_t& a, uint64_t& b) const {
+	a = h1 + h2;
+	b = h2 + a;
+	a = fmix(a);
+	b = fmix(b);
+	a += b;
+	b += a;
+}
+
+static const size_t MIN_SLOT = 16;
+
+FingerprintTable::FingerprintTable() {
+	m_Size = 0;
+	Slot empty = {0, 0, EMPTY, 0};
+	m_Slot.assign(MIN_SLOT, empty);
+	m_Mask = MIN_SLOT - 1;
+}
+
+void FingerprintTable::rehash(size_t n_slot) {
+	Slot empty = {0, 0, EMPTY, 0};
+	vector<Slot> old(n_slot, empty);
+	old.swap(m_Slot);
+	m_Mask = n_slot - 1;
+	for (size_t j = 0; j < old.size(); j++) {
+		if (old[j].index == EMPTY)
+			continue;
+		size_t i = (size_t)old[j].a & m_Mask;
+		while (m_Slot[i].index != EMPTY)
+			i = (i + 1) & m_Mask;
+		m_Slot[i] = old[j];
+	}
+}
+
+/** Comparison of two sequences of the token table.
+	The locator is the first line of a sequence.
+*/
+struct SameTokens {
+	const uint32_t* token;
+	const uint64_t* offset;
+	size_t begin;	///< first line of the new sequence
+	size_t end;		///< its sequence break
+
+	bool operator()(uint64_t first) const {
+		for (size_t k = 0; k <= end - begin; k++) {
+			size_t len = offset[begin+k+1] - offset[begin+k];
+			if (offset[first+k+1] - offset[first+k] != len)
+				return false;
+			if (len > 0 && memcmp(token + offset[first+k], token + offset[begin+k], len * sizeof(uint32_t)) != 0)
+				return false;
+		}
+		return true;
+	}
+};
+
+/** Find the first identical sequence of every sequence.
+	@param token	token ids
+	@param offset	line offsets
+	@param n_line	number of lines
+	@param first	first identical sequence (output)
+	@return number of distinct sequences
+*/
+static size_t findDuplicates(const uint32_t* token, const uint64_t* offset, size_t n_line, vector<uint64_t>& first) {
+	FingerprintTable table;
+	Fingerprint fp;
+	SameTokens same = {token, offset, 0, 0};
+	first.clear();
+	for (size_t i = 0; i < n_line; i++) {
+		size_t len = offset[i+1] - offset[i];
+		if (len == 0) {	///< sequence break
+			same.end = i;
+			first.push_back(table.insert(fp, first.size(), same.begin, same));
+			fp = Fingerprint();
+			same.begin = i + 1;
+		} else
+			fp.update(token + offset[i], len * sizeof(uint32_t));
+	}
+	return table.size();
+}
+
+size_t compileCorpus(const string& filename, const string& outputfile, size_t& n_unique) {
+	ifstream f(filename.c_str());
+	if (!f)
+		throw runtime_error("cannot open data file");
+
+	Dictionary dict;				///< token <-> id
+	vector<StringRef> tokens;
+	vector<uint32_t> token;			///< token ids
+	vector<uint64_t> offset(1, 0);	///< line offsets
+	vector<uint64_t> first;			///< first identical sequence
+	string line;
+
+	while (getline(f, line)) {
+		tokenize(StringRef(line), " \t", tokens);
+		for (size_t i = 0; i < tokens.size(); i++)
+			token.push_back((uint32_t)dict.insert(tokens[i].data, tokens[i].size));
+		offset.push_back(token.size());
+	}
+	n_unique = findDuplicates(token.empty() ? NULL : &token[0], &offset[0], offset.size() - 1, first);
+
+	BinaryModelWriter out(outputfile, "Corpus");
+	out.beginSection(BIN_CORPUS_TOKEN);
+	if (!token.empty())
+		out.write(&token[0], token.size() * sizeof(uint32_t));
+	out.endSection();
+
+	uint64_t count = offset.size() - 1;
+	out.beginSection(BIN_CORPUS_LINE);
+	out.write(&count, sizeof(count));
+	out.write(&offset[0], offset.size() * sizeof(uint64_t));
+	out.endSection();
+
+	count = first.size();
+	out.beginSection(BIN_CORPUS_SEQUENCE);
+	out.write(&count, sizeof(count));
+	if (count > 0)
+		out.write(&first[0], first.size() * sizeof(uint64_t));
+	out.endSection();
+
+	vector<string> strings(dict.size());
+	for (size_t i = 0; i < dict.size(); i++)
+		strings[i] = dict.key(i);
+	out.writeStrings(BIN_CORPUS_STRING, strings);
+	if (!out.good())
+		throw runtime_error("unable to write the corpus");
+	out.close();
+
+	return first.size();
+}
+
+/** Tokenize the chunks of a text corpus with local dictionaries.
+	@class ParseJob
+*/
+class ParseJob : public ThreadJob {
+public:
+	const char* m_Text;					///< mapped file
+	const vector<size_t>& m_Bound;		///< chunk c = [bound[c], bound[c+1])
+	vector<Dictionary>& m_Dict;			///< local dictionaries
+	vector<vector<uint32_t> >& m_Token;	///< local token ids
+	vector<vector<uint64_t> >& m_Length;	///< number of tokens of each line
+
+	ParseJob(const char* text, const vector<size_t>& bound, vector<Dictionary>& dict,
+			vector<vector<uint32_t> >& token, vector<vector<uint64_t> >& length)
+		: m_Text(text), m_Bound(bound), m_Dict(dict), m_Token(token), m_Length(length) {}
+
+	void run(size_t tid, size_t) {
+		const char* p = m_Text + m_Bound[tid];
+		const char* end = m_Text + m_Bound[tid+1];
+		Dictionary& dict = m_Dict[tid];
+		vector<uint32_t>& token = m_Token[tid];
+		vector<uint64_t>& length = m_Length[tid];
+		while (p < end) {
+			const char* eol = (const char*)memchr(p, '\n', end - p);
+			if (eol == NULL)
+				eol = end;
+			size_t n = 0;
+			while (p < eol) {	///< same as tokenize(line, " \t")
+				if (*p == ' ' || *p == '\t') {
+					++p;
+					continue;
+				}
+				const char* q = p;
+				while (q < eol && *q != ' ' && *q != '\t')
+					++q;
+				token.push_back((uint32_t)dict.insert(p, q - p));
+				++n;
+				p = q;
+			}
+			length.push_back(n);
+			p = eol + 1;
+		}
+	}
+};
+
+/** Map the local token ids to the merged ids.
+	@class RemapJob
+*/
+class RemapJob : public ThreadJob {
+public:
+	const vector<vector<uint32_t> >& m_Local;
+	const vector<vector<uint32_t> >& m_Map;	///< local id -> merged id
+	const vector<size_t>& m_Start;			///< first token of each chunk
+	uint32_t* m_Token;
+
+	RemapJob(const vector<vector<uint32_t> >& local, const vector<vector<uint32_t> >& id_map,
+			const vector<size_t>& start, uint32_t* token)
+		: m_Local(local), m_Map(id_map), m_Start(start), m_Token(token) {}
+
+	void run(size_t tid, size_t) {
+		const vector<uint32_t>& local = m_Local[tid];
+		const vector<uint32_t>& id_map = m_Map[tid];
+		for (size_t i = 0; i < local.size(); i++)
+			m_Token[m_Start[tid] + i] = id_map[local[i]];
+	}
+};
+
+/** Find the next blank line (sequence break) at or after pos.
+	@return offset of the "\n\n" or size if none
+*/
+static size_t findBreak(const char* text, size_t size, size_t pos) {
+	while (pos + 1 < size) {
+		const char* p = (const char*)memchr(text + pos, '\n', size - pos - 1);
+		if (p == NULL)
+			break;
+		if (p[1] == '\n')
+			return p - text;
+		pos = p - text + 1;
+	}
+	return size;
+}
+
+/** Parse the text corpus into the token table on the threads.
+	The file is memory-mapped and each thread tokenizes its own byte range,
+	so the text is never copied.
+	The merged dictionary gives the ids in the order of the first occurrence in the file,
+	since the chunks are merged in order and the local ids are in the same order.
+*/
+void CorpusReader::parse(ThreadPool* pool) {
+	int fd = open(m_Filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw runtime_error("cannot open data file");
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw runtime_error("cannot open data file");
+	}
+	size_t size = st.st_size;
+	const char* text = NULL;
+	if (size > 0) {
+		void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			throw runtime_error("fail to map data file");
+		}
+		madvise(data, size, MADV_SEQUENTIAL);
+		text = (const char*)data;
+	}
+	close(fd);
+	size_t n_chunk = pool->size();
+
+	/// chunk boundaries ; at the start of a blank line (sequence break)
+	vector<size_t> bound(n_chunk + 1, size);
+	bound[0] = 0;
+	for (size_t c = 1; c < n_chunk; c++) {
+		size_t pos = max(bound[c-1], size * c / n_chunk);
+		pos = findBreak(text, size, pos > 0 ? pos - 1 : 0);
+		bound[c] = (pos == size ? size : pos + 1);
+	}
+
+	vector<Dictionary> dict(n_chunk);
+	vector<vector<uint32_t> > token(n_chunk);
+	vector<vector<uint64_t> > length(n_chunk);
+	ParseJob parse_job(text, bound, dict, token, length);
+	pool->run(parse_job);
+	if (text != NULL)
+		munmap((void*)text, size);
+
+	/// merge the dictionaries in the order of the chunks
+	Dictionary merged;
+	vector<vector<uint32_t> > id_map(n_chunk);
+	vector<size_t> start(n_chunk + 1, 0);
+	for (size_t c = 0; c < n_chunk; c++) {
+		id_map[c].resize(dict[c].size());
+		for (size_t i = 0; i < dict[c].size(); i++)
+			id_map[c][i] = (uint32_t)merged.insert(dict[c].data(i), dict[c].length(i));
+		start[c+1] = start[c] + token[c].size();
+	}
+	m_TokenBuf.resize(start[n_chunk]);
+	if (!m_TokenBuf.empty()) {
+		RemapJob remap_job(token, id_map, start, &m_TokenBuf[0]);
+		pool->run(remap_job);
+	}
+
+	m_OffsetBuf.assign(1, 0);
+	for (size_t c = 0; c < n_chunk; c++) {
+		for (size_t i = 0; i < length[c].size(); i++)
+			m_OffsetBuf.push_back(m_OffsetBuf.back() + length[c][i]);
+	}
+	m_String.resize(merged.size());
+	for (size_t i = 0; i < merged.size(); i++)
+		m_String[i] = merged.key(i);
+	n_line = m_OffsetBuf.size() - 1;
+	findDuplicates(m_TokenBuf.empty() ? NULL : &m_TokenBuf[0], &m_OffsetBuf[0], n_line, m_FirstBuf);
+	n_sequence = m_FirstBuf.size();
+
+	m_Token = (m_TokenBuf.empty() ? NULL : &m_TokenBuf[0]);
+	m_Offset = &m_OffsetBuf[0];
+	m_First = (m_FirstBuf.empty() ? NULL : &m_FirstBuf[0]);
+	m_Indexed = true;
+}
+
+bool CorpusReader::isCompiled(const string& filename) {
+	return BinaryModelReader::isBinary(filename);
+}
+
+/** Constructor.
+	@param filename	text or compiled corpus
+	@param pool	threads to parse a text corpus (NULL to read the lines one by one)
+*/
+CorpusReader::CorpusReader(const string& filename, ThreadPool* pool) {
+	m_Indexed = false;
+	m_Binary = NULL;
+	m_Token = NULL;
+	m_Offset = NULL;
+	m_First = NULL;
+	n_line = 0;
+	n_sequence = 0;
+	m_Pos = 0;
+	m_Break = 0;
+	m_Start = 0;
+	m_Last = 0;
+
+	if (!isCompiled(filename)) {
+		m_Filename = filename;
+		m_File.open(filename.c_str());
+		if (!m_File)
+			throw runtime_error("cannot open data file");
+		if (pool != NULL && pool->size() > 1)
+			parse(pool);
+		return;
+	}
+
+	/// compiled corpus (memory-mapped)
+	m_Binary = new BinaryModelReader(filename);
+	const char* data;
+	uint64_t size, n_token = 0;
+	bool valid = (m_Binary->type() == "Corpus");
+	if (valid && (valid = m_Binary->nextSection(BIN_CORPUS_TOKEN, data, size))) {
+		m_Token = (const uint32_t*)data;
+		n_token = size / sizeof(uint32_t);
+	}
+	if (valid && (valid = m_Binary->nextSection(BIN_CORPUS_LINE, data, size) && size >= 2 * sizeof(uint64_t))) {
+		n_line = *(const uint64_t*)data;
+		m_Offset = (const uint64_t*)data + 1;
+		valid = ((n_line + 2) * sizeof(uint64_t) <= size && m_Offset[n_line] <= n_token);
+	}
+	if (valid && (valid = m_Binary->nextSection(BIN_CORPUS_SEQUENCE, data, size) && size >= sizeof(uint64_t))) {
+		n_sequence = *(const uint64_t*)data;
+		m_First = (const uint64_t*)data + 1;
+		valid = ((n_sequence + 1) * sizeof(uint64_t) <= size);
+	}
+	valid = valid && m_Binary->readStrings(BIN_CORPUS_STRING, m_String);
+	for (uint64_t i = 0; valid && i < n_token; i++)
+		valid = (m_Token[i] < m_String.size());
+	if (!valid) {
+		delete m_Binary;
+		throw runtime_error("invalid corpus file");
+	}
+	m_Indexed = true;
+}
+
+CorpusReader::~CorpusReader() {
+	if (m_Binary != NULL)
+		delete m_Binary;
+}
+
+/** Read the next line.
+	@param tokens	tokens of the line (empty at the sequence break)
+	@return false at the end of the corpus
+*/
+bool CorpusReader::next(vector<StringRef>& tokens) {
+	if (m_Indexed) {
+		if (m_Pos >= n_line)
+			return false;
+		const uint32_t* id = m_Token + m_Offset[m_Pos];
+		size_t n = m_Offset[m_Pos+1] - m_Offset[m_Pos];
+		tokens.resize(n);
+		for (size_t i = 0; i < n; i++)
+			tokens[i] = StringRef(m_String[id[i]]);
+	} else {
+		if (!getline(m_File, m_Line))
+			return false;
+		tokenize(StringRef(m_Line), " \t", tokens);
+	}
+	++m_Pos;
+	if (tokens.empty()) {
+		++m_Break;
+		m_Last = m_Start;
+		m_Start = (m_Indexed ? (uint64_t)m_Pos : (uint64_t)m_File.tellg());
+	}
+	return true;
+}
+
+void CorpusReader::rewind() {
+	m_Pos = 0;
+	m_Break = 0;
+	m_Start = 0;
+	m_Last = 0;
+	if (!m_Indexed) {
+		m_File.clear();
+		m_File.seekg(0, ios::beg);
+	}
+}
+
+size_t CorpusReader::firstOccurrence() const {
+	if (!m_Indexed || m_Break == 0 || m_Break > n_sequence)
+		throw runtime_error("invalid sequence in the corpus");
+	return m_First[m_Break-1];
+}
+
+/// tokens separated by a space, the line ended by a newline
+static void appendKey(const vector<StringRef>& tokens, string& key) {
+	for (size_t i = 0; i < tokens.size(); i++) {
+		if (i > 0)
+			key += ' ';
+		key.append(tokens[i].data, tokens[i].size);
+	}
+	key += '\n';
+}
+
+/** Read back a sequence.
+	@param start	first line (token table) or file offset (text corpus) of the sequence
+	@param key	lines of the sequence joined as the key of DuplicateFilter
+*/
+void CorpusReader::sequenceKey(uint64_t start, string& key) {
+	key.clear();
+	vector<StringRef> tokens;
+	if (m_Indexed) {
+		for (size_t i = (size_t)start; i < n_line && m_Offset[i+1] > m_Offset[i]; i++) {
+			tokens.resize(m_Offset[i+1] - m_Offset[i]);
+			for (size_t j = 0; j < tokens.size(); j++)
+				tokens[j] = StringRef(m_String[m_Token[m_Offset[i] + j]]);
+			appendKey(tokens, key);
+		}
+		return;
+	}
+
+	if (!m_Verify.is_open()) {
+		m_Verify.open(m_Filename.c_str());
+		if (!m_Verify)
+			throw runtime_error("cannot open data file");
+	}
+	m_Verify.clear();
+	m_Verify.seekg((streamoff)start, ios::beg);
+	string line;
+	while (getline(m_Verify, line)) {
+		tokenize(StringRef(line), " \t", tokens);
+		if (tokens.empty())
+			break;
+		appendKey(tokens, key);
+	}
+}
+
+DuplicateFilter::DuplicateFilter(CorpusReader& corpus) : m_Corpus(corpus) {
+	m_Compiled = corpus.indexed();
+}
+
+void DuplicateFilter::add(const vector<StringRef>& tokens) {
+	if (!m_Compiled)
+		appendKey(tokens, m_Key);
+}
+
+/** Comparison of the current key with a sequence read back from the corpus.
+	The locator is the start of a sequence.
+*/
+struct SameKey {
+	CorpusReader& corpus;
+	const string& key;
+	string& buffer;
+
+	bool operator()(uint64_t start) {
+		corpus.sequenceKey(start, buffer);
+		return buffer == key;
+	}
+};
+
+/** Find the sequence ended by the last break.
+	@param n_unique	number of unique sequences so far
+	@return index of the unique sequence (n_unique if it is new)
+*/
+size_t DuplicateFilter::find(size_t n_unique) {
+	size_t index;
+	if (m_Compiled) {
+		size_t first = m_Corpus.firstOccurrence();
+		index = (first == m_Unique.size() ? n_unique : m_Unique[first]);
+		m_Unique.push_back(index);
+	} else {
+		Fingerprint fp;
+		fp.update(m_Key.data(), m_Key.size());
+		SameKey same = {m_Corpus, m_Key, m_Buffer};
+		index = (size_t)m_Table.insert(fp, n_unique, m_Corpus.lastSequence(), same);
+		m_Key.clear();
+	}
+	return index;
+}
+
+} // namespace tricrf
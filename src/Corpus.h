@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __CORPUS_H__
+#define __CORPUS_H__
+
+/// max headers
+#include "BinaryModel.h"
+#include "Utility.h"
+/// standard headers
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdint.h>
+
+namespace tricrf {
+
+class ThreadPool;
+
+/** Compile a text corpus into the binary corpus format.
+	The file uses the container of the binary model (type "Corpus") with the sections
+
+	BIN_CORPUS_TOKEN	id[] (uint32) ; tokens of all lines, interned
+	BIN_CORPUS_LINE		count (uint64), offset[count+1] (uint64) ; an empty line is a sequence break
+	BIN_CORPUS_SEQUENCE	count (uint64), first[count] (uint64) ; first identical sequence (duplicates)
+	BIN_CORPUS_STRING	string table of the token ids
+
+	@param filename	text corpus
+	@param outputfile	binary corpus
+	@param n_unique	number of distinct sequences (output)
+	@return number of sequences
+*/
+size_t compileCorpus(const std::string& filename, const std::string& outputfile, size_t& n_unique);
+
+/** Line reader of a corpus.
+	Reads a text corpus or a compiled corpus (memory-mapped) with the same interface,
+	so the models read both formats with one code path.
+	With a thread pool, a text corpus is parsed in parallel into the same token table
+	as a compiled corpus: the file is split into chunks at the blank lines, every thread
+	tokenizes its chunk with a local dictionary, and the dictionaries are merged in the
+	order of the chunks, so the token ids (and the lines) are the same as a serial read.
+	@class CorpusReader
+*/
+class CorpusReader {
+private:
+	/// text corpus
+	std::string m_Filename;
+	std::ifstream m_File;
+	std::string m_Line;
+	std::ifstream m_Verify;	///< second stream to read back a sequence
+
+	/// token table (compiled corpus or parsed text corpus)
+	bool m_Indexed;
+	BinaryModelReader* m_Binary;		///< compiled corpus
+	std::vector<std::string> m_String;	///< string table
+	const uint32_t* m_Token;
+	const uint64_t* m_Offset;
+	const uint64_t* m_First;
+	size_t n_line;
+	size_t n_sequence;
+
+	/// parsed text corpus
+	std::vector<uint32_t> m_TokenBuf;
+	std::vector<uint64_t> m_OffsetBuf;
+	std::vector<uint64_t> m_FirstBuf;
+	void parse(ThreadPool* pool);
+
+	size_t m_Pos;		///< next line
+	size_t m_Break;		///< number of sequence breaks read so far
+	uint64_t m_Start;	///< start of the current sequence (line or file offset)
+	uint64_t m_Last;	///< start of the sequence ended by the last break
+
+	CorpusReader(const CorpusReader&);
+	CorpusReader& operator=(const CorpusReader&);
+
+public:
+	CorpusReader(const std::string& filename, ThreadPool* pool = NULL);
+	~CorpusReader();
+
+	static bool isCompiled(const std::string& filename);
+	bool compiled() const { return m_Binary != NULL; };
+	bool indexed() const { return m_Indexed; };	///< lines are read from the token table
+
+	/// next line ; empty tokens for a sequence break
+	/// the tokens refer to the line buffer or the string table (valid until the next call)
+	bool next(std::vector<StringRef>& tokens);
+	void rewind();
+
+	/// index of the first sequence identical to the one ended by the last break (token table only)
+	size_t firstOccurrence() const;
+
+	/// start of the sequence ended by the last break (line of the token table or offset in the file)
+	uint64_t lastSequence() const { return m_Last; };
+	/// read back the sequence at the start as a key (see DuplicateFilter)
+	void sequenceKey(uint64_t start, std::string& key);
+};
+
+/** 128-bit fingerprint of a byte stream.
+	The blocks are mixed as in MurmurHash3 (x64, 128 bit), and every update is closed
+	with its length, so that the same bytes split differently give other fingerprints.
+	@class Fingerprint
+*/
+class Fingerprint {
+private:
+	uint64_t h1, h2;
+	void mix(uint64_t k1, uint64_t k2);
+
+public:
+	Fingerprint() : h1(0x9E3779B97F4A7C15ULL), h2(0xC2B2AE3D27D4EB4FULL) {};
+	void update(const void* data, size_t len);
+	void digest(uint64_t& a, uint64_t& b) const;
+};
+
+/** Table of sequence fingerprints (open addressing, linear probing).
+	A slot keeps the fingerprint, the index of the sequence and where to find it again;
+	equal fingerprints are verified with the sequences themselves, so a collision only
+	costs a comparison.
+	@class FingerprintTable
+*/
+class FingerprintTable {
+private:
+	struct Slot {
+		uint64_t a, b;		///< fingerprint
+		uint64_t index;		///< EMPTY if the slot is free
+		uint64_t locator;	///< where the sequence is (given to the comparison)
+	};
+	static const uint64_t EMPTY = (uint64_t)-1;
+	std::vector<Slot> m_Slot;
+	size_t m_Mask;
+	size_t m_Size;
+	void rehash(size_t n_slot);
+
+public:
+	FingerprintTable();
+	size_t size() const { return m_Size; };
+
+	/** Find the sequence or insert it.
+		@param equal	equal(locator) is true if the sequence at the locator is the new one
+		@return index of the identical sequence, or the given index if the sequence is new
+	*/
+	template <class Equal>
+	uint64_t insert(const Fingerprint& fp, uint64_t index, uint64_t locator, Equal& equal) {
+		uint64_t a, b;
+		fp.digest(a, b);
+		size_t i = (size_t)a & m_Mask;
+		for (; m_Slot[i].index != EMPTY; i = (i + 1) & m_Mask) {
+			const Slot& slot = m_Slot[i];
+			if (slot.a == a && slot.b == b && equal(slot.locator))
+				return slot.index;
+		}
+		Slot& slot = m_Slot[i];
+		slot.a = a;
+		slot.b = b;
+		slot.index = index;
+		slot.locator = locator;
+		/// load factor <= 1/2
+		if (2 * ++m_Size > m_Mask + 1)
+			rehash(2 * (m_Mask + 1));
+		return index;
+	}
+};
+
+/** Duplicate sequences while reading the data.
+	The token table already knows the duplicates. Otherwise the added lines are joined
+	into a key (tokens separated by a space, lines ended by a newline) and looked up by
+	its fingerprint; only the fingerprints are kept, and a match is verified by reading
+	the earlier sequence back from the corpus.
+	@class DuplicateFilter
+*/
+class DuplicateFilter {
+private:
+	CorpusReader& m_Corpus;
+	bool m_Compiled;	///< use the duplicates of the token table
+	FingerprintTable m_Table;
+	std::string m_Key;		///< key of the current sequence
+	std::string m_Buffer;	///< key of the earlier sequence (verification)
+	std::vector<size_t> m_Unique;	///< unique index of each compiled sequence
+
+public:
+	DuplicateFilter(CorpusReader& corpus);
+
+	void add(const std::vector<StringRef>& tokens);
+	size_t find(size_t n_unique);	///< at the sequence break ; n_unique if the sequence is new
+};
+
+} // namespace tricrf
+
+#endif
@@ -31,6 +31,7 @@ struct StringEvent {
 	size_t label;
 	double fval;
 	std::vector<std::pair<std::string, double > > obs;
+	std::vector<std::pair<size_t, double> > ids;	///< obs resolved to global feature ids (see FeatureView)
 };
 
 /** Sequence.
@@ -52,6 +53,8 @@ class TriStringSequence {
 public:
 	Event topic;
 	StringSequence seq;
+	bool resolved;	///< the features are in seq[].ids instead of seq[].obs
+	TriStringSequence() : resolved(false) {};
 	size_t size() { return seq.size(); };
 };
 
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Dictionary.h"
+/// standard headers
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+namespace tricrf {
+
+static const size_t MIN_SLOT = 16;
+
+Dictionary::Dictionary() {
+	clear();
+}
+
+/// FNV-1a (64 bit)
+uint64_t Dictionary::hash(const char* key, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+size_t Dictionary::probe(const char* key, size_t len, uint64_t h) const {
+	uint64_t tag = h >> 32;
+	size_t i = (size_t)h & m_Mask;
+	for (;; i = (i + 1) & m_Mask) {
+		uint64_t slot = m_Slot[i];
+		if (slot == 0)
+			return i;
+		if ((slot >> 32) == tag) {
+			size_t id = (size_t)(slot & 0xFFFFFFFFULL) - 1;
+			if (length(id) == len && memcmp(data(id), key, len) == 0)
+				return i;
+		}
+	}
+}
+
+/** Find the key.
+	@return id of the key or npos
+*/
+size_t Dictionary::find(const char* key, size_t len) const {
+	uint64_t slot = m_Slot[probe(key, len, hash(key, len))];
+	if (slot == 0)
+		return npos;
+	return (size_t)(slot & 0xFFFFFFFFULL) - 1;
+}
+
+/** Insert the key.
+	@return id of the key (existing or new)
+*/
+size_t Dictionary::insert(const char* key, size_t len) {
+	uint64_t h = hash(key, len);
+	size_t i = probe(key, len, h);
+	if (m_Slot[i] != 0)
+		return (size_t)(m_Slot[i] & 0xFFFFFFFFULL) - 1;
+
+	size_t id = size();
+	if (id >= 0xFFFFFFFFULL)
+		throw runtime_error("too many keys in the dictionary");
+	m_Arena.insert(m_Arena.end(), key, key + len);
+	m_Offset.push_back(m_Arena.size());
+	m_Slot[i] = ((h >> 32) << 32) | (uint64_t)(id + 1);
+
+	/// load factor <= 1/2
+	if (2 * size() > m_Mask + 1)
+		rehash(2 * (m_Mask + 1));
+	return id;
+}
+
+void Dictionary::rehash(size_t n_slot) {
+	m_Slot.assign(n_slot, 0);
+	m_Mask = n_slot - 1;
+	for (size_t id = 0; id < size(); id++) {
+		uint64_t h = hash(data(id), length(id));
+		size_t i = (size_t)h & m_Mask;
+		while (m_Slot[i] != 0)
+			i = (i + 1) & m_Mask;
+		m_Slot[i] = ((h >> 32) << 32) | (uint64_t)(id + 1);
+	}
+}
+
+/** Build the dictionary from a string table.
+	@param chars	characters
+	@param offset	offset[count+1]
+	@return false if the table is invalid (a key is duplicated)
+*/
+bool Dictionary::assign(const char* chars, const uint64_t* offset, size_t count) {
+	clear();
+	reserve(count);
+	m_Arena.reserve(offset[count]);
+	for (size_t i = 0; i < count; i++) {
+		if (offset[i+1] < offset[i] || insert(chars + offset[i], offset[i+1] - offset[i]) != i)
+			return false;
+	}
+	return true;
+}
+
+/** Reserve the slots for n keys.
+*/
+void Dictionary::reserve(size_t n) {
+	size_t n_slot = MIN_SLOT;
+	while (n_slot < 2 * n)
+		n_slot *= 2;
+	if (n_slot > m_Mask + 1)
+		rehash(n_slot);
+	m_Offset.reserve(n + 1);
+}
+
+void Dictionary::clear() {
+	m_Arena.clear();
+	m_Offset.assign(1, 0);
+	m_Slot.assign(MIN_SLOT, 0);
+	m_Mask = MIN_SLOT - 1;
+}
+
+} // namespace tricrf
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __DICTIONARY_H__
+#define __DICTIONARY_H__
+
+/// standard headers
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+namespace tricrf {
+
+/** String dictionary (string <-> id).
+	The keys are stored back to back in one character arena (the same layout as the
+	string table of the binary model), and the ids are found with an open-addressing
+	hash table (linear probing) whose slots hold the id and the upper bits of the hash,
+	so that a lookup usually touches one slot and one key.
+	The ids are given in the order of insertion and never change.
+	@class Dictionary
+*/
+class Dictionary {
+private:
+	std::vector<char> m_Arena;			///< characters of all keys
+	std::vector<uint64_t> m_Offset;		///< key i = m_Arena[m_Offset[i], m_Offset[i+1])
+	std::vector<uint64_t> m_Slot;		///< (hash tag << 32) | (id + 1) ; 0 = empty
+	size_t m_Mask;						///< number of slots - 1
+
+	static uint64_t hash(const char* key, size_t len);
+	size_t probe(const char* key, size_t len, uint64_t h) const;	///< slot of the key or the empty slot
+	void rehash(size_t n_slot);
+
+public:
+	static const size_t npos = (size_t)-1;	///< not found
+
+	Dictionary();
+
+	size_t find(const char* key, size_t len) const;
+	size_t find(const std::string& key) const { return find(key.data(), key.size()); };
+	size_t insert(const char* key, size_t len);	///< id of the key (a new id if not found)
+	size_t insert(const std::string& key) { return insert(key.data(), key.size()); };
+
+	/// Key access
+	size_t size() const { return m_Offset.size() - 1; };
+	std::string key(size_t id) const { return std::string(data(id), length(id)); };
+	const char* data(size_t id) const { return m_Arena.empty() ? "" : &m_Arena[m_Offset[id]]; };
+	size_t length(size_t id) const { return m_Offset[id+1] - m_Offset[id]; };
+
+	/// Arena (string table layout)
+	const std::vector<char>& arena() const { return m_Arena; };
+	const std::vector<uint64_t>& offset() const { return m_Offset; };
+	bool assign(const char* chars, const uint64_t* offset, size_t count);	///< build from a string table
+
+	void reserve(size_t n);
+	void clear();
+};
+
+} // namespace tricrf
+
+#endif
@@ -72,7 +72,7 @@ void Evaluator::initialize() {
 */
 void Evaluator::encode(Parameter& param, bool bio) {
 	map<string, size_t> m_StateMap = param.getState().first;
-	vector<string> m_StateVec = param.getState().second;
+	vector<string> m_StateVec = param.getStateVec();
 
 	if (!bio) {	/// does not use BIO encoding scheme
 		class_map = m_StateMap;
@@ -175,7 +175,7 @@ vector<pair<size_t, pair<size_t, size_t> > > Evaluator::chunk(vector<size_t> seq
 size_t Evaluator::append(Parameter& param, vector<string> ref, vector<string> hyp) {
 	vector<size_t> ref_d, hyp_d;
 	map<string, size_t> m_StateMap = param.getState().first;
-	vector<string> m_StateVec = param.getState().second;
+	vector<string> m_StateVec = param.getStateVec();
 
 	for (size_t i = 0; i < ref.size(); i++) {
 		if (m_StateMap.find(ref[i]) != m_StateMap.end()) 
@@ -305,6 +305,25 @@ void Evaluator::calculateF1() {
 		micro_f1 = 2.0 * (micro_prec * micro_rec) / (micro_prec + micro_rec);
 }
 
+/** Merge the counts of the other evaluator.
+	Both must be encoded with the same parameter (e.g., per-thread copies).
+	@param other	evaluator to be added
+*/
+void Evaluator::merge(const Evaluator& other) {
+	n_correct += other.n_correct;
+	n_event += other.n_event;
+	n_sequence += other.n_sequence;
+	loglikelihood += other.loglikelihood;
+	nTruePhrase_ += other.nTruePhrase_;
+	nGuessPhrase_ += other.nGuessPhrase_;
+	nCorrectPhrase_ += other.nCorrectPhrase_;
+	for (size_t i = 0; i < true_class.size() && i < other.true_class.size(); i++) {
+		true_class[i] += other.true_class[i];
+		guess_class[i] += other.guess_class[i];
+		correct_class[i] += other.correct_class[i];
+	}
+}
+
 /** Add likelihood.
 	@return loglikelihood
 */
@@ -341,6 +360,7 @@ double Evaluator::addLikelihood(double p, double w) {
 */
 double Evaluator::subLoglikelihood(double p) {
 	loglikelihood += p;
+	return loglikelihood;
 }
 
 /** Get loglikelihood.
@@ -73,6 +73,7 @@ public:
 	size_t append(Parameter& param, std::vector<std::string> ref, std::vector<std::string> hyp);
 	size_t append(std::vector<size_t> ref, std::vector<size_t> hyp);
 	void calculateF1();
+	void merge(const Evaluator& other);
 
 	/// log-likelihood
 	double subLoglikelihood(double p);
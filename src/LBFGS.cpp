@@ -21,9 +21,9 @@
 */
 
 #include "LBFGS.h"
+#include "Lattice.h"
 #include <cmath>
 #include <iostream>
-#include <numeric>
 
 #define min(a, b) ((a) <= (b) ? (a) : (b))
 #define max(a, b) ((a) >= (b) ? (a) : (b))
@@ -42,13 +42,79 @@ namespace {
      return tricrf::sigma(x) == tricrf::sigma(y) ?x : 0.0;
   }
 
-  inline void daxpy_(int n, double da, const double *dx, double *dy) {
-    for (int i = 0; i < n; ++i)
-      dy[i] += da * dx[i];
+  // vector operations of the recursion and of the line search
+  // (dot and axpy run the SIMD kernels of Lattice.h ; the history (x) may be in float)
+  template <class T>
+  inline double dot(const T *x, const double *y, size_t n) {
+    return tricrf::latticeDot(x, y, n);
   }
 
-  inline double ddot_(int size, const double *dx, const double *dy) {
-    return std::inner_product(dx, dx + size, dy, 0.0);
+  template <class T>
+  inline void axpy(double a, const T *x, double *y, size_t n) {   // y += a * x
+    tricrf::latticeAxpy(a, x, y, n);
+  }
+
+  template <class T>
+  inline void scale(double a, const double *x, T *y, size_t n) {   // y = a * x
+    for (size_t i = 0; i < n; ++i)
+      y[i] = static_cast<T>(a * x[i]);
+  }
+
+  inline void sub(const double *x, const double *z, double *y, size_t n) {   // y = x - z
+    for (size_t i = 0; i < n; ++i)
+      y[i] = x[i] - z[i];
+  }
+
+  inline void addScaled(const double *x, double a, const double *z, double *y, size_t n) {   // y = x + a * z
+    for (size_t i = 0; i < n; ++i)
+      y[i] = x[i] + a * z[i];
+  }
+
+  // pseudo-gradient of f(x) + |x| / C (OWL-QN) ; returns |pg|^2
+  inline double pseudoGradient(const double *x, const double *g, double C, double *pg, size_t n) {
+    const double c = 1.0 / C;
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      if (x[i] > 0.0) {
+        pg[i] = g[i] + c;
+      } else if (x[i] < 0.0) {
+        pg[i] = g[i] - c;
+      } else if (g[i] + c < 0.0) {
+        pg[i] = g[i] + c;   // right derivative
+      } else if (g[i] - c > 0.0) {
+        pg[i] = g[i] - c;   // left derivative
+      } else {
+        pg[i] = 0.0;        // zero weight stays at zero
+      }
+      sum += pg[i] * pg[i];
+    }
+    return sum;
+  }
+
+  // drops the components of d which do not descend along -pg ; returns d * pg
+  inline double constrain(const double *pg, double *d, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      d[i] = pi(d[i], -pg[i]);
+      sum += d[i] * pg[i];
+    }
+    return sum;
+  }
+
+  // x = pi(x0 + a * d ; xi), xi being the orthant of x0 (or of -pg at zero) ;
+  // returns pg * (x - x0)
+  inline double orthantStep(const double *x0, double a, const double *d, const double *pg, double *x, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      if (d[i] == 0.0) {   // active set: the weight does not move
+        x[i] = x0[i];
+        continue;
+      }
+      const double xi = (x0[i] == 0.0 ? -pg[i] : x0[i]);
+      x[i] = pi(x0[i] + a * d[i], xi);
+      sum += pg[i] * (x[i] - x0[i]);
+    }
+    return sum;
   }
 
   void mcstep(double *stx, double *fx, double *dx,
@@ -241,7 +307,7 @@ namespace tricrf {
                 double *x,
                 double f, const double *g, double *s,
                 double *stp,
-                int *info, int *nfev, double *wa, bool orthant, double C) {
+                int *info, int *nfev, double *wa) {
       static const double p5 = 0.5;
       static const double p66 = 0.66;
       static const double xtrapf = 4.0;
@@ -258,7 +324,7 @@ namespace tricrf {
 
       if (size <= 0 || *stp <= 0.0) return;
 
-      dginit = ddot_(size, &g[1], &s[1]);
+      dginit = dot(&g[1], &s[1], size);
       if (dginit >= 0.0) return;
 
       brackt = false;
@@ -268,9 +334,7 @@ namespace tricrf {
       dgtest = ftol * dginit;
       width = lb3_1_stpmax - lb3_1_stpmin;
       width1 = width / p5;
-      for (int j = 1; j <= size; ++j) {
-        wa[j] = x[j];
-      }
+      scale(1.0, &x[1], &wa[1], size);
 
       stx = 0.0;
       fx = finit;
@@ -297,40 +361,14 @@ namespace tricrf {
           *stp = stx;
         }
 
-        if (orthant) {
-          for (int j = 1; j <= size; ++j) {
-            double grad_neg = 0.0;
-            double grad_pos = 0.0;
-            double grad = 0.0;
-            if (wa[j] == 0.0) {
-              grad_neg = g[j] - 1.0 / C;
-              grad_pos = g[j] + 1.0 / C;
-            } else {
-              grad_pos = grad_neg = g[j] + 1.0 * sigma(wa[j]) / C;
-            }
-            if (grad_neg > 0.0) {
-              grad = grad_neg;
-            } else if (grad_pos < 0.0) {
-              grad = grad_pos;
-            } else {
-              grad = 0.0;
-            }
-            const double p = pi(s[j], -grad);
-            const double xi = wa[j] == 0.0 ? sigma(-grad) : sigma(wa[j]);
-            x[j] = pi(wa[j] + *stp * p, xi);
-          }
-        } else {
-          for (int j = 1; j <= size; ++j) {
-            x[j] = wa[j] + *stp * s[j];
-          }
-        }
+        addScaled(&wa[1], *stp, &s[1], &x[1], size);
         *info = -1;
         return;
 
       L45:
         *info = 0;
         ++(*nfev);
-        double dg = ddot_(size, &g[1], &s[1]);
+        double dg = dot(&g[1], &s[1], size);
         double ftest1 = finit + *stp * dgtest;
 
         if (brackt && ((*stp <= stmin || *stp >= stmax) || infoc == 0)) {
@@ -393,128 +431,112 @@ namespace tricrf {
   };
 
   void LBFGS::clear() {
-    iflag_ = iscn = nfev = iycn = point = npt =
-      iter = info = ispt = isyt = iypt = 0;
-    stp = stp1 = 0.0;
-    diag_.clear();
+    iflag_ = nfev = point = iter = info = stored = 0;
+    stp = stp1 = ys = yy = finit = dgtrial = 0.0;
     w_.clear();
+    d_.clear();
+    wa_.clear();
+    pg_.clear();
+    rho_.clear();
+    alpha_.clear();
+    s_.clear();
+    y_.clear();
+    sf_.clear();
+    yf_.clear();
     delete mcsrch_;
     mcsrch_ = 0;
   }
 
+  // COMPUTE -H*G USING THE FORMULA GIVEN IN: Nocedal, J. 1980,
+  // "Updating quasi-Newton matrices with limited storage",
+  // Mathematics of Computation, Vol.24, No.151, pp. 773-782.
+  // The direction is left in d_.
+  template <class T>
+  void LBFGS::direction(int size, const T *s, const T *y, const double *g, double gamma, int bound) {
+    double *q = &w_[0];
+    scale(-1.0, g, q, size);
+
+    int cp = point;
+    for (int i = 1; i <= bound; ++i) {
+      --cp;
+      if (cp == -1) cp = msize_ - 1;
+      double sq = dot(s + static_cast<size_t>(cp) * size, q, size);
+      alpha_[cp] = rho_[cp] * sq;
+      axpy(-alpha_[cp], y + static_cast<size_t>(cp) * size, q, size);
+    }
+
+    scale(gamma, q, q, size);
+
+    for (int i = 1; i <= bound; ++i) {
+      double yr = dot(y + static_cast<size_t>(cp) * size, q, size);
+      double beta = rho_[cp] * yr;
+      beta = alpha_[cp] - beta;
+      axpy(beta, s + static_cast<size_t>(cp) * size, q, size);
+      ++cp;
+      if (cp == msize_) cp = 0;
+    }
+
+    // STORE THE NEW SEARCH DIRECTION
+    scale(1.0, q, &d_[0], size);
+  }
+
+  // COMPUTE THE NEW STEP AND GRADIENT CHANGE ; w_ has the previous gradient
+  template <class T>
+  void LBFGS::storePair(int size, T *s, T *y, const double *g) {
+    double *yv = &w_[0];
+    T *sp = s + static_cast<size_t>(point) * size;
+    T *yp = y + static_cast<size_t>(point) * size;
+    sub(g, yv, yv, size);
+    scale(stp, &d_[0], sp, size);
+    scale(1.0, yv, yp, size);
+    ys = dot(sp, yv, size);
+    yy = dot(yv, yv, size);
+  }
+
   void LBFGS::lbfgs_optimize(int size,
-                             int msize,
                              double *x,
                              double f,
                              const double *g,
-                             double *diag,
-                             double *w,
-                             bool orthant,
-                             double C,
                              int *iflag) {
-    double yy = 0.0;
-    double ys = 0.0;
-    int bound = 0;
-    int cp = 0;
-
-    --diag;
-    --g;
-    --x;
-    --w;
-
     if (!mcsrch_) mcsrch_ = new Mcsrch;
 
-    if (*iflag == 1) goto L172;
-    if (*iflag == 2) goto L100;
-
-    // initialization
+    // initialization ; the first direction is the steepest descent
     if (*iflag == 0) {
       point = 0;
-      for (int i = 1; i <= size; ++i) {
-        diag[i] = 1.0;
-      }
-      ispt = size + (msize << 1);
-      iypt = ispt + size * msize;
-      for (int i = 1; i <= size; ++i) {
-        w[ispt + i] = -g[i] * diag[i];
-      }
-      stp1 = 1.0 / std::sqrt(ddot_(size, &g[1], &g[1]));
+      scale(-1.0, g, &d_[0], size);
+      stp1 = 1.0 / std::sqrt(dot(g, g, size));
     }
 
     // MAIN ITERATION LOOP
+    bool searching = (*iflag == 1);   // back from the evaluation of a step
     while (true) {
-      ++iter;
-      info = 0;
-      if (iter == 1) goto L165;
-      if (iter > size) bound = size;
-
-      // COMPUTE -H*G USING THE FORMULA GIVEN IN: Nocedal, J. 1980,
-      // "Updating quasi-Newton matrices with limited storage",
-      // Mathematics of Computation, Vol.24, No.151, pp. 773-782.
-      ys = ddot_(size, &w[iypt + npt + 1], &w[ispt + npt + 1]);
-      yy = ddot_(size, &w[iypt + npt + 1], &w[iypt + npt + 1]);
-      for (int i = 1; i <= size; ++i) {
-        diag[i] = ys / yy;
-      }
-
-    L100:
-      cp = point;
-      if (point == 0) cp = msize;
-      w[size + cp] = 1.0 / ys;
-
-      for (int i = 1; i <= size; ++i) {
-        w[i] = -g[i];
-      }
-
-      bound = min(iter - 1, msize);
-
-      cp = point;
-      for (int i = 1; i <= bound; ++i) {
-        --cp;
-        if (cp == -1) cp = msize - 1;
-        double sq = ddot_(size, &w[ispt + cp * size + 1], &w[1]);
-        int inmc = size + msize + cp + 1;
-        iycn = iypt + cp * size;
-        w[inmc] = w[size + cp + 1] * sq;
-        double d = -w[inmc];
-        daxpy_(size, d, &w[iycn + 1], &w[1]);
-      }
-
-      for (int i = 1; i <= size; ++i) {
-        w[i] = diag[i] * w[i];
-      }
-
-      for (int i = 1; i <= bound; ++i) {
-        double yr = ddot_(size, &w[iypt + cp * size + 1], &w[1]);
-        double beta = w[size + cp + 1] * yr;
-        int inmc = size + msize + cp + 1;
-        beta = w[inmc] - beta;
-        iscn = ispt + cp * size;
-        daxpy_(size, beta, &w[iscn + 1], &w[1]);
-        ++cp;
-        if (cp == msize) cp = 0;
-      }
-
-      // STORE THE NEW SEARCH DIRECTION
-      for (int i = 1; i <= size; ++i) {
-        w[ispt + point * size + i] = w[i];
-      }
+      if (!searching) {
+        ++iter;
+        info = 0;
+        if (iter > 1) {
+          int cp = point;
+          if (point == 0) cp = msize_;
+          rho_[cp - 1] = 1.0 / ys;
+          int bound = min(iter - 1, msize_);
+          if (float_)
+            direction(size, &sf_[0], &yf_[0], g, ys / yy, bound);
+          else
+            direction(size, &s_[0], &y_[0], g, ys / yy, bound);
+        }
 
-    L165:
-      // OBTAIN THE ONE-DIMENSIONAL MINIMIZER OF THE FUNCTION
-      // BY USING THE LINE SEARCH ROUTINE MCSRCH
-      nfev = 0;
-      stp = 1.0;
-      if (iter == 1) {
-        stp = stp1;
-      }
-      for (int i = 1; i <= size; ++i) {
-        w[i] = g[i];
+        // OBTAIN THE ONE-DIMENSIONAL MINIMIZER OF THE FUNCTION
+        // BY USING THE LINE SEARCH ROUTINE MCSRCH
+        nfev = 0;
+        stp = 1.0;
+        if (iter == 1) {
+          stp = stp1;
+        }
+        scale(1.0, g, &w_[0], size);
       }
+      searching = false;
 
-    L172:
-      mcsrch_->mcsrch(size, &x[1], f, &g[1], &w[ispt + point * size + 1],
-                      &stp, &info, &nfev, &diag[1], orthant, C);
+      mcsrch_->mcsrch(size, x, f, g, &d_[0],
+                      &stp, &info, &nfev, &wa_[0]);
       if (info == -1) {
         *iflag = 1;  // next value
         return;
@@ -526,17 +548,15 @@ namespace tricrf {
         return;
       }
 
-      // COMPUTE THE NEW STEP AND GRADIENT CHANGE
-      npt = point * size;
-      for (int i = 1; i <= size; ++i) {
-        w[ispt + npt + i] = stp * w[ispt + npt + i];
-        w[iypt + npt + i] = g[i] - w[i];
-      }
+      if (float_)
+        storePair(size, &sf_[0], &yf_[0], g);
+      else
+        storePair(size, &s_[0], &y_[0], g);
       ++point;
-      if (point == msize) point = 0;
+      if (point == msize_) point = 0;
 
-      double gnorm = std::sqrt(ddot_(size, &g[1], &g[1]));
-      double xnorm = max(1.0, std::sqrt(ddot_(size, &x[1], &x[1])));
+      double gnorm = std::sqrt(dot(g, g, size));
+      double xnorm = max(1.0, std::sqrt(dot(x, x, size)));
       if (gnorm / xnorm <= eps) {
         *iflag = 0;  // OK terminated
         return;
@@ -545,4 +565,90 @@ namespace tricrf {
 
     return;
   }
+
+  // OWL-QN: Andrew, G. and Gao, J. 2007, "Scalable training of L1-regularized
+  // log-linear models", ICML. f has the L1 term |x| / C and g is the gradient
+  // of the loss only. The search direction is the two-loop recursion on the
+  // pseudo-gradient, constrained to its orthant, and the step is a backtracking
+  // line search projected onto the orthant of the current point.
+  void LBFGS::owlqn_optimize(int size,
+                             double *x,
+                             double f,
+                             const double *g,
+                             double C,
+                             int *iflag) {
+    static const double backoff = 0.5;
+    static const int maxfev = 20;
+
+    if (*iflag == 1) {
+      // back from the evaluation of a step
+      ++nfev;
+      if (f > finit + ftol * dgtrial) {
+        if (nfev >= maxfev) {
+          // no decrease along the direction: stay at the start of the search
+          scale(1.0, &wa_[0], x, size);
+          *iflag = 0;
+          return;
+        }
+        stp *= backoff;
+        dgtrial = orthantStep(&wa_[0], stp, &d_[0], &pg_[0], x, size);
+        return;
+      }
+
+      // s = x - x0 (the projection changes the step) ; y = g - g0
+      const double ys0 = ys, yy0 = yy;
+      sub(x, &wa_[0], &d_[0], size);
+      stp = 1.0;
+      if (float_)
+        storePair(size, &sf_[0], &yf_[0], g);
+      else
+        storePair(size, &s_[0], &y_[0], g);
+      if (ys > 0.0) {
+        rho_[point] = 1.0 / ys;
+        ++point;
+        if (point == msize_) point = 0;
+        ++stored;
+      } else {
+        // the pair is not stored ; its slot held the oldest pair
+        ys = ys0;
+        yy = yy0;
+        stored = min(stored, msize_ - 1);
+      }
+    } else {
+      point = 0;
+      stored = 0;
+    }
+
+    double gnorm = std::sqrt(pseudoGradient(x, g, C, &pg_[0], size));
+    double xnorm = max(1.0, std::sqrt(dot(x, x, size)));
+    if (gnorm / xnorm <= eps) {
+      *iflag = 0;  // OK terminated
+      return;
+    }
+
+    ++iter;
+    double dg = 0.0;
+    if (stored > 0) {
+      if (float_)
+        direction(size, &sf_[0], &yf_[0], &pg_[0], ys / yy, min(stored, msize_));
+      else
+        direction(size, &s_[0], &y_[0], &pg_[0], ys / yy, min(stored, msize_));
+      dg = constrain(&pg_[0], &d_[0], size);
+    }
+    if (dg >= 0.0) {
+      // steepest descent on the first iteration or when the direction does not descend
+      scale(-1.0, &pg_[0], &d_[0], size);
+      stp = 1.0 / gnorm;
+    } else {
+      stp = 1.0;
+    }
+
+    // the first step of the search
+    nfev = 0;
+    finit = f;
+    scale(1.0, x, &wa_[0], size);
+    scale(1.0, g, &w_[0], size);
+    dgtrial = orthantStep(&wa_[0], stp, &d_[0], &pg_[0], x, size);
+    *iflag = 1;  // next value
+  }
 }
@@ -19,45 +19,80 @@ namespace tricrf {
     return 0.0;
   }
 
+  /** L-BFGS with the line search of Nocedal (lbfgs.f).
+      The history size m is configurable (5 by default) ; the pairs (s, y) can be kept
+      in float, which halves the 2 * m * n memory of the history.
+      The dot products and axpys of the two-loop recursion and of the line search run
+      the SIMD kernels of Lattice.h.
+      With orthant = true, it runs OWL-QN for the L1 term |x| / C (Andrew and Gao, 2007):
+      f includes the L1 term and g is the gradient of the loss only.
+      @class LBFGS
+  */
   class LBFGS {
   private:
     class Mcsrch;
-    int iflag_, iscn, nfev, iycn, point, npt, iter, info, ispt, isyt, iypt, maxfev;
-    double stp, stp1;
-    std::vector <double> diag_;
-    std::vector <double> w_;
+    int iflag_, nfev, point, iter, info, stored;
+    double stp, stp1, ys, yy, finit, dgtrial;
+    int msize_;                   ///< history size m
+    bool float_;                  ///< the history is in float
+    std::vector<double> w_;       ///< q (two-loop recursion) and the previous gradient (line search)
+    std::vector<double> d_;       ///< search direction
+    std::vector<double> wa_;      ///< weights at the beginning of the line search
+    std::vector<double> pg_;      ///< pseudo-gradient (OWL-QN)
+    std::vector<double> rho_;     ///< 1 / (y * s) of each pair
+    std::vector<double> alpha_;
+    std::vector<double> s_, y_;   ///< history (m x n)
+    std::vector<float> sf_, yf_;  ///< history in float (m x n)
     Mcsrch *mcsrch_;
 
     void lbfgs_optimize(int size,
-                        int msize,
                         double *x,
                         double f,
                         const double *g,
-                        double *diag,
-                        double *w, bool orthant, double C, int *iflag);
+                        int *iflag);
+    void owlqn_optimize(int size,
+                        double *x,
+                        double f,
+                        const double *g,
+                        double C, int *iflag);
+    template <class T> void direction(int size, const T* s, const T* y, const double* g, double gamma, int bound);
+    template <class T> void storePair(int size, T* s, T* y, const double* g);
 
   public:
-    explicit LBFGS(): iflag_(0), iscn(0), nfev(0), iycn(0),
-                      point(0), npt(0), iter(0), info(0),
-                      ispt(0), isyt(0), iypt(0), maxfev(0),
-                      stp(0.0), stp1(0.0), mcsrch_(0) {}
+    explicit LBFGS(int msize = 5, bool float_history = false)
+                    : iflag_(0), nfev(0), point(0), iter(0), info(0), stored(0),
+                      stp(0.0), stp1(0.0), ys(0.0), yy(0.0), finit(0.0), dgtrial(0.0),
+                      msize_(msize > 0 ? msize : 5), float_(float_history),
+                      mcsrch_(0) {}
     virtual ~LBFGS() { clear(); }
 
     void clear();
 
     int optimize(size_t size, double *x, double f, double *g, bool orthant, double C) {
-      static const int msize = 5;
       if (w_.empty()) {
         iflag_ = 0;
-        w_.resize(size * (2 * msize + 1) + 2 * msize);
-        diag_.resize(size);
-      } else if (diag_.size() != size) {
+        w_.resize(size);
+        d_.resize(size);
+        wa_.resize(size);
+        if (orthant && C > 0.0) pg_.resize(size);
+        rho_.resize(msize_);
+        alpha_.resize(msize_);
+        if (float_) {
+          sf_.resize(size * msize_);
+          yf_.resize(size * msize_);
+        } else {
+          s_.resize(size * msize_);
+          y_.resize(size * msize_);
+        }
+      } else if (w_.size() != size) {
         std::cerr << "size of array is different" << std::endl;
         return -1;
       }
 
-      lbfgs_optimize(static_cast<int>(size),
-                      msize, x, f, g, &diag_[0], &w_[0], orthant, C, &iflag_);
+      if (orthant && C > 0.0)
+        owlqn_optimize(static_cast<int>(size), x, f, g, C, &iflag_);
+      else
+        lbfgs_optimize(static_cast<int>(size), x, f, g, &iflag_);
 
       if (iflag_ < 0) {
         std::cerr << "routine stops with unexpected error" << std::endl;
@@ -0,0 +1,501 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Lattice.h"
+/// standard headers
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+/// the SIMD kernels are compiled with the target attribute and selected at runtime,
+/// so the rest of the code does not need -mavx2
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+#define LATTICE_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace tricrf {
+
+LatticePrecision parsePrecision(const string& name) {
+	if (name == "long_double")
+		return LATTICE_LONG_DOUBLE;
+	else if (name == "double")
+		return LATTICE_DOUBLE;
+	else if (name == "float")
+		return LATTICE_FLOAT;
+	throw runtime_error("unknown lattice precision (long_double, double or float)");
+}
+
+const char* precisionName(LatticePrecision precision) {
+	switch (precision) {
+		case LATTICE_DOUBLE: return "double";
+		case LATTICE_FLOAT: return "float";
+		default: return "long_double";
+	}
+}
+
+/// Generic kernels (auto-vectorized for the axpy) ; x may be in float for a double y
+template <class T, class X>
+static void axpyGeneric(T a, const X* x, T* y, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		y[i] += a * x[i];
+}
+
+template <class T, class X>
+static T dotGeneric(const X* x, const T* y, size_t n) {
+	T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		s0 += x[i] * y[i];
+		s1 += x[i+1] * y[i+1];
+		s2 += x[i+2] * y[i+2];
+		s3 += x[i+3] * y[i+3];
+	}
+	for (; i < n; i++)
+		s0 += x[i] * y[i];
+	return (s0 + s1) + (s2 + s3);
+}
+
+/// the cells without any active feature are simply set to 1 (as expScore() of Utility.h)
+static void expGeneric(const double* x, double* y, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		y[i] = (x[i] == 0.0) ? 1.0 : exp(x[i]);
+}
+
+#ifdef LATTICE_SIMD
+
+/** Vector exp.
+	x = k ln2 + r with |r| <= ln2 / 2 (ln2 in two parts, so that k ln2 is exact), and exp(r) is
+	the Taylor polynomial of degree 13 (truncation below 2e-16) ; the error is within 2 ulp of exp().
+	x is clamped to [EXP_MIN, EXP_MAX], whose exp is 0 and inf in double, and a NaN is kept.
+*/
+static const double EXP_MIN = -746.0;
+static const double EXP_MAX = 710.0;
+static const double LOG2E = 1.4426950408889634074;
+static const double LN2_HI = 6.93147180369123816490e-01;
+static const double LN2_LO = 1.90821492927058770002e-10;
+static const double EXP_POLY[] = {	///< 1/13!, ..., 1/2!, 1, 1 (Horner)
+	1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0,
+	1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0
+};
+static const size_t EXP_TERMS = sizeof(EXP_POLY) / sizeof(EXP_POLY[0]);
+
+/// horizontal sums of the AVX-512 accumulators through memory ;
+/// _mm512_reduce_add_* extracts the halves into undefined registers (-Wuninitialized)
+__attribute__((target("avx512f")))
+static double sumAVX512(__m512d s) {
+	double lane[8];
+	_mm512_storeu_pd(lane, s);
+	return ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+}
+
+__attribute__((target("avx512f")))
+static float sumAVX512(__m512 s) {
+	float lane[16];
+	_mm512_storeu_ps(lane, s);
+	float sum = 0;
+	for (size_t k = 0; k < 16; k += 4)
+		sum += (lane[k] + lane[k+1]) + (lane[k+2] + lane[k+3]);
+	return sum;
+}
+
+/// AVX2 + FMA
+__attribute__((target("avx2,fma")))
+static void axpyAVX2(double a, const double* x, double* y, size_t n) {
+	__m256d va = _mm256_set1_pd(a);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+	for (; i < n; i++)
+		y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static void axpyAVX2(float a, const float* x, float* y, size_t n) {
+	__m256 va = _mm256_set1_ps(a);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+	for (; i < n; i++)
+		y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static double dotAVX2(const double* x, const double* y, size_t n) {
+	__m256d s = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		s = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), s);
+	__m128d h = _mm_add_pd(_mm256_castpd256_pd128(s), _mm256_extractf128_pd(s, 1));
+	double sum = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+	for (; i < n; i++)
+		sum += x[i] * y[i];
+	return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float dotAVX2(const float* x, const float* y, size_t n) {
+	__m256 s = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		s = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), s);
+	__m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+	h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+	float sum = _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+	for (; i < n; i++)
+		sum += x[i] * y[i];
+	return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static void axpyAVX2(double a, const float* x, double* y, size_t n) {
+	__m256d va = _mm256_set1_pd(a);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_cvtps_pd(_mm_loadu_ps(x + i)), _mm256_loadu_pd(y + i)));
+	for (; i < n; i++)
+		y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static double dotAVX2(const float* x, const double* y, size_t n) {
+	__m256d s = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		s = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + i)), _mm256_loadu_pd(y + i), s);
+	__m128d h = _mm_add_pd(_mm256_castpd256_pd128(s), _mm256_extractf128_pd(s, 1));
+	double sum = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+	for (; i < n; i++)
+		sum += x[i] * y[i];
+	return sum;
+}
+
+/// 2^k for the k in [-1022, 1023] of the 32-bit lanes
+__attribute__((target("avx2,fma")))
+static __m256d pow2AVX2(__m128i k) {
+	__m256i e = _mm256_add_epi64(_mm256_cvtepi32_epi64(k), _mm256_set1_epi64x(1023));
+	return _mm256_castsi256_pd(_mm256_slli_epi64(e, 52));
+}
+
+/// 2^k is applied in two factors, which are normal numbers for the k of [EXP_MIN, EXP_MAX]
+__attribute__((target("avx2,fma")))
+static __m256d expAVX2(__m256d x) {
+	x = _mm256_min_pd(_mm256_set1_pd(EXP_MAX), _mm256_max_pd(_mm256_set1_pd(EXP_MIN), x));
+	__m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(LN2_HI), x);
+	r = _mm256_fnmadd_pd(k, _mm256_set1_pd(LN2_LO), r);
+	__m256d p = _mm256_set1_pd(EXP_POLY[0]);
+	for (size_t c = 1; c < EXP_TERMS; c++)
+		p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_POLY[c]));
+	__m128i k1 = _mm256_cvtpd_epi32(k);
+	__m128i k0 = _mm_srai_epi32(k1, 1);
+	k1 = _mm_sub_epi32(k1, k0);
+	return _mm256_mul_pd(_mm256_mul_pd(p, pow2AVX2(k0)), pow2AVX2(k1));
+}
+
+__attribute__((target("avx2,fma")))
+static void expAVX2(const double* x, double* y, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(y + i, expAVX2(_mm256_loadu_pd(x + i)));
+	if (i < n) {
+		double tail[4] = { 0 };
+		copy(x + i, x + n, tail);
+		_mm256_storeu_pd(tail, expAVX2(_mm256_loadu_pd(tail)));
+		copy(tail, tail + (n - i), y + i);
+	}
+}
+
+/// AVX-512
+__attribute__((target("avx512f")))
+static void axpyAVX512(double a, const double* x, double* y, size_t n) {
+	__m512d va = _mm512_set1_pd(a);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm512_storeu_pd(y + i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+	if (i < n) {
+		__mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+		_mm512_mask_storeu_pd(y + i, m, _mm512_fmadd_pd(va, _mm512_maskz_loadu_pd(m, x + i), _mm512_maskz_loadu_pd(m, y + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void axpyAVX512(float a, const float* x, float* y, size_t n) {
+	__m512 va = _mm512_set1_ps(a);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+	if (i < n) {
+		__mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+		_mm512_mask_storeu_ps(y + i, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+static double dotAVX512(const double* x, const double* y, size_t n) {
+	__m512d s = _mm512_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		s = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), s);
+	if (i < n) {
+		__mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+		s = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, x + i), _mm512_maskz_loadu_pd(m, y + i), s);
+	}
+	return sumAVX512(s);
+}
+
+__attribute__((target("avx512f")))
+static float dotAVX512(const float* x, const float* y, size_t n) {
+	__m512 s = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		s = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), s);
+	if (i < n) {
+		__mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+		s = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i), s);
+	}
+	return sumAVX512(s);
+}
+
+/// 8 floats to doubles through the zero-masked conversion ;
+/// _mm512_cvtps_pd converts into an undefined register (-Wmaybe-uninitialized), as the reduce above
+__attribute__((target("avx512f")))
+static __m512d widenAVX512(const float* x) {
+	return _mm512_maskz_cvtps_pd((__mmask8)0xFF, _mm256_loadu_ps(x));
+}
+
+__attribute__((target("avx512f")))
+static void axpyAVX512(double a, const float* x, double* y, size_t n) {
+	__m512d va = _mm512_set1_pd(a);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm512_storeu_pd(y + i, _mm512_fmadd_pd(va, widenAVX512(x + i), _mm512_loadu_pd(y + i)));
+	if (i < n) {
+		float tail[8] = { 0 };
+		copy(x + i, x + n, tail);
+		__mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+		_mm512_mask_storeu_pd(y + i, m, _mm512_fmadd_pd(va, widenAVX512(tail), _mm512_maskz_loadu_pd(m, y + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+static double dotAVX512(const float* x, const double* y, size_t n) {
+	__m512d s = _mm512_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		s = _mm512_fmadd_pd(widenAVX512(x + i), _mm512_loadu_pd(y + i), s);
+	if (i < n) {
+		float tail[8] = { 0 };
+		copy(x + i, x + n, tail);
+		__mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+		s = _mm512_fmadd_pd(widenAVX512(tail), _mm512_maskz_loadu_pd(m, y + i), s);
+	}
+	return sumAVX512(s);
+}
+
+/// scalef applies 2^k with the overflow and the gradual underflow of exp() ;
+/// the zero-masked forms, since the unmasked ones merge into an undefined register (-Wmaybe-uninitialized)
+__attribute__((target("avx512f")))
+static __m512d expAVX512(__m512d x) {
+	const __mmask8 all = (__mmask8)0xFF;
+	x = _mm512_maskz_min_pd(all, _mm512_set1_pd(EXP_MAX), _mm512_maskz_max_pd(all, _mm512_set1_pd(EXP_MIN), x));
+	__m512d k = _mm512_maskz_roundscale_pd(all, _mm512_mul_pd(x, _mm512_set1_pd(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m512d r = _mm512_fnmadd_pd(k, _mm512_set1_pd(LN2_HI), x);
+	r = _mm512_fnmadd_pd(k, _mm512_set1_pd(LN2_LO), r);
+	__m512d p = _mm512_set1_pd(EXP_POLY[0]);
+	for (size_t c = 1; c < EXP_TERMS; c++)
+		p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(EXP_POLY[c]));
+	return _mm512_maskz_scalef_pd(all, p, k);
+}
+
+__attribute__((target("avx512f")))
+static void expAVX512(const double* x, double* y, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm512_storeu_pd(y + i, expAVX512(_mm512_loadu_pd(x + i)));
+	if (i < n) {
+		__mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+		_mm512_mask_storeu_pd(y + i, m, expAVX512(_mm512_maskz_loadu_pd(m, x + i)));
+	}
+}
+
+enum { SIMD_GENERIC = 0, SIMD_AVX2, SIMD_AVX512 };
+
+static int detectSIMD() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return SIMD_AVX2;
+	return SIMD_GENERIC;
+}
+
+static const int g_SIMD = detectSIMD();	///< selected once at start-up
+
+const char* latticeKernel() {
+	switch (g_SIMD) {
+		case SIMD_AVX512: return "AVX-512";
+		case SIMD_AVX2: return "AVX2";
+		default: return "generic";
+	}
+}
+
+void latticeAxpy(double a, const double* x, double* y, size_t n) {
+	if (g_SIMD == SIMD_AVX512) axpyAVX512(a, x, y, n);
+	else if (g_SIMD == SIMD_AVX2) axpyAVX2(a, x, y, n);
+	else axpyGeneric(a, x, y, n);
+}
+
+void latticeAxpy(float a, const float* x, float* y, size_t n) {
+	if (g_SIMD == SIMD_AVX512) axpyAVX512(a, x, y, n);
+	else if (g_SIMD == SIMD_AVX2) axpyAVX2(a, x, y, n);
+	else axpyGeneric(a, x, y, n);
+}
+
+double latticeDot(const double* x, const double* y, size_t n) {
+	if (g_SIMD == SIMD_AVX512) return dotAVX512(x, y, n);
+	else if (g_SIMD == SIMD_AVX2) return dotAVX2(x, y, n);
+	return dotGeneric(x, y, n);
+}
+
+float latticeDot(const float* x, const float* y, size_t n) {
+	if (g_SIMD == SIMD_AVX512) return dotAVX512(x, y, n);
+	else if (g_SIMD == SIMD_AVX2) return dotAVX2(x, y, n);
+	return dotGeneric(x, y, n);
+}
+
+void latticeAxpy(double a, const float* x, double* y, size_t n) {
+	if (g_SIMD == SIMD_AVX512) axpyAVX512(a, x, y, n);
+	else if (g_SIMD == SIMD_AVX2) axpyAVX2(a, x, y, n);
+	else axpyGeneric(a, x, y, n);
+}
+
+double latticeDot(const float* x, const double* y, size_t n) {
+	if (g_SIMD == SIMD_AVX512) return dotAVX512(x, y, n);
+	else if (g_SIMD == SIMD_AVX2) return dotAVX2(x, y, n);
+	return dotGeneric(x, y, n);
+}
+
+void latticeExp(const double* x, double* y, size_t n) {
+	if (g_SIMD == SIMD_AVX512) expAVX512(x, y, n);
+	else if (g_SIMD == SIMD_AVX2) expAVX2(x, y, n);
+	else expGeneric(x, y, n);
+}
+
+#else
+
+const char* latticeKernel() {
+	return "generic";
+}
+
+void latticeAxpy(double a, const double* x, double* y, size_t n) {
+	axpyGeneric(a, x, y, n);
+}
+
+void latticeAxpy(float a, const float* x, float* y, size_t n) {
+	axpyGeneric(a, x, y, n);
+}
+
+double latticeDot(const double* x, const double* y, size_t n) {
+	return dotGeneric(x, y, n);
+}
+
+float latticeDot(const float* x, const float* y, size_t n) {
+	return dotGeneric(x, y, n);
+}
+
+void latticeAxpy(double a, const float* x, double* y, size_t n) {
+	axpyGeneric(a, x, y, n);
+}
+
+double latticeDot(const float* x, const double* y, size_t n) {
+	return dotGeneric(x, y, n);
+}
+
+void latticeExp(const double* x, double* y, size_t n) {
+	expGeneric(x, y, n);
+}
+
+#endif	///< LATTICE_SIMD
+
+template <class T>
+void scaledForward(const T* R, const T* M, size_t len, size_t n, T* alpha, T* scale, T* work) {
+	if (len == 0)
+		return;
+
+	T sum = 0;
+	for (size_t j = 0; j < n; j++) {
+		alpha[j] = R[j];
+		sum += alpha[j];
+	}
+	for (size_t j = 0; j < n; j++)
+		alpha[j] /= sum;
+	scale[0] = sum;
+
+	for (size_t i = 1; i < len; i++) {
+		const T* prev = alpha + (i-1) * n;
+		T* cur = alpha + i * n;
+		const T* r = R + i * n;
+
+		/// work[j] = sum_k alpha[i-1][k] * M[k][j] ; one axpy per row of M
+		for (size_t j = 0; j < n; j++)
+			work[j] = 0;
+		for (size_t k = 0; k < n; k++) {
+			if (prev[k] != 0)
+				latticeAxpy(prev[k], M + k * n, work, n);
+		}
+
+		sum = 0;
+		for (size_t j = 0; j < n; j++) {
+			cur[j] = work[j] * r[j];
+			sum += cur[j];
+		}
+		for (size_t j = 0; j < n; j++)
+			cur[j] /= sum;
+		scale[i] = sum;
+	}
+}
+
+template <class T>
+void scaledBackward(const T* R, const T* M, size_t len, size_t n, T* beta, T* scale2, T* work) {
+	if (len == 0)
+		return;
+
+	T* last = beta + (len-1) * n;
+	for (size_t k = 0; k < n; k++)
+		last[k] = (T)1.0 / n;
+	scale2[len-1] = n;
+
+	for (size_t i = len-1; i >= 1; i--) {
+		const T* next = beta + i * n;
+		T* cur = beta + (i-1) * n;
+		const T* r = R + i * n;
+
+		/// work[k] = R[i][k] * beta[i][k] ; beta[i-1][j] = M[j] . work
+		for (size_t k = 0; k < n; k++)
+			work[k] = r[k] * next[k];
+
+		T sum = 0;
+		for (size_t j = 0; j < n; j++) {
+			cur[j] = latticeDot(M + j * n, work, n);
+			sum += cur[j];
+		}
+		for (size_t j = 0; j < n; j++)
+			cur[j] /= sum;
+		scale2[i-1] = sum;
+	}
+}
+
+template void scaledForward<double>(const double*, const double*, size_t, size_t, double*, double*, double*);
+template void scaledForward<float>(const float*, const float*, size_t, size_t, float*, float*, float*);
+template void scaledBackward<double>(const double*, const double*, size_t, size_t, double*, double*, double*);
+template void scaledBackward<float>(const float*, const float*, size_t, size_t, float*, float*, float*);
+
+} // namespace tricrf
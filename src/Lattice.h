@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __LATTICE_H__
+#define __LATTICE_H__
+
+/// standard headers
+#include <vector>
+#include <string>
+#include <cstddef>
+
+namespace tricrf {
+
+/** Precision of the forward-backward lattice.
+	LATTICE_LONG_DOUBLE is the reference (x87) path; the others copy the factors
+	into double or float buffers and run the dense SIMD kernels below.
+*/
+enum LatticePrecision {
+	LATTICE_LONG_DOUBLE = 0,
+	LATTICE_DOUBLE,
+	LATTICE_FLOAT
+};
+
+LatticePrecision parsePrecision(const std::string& name);	///< "long_double", "double" or "float"
+const char* precisionName(LatticePrecision precision);
+const char* latticeKernel();	///< SIMD kernel selected at runtime ("AVX-512", "AVX2" or "generic")
+
+/** Reduced precision lattice of a single sequence.
+	@class LatticeBuffer
+*/
+template <class T>
+struct LatticeBuffer {
+	std::vector<T> R;		///< node factors
+	std::vector<T> Alpha;
+	std::vector<T> Beta;
+	std::vector<T> scale;	///< scaling factor (forward)
+	std::vector<T> scale2;	///< scaling factor (backward)
+	std::vector<T> work;	///< temporary row
+};
+
+/// y += a * x
+void latticeAxpy(double a, const double* x, double* y, size_t n);
+void latticeAxpy(float a, const float* x, float* y, size_t n);
+void latticeAxpy(double a, const float* x, double* y, size_t n);	///< x in float (history of LBFGS)
+/// x . y
+double latticeDot(const double* x, const double* y, size_t n);
+float latticeDot(const float* x, const float* y, size_t n);
+double latticeDot(const float* x, const double* y, size_t n);	///< x in float, the sum in double
+/// y = exp(x) ; the linear scores of a lattice into its node factors (within 2 ulp of exp())
+void latticeExp(const double* x, double* y, size_t n);
+
+/** Scaled forward recursion over a dense transition matrix.
+	alpha[0][j] = R[0][j], alpha[i][j] = R[i][j] * sum_k alpha[i-1][k] * M[k][j],
+	and every row is normalized to sum 1 (the sum is stored in scale[i]).
+	@param R	node factors (len x n)
+	@param M	transition factors (n x n, row-major)
+	@param len	number of positions
+	@param n	number of states
+*/
+template <class T>
+void scaledForward(const T* R, const T* M, size_t len, size_t n, T* alpha, T* scale, T* work);
+
+/** Scaled backward recursion over a dense transition matrix.
+	beta[len-1][k] = 1, beta[i-1][j] = sum_k M[j][k] * R[i][k] * beta[i][k],
+	and every row is normalized to sum 1 (the sum is stored in scale2[i]).
+*/
+template <class T>
+void scaledBackward(const T* R, const T* M, size_t len, size_t n, T* beta, T* scale2, T* work);
+
+} // namespace tricrf
+
+#endif
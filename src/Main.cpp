@@ -11,6 +11,7 @@
 #include "TriCRF1.h"
 #include "TriCRF2.h"
 #include "TriCRF3.h"
+#include "Corpus.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -31,12 +32,12 @@ int main(int argc, void** argv) {
 	////////////////////////////////////////////////////////////////
 	///	 Parameters
 	////////////////////////////////////////////////////////////////
-	vector<string> model_file, train_file, dev_file, test_file, output_file;
+	vector<string> model_file, train_file, dev_file, test_file, output_file, convert_file, compile_file;
 	string initialize_method, estimation_method;
 	size_t max_iter, init_iter;
 	double l1_prior, l2_prior;
-	enum {MaxEnt = 0, CRF, TriCRF1, TriCRF2, TriCRF3} model_type;
-	bool train_mode = false, testing_mode = false;
+	enum {MaxEnt = 0, CRF, TriCRF1, TriCRF2, TriCRF3} model_type = MaxEnt;
+	bool train_mode = false, testing_mode = false, convert_mode = false, compile_mode = false;
 	bool confidence = false;
 
 	////////////////////////////////////////////////////////////////
@@ -114,6 +115,10 @@ int main(int argc, void** argv) {
 		train_mode = (config.get("mode") == "train" || config.get("mode") == "both" ? true : false);
 	if (config.isValid("mode")) 
 		testing_mode = (config.get("mode") == "test" || config.get("mode") == "both" ? true : false);
+	if (config.isValid("mode")) 
+		convert_mode = (config.get("mode") == "convert" ? true : false);
+	if (config.isValid("mode")) 
+		compile_mode = (config.get("mode") == "compile" ? true : false);
 
 	////////////////////////////////////////////////////////////////
 	///	 Data Files
@@ -131,6 +136,10 @@ int main(int argc, void** argv) {
 	if (config.isValid("model_file")) {
 		model_file = config.gets("model_file");
 	}
+	if (config.isValid("model_format"))
+		model->setBinaryModel(config.get("model_format") == "binary" ? true : false);
+	else if (convert_mode)
+		model->setBinaryModel(true);	///< text to binary by default
 
 	////////////////////////////////////////////////////////////////
 	///	 Pruning
@@ -141,6 +150,59 @@ int main(int argc, void** argv) {
 	}
 	else
 		model->setPrune(1000);
+	if (config.isValid("topic_beam")) {
+		double beam = atof(config.get("topic_beam").c_str());
+		model->setTopicBeam(beam);
+	}
+	if (config.isValid("state_beam") || config.isValid("state_beam_ratio")) {
+		size_t beam = (config.isValid("state_beam") ? atoi(config.get("state_beam").c_str()) : 0);
+		double ratio = (config.isValid("state_beam_ratio") ? atof(config.get("state_beam_ratio").c_str()) : 0.0);
+		model->setStateBeam(beam, ratio);
+	}
+	if (config.isValid("sparse_fb")) {
+		string sparse_str = config.get("sparse_fb");
+		tricrf::SparseMode sparse = tricrf::SPARSE_NONE;
+		double threshold = 0.0;
+		if (sparse_str == "tied") {
+			sparse = tricrf::SPARSE_TIED;
+			threshold = 1.0;	///< the transitions never seen are tied
+		} else if (sparse_str == "active") {
+			sparse = tricrf::SPARSE_ACTIVE;
+			threshold = 1E-02;
+		} else if (sparse_str != "none") {
+			cerr << "Unknown sparse_fb: " << sparse_str << "\n";
+			exit(1);
+		}
+		if (config.isValid("sparse_threshold"))
+			threshold = atof(config.get("sparse_threshold").c_str());
+		model->setSparse(sparse, threshold);
+	}
+	if (config.isValid("checkpoint_length")) {
+		size_t length = atoi(config.get("checkpoint_length").c_str());
+		if (length > 0 && model_type != CRF) {	///< the topic planes of TriCRF keep the whole lattices
+			cerr << "checkpoint_length is supported only by CRF\n";
+			exit(1);
+		}
+		model->setCheckpoint(length);
+	}
+
+	////////////////////////////////////////////////////////////////
+	///	 Threads
+	////////////////////////////////////////////////////////////////
+	if (config.isValid("threads")) {
+		size_t n_threads = atoi(config.get("threads").c_str());
+		model->setThreads(n_threads);
+	}
+
+	////////////////////////////////////////////////////////////////
+	///	 Lattice precision
+	////////////////////////////////////////////////////////////////
+	if (config.isValid("precision")) {
+		tricrf::LatticePrecision precision = tricrf::parsePrecision(config.get("precision"));
+		model->setPrecision(precision);
+		if (log != NULL)
+			log->report(" Lattice precision = %s (%s kernel)\n\n", tricrf::precisionName(precision), tricrf::latticeKernel());
+	}
 
 	////////////////////////////////////////////////////////////////
 	///	 Training mode
@@ -185,9 +247,24 @@ int main(int argc, void** argv) {
 			if (config.isValid("estimation")) {
 				type_str = config.get("estimation");
 			}
+			if (type_str == "SGD-L1" || type_str == "SGD-L2") {
+				double rate = (config.isValid("sgd_rate") ? atof(config.get("sgd_rate").c_str()) : 0.0);
+				double decay = (config.isValid("sgd_decay") ? atof(config.get("sgd_decay").c_str()) : 0.85);
+				model->setEstimator(tricrf::ESTIMATE_SGD, rate, decay);
+				model->setHogwild(config.isValid("hogwild_refresh") ? atoi(config.get("hogwild_refresh").c_str()) : 16);
+			} else if (type_str == "Perceptron" || type_str == "MIRA") {
+				model->setEstimator(type_str == "MIRA" ? tricrf::ESTIMATE_MIRA : tricrf::ESTIMATE_PERCEPTRON);
+				model->setMIRA(config.isValid("mira_c") ? atof(config.get("mira_c").c_str()) : 1.0);
+			} else if (type_str != "LBFGS-L1" && type_str != "LBFGS-L2") {
+				cerr << "Unknown estimation: " << type_str << "\n";
+				exit(1);
+			}
+			size_t lbfgs_history = (config.isValid("lbfgs_history") ? atoi(config.get("lbfgs_history").c_str()) : 5);
+			bool lbfgs_float = (config.isValid("lbfgs_float_history") && config.get("lbfgs_float_history") == "true");
+			model->setLBFGS(lbfgs_history, lbfgs_float);
 
-			if (type_str == "LBFGS-L1") {
-				/// LBFGS-L1
+			if (type_str == "LBFGS-L1" || type_str == "SGD-L1") {
+				/// L1
 				if (config.isValid("l1_prior"))
 					l1_prior = atof(config.get("l1_prior").c_str());
 				else
@@ -204,7 +281,7 @@ int main(int argc, void** argv) {
 					return -1;
 				}		
 			} else { 
-				/// LBFGS-L2
+				/// L2
 				if (config.isValid("l2_prior"))
 					l2_prior = atof(config.get("l2_prior").c_str());
 				else
@@ -259,4 +336,50 @@ int main(int argc, void** argv) {
 		}
 	}
 
+	////////////////////////////////////////////////////////////////
+	///	 Converting mode ; model_file -> convert_file (model_format)
+	////////////////////////////////////////////////////////////////	
+	if (convert_mode) { 
+		if (config.isValid("convert_file"))
+			convert_file = config.gets("convert_file");
+		if (model_file.size() == 0 || convert_file.size() != model_file.size()) {
+			cerr << "Invalid setting. Please see the configuration\n";
+			return -1;
+		}
+
+		for (size_t iter = 0; iter < model_file.size(); iter++) {
+			log->report("\n\nConverting Model File = %s -> %s\n\n", model_file[iter].data(), convert_file[iter].data());
+			model->clear();
+			if (!model->loadModel(model_file[iter])) {
+				cerr << "Model loading error\n";
+				return -1;
+			}
+			if (!model->saveModel(convert_file[iter])) {
+				cerr << "Model saving error\n";
+				return -1;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	///	 Compiling mode ; train_file -> compile_file (binary corpus)
+	////////////////////////////////////////////////////////////////	
+	if (compile_mode) { 
+		if (config.isValid("compile_file"))
+			compile_file = config.gets("compile_file");
+		if (train_file.size() == 0 || compile_file.size() != train_file.size()) {
+			cerr << "Invalid setting. Please see the configuration\n";
+			return -1;
+		}
+
+		for (size_t iter = 0; iter < train_file.size(); iter++) {
+			log->report("\n\nCompiling Data File = %s -> %s\n", train_file[iter].data(), compile_file[iter].data());
+			tricrf::timer stop_watch;
+			size_t n_unique;
+			size_t n_seq = tricrf::compileCorpus(train_file[iter], compile_file[iter], n_unique);
+			log->report("  # of data = \t\t%d (%d unique)\n", n_seq, n_unique);
+			log->report("  compiling time = \t%.3f\n\n", stop_watch.elapsed());
+		}
+	}
+
 }
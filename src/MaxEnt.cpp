@@ -7,9 +7,12 @@
 
 /// max headers
 #include "MaxEnt.h"
+#include "BinaryModel.h"
 #include "Evaluator.h"
 #include "Utility.h"
+#include "Corpus.h"
 #include "LBFGS.h"
+#include "SGD.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -30,14 +33,36 @@ namespace tricrf {
 /// Constructor
 MaxEnt::MaxEnt() {
 	logger = new Logger();
+	setDefaults();
 }
 
 MaxEnt::MaxEnt(Logger *logger_ptr) {
+	setDefaults();
 	setLogger(logger_ptr);
 	logger->report(2, MAX_HEADER);
 	logger->report(2, ">> Maximum Entropy << \n\n");
 }
 
+/// Default options of the constructors
+void MaxEnt::setDefaults() {
+	m_Pool = NULL;
+	m_BinaryModel = false;
+	m_Precision = LATTICE_LONG_DOUBLE;
+	m_topic_beam = 0;
+	m_state_beam = 0;
+	m_state_beam_ratio = 0;
+	m_SparseMode = SPARSE_NONE;
+	m_sparse_threshold = 0;
+	m_checkpoint_length = 0;
+	m_Estimator = ESTIMATE_LBFGS;
+	m_sgd_rate = 0.0;
+	m_sgd_decay = 0.85;
+	m_mira_c = 1.0;
+	m_hogwild_refresh = 16;
+	m_lbfgs_history = 5;
+	m_lbfgs_float = false;
+}
+
 void MaxEnt::setLogger(Logger *logger_ptr) { 
 	logger = logger_ptr;
 }
@@ -46,8 +71,134 @@ void MaxEnt::setPrune(double prune) {
 	m_prune_threshold = prune;
 }
 
+/** Set the topic beam of the triangular-chain models.
+	Only the topic planes within the beam are computed by the forward-backward and Viterbi.
+	@param beam	ratio to the best topic plane (0: every plane)
+*/
+void MaxEnt::setTopicBeam(double beam) {
+	m_topic_beam = beam;
+}
+
+/** Set the state beam of the forward-backward (CRF).
+	Only the states within the beam at each position are kept in the lattice, 
+	so the forward-backward and Viterbi take O(T*K*S) instead of O(T*S^2).
+	@param beam	maximum number of states at each position (0: no limit)
+	@param ratio	ratio to the best state (0: no limit)
+*/
+void MaxEnt::setStateBeam(size_t beam, double ratio) {
+	m_state_beam = beam;
+	m_state_beam_ratio = ratio;
+}
+
+/** Set the sparse forward-backward of the training (CRF).
+	SPARSE_TIED ties the transitions seen less than K times in the training data to one potential per label,
+	so that the recursions visit only the frequent transitions and remain exact (Jeong et al., 2009).
+	SPARSE_ACTIVE fixes the transitions whose potential is within eta of 1 to 1 at every iteration.
+	@param mode	SPARSE_NONE, SPARSE_TIED or SPARSE_ACTIVE
+	@param threshold	K (SPARSE_TIED) or eta (SPARSE_ACTIVE)
+*/
+void MaxEnt::setSparse(SparseMode mode, double threshold) {
+	m_SparseMode = mode;
+	m_sparse_threshold = threshold;
+}
+
+/** Set the length from which the checkpointed forward-backward and Viterbi are used (CRF).
+	Only the alpha before every sqrt(T) positions is stored and the rest is recomputed
+	during the backward pass, so that the memory is O(sqrt(T)*S) instead of O(T*S).
+	The topic planes of the triangular-chain models are not checkpointed, so Main rejects the option for them.
+	@param length	minimum length of a sequence (0: off)
+*/
+void MaxEnt::setCheckpoint(size_t length) {
+	m_checkpoint_length = length;
+}
+
+/** Set the estimation method of train().
+	ESTIMATE_SGD, ESTIMATE_PERCEPTRON and ESTIMATE_MIRA visit the training sequences in a random order 
+	and update the weights after each of them ; max_iter of train() is the number of epochs.
+	@param estimator	estimation method
+	@param rate	initial learning rate (SGD ; 0: calibrated on a subsample)
+	@param decay	the learning rate is multiplied by decay every epoch (SGD ; 0: eta_0 / (1 + lambda * eta_0 * k), see SGD)
+*/
+void MaxEnt::setEstimator(Estimator estimator, double rate, double decay) {
+	m_Estimator = estimator;
+	m_sgd_rate = rate;
+	m_sgd_decay = decay;
+}
+
+/** Set the upper bound of the MIRA step.
+	A small C is robust to the noisy labels ; a large C gets closer to the hard margin.
+	@param C	aggressiveness
+*/
+void MaxEnt::setMIRA(double C) {
+	m_mira_c = C;
+}
+
+/** Set the rounds of the Hogwild SGD (threads > 1).
+	Each thread takes refresh samples without waiting for the others ; the transitions are then
+	stepped and their factors computed again. A large refresh waits less but reads older transitions.
+	The result is not that of the serial SGD: the trained weights depend on refresh, on the number
+	of threads and on the interleaving of the threads, so two runs can differ.
+	@param refresh	samples of a thread between two updates of the transitions
+*/
+void MaxEnt::setHogwild(size_t refresh) {
+	m_hogwild_refresh = refresh;
+}
+
+/** Set the memory of LBFGS.
+	A longer history gives a better curvature estimate at the cost of 2 * history * n weights ;
+	the float history halves this memory.
+	@param history	number of the (s, y) pairs
+	@param float_history	keep the pairs in float
+*/
+void MaxEnt::setLBFGS(size_t history, bool float_history) {
+	m_lbfgs_history = (history > 0 ? history : 5);
+	m_lbfgs_float = float_history;
+}
+
+/** Set the model format used by saveModel().
+	loadModel() detects the format by itself.
+	@param binary	true for the binary (memory-mapped) format
+*/
+void MaxEnt::setBinaryModel(bool binary) {
+	m_BinaryModel = binary;
+}
+
+/** Set the precision of the forward-backward lattice.
+	@param precision	LATTICE_LONG_DOUBLE (reference), LATTICE_DOUBLE or LATTICE_FLOAT
+*/
+void MaxEnt::setPrecision(LatticePrecision precision) {
+	m_Precision = precision;
+}
+
+/** Set the number of threads.
+	The pool is created once and shared by the estimators.
+	@param n_threads	number of threads (1 = single thread)
+*/
+void MaxEnt::setThreads(size_t n_threads) {
+	if (m_Pool != NULL)
+		delete m_Pool;
+	m_Pool = NULL;
+	if (n_threads > 1)
+		m_Pool = new ThreadPool(n_threads);
+}
+
+size_t MaxEnt::sizeThreads() {
+	return (m_Pool == NULL ? 1 : m_Pool->size());
+}
+
+/** Run the job on the thread pool (or in the calling thread).
+*/
+void MaxEnt::runParallel(ThreadJob& job) {
+	if (m_Pool == NULL)
+		job.run(0, 1);
+	else
+		m_Pool->run(job);
+}
+
 /// Deconstructor
 MaxEnt::~MaxEnt() {
+	if (m_Pool != NULL)
+		delete m_Pool;
 }
 
 void MaxEnt::clear() {
@@ -66,20 +217,28 @@ bool	MaxEnt::saveModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model saving]\n");
 
-	/// file stream
-    ofstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("unable to open file to write");
-
-    /// header
-    f << "# MAX: A C++ Library for Structured Prediction" << endl;
-	f << "# MaxEnt Model file (text format)" << endl;
-	f << "# Do not edit this file" << endl;
-	f << "# " << endl << ":" << endl;
-	
-	bool ret = m_Param.save(f);
-	f.close();
+	bool ret;
+	if (m_BinaryModel) {
+		/// binary format
+		BinaryModelWriter f(filename, "MaxEnt");
+		ret = m_Param.save(f);
+		f.close();
+	} else {
+		/// file stream
+		ofstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("unable to open file to write");
+
+		/// header
+		f << "# MAX: A C++ Library for Structured Prediction" << endl;
+		f << "# MaxEnt Model file (text format)" << endl;
+		f << "# Do not edit this file" << endl;
+		f << "# " << endl << ":" << endl;
+
+		ret = m_Param.save(f);
+		f.close();
+	}
 	logger->report("  saving time = \t%.3f\n\n", stop_watch.elapsed());
 
 	return ret;
@@ -97,30 +256,41 @@ bool MaxEnt::loadModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model loading]\n");
 
-	/// file stream
-    ifstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("fail to open model file");
-
-    /// header
-	size_t count = 0;
-    string line;
-    getline(f, line);
-    while (line.empty() || line[0] == '#') {
-		if (count == 1) {
-			vector<string> tok = tokenize(line);
-			if (tok.size() < 2 || tok[1] != "MaxEnt") {
-				logger->report("|Error| Invalid model files ... \n");
-				return false;
+	bool ret;
+	if (BinaryModelReader::isBinary(filename)) {
+		/// binary format (memory-mapped)
+		BinaryModelReader f(filename);
+		if (f.type() != "MaxEnt") {
+			logger->report("|Error| Invalid model files ... \n");
+			return false;
+		}
+		ret = m_Param.load(f);
+	} else {
+		/// file stream
+		ifstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("fail to open model file");
+
+		/// header
+		size_t count = 0;
+		string line;
+		getline(f, line);
+		while (line.empty() || line[0] == '#') {
+			if (count == 1) {
+				vector<string> tok = tokenize(line);
+				if (tok.size() < 2 || tok[1] != "MaxEnt") {
+					logger->report("|Error| Invalid model files ... \n");
+					return false;
+				}
 			}
+			getline(f, line);
+			count++;
 		}
-        getline(f, line);
-		count++;
-	}
 
-	bool ret = m_Param.load(f);
-	f.close();
+		ret = m_Param.load(f);
+		f.close();
+	}
 	m_Param.print(logger);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 
@@ -131,29 +301,24 @@ bool MaxEnt::loadModel(const std::string& filename) {
 	@param tokens	string tokens to be packed
 	@param p_Param	parameter pointer
 */
-Event MaxEnt::packEvent(vector<string>& tokens, Parameter* p_Param, bool test) {
+Event MaxEnt::packEvent(const vector<StringRef>& tokens, Parameter* p_Param, bool test) {
 	Event ev;		///< Event
-	vector<string>::iterator it = tokens.begin();
+	vector<StringRef>::const_iterator it = tokens.begin();
 
 	if (!p_Param)	///< for generalization
 		p_Param = &m_Param;
 
 	/// label confidence
 	/// todo: this can be used for cascading system.
-	string fstr(it->c_str());
-	vector<string> tok = tokenize(fstr, ":");
 	double fval = 1.0;
-	if (tok.size() > 1) {
-		fval = atof(tok[1].c_str());	///< feature value
-		fstr = tok[0];
-	}
+	StringRef fstr = parseFeature(*it, fval);
 	
 	if (!test) { ///< train data
 		ev.label = p_Param->addNewState(fstr);	// outcome id
 	} else { ///< dev, test data
 		int oid;
 		if ( (oid = p_Param->findState(fstr)) >= 0 )
-			ev.label = p_Param->findState(fstr);
+			ev.label = (size_t)oid;
 		else
 			ev.label = p_Param->sizeStateVec();
 	}
@@ -166,14 +331,9 @@ Event MaxEnt::packEvent(vector<string>& tokens, Parameter* p_Param, bool test) {
 	// observation
 	++it;
 	for (; it != tokens.end();) {
-		string fi(it->c_str()); ++it;
-		vector<string> tok = tokenize(fi, ":");
-		string fstr = fi;
 		double fval = ev.fval;
-		if (tok.size() > 1) {
-			fval = atof(tok[1].c_str());	///< feature value
-			fstr = tok[0];
-		}
+		StringRef fstr = parseFeature(*it, fval);	///< feature and its value
+		++it;
 		if (!test) {	 ///< train data
 			size_t pid = p_Param->addNewObs(fstr);
 			ev.obs.push_back(make_pair(pid, 1.0));
@@ -189,29 +349,24 @@ Event MaxEnt::packEvent(vector<string>& tokens, Parameter* p_Param, bool test) {
 	return ev;
 }
 
-Event MaxEnt::packEvent2(vector<string>& tokens, Parameter* p_Param, bool test) {
+Event MaxEnt::packEvent2(const vector<StringRef>& tokens, Parameter* p_Param, bool test) {
 	Event ev;		///< Event
-	vector<string>::iterator it = tokens.begin();
+	vector<StringRef>::const_iterator it = tokens.begin();
 
 	if (!p_Param)	///< for generalization
 		p_Param = &m_Param;
 
 	/// label confidence
 	/// todo: this can be used for cascading system.
-	string fstr(it->c_str());
-	vector<string> tok = tokenize(fstr, ":");
 	double fval = 1.0;
-	if (tok.size() > 1) {
-		fval = atof(tok[1].c_str());	///< feature value
-		fstr = tok[0];
-	}
+	StringRef fstr = parseFeature(*it, fval);
 	
 	if (!test) { ///< train data
 		ev.label = p_Param->addNewState(fstr);	// outcome id
 	} else { ///< dev, test data
 		int oid;
 		if ( (oid = p_Param->findState(fstr)) >= 0 )
-			ev.label = p_Param->findState(fstr);
+			ev.label = (size_t)oid;
 		else
 			ev.label = p_Param->sizeStateVec();
 	}
@@ -224,14 +379,9 @@ Event MaxEnt::packEvent2(vector<string>& tokens, Parameter* p_Param, bool test)
 	// observation
 	++it;
 	for (; it != tokens.end();) {
-		string fi(it->c_str()); ++it;
-		vector<string> tok = tokenize(fi, ":");
-		string fstr = fi;
 		double fval = ev.fval;
-		if (tok.size() > 1) {
-			fval = atof(tok[1].c_str());	///< feature value
-			fstr = tok[0];
-		}
+		StringRef fstr = parseFeature(*it, fval);	///< feature and its value
+		++it;
 		
 		if (!test) {	 ///< train data
 			size_t pid = p_Param->addNewObs(fstr);
@@ -260,22 +410,17 @@ Event MaxEnt::packEvent2(vector<string>& tokens, Parameter* p_Param, bool test)
 	@param tokens	string tokens to be packed
 	@param p_Param	parameter pointer
 */
-StringEvent MaxEnt::packStringEvent(vector<string>& tokens, Parameter* p_Param, bool test) {
+StringEvent MaxEnt::packStringEvent(const vector<StringRef>& tokens, Parameter* p_Param, bool test) {
 	StringEvent ev;		///< Event
-	vector<string>::iterator it = tokens.begin();
+	vector<StringRef>::const_iterator it = tokens.begin();
 
 	if (!p_Param)	///< for generalization
 		p_Param = &m_Param;
 
 	/// label confidence
 	/// todo: this can be used for cascading system.
-	string fstr(it->c_str());
-	vector<string> tok = tokenize(fstr, ":");
 	double fval = 1.0;
-	if (tok.size() > 1) {
-		fval = atof(tok[1].c_str());	///< feature value
-		fstr = tok[0];
-	}
+	StringRef fstr = parseFeature(*it, fval);
 
 	if (!test) { ///< train data
 		ev.label = p_Param->addNewState(fstr);	// outcome id
@@ -295,17 +440,12 @@ StringEvent MaxEnt::packStringEvent(vector<string>& tokens, Parameter* p_Param,
 	// observation
 	++it;
 	for (; it != tokens.end();) {
-		string fi(it->c_str()); ++it;
-		vector<string> tok = tokenize(fi, ":");
-		string fstr = fi;
 		double fval = ev.fval;
-		if (tok.size() > 1) {
-			fval = atof(tok[1].c_str());	///< feature value
-			fstr = tok[0];
-		}
+		StringRef fstr = parseFeature(*it, fval);	///< feature and its value
+		++it;
 		if (!test) { ///< train data
 			size_t pid = p_Param->addNewObs(fstr);
-			ev.obs.push_back(make_pair(fstr, 1.0));
+			ev.obs.push_back(make_pair(fstr.str(), 1.0));
 			
 			/*
 			for (size_t i = 0; i < p_Param->sizeStateVec(); i++) 
@@ -321,7 +461,7 @@ StringEvent MaxEnt::packStringEvent(vector<string>& tokens, Parameter* p_Param,
 		} else { ///< dev, test data
 			int pid;
 			if ( (pid = p_Param->findObs(fstr)) >= 0 ) {
-				ev.obs.push_back(make_pair(fstr, 1.0));
+				ev.obs.push_back(make_pair(fstr.str(), 1.0));
 			}
 		}
 	}
@@ -335,37 +475,32 @@ void MaxEnt::readTrainData(const string& filename) {
 	// initializing
 	m_TrainSet.clear();
 	m_TrainSetCount.clear();
-	map<vector<vector<string> >, size_t> train_data_map;	///<	To reduce the storage and computation
-	vector<vector<string> > token_list;
 
-	/// file stream
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
-	string line;
+	/// corpus (text or compiled)
+	CorpusReader corpus(filename, m_Pool);
+	DuplicateFilter duplicate(corpus);	///<	To reduce the storage and computation
+	vector<StringRef> tokens;
 	size_t count = 0;
 	Sequence seq;
 
 	/// reading the text
 	logger->report("[Training data file loading]\n");
 	timer stop_watch;
-	while (getline(f,line)) {
-		if (line.empty()) {
-			if (train_data_map.find(token_list) == train_data_map.end()) {
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {
+			size_t index = duplicate.find(m_TrainSetCount.size());
+			if (index == m_TrainSetCount.size()) {
 				m_TrainSet.append(seq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
 				m_TrainSetCount.push_back(1.0);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				m_TrainSetCount[index] += 1.0;
 			}
 			seq.clear();
-			token_list.clear();
 			++count;
 		} else {
-			vector<string> tokens = tokenize(line);
 			seq.push_back(packEvent(tokens));
 
-			token_list.push_back(tokens);
+			duplicate.add(tokens);
 		}	///< else
 
 	}	///< while
@@ -380,11 +515,9 @@ void MaxEnt::readTrainData(const string& filename) {
 */
 void MaxEnt::readDevData(const string& filename) {
 
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
+	/// Corpus (text or compiled)
+	vector<StringRef> tokens;
+	CorpusReader corpus(filename, m_Pool);
 	
 	/// initializing
 	size_t count = 0;
@@ -394,28 +527,24 @@ void MaxEnt::readDevData(const string& filename) {
 	m_DevSet.clear();
 	m_DevSetCount.clear();
 
-	///<	To reduce the storage and computation
-	map<vector<vector<string> >, size_t> dev_data_map;	
-	vector<vector<string> > token_list;
+	DuplicateFilter duplicate(corpus);	///<	To reduce the storage and computation
 
 	/// reading the text
-	while (getline(f,line)) {
-		if (line.empty()) {
-			if (dev_data_map.find(token_list) == dev_data_map.end()) {
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {
+			size_t index = duplicate.find(m_DevSetCount.size());
+			if (index == m_DevSetCount.size()) {
 				m_DevSet.append(seq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
 				m_DevSetCount.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				m_DevSetCount[index] += 1.0;
 			}
 			seq.clear();
-			token_list.clear();
 			++count;
 		} else {
-			vector<string> tokens = tokenize(line);
 			seq.push_back(packEvent(tokens, &m_Param, true));
 
-			token_list.push_back(tokens);
+			duplicate.add(tokens);
 		}	///< else
 
 	}	///< while
@@ -433,10 +562,11 @@ vector<double> MaxEnt::evaluate(Event ev, size_t& max_outcome) {
 	fill(q.begin(), q.end(), 0.0);
 
 	/// w * f (for all classes)
-	vector<ObsParam> obs_param = m_Param.makeObsIndex(ev.obs);
-	vector<ObsParam>::iterator iter = obs_param.begin();
-	for(; iter != obs_param.end(); ++iter) {
-		q[iter->y] += theta[iter->fid] * iter->fval;
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	vector<pair<size_t, double> >::const_iterator iter = ev.obs.begin();
+	for (; iter != ev.obs.end(); ++iter) {
+		for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j)
+			q[index.label[j]] += theta[index.fid[j]] * iter->second;
 	}
 	
 	/// normalize
@@ -466,9 +596,10 @@ vector<double> MaxEnt::evaluate(Event ev, size_t& max_outcome) {
 		1) R. Malouf, 2002, A comparison of algorithms for maximum entropy parameter estimation, CoNLL, pp. 49-55.
 		2) F. Sha and F. Pereira, 2003, Shallow parsing with conditional random fields, HLT.
 		3) J. Nocedal and S. J. Wright, 1999, Numerical optimization, Springer, New York.
+		4) G. Andrew and J. Gao, 2007, Scalable training of L1-regularized log-linear models, ICML. (OWL-QN, L1)
 */
 bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta) {
-	LBFGS lbfgs;	///< LBFGS optimizer
+	LBFGS lbfgs(m_lbfgs_history, m_lbfgs_float);	///< LBFGS optimizer
 	double* theta = m_Param.getWeight();
 	double* gradient = m_Param.getGradient();
 
@@ -477,7 +608,9 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 
 	/// Reporting
 	logger->report("[Parameter estimation]\n");
-	logger->report("  Method = \t\tLBFGS\n");
+	logger->report("  Method = \t\t%s\n", (sigma && L1 ? "OWL-QN" : "LBFGS"));
+	if (m_lbfgs_history != 5 || m_lbfgs_float)
+		logger->report("  History = \t\t%d%s\n", (int)m_lbfgs_history, (m_lbfgs_float ? " (float)" : ""));
 	logger->report("  Regularization = \t%s\n", (sigma ? (L1 ? "L1":"L2") : "none"));
 	logger->report("  Penalty value = \t%.2f\n", sigma);
 	m_Param.print(logger);
@@ -513,10 +646,11 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 
 				/// calculate the expectation
 				/// E[p] - E[~p]
-				vector<ObsParam> obs_param = m_Param.makeObsIndex(it->obs);
-				vector<ObsParam>::iterator iter = obs_param.begin();
-				for(; iter != obs_param.end(); ++iter) {
-					gradient[iter->fid] += q[iter->y] * iter->fval * count;
+				const ParamIndex& index = m_Param.m_ParamIndex;
+				vector<pair<size_t, double> >::const_iterator iter = it->obs.begin();
+				for (; iter != it->obs.end(); ++iter) {
+					for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j)
+						gradient[index.fid[j]] += q[index.label[j]] * iter->second * count;
 				}
 		
 				/// loglikelihood
@@ -614,6 +748,479 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 	return true;
 }
 
+/** Hogwild job of the online estimation.
+	The order of an epoch is split into a shard per thread ; in each round, every thread takes
+	the next samples of its shard (m_hogwild_refresh) one after the other and steps on their weights
+	without a lock nor waiting for the other threads.
+	The dense weights are stepped by the caller at the end of the round (SGD::endRound()).
+	@class HogwildJob
+*/
+class HogwildJob : public ThreadJob {
+private:
+	MaxEnt* m_Model;
+	SGD& m_SGD;
+	const vector<size_t>& m_Order;
+	vector<vector<Evaluator> >& m_Eval;
+	size_t m_Length;	///< samples of a thread in a round
+	size_t m_Round;
+	size_t m_Epoch;
+public:
+	HogwildJob(MaxEnt* model, SGD& sgd, const vector<size_t>& order, vector<vector<Evaluator> >& eval, size_t length)
+		: m_Model(model), m_SGD(sgd), m_Order(order), m_Eval(eval), m_Length(length), m_Round(0), m_Epoch(0) {}
+	void setRound(size_t round, size_t epoch) { m_Round = round; m_Epoch = epoch; }
+	void run(size_t tid, size_t n_threads) {
+		size_t begin, end;
+		splitRange(m_Order.size(), tid, n_threads, begin, end);
+		begin += m_Round * m_Length;
+		end = min(end, begin + m_Length);
+		for (size_t k = begin; k < end; k++) {
+			size_t s = m_Order[k];
+			m_Model->touchSample(m_SGD, tid, s);
+			m_SGD.prepare(tid);
+			m_Model->gradientSample(m_SGD, tid, s, m_Eval[tid], m_Epoch);
+			m_SGD.update(tid);
+		}
+	}
+};
+
+/** Training with stochastic gradient descent.
+	The weights are updated after each training sequence ; the model gives the weights of a sequence
+	(touchSample()) and its gradient (gradientSample()). The dense weights (onlineDense()) are
+	in every sequence, so they are updated at every step.
+	With several threads, the sequences are taken by the threads at the same time (HogwildJob).
+	@param max_iter	maximum number of epochs
+	@param sigma		prior
+	@param L1				using L1 regularization (cumulative penalty)
+	@param eta			condition for finishing the epochs (relative change of the objective)
+	@see SGD
+*/
+bool MaxEnt::estimateWithSGD(size_t max_iter, double sigma, bool L1, double eta) {
+	/// every sequence is a sample ; the duplicates are visited count times
+	vector<size_t> order;
+	for (size_t i = 0; i < m_TrainSetCount.size(); i++)
+		order.insert(order.end(), (size_t)m_TrainSetCount[i], i);
+	SGD sgd(sigma, L1, m_sgd_rate, m_sgd_decay, order.size());
+
+	vector<Parameter*> block;
+	onlineBlocks(block);
+	for (size_t b = 0; b < block.size(); b++) {
+		block[b]->initializeGradient2();
+		sgd.addBlock(block[b]->getWeight(), block[b]->getGradient(), block[b]->size());
+	}
+	vector<vector<size_t> > dense(block.size());
+	onlineDense(dense);
+
+	vector<Evaluator> eval;	///< Evaluators
+	onlineEvaluators(eval);
+	timer t;		///< timer
+
+	/// Hogwild
+	size_t n_threads = sizeThreads();
+	sgd.setWorkers(n_threads);
+	for (size_t b = 0; n_threads > 1 && b < dense.size(); b++) {
+		for (size_t j = 0; j < dense[b].size(); j++)
+			sgd.addDense(b, dense[b][j]);
+	}
+	onlineBegin(n_threads);
+
+	/// eta_0 on a subsample
+	size_t n_sample = 0;
+	if (m_sgd_rate <= 0.0) {
+		n_sample = min(order.size(), max((size_t)100, order.size() / 10));
+		sgd.shuffle(order);
+		vector<size_t> sample(order.begin(), order.begin() + n_sample);
+		calibrateRate(sgd, sample, dense, eval);
+	}
+
+	/// Reporting
+	logger->report("[Parameter estimation]\n");
+	logger->report("  Method = \t\tSGD%s\n", (n_threads > 1 ? " (Hogwild)" : ""));
+	if (n_sample > 0)
+		logger->report("  Learning rate = \t%g (calibrated on %d samples)\n", sgd.initialRate(), n_sample);
+	else
+		logger->report("  Learning rate = \t%g\n", sgd.initialRate());
+	if (m_sgd_decay > 0.0)
+		logger->report("  Schedule = \t\teta_0 * %g^epoch\n", m_sgd_decay);
+	else
+		logger->report("  Schedule = \t\teta_0 / (1 + lambda * eta_0 * k)\n");
+	logger->report("  Regularization = \t%s\n", (sigma ? (L1 ? "L1":"L2") : "none"));
+	logger->report("  Penalty value = \t%.2f\n\n", sigma);
+	reportParam();
+	if (n_threads > 1)
+		logger->report("  Threads = \t\t%d\n", n_threads);
+	logger->report("[Iterations]\n");
+	logger->report("%4s %15s %8s %8s %8s %8s\n", "iter", "loglikelihood", "acc", "micro-f1", "macro-f1", "sec");
+
+	double old_obj = 1e+37;
+
+	/// Training epoch
+	for (size_t niter = 0; niter < max_iter; ++niter) {
+		timer t2;	///< elapsed time for one epoch
+		onlineEpoch();
+		sgd.save();
+		sgd.shuffle(order);
+		stepEpoch(sgd, order, dense, eval, niter);
+		sgd.finish();
+		double penalty = sgd.penalty();
+		for (size_t e = 0; e < eval.size(); e++)
+			eval[e].subLoglikelihood(penalty);
+
+		/// Divergence: the epoch is taken again with the smaller learning rate
+		double obj = eval.back().getObjFunc();
+		if (!finite(obj) || (niter > 0 && (obj - old_obj) / old_obj > eta)) {
+			sgd.restore();
+			calculateEdge();
+			logger->report("%4d %15E  rolled back (learning rate = %g)\n", niter, eval[0].getLoglikelihood(), sgd.initialRate());
+			continue;
+		}
+		calculateEdge();
+
+		char value[32];
+		sprintf(value, "%15E", eval[0].getLoglikelihood());
+		reportEpoch(niter, value, eval, t2);
+
+		double diff = (niter == 0 ? 1.0 : abs(old_obj - eval.back().getObjFunc()) / old_obj);
+		old_obj = eval.back().getObjFunc();
+		if (diff < eta)
+			break;
+	} ///< for epoch
+
+	logger->report("  training time = \t%.3f\n\n", t.elapsed());
+	return true;
+}
+
+/** An SGD step for each sample of order.
+	With several threads, a round takes m_hogwild_refresh samples of each shard of order (HogwildJob) ;
+	the dense weights and the factors shared by the samples (calculateEdge()) are updated between the rounds.
+	The evaluators are initialized.
+	@param epoch	the epoch (the models prune the topics from the second one)
+*/
+void MaxEnt::stepEpoch(SGD& sgd, const vector<size_t>& order, const vector<vector<size_t> >& dense, vector<Evaluator>& eval, size_t epoch) {
+	for (size_t e = 0; e < eval.size(); e++)
+		eval[e].initialize();	///< evaluator intialization
+
+	size_t n_threads = sizeThreads();
+	if (n_threads > 1) {
+		vector<vector<Evaluator> > thread_eval(n_threads, eval);
+		size_t length = max(m_hogwild_refresh, (size_t)1);
+		HogwildJob job(this, sgd, order, thread_eval, length);
+		size_t n_round = ((order.size() + n_threads - 1) / n_threads + length - 1) / length;
+		calculateEdge();
+		for (size_t r = 0; r < n_round; r++) {
+			size_t n_samples = 0;
+			for (size_t i = 0; i < n_threads; i++) {
+				size_t begin, end;
+				splitRange(order.size(), i, n_threads, begin, end);
+				begin += r * length;
+				if (begin < end)
+					n_samples += min(end - begin, length);
+			}
+			sgd.beginRound(n_samples);
+			job.setRound(r, epoch);
+			runParallel(job);
+			sgd.endRound();
+			calculateEdge();
+		}
+		for (size_t i = 0; i < n_threads; i++) {
+			for (size_t e = 0; e < eval.size(); e++)
+				eval[e].merge(thread_eval[i][e]);
+		}
+	} else {
+		for (size_t k = 0; k < order.size(); k++) {
+			touchSample(sgd, 0, order[k]);
+			for (size_t b = 0; b < dense.size(); b++) {
+				for (size_t j = 0; j < dense[b].size(); j++)
+					sgd.touch(0, b, dense[b][j]);
+			}
+			sgd.prepare(0);
+
+			calculateEdge();
+			gradientSample(sgd, 0, order[k], eval, epoch);
+			sgd.update(0);
+		} ///< for each sample
+	}
+}
+
+/** Calibrate eta_0 on a subsample (Bottou, 2012).
+	Starting from eta_0 = 1, eta_0 is doubled or halved while one pass over the subsample
+	from the initial weights gives a smaller objective ; the weights are restored after each pass.
+	@param order	the subsample
+	@return	eta_0 (set to sgd)
+*/
+double MaxEnt::calibrateRate(SGD& sgd, const vector<size_t>& order, const vector<vector<size_t> >& dense, vector<Evaluator>& eval) {
+	const double factor = 2.0;
+	double n_data = 0.0;
+	for (size_t i = 0; i < m_TrainSetCount.size(); i++)
+		n_data += m_TrainSetCount[i];
+	double scale = order.size() / max(n_data, 1.0);	///< the penalty of the subsample
+	sgd.save();
+
+	double rate[2] = { 1.0, factor };	///< low, high
+	double cost[2];
+	for (size_t i = 0; i < 2; i++) {
+		cost[i] = numeric_limits<double>::infinity();
+		if (sgd.validRate(rate[i])) {
+			sgd.rewind();
+			sgd.setInitialRate(rate[i]);
+			stepEpoch(sgd, order, dense, eval, 0);
+			sgd.finish();
+			cost[i] = eval.back().subLoglikelihood(sgd.penalty() * scale);
+			if (!finite(cost[i]))
+				cost[i] = numeric_limits<double>::infinity();
+		}
+	}
+
+	/// the better side is moved by the factor until the objective gets worse
+	size_t better = (cost[0] <= cost[1] ? 0 : 1);
+	double step = (better == 0 ? 1.0 / factor : factor);
+	double best_rate = rate[better], best_cost = cost[better];
+	for (size_t n = 0; n < 20; n++) {
+		double r = best_rate * step;
+		if (!sgd.validRate(r))
+			break;
+		sgd.rewind();
+		sgd.setInitialRate(r);
+		stepEpoch(sgd, order, dense, eval, 0);
+		sgd.finish();
+		double c = eval.back().subLoglikelihood(sgd.penalty() * scale);
+		if (!finite(c) || c >= best_cost)
+			break;
+		best_rate = r;
+		best_cost = c;
+	}
+
+	sgd.rewind();
+	sgd.setInitialRate(best_rate);
+	calculateEdge();
+	return best_rate;
+}
+
+/** Training with the averaged perceptron or 1-best MIRA (m_Estimator).
+	Each training sequence is decoded with the current weights and the model takes the step
+	of its mistakes (mistakeSample()). The averaged weights are evaluated on the dev set and saved.
+	@param max_iter	maximum number of epochs
+	@see Perceptron
+*/
+bool MaxEnt::estimateWithPerceptron(size_t max_iter) {
+	bool mira = (m_Estimator == ESTIMATE_MIRA);
+
+	/// every sequence is a sample ; the duplicates are visited count times
+	vector<size_t> order;
+	for (size_t i = 0; i < m_TrainSetCount.size(); i++)
+		order.insert(order.end(), (size_t)m_TrainSetCount[i], i);
+	m_Perceptron.initialize(mira, m_mira_c);
+
+	vector<Parameter*> block;
+	onlineBlocks(block);
+	for (size_t b = 0; b < block.size(); b++) {
+		block[b]->initializeGradient2();
+		m_Perceptron.addBlock(block[b]->getWeight(), block[b]->getGradient(), block[b]->size());
+	}
+
+	vector<Evaluator> eval;	///< Evaluators
+	onlineEvaluators(eval);
+	timer t;		///< timer
+	onlineBegin(1);
+
+	/// Reporting
+	logger->report("[Parameter estimation]\n");
+	logger->report("  Method = \t\t%s (averaged)\n", (mira ? "MIRA" : "Perceptron"));
+	if (mira)
+		logger->report("  C = \t\t\t%g\n", m_mira_c);
+	logger->report("\n");
+	reportParam();
+	logger->report("[Iterations]\n");
+	logger->report("%4s %15s %8s %8s %8s %8s\n", "iter", "mistakes", "acc", "micro-f1", "macro-f1", "sec");
+
+	/// Training epoch
+	for (size_t niter = 0; niter < max_iter; ++niter) {
+		timer t2;	///< elapsed time for one epoch
+		for (size_t e = 0; e < eval.size(); e++)
+			eval[e].initialize();	///< evaluator intialization
+		onlineEpoch();
+		m_Perceptron.shuffle(order);
+		size_t n_mistake = 0;
+		bool changed = true;	///< the transitions are computed again after a step
+
+		for (size_t k = 0; k < order.size(); k++) {
+			if (changed)
+				calculateEdge();
+			n_mistake += mistakeSample(order[k], eval, changed);
+		} ///< for each sample
+
+		/// Evaluation for dev set (averaged weights)
+		m_Perceptron.average();
+		calculateEdge();
+		char value[32];
+		sprintf(value, "%15d", (int)n_mistake);
+		reportEpoch(niter, value, eval, t2);
+		m_Perceptron.restore();
+
+		if (n_mistake == 0)
+			break;
+	} ///< for epoch
+
+	averageParam();
+	calculateEdge();
+	logger->report("  training time = \t%.3f\n\n", t.elapsed());
+	return true;
+}
+
+/** Evaluate the dev set and report an epoch of the online estimation ; a line for each evaluator.
+	@param value	the first column (loglikelihood or mistakes)
+	@param t	timer of the epoch
+*/
+void MaxEnt::reportEpoch(size_t niter, const char* value, vector<Evaluator>& eval, timer& t) {
+	vector<Evaluator> dev_eval;
+	onlineEvaluators(dev_eval);
+	for (size_t e = 0; e < dev_eval.size(); e++)
+		dev_eval[e].initialize();
+	bool dev = evaluateDev(dev_eval);
+
+	/// Reporting the results
+	char iter[16];
+	sprintf(iter, "%d", (int)niter);
+	for (size_t e = 0; e < eval.size(); e++) {
+		eval[e].calculateF1();
+		if (dev) {
+			dev_eval[e].calculateF1();
+			logger->report("%4s %15s %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n", 
+				(e == 0 ? iter : ""), (e == 0 ? value : ""), 
+				eval[e].getAccuracy(), eval[e].getMicroF1()[2], eval[e].getMacroF1()[2], t.elapsed(), 
+				dev_eval[e].getAccuracy(), dev_eval[e].getMicroF1()[2], dev_eval[e].getMacroF1()[2]);
+		} else {
+			logger->report("%4s %15s %8.3f %8.3f %8.3f %8.3f\n", (e == 0 ? iter : ""), (e == 0 ? value : ""),
+				eval[e].getAccuracy(), eval[e].getMicroF1()[2], eval[e].getMacroF1()[2], t.elapsed());
+		}
+	}
+}
+
+void MaxEnt::onlineBlocks(vector<Parameter*>& block) {
+	block.push_back(&m_Param);
+}
+
+void MaxEnt::onlineDense(vector<vector<size_t> >&) {
+}
+
+void MaxEnt::onlineEvaluators(vector<Evaluator>& eval) {
+	eval.push_back(Evaluator(m_Param));
+}
+
+void MaxEnt::onlineBegin(size_t) {
+}
+
+void MaxEnt::onlineEpoch() {
+}
+
+void MaxEnt::reportParam() {
+	m_Param.print(logger);
+}
+
+/// the observation weights of the events
+void MaxEnt::touchSample(SGD& sgd, size_t worker, size_t s) {
+	const Sequence& seq = m_TrainSet[s];
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	for (Sequence::const_iterator it = seq.begin(); it != seq.end(); ++it) {
+		vector<pair<size_t, double> >::const_iterator iter = it->obs.begin();
+		for (; iter != it->obs.end(); ++iter) {
+			for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j)
+				sgd.touch(worker, 0, index.fid[j]);
+		}
+	}
+}
+
+/// the events of a sequence are independent
+void MaxEnt::gradientSample(SGD& sgd, size_t worker, size_t s, vector<Evaluator>& eval, size_t) {
+	Sequence& seq = m_TrainSet[s];
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	double* gradient = sgd.gradient(worker, 0);
+	vector<size_t> reference, hypothesis;
+
+	for (Sequence::iterator it = seq.begin(); it != seq.end(); ++it) {	 /// for each node
+		size_t max_outcome = 0;
+		vector<double> q = evaluate(*it, max_outcome);
+
+		reference.push_back(it->label);
+		hypothesis.push_back(max_outcome);
+
+		/// E[p] - E[~p]
+		vector<pair<size_t, double> >::const_iterator iter = it->obs.begin();
+		for (; iter != it->obs.end(); ++iter) {
+			for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j) {
+				double prob = q[index.label[j]] - (index.label[j] == it->label ? 1.0 : 0.0);
+				gradient[index.fid[j]] += prob * iter->second;
+			}
+		}
+		eval[0].addLikelihood(q[it->label]);
+	}
+	eval[0].append(reference, hypothesis);
+}
+
+/** Each event is a sample of the perceptron ; the weights of its best outcome and of its reference
+	are updated when they are different.
+	@return	number of the mistaken events
+*/
+size_t MaxEnt::mistakeSample(size_t s, vector<Evaluator>& eval, bool& changed) {
+	Sequence& seq = m_TrainSet[s];
+	const ParamIndex& index = m_Param.m_ParamIndex;
+	double* gradient = m_Param.getGradient();
+	vector<size_t> reference, hypothesis;
+	size_t n_mistake = 0;
+
+	for (Sequence::iterator it = seq.begin(); it != seq.end(); ++it) {	 /// for each node
+		size_t max_outcome = 0;
+		evaluate(*it, max_outcome);
+		reference.push_back(it->label);
+		hypothesis.push_back(max_outcome);
+		if (max_outcome == it->label) {
+			changed = m_Perceptron.update(0.0);
+			continue;
+		}
+
+		/// f(x,y^) - f(x,y)
+		vector<pair<size_t, double> >::const_iterator iter = it->obs.begin();
+		for (; iter != it->obs.end(); ++iter) {
+			for (size_t j = index.begin(iter->first); j < index.end(iter->first); ++j) {
+				if (index.label[j] == max_outcome)
+					gradient[index.fid[j]] += iter->second;
+				else if (index.label[j] == it->label)
+					gradient[index.fid[j]] -= iter->second;
+				else
+					continue;
+				m_Perceptron.touch(0, index.fid[j]);
+			}
+		}
+		changed = m_Perceptron.update(1.0);
+		++n_mistake;
+	}
+	eval[0].append(reference, hypothesis);
+	return n_mistake;
+}
+
+bool MaxEnt::evaluateDev(vector<Evaluator>& dev_eval) {
+	vector<Sequence>::iterator sit = m_DevSet.begin();
+	vector<double>::iterator count_it = m_DevSetCount.begin();
+	for (; sit != m_DevSet.end(); ++sit, ++count_it) {
+		vector<size_t> reference, hypothesis;
+		for (Sequence::iterator it = sit->begin(); it != sit->end(); ++it) {
+			size_t max_outcome = 0;
+			evaluate(*it, max_outcome);
+			reference.push_back(it->label);
+			hypothesis.push_back(max_outcome);
+		}
+		for (size_t c = 0; c < *count_it; c++)
+			dev_eval[0].append(reference, hypothesis);
+	}
+	return m_DevSet.size() > 0;
+}
+
+/** Replace the weights by their averages over the online updates (perceptron, MIRA).
+	@return	false if the model is not trained by the online updates
+*/
+bool MaxEnt::averageParam() {
+	return m_Perceptron.average();
+}
+
 void MaxEnt::initializeModel() {
 	m_Param.initialize();
 }
@@ -623,12 +1230,17 @@ bool MaxEnt::pretrain(size_t max_iter, double sigma, bool L1) {
 }
 
 bool MaxEnt::train(size_t max_iter, double sigma, bool L1) { 
+	if (m_Estimator == ESTIMATE_SGD)
+		return estimateWithSGD(max_iter, sigma, L1);
+	if (m_Estimator == ESTIMATE_PERCEPTRON || m_Estimator == ESTIMATE_MIRA)
+		return estimateWithPerceptron(max_iter);
 	return estimateWithLBFGS(max_iter, sigma, L1); 
 }
 
 bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bool confidence) {
 	/// File stream
 	string line;
+	vector<StringRef> tokens;	///< tokens of the line (refer to the line)
 	ifstream f(filename.c_str());
 	if (!f)
 		throw runtime_error("cannot open data file");
@@ -639,7 +1251,7 @@ bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bo
 	if (outputfile != "") {
 		out.open(outputfile.c_str());
 		out.precision(20);
-		state_vec = m_Param.getState().second;
+		state_vec = m_Param.getStateVec();
 	}
 	
 	/// initializing
@@ -676,7 +1288,7 @@ bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bo
 			seq.clear();
 			++count;
 		} else {
-			vector<string> tokens = tokenize(line);
+			tokenize(StringRef(line), " 	", tokens);
 			seq.push_back(packEvent(tokens, &m_Param, true));
 		}	///< else
 	}	///< while
@@ -687,6 +1299,8 @@ bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bo
 	logger->report("  Acc = \t\t%8.3f\n", test_eval.getAccuracy());
 	logger->report("  MicroF1 = \t\t%8.3f\n", test_eval.getMicroF1()[2]);
 	logger->report("  MacroF1 = \t\t%8.3f\n", test_eval.getMacroF1()[2]);
+
+	return true;
 }
 
 
@@ -11,6 +11,9 @@
 /// max headers
 #include "Param.h"
 #include "Data.h"
+#include "Thread.h"
+#include "Lattice.h"
+#include "Perceptron.h"
 /// standard headers
 #include <vector>
 #include <string>
@@ -18,6 +21,28 @@
 
 namespace tricrf {
 
+class Evaluator;
+class SGD;
+
+/** Sparse forward-backward of the linear-chain CRF.
+	Only the selected transitions are visited by the forward and backward recursions;
+	the others have a single potential per label (1 for SPARSE_ACTIVE).
+*/
+enum SparseMode {
+	SPARSE_NONE = 0,	///< every transition with a non-zero weight
+	SPARSE_TIED,	///< the transitions seen less than K times share one potential per label
+	SPARSE_ACTIVE	///< the transitions with |exp(w) - 1| <= eta are fixed to 1
+};
+
+/** Parameter estimation method (see MaxEnt::train()).
+*/
+enum Estimator {
+	ESTIMATE_LBFGS = 0,	///< batch L-BFGS
+	ESTIMATE_SGD,	///< stochastic gradient descent with lazy regularization (see SGD)
+	ESTIMATE_PERCEPTRON,	///< averaged perceptron (see Perceptron)
+	ESTIMATE_MIRA	///< averaged 1-best MIRA (see Perceptron)
+};
+
 /** Maximum Entropy Model.
 	@class MaxEnt
 */
@@ -40,12 +65,58 @@ protected:
 
 	/// Parameter Estimation
 	virtual bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta = 1E-05);
+	bool estimateWithSGD(size_t max_iter, double sigma, bool L1, double eta = 1E-04);
+	bool estimateWithPerceptron(size_t max_iter);
+	Estimator m_Estimator;	///< estimation method of train()
+	double m_sgd_rate;	///< initial learning rate (SGD ; 0: calibrated)
+	double m_sgd_decay;	///< the learning rate is multiplied by this every epoch (SGD ; 0: eta_0 / (1 + lambda * eta_0 * k))
+	Perceptron m_Perceptron;	///< online updates and their averages (perceptron, MIRA)
+	double m_mira_c;	///< upper bound of the step (MIRA)
+	size_t m_hogwild_refresh;	///< samples of a thread between two updates of the transitions (Hogwild SGD)
+	size_t m_lbfgs_history;	///< number of the (s, y) pairs (LBFGS)
+	bool m_lbfgs_float;	///< the (s, y) pairs are kept in float (LBFGS)
+
+	/// Online estimation (SGD, perceptron, MIRA) ; the epochs are shared by the models,
+	/// which give their weights and the step of a sample (a training sequence s)
+	virtual void onlineBlocks(std::vector<Parameter*>& block);	///< weight blocks
+	virtual void onlineDense(std::vector<std::vector<size_t> >& dense);	///< weights of each block written by every sample (transitions)
+	virtual void onlineEvaluators(std::vector<Evaluator>& eval);	///< the first gives the loglikelihood, the last the objective
+	virtual void onlineBegin(size_t n_workers);	///< workspace of the workers
+	virtual void onlineEpoch();	///< beginning of an epoch
+	virtual void reportParam();
+	virtual void touchSample(SGD& sgd, size_t worker, size_t s);	///< the weights of a sample but the dense ones
+	virtual void gradientSample(SGD& sgd, size_t worker, size_t s, std::vector<Evaluator>& eval, size_t epoch);	///< E[p] - E[~p]
+	virtual size_t mistakeSample(size_t s, std::vector<Evaluator>& eval, bool& changed);	///< perceptron step ; @return mistakes
+	virtual bool evaluateDev(std::vector<Evaluator>& dev_eval);	///< @return false without a dev set
+	virtual void calculateEdge() {}	///< factors shared by the samples (transitions)
+	void stepEpoch(SGD& sgd, const std::vector<size_t>& order, const std::vector<std::vector<size_t> >& dense,
+		std::vector<Evaluator>& eval, size_t epoch);	///< an SGD step for each sample of order
+	double calibrateRate(SGD& sgd, const std::vector<size_t>& order, const std::vector<std::vector<size_t> >& dense,
+		std::vector<Evaluator>& eval);
+	void reportEpoch(size_t niter, const char* value, std::vector<Evaluator>& eval, timer& t);
+	friend class HogwildJob;
 
 	/// Prune
 	/// for pruning
-	std::vector<std::pair<long double, size_t> > m_prune;
 	long double m_prune_threshold;
+	long double m_topic_beam;	///< topic beam before the forward pass (0: off)
+	size_t m_state_beam;	///< states kept at each position by the forward-backward (0: all)
+	long double m_state_beam_ratio;	///< states below the best one / ratio are dropped (0: off)
+	SparseMode m_SparseMode;	///< sparse forward-backward (CRF)
+	double m_sparse_threshold;	///< K (SPARSE_TIED) or eta (SPARSE_ACTIVE)
+	size_t m_checkpoint_length;	///< the sequences from this length use the checkpointed forward-backward (0: off)
+
+	/// Threads
+	ThreadPool* m_Pool;
+	void runParallel(ThreadJob& job);
+
+	/// Model format
+	bool m_BinaryModel;	///< save the model in binary format
+
+	/// Lattice precision
+	LatticePrecision m_Precision;	///< precision of the forward-backward (CRF)
 
+	void setDefaults();	///< options of the constructors
 
 public:
 	MaxEnt();	 
@@ -53,16 +124,16 @@ public:
 	~MaxEnt();	
 
 	/// Data manipulation
-	Event packEvent(std::vector<std::string>& tokens, Parameter* p_Param = NULL, bool test = false);
-	Event packEvent2(std::vector<std::string>& tokens, Parameter* p_Param = NULL, bool test = false);
-	StringEvent packStringEvent(std::vector<std::string>& tokens, Parameter* p_Param = NULL, bool test = false);
+	Event packEvent(const std::vector<StringRef>& tokens, Parameter* p_Param = NULL, bool test = false);
+	Event packEvent2(const std::vector<StringRef>& tokens, Parameter* p_Param = NULL, bool test = false);
+	StringEvent packStringEvent(const std::vector<StringRef>& tokens, Parameter* p_Param = NULL, bool test = false);
 	virtual void readTrainData(const std::string& filename);
 	virtual void readDevData(const std::string& filename);
 	
 	/// Model 
 	virtual bool loadModel(const std::string& filename);
 	virtual bool saveModel(const std::string& filename);
-	virtual bool averageParam() {};
+	virtual bool averageParam();
 
 	/// Testing
 	virtual bool test(const std::string& filename, const std::string& outputfile = "", bool confidence = false);
@@ -76,6 +147,18 @@ public:
 	/// Logger 
 	void setLogger(Logger *logger);
 	void setPrune(double prune);
+	void setTopicBeam(double beam);
+	void setStateBeam(size_t beam, double ratio);
+	void setSparse(SparseMode mode, double threshold);
+	void setCheckpoint(size_t length);
+	void setEstimator(Estimator estimator, double rate = 0.0, double decay = 0.85);
+	void setMIRA(double C);
+	void setHogwild(size_t refresh);
+	void setLBFGS(size_t history, bool float_history = false);
+	void setThreads(size_t n_threads);
+	size_t sizeThreads();
+	void setBinaryModel(bool binary);
+	void setPrecision(LatticePrecision precision);
 	
 	Parameter& getParam() { return m_Param; };
 };
@@ -8,8 +8,10 @@
 /// max header
 #include "Param.h"
 #include "Utility.h"
+#include "BinaryModel.h"
 /// standard headers
 #include <cassert>
+#include <cstring>
 #include <cfloat>
 #include <cmath>
 #include <limits>
@@ -42,7 +44,7 @@ Parameter::~Parameter() {
 /** Size of weight vector.
 	@return	size of weight vector
 */
-size_t Parameter::size() {
+size_t Parameter::size() const {
 	return n_weight;
 }
 
@@ -54,16 +56,20 @@ void Parameter::clear(bool state) {
 		m_StateVec.clear();
 	}
 	m_FeatureMap.clear();
-	m_FeatureVec.clear();
 	//m_StateID.clear();
 	m_Count.clear();
 	m_Weight.clear();
 	m_Gradient.clear();
 	m_ParamIndex.clear();
+	m_Update.clear();
 	n_weight = 0;
 	m_StateIndex.clear();
 	m_SelectedStateList1.clear();
 	m_SelectedStateList2.clear();
+	m_SelectedStateIndex.clear();
+	m_RemainStateIndex.clear();
+	remain_fid.clear();
+	remain_count.clear();
 }
 
 /** Initialize the weight vector.
@@ -95,6 +101,10 @@ double* Parameter::getWeight() {
 	return &m_Weight[0]; 
 }
 
+const double* Parameter::getWeight() const { 
+	return &m_Weight[0]; 
+}
+
 void Parameter::setWeight(double* theta) {
 	for (size_t i = 0; i < n_weight; i++) {
 		m_Weight[i] = *(theta++);
@@ -111,15 +121,14 @@ double* Parameter::getGradient() {
 /** Make and return the observation index
 	@todo	If the index vector is stored in training set, then the training speed can be (slightly) improved.
 */
-vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs) {
+vector<ObsParam> Parameter::makeObsIndex(const vector<pair<size_t, double> >& obs) const {
 	vector<ObsParam> obs_param; 
-	vector<pair<size_t, double> >::iterator iter = obs.begin();
+	vector<pair<size_t, double> >::const_iterator iter = obs.begin();
 	for (; iter != obs.end(); iter++) {
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[iter->first];
-		for (size_t i = 0; i < param.size(); ++i) {
+		for (size_t j = m_ParamIndex.begin(iter->first); j < m_ParamIndex.end(iter->first); ++j) {
 			ObsParam element;
-			element.y = param[i].first;
-			element.fid = param[i].second;
+			element.y = m_ParamIndex.label[j];
+			element.fid = m_ParamIndex.fid[j];
 			element.fval = iter->second;
 			obs_param.push_back(element);
 		}
@@ -128,18 +137,16 @@ vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs) {
 }
 
 // sparse-FB, 2007-11-08 
-vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs, map<size_t, size_t>& beam) {
+vector<ObsParam> Parameter::makeObsIndex(const vector<pair<size_t, double> >& obs, const map<size_t, size_t>& beam) const {
 	vector<ObsParam> obs_param; 
-	vector<pair<size_t, double> >::iterator iter = obs.begin();
+	vector<pair<size_t, double> >::const_iterator iter = obs.begin();
 	for (; iter != obs.end(); iter++) {
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[iter->first];
-		size_t index = 0;
-		for (size_t i = 0; i < param.size(); ++i) {
-			if (beam.find(param[i].first) == beam.end()) 
+		for (size_t j = m_ParamIndex.begin(iter->first); j < m_ParamIndex.end(iter->first); ++j) {
+			if (beam.find(m_ParamIndex.label[j]) == beam.end()) 
 				continue;
 			ObsParam element;
-			element.y = param[i].first;
-			element.fid = param[i].second;
+			element.y = m_ParamIndex.label[j];
+			element.fid = m_ParamIndex.fid[j];
 			element.fval = iter->second;
 			obs_param.push_back(element);
 		}
@@ -147,17 +154,38 @@ vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs, map
 	return obs_param;
 }
 
-vector<ObsParam> Parameter::makeObsIndex(vector<pair<string, double> >& obs) {
+vector<ObsParam> Parameter::makeObsIndex(const vector<pair<string, double> >& obs) const {
 	int pid;
 	vector<ObsParam> obs_param; 
-	vector<pair<string, double> >::iterator iter = obs.begin();
+	vector<pair<string, double> >::const_iterator iter = obs.begin();
 	for (; iter != obs.end(); iter++) {
 		if ((pid = findObs(iter->first)) >= 0) {
-			vector<pair<size_t, size_t> >& param = m_ParamIndex[(size_t)pid];
-			for (size_t i = 0; i < param.size(); ++i) {
+			for (size_t j = m_ParamIndex.begin(pid); j < m_ParamIndex.end(pid); ++j) {
 				ObsParam element;
-				element.y = param[i].first;
-				element.fid = param[i].second;
+				element.y = m_ParamIndex.label[j];
+				element.fid = m_ParamIndex.fid[j];
+				element.fval = iter->second;
+				obs_param.push_back(element);
+			}
+		}
+	}
+	return obs_param;
+}
+
+/** Make the observation index of the features resolved by a FeatureView.
+	@param obs	global feature ids and values
+	@param remap	global id -> observation id of this parameter (-1 if not found)
+*/
+vector<ObsParam> Parameter::makeObsIndex(const vector<pair<size_t, double> >& obs, const vector<int>& remap) const {
+	int pid;
+	vector<ObsParam> obs_param; 
+	vector<pair<size_t, double> >::const_iterator iter = obs.begin();
+	for (; iter != obs.end(); iter++) {
+		if ((pid = remap[iter->first]) >= 0) {
+			for (size_t j = m_ParamIndex.begin(pid); j < m_ParamIndex.end(pid); ++j) {
+				ObsParam element;
+				element.y = m_ParamIndex.label[j];
+				element.fid = m_ParamIndex.fid[j];
 				element.fval = iter->second;
 				obs_param.push_back(element);
 			}
@@ -168,20 +196,23 @@ vector<ObsParam> Parameter::makeObsIndex(vector<pair<string, double> >& obs) {
 
 /**	Return the size of feature vector.
 */
-size_t Parameter::sizeFeatureVec() { 
-	return m_FeatureVec.size(); 
+size_t Parameter::sizeFeatureVec() const { 
+	return m_FeatureMap.size(); 
 }
 
 /**	Return the size of state vector.
 */
-size_t Parameter::sizeStateVec() { 
+size_t Parameter::sizeStateVec() const { 
 	return m_StateVec.size(); 
 }
 
 /**	Return the state map and vector.
 */
-std::pair<Map, Vec> Parameter::getState() { 
-	return make_pair(m_StateMap, m_StateVec); 
+std::pair<Map, Vec> Parameter::getState() const { 
+	Map state_map;
+	for (size_t i = 0; i < m_StateVec.size(); ++i)
+		state_map.insert(make_pair(m_StateVec[i], i));
+	return make_pair(state_map, m_StateVec); 
 }
 
 /**	Return the size of feature vector.
@@ -195,15 +226,12 @@ std::pair<Map, Vec> Parameter::getState() {
 
 /**
 */
-size_t Parameter::addNewState(const string& key) {
-	size_t oid;
-	if (m_StateMap.find(key) == m_StateMap.end()) {
-		oid = m_StateVec.size();
-		m_StateMap.insert(make_pair(key, oid));
-		m_StateVec.push_back(key);
+size_t Parameter::addNewState(const StringRef& key) {
+	size_t oid = m_StateMap.insert(key.data, key.size);
+	if (oid == m_StateVec.size()) {
+		m_StateVec.push_back(key.str());
 	} else {
-		oid = m_StateMap[key];
-		if (m_StateVec[oid] != key) {
+		if (StringRef(m_StateVec[oid]) != key) {
 			cerr << "outcome id mismatch error" << endl;
 			exit(1);
 		}
@@ -213,96 +241,146 @@ size_t Parameter::addNewState(const string& key) {
 
 /**
 */
-int Parameter::findState(const string& key) {
-	int oid = -1;
-
-	if (m_StateMap.find(key) != m_StateMap.end()) {
-		oid = m_StateMap[key];
-	}
-
-	return oid;
+int Parameter::findState(const StringRef& key) const {
+	size_t oid = m_StateMap.find(key.data, key.size);
+	if (oid == Dictionary::npos)
+		return -1;
+	return (int)oid;
 }
 
 /**
 */
-int Parameter::findObs(const string& key) {
-	int pid = -1;
-
-	if (m_FeatureMap.find(key) != m_FeatureMap.end()) {
-		pid = m_FeatureMap[key];
-	}
-
-	return pid;
+int Parameter::findObs(const StringRef& key) const {
+	size_t pid = m_FeatureMap.find(key.data, key.size);
+	if (pid == Dictionary::npos)
+		return -1;
+	return (int)pid;
 }
 
 /**
 */
-size_t Parameter::addNewObs(const string& key) {
-	size_t pid;
-
-	if (m_FeatureMap.find(key) != m_FeatureMap.end()) {
-		pid = m_FeatureMap[key];
-	} else {
-		pid = m_FeatureVec.size();
-		m_FeatureMap[key] = pid;
-		m_FeatureVec.push_back(key);
-	}
-	return pid;
+size_t Parameter::addNewObs(const StringRef& key) {
+	return m_FeatureMap.insert(key.data, key.size);
 }
 
 /** Update the parameter.
+	The update is queued and merged into the index in bulk (see mergeUpdate()),
+	so that the loading time is linear in the number of updates.
 */
-size_t Parameter::updateParam(size_t oid, size_t pid, double fval) {
-	size_t fid;
-	assert(m_ParamIndex.size() >= pid);
-	if (m_ParamIndex.size() == pid) {	/// New feature
-		vector<pair<size_t, size_t> > param;
-		fid = n_weight;
-		n_weight++;
-		m_Count.push_back(fval);
-		m_Weight.push_back(0.0);
-		m_Gradient.push_back(0.0);
-		param.push_back(make_pair(oid, fid));
-		m_ParamIndex.push_back(param);
-	} else {	 /// A parameter vector is exist 
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
-		size_t i;
-		for (i = 0; i < param.size(); i++) {
-			if (param[i].first == oid) {
-				m_Count[param[i].second] += fval;
-				break;
+void Parameter::updateParam(size_t oid, size_t pid, double fval) {
+	if (oid >= 0xFFFFFFFFULL || pid >= 0xFFFFFFFFULL)
+		throw runtime_error("too many parameters for the 32-bit index");
+	Update update;
+	update.pid = (uint32_t)pid;
+	update.oid = (uint32_t)oid;
+	update.fval = fval;
+	m_Update.push_back(update);
+
+	/// the merge is linear in the size of the index, so the queue grows with the index
+	if (m_Update.size() >= (1 << 22) && m_Update.size() >= m_ParamIndex.label.size())
+		mergeUpdate();
+}
+
+/** Merge the queued updates into the index.
+	The updates are sorted by (feature, label) with two stable counting passes
+	and merged with the rows of the index. The counts of a parameter are added
+	in the order of the updates, and the weight ids follow the feature order
+	(fid = entry number).
+*/
+void Parameter::mergeUpdate() {
+	if (m_Update.empty())
+		return;
+
+	size_t n_row = m_ParamIndex.size(), n_label = 0;
+	for (size_t i = 0; i < m_Update.size(); ++i) {
+		n_row = max(n_row, (size_t)m_Update[i].pid + 1);
+		n_label = max(n_label, (size_t)m_Update[i].oid + 1);
+	}
+
+	/// radix sort ; label, then feature
+	vector<Update> sorted(m_Update.size());
+	vector<size_t> pos(n_label + 1, 0);
+	for (size_t i = 0; i < m_Update.size(); ++i)
+		pos[m_Update[i].oid + 1]++;
+	for (size_t y = 0; y < n_label; ++y)
+		pos[y+1] += pos[y];
+	for (size_t i = 0; i < m_Update.size(); ++i)
+		sorted[pos[m_Update[i].oid]++] = m_Update[i];
+
+	vector<size_t> start(n_row + 1, 0);
+	for (size_t i = 0; i < sorted.size(); ++i)
+		start[sorted[i].pid + 1]++;
+	for (size_t r = 0; r < n_row; ++r)
+		start[r+1] += start[r];
+	pos.assign(start.begin(), start.end() - 1);
+	for (size_t i = 0; i < sorted.size(); ++i)
+		m_Update[pos[sorted[i].pid]++] = sorted[i];
+
+	/// merge with the rows of the index
+	const ParamIndex& old = m_ParamIndex;
+	ParamIndex index;
+	vector<double> weight, gradient, count;
+	size_t capacity = old.label.size() + m_Update.size();
+	index.row.resize(n_row + 1);
+	index.label.reserve(capacity);
+	weight.reserve(capacity);
+	gradient.reserve(capacity);
+	count.reserve(capacity);
+	index.row[0] = 0;
+	for (size_t r = 0; r < n_row; ++r) {
+		size_t a = (r < old.size() ? old.begin(r) : 0), a_end = (r < old.size() ? old.end(r) : 0);
+		size_t b = start[r], b_end = start[r+1];
+		while (a < a_end || b < b_end) {
+			if (b == b_end || (a < a_end && old.label[a] < m_Update[b].oid)) {	///< existing parameter
+				index.label.push_back(old.label[a]);
+				weight.push_back(m_Weight[old.fid[a]]);
+				gradient.push_back(m_Gradient[old.fid[a]]);
+				count.push_back(m_Count[old.fid[a]]);
+				++a;
+				continue;
 			}
+			uint32_t y = m_Update[b].oid;
+			double w = 0.0, g = 0.0, c;
+			if (a < a_end && old.label[a] == y) {	///< updated parameter
+				w = m_Weight[old.fid[a]];
+				g = m_Gradient[old.fid[a]];
+				c = m_Count[old.fid[a]];
+				++a;
+			} else	///< new parameter
+				c = m_Update[b++].fval;
+			for (; b < b_end && m_Update[b].oid == y; ++b)
+				c += m_Update[b].fval;
+			index.label.push_back(y);
+			weight.push_back(w);
+			gradient.push_back(g);
+			count.push_back(c);
 		}
-		if (i == param.size()) {
-			fid = n_weight;
-			n_weight++;
-			m_Count.push_back(fval);
-			m_Weight.push_back(0.0);
-			m_Gradient.push_back(0.0);
-			param.push_back(make_pair(oid, fid));
-	        sort(param.begin(), param.end());
-		}
+		if (index.label.size() >= 0xFFFFFFFFULL)
+			throw runtime_error("too many parameters for the 32-bit index");
+		index.row[r+1] = (uint32_t)index.label.size();
 	}
-	return n_weight;
+	index.fid.resize(index.label.size());
+	for (size_t j = 0; j < index.fid.size(); ++j)
+		index.fid[j] = (uint32_t)j;
+
+	m_ParamIndex.row.swap(index.row);
+	m_ParamIndex.label.swap(index.label);
+	m_ParamIndex.fid.swap(index.fid);
+	m_Weight.swap(weight);
+	m_Gradient.swap(gradient);
+	m_Count.swap(count);
+	n_weight = m_Count.size();
+	m_Update.clear();
 }
 
+/** Merge the remaining updates and release the queue.
+*/
 void Parameter::endUpdate() {
-	vector<double> tmp_Count = m_Count;
-	fill(m_Count.begin(), m_Count.end(), 0.0);
-
-    size_t fid = 0;
-    for (size_t i = 0; i < m_ParamIndex.size(); ++i) {
-        vector<pair<size_t, size_t> >& param = m_ParamIndex[i];
-        for (size_t j = 0; j < param.size(); ++j) {
-			m_Count[fid] = tmp_Count[param[j].second];
-            param[j].second = fid;
-            fid++;
-        }
-    }
-	assert(fid == n_weight);
+	mergeUpdate();
+	vector<Update>().swap(m_Update);
 }
 
-size_t Parameter::getDefaultState() {
+size_t Parameter::getDefaultState() const {
 	return m_default_oid;
 }
 
@@ -336,14 +414,13 @@ void Parameter::makeStateIndex(bool makeIndex) {
 		//if (pid < 0) 
 		//	continue;
 		string fi = mEDGE + m_StateVec[y1];
-		if (m_FeatureMap.find(fi) != m_FeatureMap.end()) {
-			size_t pid = m_FeatureMap[fi];
-			vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
-			for (size_t i = 0; i < param.size(); i++) {
+		size_t pid = m_FeatureMap.find(fi);
+		if (pid != Dictionary::npos) {
+			for (size_t j = m_ParamIndex.begin(pid); j < m_ParamIndex.end(pid); j++) {
 				StateParam element;
 				element.y1 = y1;
-				element.y2 = param[i].first;
-				element.fid = param[i].second;
+				element.y2 = m_ParamIndex.label[j];
+				element.fid = m_ParamIndex.fid[j];
 				element.fval = 1.0;
 				m_StateIndex.push_back(element);
 				
@@ -383,14 +460,13 @@ void Parameter::makeActiveIndex(double eta) {
 vector<StateParam> Parameter::makeStateIndex(size_t y1) {
 	vector<StateParam> state_param; 
 	string fi = mEDGE + m_StateVec[y1];
-	if (m_FeatureMap.find(fi) != m_FeatureMap.end()) {
-		size_t pid = m_FeatureMap[fi];
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
-		for (size_t i = 0; i < param.size(); i++) {
+	size_t pid = m_FeatureMap.find(fi);
+	if (pid != Dictionary::npos) {
+		for (size_t j = m_ParamIndex.begin(pid); j < m_ParamIndex.end(pid); j++) {
 			StateParam element;
-			element.y1 = i;
-			element.y2 = param[i].first;
-			element.fid = param[i].second;
+			element.y1 = j - m_ParamIndex.begin(pid);
+			element.y2 = m_ParamIndex.label[j];
+			element.fid = m_ParamIndex.fid[j];
 			element.fval = 1.0;
 			state_param.push_back(element);
 		}	///< for
@@ -398,7 +474,12 @@ vector<StateParam> Parameter::makeStateIndex(size_t y1) {
 	return state_param;
 }
 
-/** Make the index for Tied Potential
+/** Make the index for Tied Potential.
+	The transitions seen less than K times are tied: the transitions into a label y2
+	share one weight (the "@REMAIN@" feature of y2), whose empirical count is the sum of theirs.
+	Only the other transitions are in m_SelectedStateList1/2, so the forward-backward 
+	visits O(selected) transitions per position (see CRF::forward()).
+	@param K	minimum count of a selected transition
 */
 void Parameter::makeTiedPotential(double K) {
 	
@@ -408,13 +489,14 @@ void Parameter::makeTiedPotential(double K) {
 
 	remain_count.clear();
 	remain_fid.clear();
-	vector<double> remain_size;
+	size_t remain_pid = addNewObs("@REMAIN@");
 	for (size_t i = 0; i < sizeStateVec(); i++) {
-		size_t temp_fid = updateParam(i, addNewObs("@REMAIN@"), 0.0); // empirical feature count is augmented
-		remain_fid.push_back(temp_fid);
-		remain_size.push_back(0.0);
+		updateParam(i, remain_pid, 0.0); // empirical feature count is augmented
 		remain_count.push_back(0.0);
 	}
+	mergeUpdate();
+	for (size_t j = m_ParamIndex.begin(remain_pid); j < m_ParamIndex.end(remain_pid); ++j)
+		remain_fid.push_back(m_ParamIndex.fid[j]);
 	
 	// redefinition for tied potential (redundant)
 	m_SelectedStateList1.clear();
@@ -424,14 +506,13 @@ void Parameter::makeTiedPotential(double K) {
 
 	for (size_t y1=0; y1 < sizeStateVec(); y1++) {
 		string fi = mEDGE + m_StateVec[y1];
-		if (m_FeatureMap.find(fi) != m_FeatureMap.end()) {
-			size_t pid = m_FeatureMap[fi];
-			vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
-			for (size_t i = 0; i < param.size(); i++) {
+		size_t pid = m_FeatureMap.find(fi);
+		if (pid != Dictionary::npos) {
+			for (size_t j = m_ParamIndex.begin(pid); j < m_ParamIndex.end(pid); j++) {
 				StateParam element;
 				element.y1 = y1;
-				element.y2 = param[i].first;
-				element.fid = param[i].second;
+				element.y2 = m_ParamIndex.label[j];
+				element.fid = m_ParamIndex.fid[j];
 				element.fval = 1.0;
 				if (m_Count[element.fid] >= K) {
 					m_SelectedStateIndex.push_back(element);
@@ -445,34 +526,32 @@ void Parameter::makeTiedPotential(double K) {
 				} else {
 					m_RemainStateIndex.push_back(element);
 					remain_count[element.y2] += m_Count[element.fid];
-					//remain_fid[element.y2] = element.fid;
-					remain_size[element.y2] += 1.0;
 					m_Count[remain_fid[element.y2]] += m_Count[element.fid]; // empirical feature count is augmented
 					m_Count[element.fid] = 0.0;
 				}
 			}	///< for
 		} ///< if else
 	} ///< for each state
+}
 
-	/*
-	for (size_t j = 0; j < sizeStateVec(); j++) {
-			vector<size_t> &backpointer = m_SelectedStateList1[j];
-			sort(backpointer.begin(), backpointer.end());
-			vector<size_t> &backpointer2 = m_SelectedStateList2[j];
-			sort(backpointer2.begin(), backpointer2.end());
-	}
+/** Untie the potentials after the training.
+	The tied weight is copied to each of the tied transitions and reset,
+	so that the model is an ordinary CRF with the same distribution.
+*/
+void Parameter::untiePotential() {
 	vector<StateParam>::iterator iter = m_RemainStateIndex.begin();
 	for (; iter != m_RemainStateIndex.end(); ++iter) {
-		m_Count[iter->fid] = remain_count[iter->y2] / remain_size[iter->y2];
+		m_Weight[iter->fid] = m_Weight[remain_fid[iter->y2]];
 	}
-	*/
-	
-	for (size_t i = 0; i < sizeStateVec(); i++) {
-		if (remain_size[i] > 0)
-			m_Count[remain_fid[i]] /= remain_size[i];
-		else
-			m_Count[remain_fid[i]] = 0.0;
+	for (size_t i = 0; i < remain_fid.size(); i++) {
+		m_Weight[remain_fid[i]] = 0.0;
+		m_Count[remain_fid[i]] = 0.0;
 	}
+
+	m_SelectedStateIndex.clear();
+	m_RemainStateIndex.clear();
+	remain_fid.clear();
+	remain_count.clear();
 }
 
 /** Save the model.
@@ -481,7 +560,7 @@ void Parameter::makeTiedPotential(double K) {
 */
 bool Parameter::save(ofstream& f) {
 	/// Errors	
-	if (m_ParamIndex.size() != m_FeatureVec.size())
+	if (m_ParamIndex.size() != m_FeatureMap.size())
 		return false;
 
 	/// state
@@ -490,17 +569,16 @@ bool Parameter::save(ofstream& f) {
         f << m_StateVec[i] << endl;
 	
 	/// feature 
-    f << "// Feature ; " << m_FeatureVec.size() << endl;
-    for (size_t i = 0; i < m_FeatureVec.size(); ++i)
-        f << m_FeatureVec[i] << endl;
+    f << "// Feature ; " << m_FeatureMap.size() << endl;
+    for (size_t i = 0; i < m_FeatureMap.size(); ++i)
+        f.write(m_FeatureMap.data(i), m_FeatureMap.length(i)) << endl;
 	
 	/// parameter index
     f << "// Parameter ; " << m_ParamIndex.size() << endl;
     for (size_t i = 0; i < m_ParamIndex.size(); ++i) {
-        vector<pair<size_t, size_t> >& param = m_ParamIndex[i];
-        f << param.size() << ' ';
-        for (size_t j = 0; j < param.size(); ++j) {
-            f << param[j].first << ' ';
+        f << m_ParamIndex.end(i) - m_ParamIndex.begin(i) << ' ';
+        for (size_t j = m_ParamIndex.begin(i); j < m_ParamIndex.end(i); ++j) {
+            f << m_ParamIndex.label[j] << ' ';
         }
         f << endl;
     }
@@ -533,7 +611,7 @@ bool Parameter::load(ifstream& f) {
 	count = atoi(tok[3].c_str());
     for (size_t i = 0; i < count; ++i) {
 		getline(f, line);
-		m_StateMap[line] = i;
+		m_StateMap.insert(line);
 		m_StateVec.push_back(line);
     }
 
@@ -545,10 +623,10 @@ bool Parameter::load(ifstream& f) {
 		return false;
 	}
 	count = atoi(tok[3].c_str());
+	m_FeatureMap.reserve(count);
     for (size_t i = 0; i < count; ++i) {
         getline(f, line);
-        m_FeatureMap[line] = i;
-        m_FeatureVec.push_back(line);
+        m_FeatureMap.insert(line);
     }
 
 	/// parameter index
@@ -558,9 +636,8 @@ bool Parameter::load(ifstream& f) {
 		return false;
 	count = atoi(tok[3].c_str());
     size_t fid = 0;
-    vector<pair<size_t, size_t> > param;
+	m_ParamIndex.row.resize(count + 1);
     for (size_t i = 0; i < count; ++i) {
-        param.clear();
         getline(f, line);
         size_t oid;
         tok = tokenize(line);
@@ -568,9 +645,10 @@ bool Parameter::load(ifstream& f) {
         ++it; ///< skip count which is only used in binary format
         for (; it != tok.end();) {
             oid = atoi(it->c_str()); ++it;
-            param.push_back(make_pair(oid,fid++));
+            m_ParamIndex.label.push_back((uint32_t)oid);
+            m_ParamIndex.fid.push_back((uint32_t)fid++);
         }
-        m_ParamIndex.push_back(param);
+        m_ParamIndex.row[i+1] = (uint32_t)fid;
     }
 
 	/// weight
@@ -595,14 +673,160 @@ bool Parameter::load(ifstream& f) {
 	return true;
 }
 
+/** Save the model (binary format).
+	@param	f	binary model writer
+	@return	success or failure
+*/
+bool Parameter::save(BinaryModelWriter& f) {
+	/// Errors	
+	if (m_ParamIndex.size() != m_FeatureMap.size())
+		return false;
+
+	/// state and feature (the feature arena is already a string table)
+	f.writeStrings(BIN_STATE, m_StateVec);
+	uint64_t n_feature = m_FeatureMap.size();
+	f.beginSection(BIN_FEATURE);
+	f.write(&n_feature, sizeof(n_feature));
+	f.write(&m_FeatureMap.offset()[0], m_FeatureMap.offset().size() * sizeof(uint64_t));
+	if (!m_FeatureMap.arena().empty())
+		f.write(&m_FeatureMap.arena()[0], m_FeatureMap.arena().size());
+	f.endSection();
+
+	/// parameter index (CSR)
+	uint64_t rows = m_ParamIndex.size();
+	vector<uint64_t> row(m_ParamIndex.row.begin(), m_ParamIndex.row.end());
+	const vector<uint32_t>& label = m_ParamIndex.label;
+	uint64_t entries = label.size();
+	f.beginSection(BIN_PARAM_INDEX);
+	f.write(&rows, sizeof(rows));
+	f.write(&entries, sizeof(entries));
+	f.write(&row[0], row.size() * sizeof(uint64_t));
+	if (entries > 0)
+		f.write(&label[0], entries * sizeof(uint32_t));
+	f.endSection();
+
+	/// weight vector
+	uint64_t count = n_weight;
+	f.beginSection(BIN_WEIGHT);
+	f.write(&count, sizeof(count));
+	if (n_weight > 0)
+		f.write(&m_Weight[0], n_weight * sizeof(double));
+	f.endSection();
+
+	return f.good();
+}
+
+/** Load the model (binary format).
+	The sections are read from the mapped file without parsing and copied into the tables:
+	the weights and the CSR index are the vectors that the training updates and reindexes,
+	so they are not served from the mapping. The copies are a small part of the load ;
+	most of it is paging in the file and building the feature dictionary.
+	@param	f	binary model reader
+	@return	success or failure
+*/
+bool Parameter::load(BinaryModelReader& f) {
+	/// initializing
+	clear();
+
+	/// state and feature
+	if (!f.readStrings(BIN_STATE, m_StateVec)) {
+		cerr << "state error\n";
+		return false;
+	}
+	for (size_t i = 0; i < m_StateVec.size(); ++i)
+		m_StateMap.insert(m_StateVec[i]);
+	const char* data;
+	uint64_t size;
+	if (!f.nextSection(BIN_FEATURE, data, size) || size < sizeof(uint64_t)) {
+		cerr << "feature error\n";
+		return false;
+	}
+	uint64_t n_feature = *(const uint64_t*)data;
+	const uint64_t* offset = (const uint64_t*)(data + sizeof(uint64_t));
+	if ((n_feature + 2) * sizeof(uint64_t) > size || (n_feature + 2) * sizeof(uint64_t) + offset[n_feature] > size
+		|| !m_FeatureMap.assign((const char*)(offset + n_feature + 1), offset, n_feature)) {
+		cerr << "feature error\n";
+		return false;
+	}
+
+	/// parameter index
+	if (!f.nextSection(BIN_PARAM_INDEX, data, size) || size < 2 * sizeof(uint64_t))
+		return false;
+	uint64_t rows = ((const uint64_t*)data)[0];
+	uint64_t entries = ((const uint64_t*)data)[1];
+	const uint64_t* row = (const uint64_t*)data + 2;
+	const uint32_t* label = (const uint32_t*)(row + rows + 1);
+	if ((rows + 3) * sizeof(uint64_t) + entries * sizeof(uint32_t) > size || rows != m_FeatureMap.size() || row[rows] != entries
+		|| entries >= 0xFFFFFFFFULL)
+		return false;
+	m_ParamIndex.row.resize(rows + 1);
+	m_ParamIndex.row[0] = 0;
+	for (size_t i = 0; i < rows; ++i) {
+		if (row[i+1] < row[i] || row[i+1] > entries)
+			return false;
+		m_ParamIndex.row[i+1] = (uint32_t)row[i+1];
+	}
+	m_ParamIndex.label.assign(label, label + entries);
+	m_ParamIndex.fid.resize(entries);
+	for (size_t j = 0; j < entries; ++j)
+		m_ParamIndex.fid[j] = (uint32_t)j;	///< fid = entry number
+
+	/// weight
+	if (!f.nextSection(BIN_WEIGHT, data, size) || size < sizeof(uint64_t))
+		return false;
+	uint64_t count = *(const uint64_t*)data;
+	if (count != entries || sizeof(uint64_t) + count * sizeof(double) > size)
+		return false;
+	n_weight = count;
+	initialize();
+	if (n_weight > 0)
+		memcpy(&m_Weight[0], data + sizeof(uint64_t), n_weight * sizeof(double));
+
+	/// setting
+	m_Count.resize(n_weight);
+	fill(m_Count.begin(), m_Count.end(), 0.0);
+
+	return true;
+}
+
 /** Print the information.
 */
 void Parameter::print(Logger *log) {
 	//log->report("[Parameters]\n");
 	log->report("  # of States = \t%d\n", m_StateVec.size());
-	log->report("  # of Features = \t%d\n", m_FeatureVec.size());
+	log->report("  # of Features = \t%d\n", m_FeatureMap.size());
 	log->report("  # of Parameters = \t%d\n\n", n_weight);
 }
 
+void FeatureView::clear() {
+	m_Feature.clear();
+	m_Remap.clear();
+}
+
+/** Resolve the features of a sequence.
+	The string features are replaced by the global ids (seq[].ids), and the strings are released.
+*/
+void FeatureView::resolve(TriStringSequence& triseq) {
+	for (StringSequence::iterator it = triseq.seq.begin(); it != triseq.seq.end(); ++it) {
+		it->ids.resize(it->obs.size());
+		for (size_t i = 0; i < it->obs.size(); i++)
+			it->ids[i] = make_pair(m_Feature.insert(it->obs[i].first), it->obs[i].second);
+		vector<pair<string, double> >().swap(it->obs);
+	}
+	triseq.resolved = true;
+}
+
+/** Map the global ids to the observation ids of the planes.
+	It must be called again when new features are resolved or the planes change.
+*/
+void FeatureView::build(const vector<const Parameter*>& planes) {
+	m_Remap.resize(planes.size());
+	for (size_t p = 0; p < planes.size(); p++) {
+		m_Remap[p].resize(m_Feature.size());
+		for (size_t gid = 0; gid < m_Feature.size(); gid++)
+			m_Remap[p][gid] = planes[p]->findObs(StringRef(m_Feature.data(gid), m_Feature.length(gid)));
+	}
+}
+
 }	// namespace tricrf
 
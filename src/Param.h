@@ -10,13 +10,21 @@
 
 /// max headers
 #include "Utility.h"
+#include "Dictionary.h"
+#include "Data.h"
 /// standard headers
 #include <vector>
 #include <string>
 #include <map>
+#include <stdint.h>
 
 namespace tricrf {
 
+class BinaryModelWriter;
+class BinaryModelReader;
+
+const uint32_t NO_STATE = 0xFFFFFFFF;	///< label that is not in a parameter plane
+
 /** Structure for Observation Parameter.
 */
 struct ObsParam {
@@ -31,6 +39,21 @@ struct StateParam {
 	double fval;
 };
 
+/** Parameter index (compressed sparse row).
+	The parameters of the feature pid are the entries [row[pid], row[pid+1]),
+	and each entry packs the label and the weight id in 32 bits.
+*/
+struct ParamIndex {
+	std::vector<uint32_t> row;		///< offsets (size() + 1)
+	std::vector<uint32_t> label;	///< label of each entry
+	std::vector<uint32_t> fid;		///< weight id of each entry
+
+	size_t size() const { return row.empty() ? 0 : row.size() - 1; };
+	size_t begin(size_t pid) const { return row[pid]; };
+	size_t end(size_t pid) const { return row[pid+1]; };
+	void clear() { row.assign(1, 0); label.clear(); fid.clear(); };
+};
+
 /** Typedef for Map.
 */
 typedef std::map<std::string, size_t> Map;
@@ -52,11 +75,17 @@ protected:
 	std::vector<double> m_Count;
 	
 	/// Dictionary
-	Map m_FeatureMap;
-	Vec m_FeatureVec;
-	Map m_StateMap;
+	Dictionary m_FeatureMap;	///< the feature strings are kept only in the dictionary arena
+	Dictionary m_StateMap;
 	Vec m_StateVec;
 	
+	/// Updates queued while reading the data ; merged into m_ParamIndex in bulk
+	struct Update {
+		uint32_t pid, oid;
+		double fval;
+	};
+	std::vector<Update> m_Update;
+	void mergeUpdate();
 
 	/// Options
 	std::string mEDGE;
@@ -69,39 +98,42 @@ public:
 	Parameter();
 	~Parameter();
 
-	/// Parameter index
-	std::vector<std::vector<std::pair<size_t, size_t> > > m_ParamIndex;
+	/// Parameter index (valid after endUpdate() or load())
+	ParamIndex m_ParamIndex;
 
 	/// weight vector
 	void initialize();
 	void initializeGradient();
 	void initializeGradient2();
-	size_t size(); 
+	size_t size() const; 
 	void clear(bool state = false);
 
 	/// Parameters 
 	double* getWeight();
+	const double* getWeight() const;
 	double* getGradient();
 	void setWeight(double* theta);
 
 	std::vector<StateParam> m_StateIndex;
-	std::vector<ObsParam> makeObsIndex(std::vector<std::pair<size_t, double> >& obs);
-	std::vector<ObsParam> makeObsIndex(std::vector<std::pair<size_t, double> >& obs, std::map<size_t, size_t>& beam);
-	std::vector<ObsParam> makeObsIndex(std::vector<std::pair<std::string, double> >& obs);
-	int findObs(const std::string& key);
-	int findState(const std::string& key);
-	size_t getDefaultState();
+	std::vector<ObsParam> makeObsIndex(const std::vector<std::pair<size_t, double> >& obs) const;
+	std::vector<ObsParam> makeObsIndex(const std::vector<std::pair<size_t, double> >& obs, const std::map<size_t, size_t>& beam) const;
+	std::vector<ObsParam> makeObsIndex(const std::vector<std::pair<std::string, double> >& obs) const;
+	std::vector<ObsParam> makeObsIndex(const std::vector<std::pair<size_t, double> >& obs, const std::vector<int>& remap) const;	///< global feature ids
+	int findObs(const StringRef& key) const;
+	int findState(const StringRef& key) const;
+	size_t getDefaultState() const;
 
 	/// Dictionary access functions
-	size_t sizeFeatureVec();
-	size_t sizeStateVec();
-	std::pair<Map, Vec> getState();
+	size_t sizeFeatureVec() const;
+	size_t sizeStateVec() const;
+	std::pair<Map, Vec> getState() const;	///< builds the map ; use getStateVec() per token
+	const Vec& getStateVec() const { return m_StateVec; };	///< state names by id
 	//int findState(size_t key); 
 
 	/// Update and test the parameters
-	size_t addNewState(const std::string& key);
-	size_t addNewObs(const std::string& key);
-	size_t updateParam(size_t oid, size_t pid,  double fval = 1.0);
+	size_t addNewState(const StringRef& key);
+	size_t addNewObs(const StringRef& key);
+	void updateParam(size_t oid, size_t pid,  double fval = 1.0);
 	void endUpdate();
 	void makeStateIndex(bool makeIndex = true);
 	std::vector<StateParam> makeStateIndex(size_t y1);
@@ -111,6 +143,8 @@ public:
 	std::vector<StateParam> m_SelectedStateIndex;
 	std::vector<StateParam> m_RemainStateIndex;
 	void makeTiedPotential(double K);
+	void untiePotential();
+	bool isTied() const { return !remain_fid.empty(); };
 	std::vector<size_t> remain_fid;
 	std::vector<double> remain_count;
 	std::vector<std::vector<size_t> > m_SelectedStateList1;
@@ -119,11 +153,31 @@ public:
 	/// save and load
 	bool save(std::ofstream& f);
 	bool load(std::ifstream& f);
+	bool save(BinaryModelWriter& f);
+	bool load(BinaryModelReader& f);
 
 	/// Reporting
 	void print(Logger *log);
 };
 
+/** Integer view of the string features for several parameter planes.
+	The feature strings of the data are interned once to global ids, and every plane
+	maps a global id to its own observation id (-1 if the plane does not have it),
+	so the observation index of any plane is made without a string lookup.
+	@class FeatureView
+*/
+class FeatureView {
+private:
+	Dictionary m_Feature;	///< global feature ids
+	std::vector<std::vector<int> > m_Remap;	///< [plane][global id] -> observation id
+
+public:
+	void clear();
+	void resolve(TriStringSequence& triseq);	///< intern the features and drop the strings
+	void build(const std::vector<const Parameter*>& planes);	///< (re)map the global ids to the planes
+	const std::vector<int>& remap(size_t plane) const { return m_Remap[plane]; };
+};
+
 } // namespace tricrf
 
 #endif
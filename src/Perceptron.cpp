@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Perceptron.h"
+#include "Utility.h"
+/// standard headers
+#include <algorithm>
+
+using namespace std;
+
+namespace tricrf {
+
+Perceptron::Perceptron()
+	: m_MIRA(false), m_C(1.0), m_time(0), m_seed(88172645463325252ULL), m_averaged(false) {
+}
+
+/** Initialize.
+	@param mira	1-best MIRA (false: perceptron)
+	@param C	upper bound of the step (MIRA)
+*/
+void Perceptron::initialize(bool mira, double C) {
+	m_Block.clear();
+	m_MIRA = mira;
+	m_C = C;
+	m_time = 0;
+	m_averaged = false;
+}
+
+size_t Perceptron::addBlock(double* theta, double* gradient, size_t size) {
+	Block block;
+	block.theta = theta;
+	block.gradient = gradient;
+	block.size = size;
+	m_Block.push_back(block);
+	m_Block.back().sum.assign(size, 0.0);
+	m_Block.back().stamp.assign(size, 0);
+	m_Block.back().mark.assign(size, 0);
+	return m_Block.size() - 1;
+}
+
+/** Take the step of the current sample.
+	@param loss	loss of the best path (e.g. number of wrong labels) ; no step for 0
+	@return	true if the weights are changed
+*/
+bool Perceptron::update(double loss) {
+	/// |f(x,y^) - f(x,y)|^2 and theta * (f(x,y^) - f(x,y)) = -margin
+	double norm = 0.0, dot = 0.0;
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		const Block& block = m_Block[b];
+		for (size_t k = 0; k < block.touched.size(); k++) {
+			double g = block.gradient[block.touched[k]];
+			norm += g * g;
+			dot += g * block.theta[block.touched[k]];
+		}
+	}
+
+	double tau = 0.0;
+	if (loss > 0.0 && norm > 0.0)
+		tau = (m_MIRA ? min(m_C, (loss + dot) / norm) : 1.0);
+
+	/// the weights before the step count for the samples up to this one
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		Block& block = m_Block[b];
+		for (size_t k = 0; k < block.touched.size(); k++) {
+			size_t j = block.touched[k];
+			double g = block.gradient[j];
+			if (tau > 0.0 && g != 0.0) {
+				block.sum[j] += (m_time - block.stamp[j]) * block.theta[j];
+				block.stamp[j] = m_time;
+				block.theta[j] -= tau * g;
+			}
+			block.gradient[j] = 0.0;
+			block.mark[j] = 0;
+		}
+		block.touched.clear();
+	}
+	++m_time;
+
+	return tau > 0.0;
+}
+
+/** Replace the weights by their averages over the samples.
+	The current weights are kept for restore().
+	@return	false if there is no sample
+*/
+bool Perceptron::average() {
+	if (m_time == 0 || m_averaged)
+		return false;
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		Block& block = m_Block[b];
+		block.current.assign(block.theta, block.theta + block.size);
+		for (size_t j = 0; j < block.size; j++)
+			block.theta[j] = (block.sum[j] + (m_time - block.stamp[j]) * block.theta[j]) / m_time;
+	}
+	m_averaged = true;
+	return true;
+}
+
+void Perceptron::restore() {
+	if (!m_averaged)
+		return;
+	for (size_t b = 0; b < m_Block.size(); b++)
+		copy(m_Block[b].current.begin(), m_Block[b].current.end(), m_Block[b].theta);
+	m_averaged = false;
+}
+
+/** Shuffle the samples of an epoch.
+	The seed is fixed, so that the training is reproducible.
+*/
+void Perceptron::shuffle(vector<size_t>& order) {
+	shuffleOrder(order, m_seed);
+}
+
+} // namespace tricrf
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __PERCEPTRON_H__
+#define __PERCEPTRON_H__
+
+/// standard headers
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+namespace tricrf {
+
+/** Averaged perceptron and 1-best MIRA with lazy averaging.
+	The model decodes a sample with the current weights and writes f(x,y^) - f(x,y)
+	of the best path y^ and the reference y into the gradient vectors ; it touches the weights it writes.
+	update() takes the step theta -= tau * (f(x,y^) - f(x,y)) on them,
+	with tau = 1 (perceptron) or tau = min(C, (loss - margin) / |f(x,y^) - f(x,y)|^2) (MIRA).
+	The average over the samples is kept lazily: each weight has the sum of its past values
+	up to its last change (timestamp), so that a step costs only the touched weights.
+	@reference
+		1) M. Collins, 2002, Discriminative training methods for hidden Markov models, EMNLP.
+		2) K. Crammer and Y. Singer, 2003, Ultraconservative online algorithms for multiclass problems, JMLR.
+		3) H. Daume III, 2006, Practical structured learning techniques for natural language processing, Ph.D. thesis.
+	@class Perceptron
+*/
+class Perceptron {
+private:
+	struct Block {
+		double* theta;
+		double* gradient;
+		size_t size;
+		std::vector<double> sum;	///< sum of the weights over the samples before the timestamp
+		std::vector<size_t> stamp;	///< timestamp of the last change
+		std::vector<double> current;	///< the current weights (while the averages are applied)
+		std::vector<char> mark;		///< touched in the current step
+		std::vector<size_t> touched;	///< weights of the current step
+	};
+	std::vector<Block> m_Block;
+
+	bool m_MIRA;
+	double m_C;			///< aggressiveness (MIRA)
+	size_t m_time;		///< number of the samples
+	uint64_t m_seed;	///< xorshift state (shuffling)
+	bool m_averaged;	///< the averages are applied
+
+public:
+	Perceptron();
+
+	void initialize(bool mira, double C);	///< remove the blocks
+	size_t addBlock(double* theta, double* gradient, size_t size);	///< @return block id
+	void touch(size_t block, size_t j) {
+		Block& b = m_Block[block];
+		if (!b.mark[j]) {
+			b.mark[j] = 1;
+			b.touched.push_back(j);
+		}
+	};
+
+	bool update(double loss);	///< step on the touched weights and clear their gradient ; @return true if the weights are changed
+	bool average();		///< replace the weights by their averages
+	void restore();		///< back to the current weights after average()
+
+	size_t size() const { return m_time; };	///< number of the samples
+	void shuffle(std::vector<size_t>& order);
+};
+
+} // namespace tricrf
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "SGD.h"
+#include "Utility.h"
+/// standard headers
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+namespace tricrf {
+
+/** Constructor.
+	@param sigma	prior of the objective (L2: theta^2 / (2 * sigma), L1: |theta| / sigma) ; 0 for none
+	@param L1	L1 regularization
+	@param rate	eta_0
+	@param decay	alpha ; the learning rate is multiplied by alpha every epoch (0: eta_0 / (1 + lambda * eta_0 * k))
+	@param n_data	number of samples per epoch ; each sample takes 1/N of the regularization
+*/
+SGD::SGD(double sigma, bool L1, double rate, double decay, size_t n_data)
+	: m_round_rate(0.0), m_sigma(sigma), m_L1(L1), m_rate0(rate), m_decay(decay), m_n_data(max(n_data, (size_t)1)),
+	m_step(0), m_total(0.0), m_seed(88172645463325252ULL), m_saved_step(0), m_saved_total(0.0) {
+	m_lambda = 1.0 / ((m_sigma ? m_sigma : 1.0) * m_n_data);
+	if (!validRate(m_rate0))
+		throw runtime_error("SGD: the learning rate is too large for the L2 prior");
+}
+
+size_t SGD::addBlock(double* theta, double* gradient, size_t size) {
+	Block block;
+	block.theta = theta;
+	block.gradient = gradient;
+	block.size = size;
+	m_Block.push_back(block);
+	m_Block.back().applied.assign(size, 0.0);
+	m_Dense.push_back(vector<size_t>());
+	return m_Block.size() - 1;
+}
+
+double SGD::rate() const {
+	if (m_decay > 0.0)
+		return m_rate0 * pow(m_decay, (double)m_step / m_n_data);
+	return m_rate0 / (1.0 + m_lambda * m_rate0 * m_step);
+}
+
+/** Apply the pending regularization to a weight.
+	L2: theta *= prod (1 - eta_k * lambda) since its last step.
+	L1: theta is clipped at zero by the cumulative penalty (Tsuruoka et al., 2009).
+*/
+void SGD::regularize(Block& block, size_t j) {
+	if (!m_sigma)
+		return;
+	double& w = block.theta[j];
+	double& applied = block.applied[j];
+	if (m_L1) {
+		double z = w;
+		if (w > 0.0)
+			w = max(0.0, w - (m_total + applied));
+		else if (w < 0.0)
+			w = min(0.0, w + (m_total - applied));
+		applied += w - z;
+	} else if (applied != m_total) {
+		w *= exp(m_total - applied);
+		applied = m_total;
+	}
+}
+
+void SGD::advance(double eta) {
+	if (m_sigma) {
+		if (m_L1)
+			m_total += eta / (m_sigma * m_n_data);
+		else
+			m_total += log(1.0 - eta / (m_sigma * m_n_data));
+	}
+}
+
+/** Make the workers.
+	A single worker writes the gradient vectors of the blocks and takes the steps one by one ;
+	several workers (Hogwild) have their own gradients and take the steps of a round at the same time.
+	Call after the blocks are added.
+*/
+void SGD::setWorkers(size_t n_workers) {
+	m_Worker.assign(max(n_workers, (size_t)1), Worker());
+	for (size_t w = 0; w < m_Worker.size(); w++) {
+		Worker& worker = m_Worker[w];
+		worker.buffer.resize(m_Block.size());
+		for (size_t b = 0; b < m_Block.size(); b++) {
+			if (m_Worker.size() > 1) {
+				worker.buffer[b].assign(m_Block[b].size, 0.0);
+				worker.gradient.push_back(&worker.buffer[b][0]);
+			} else {
+				worker.gradient.push_back(m_Block[b].gradient);
+			}
+			worker.mark.push_back(vector<char>(m_Block[b].size, 0));
+			worker.touched.push_back(vector<size_t>());
+		}
+	}
+}
+
+void SGD::addDense(size_t block, size_t j) {
+	m_Dense[block].push_back(j);
+}
+
+/** Begin a round of the workers.
+	Every sample of the round takes the learning rate of the first one ;
+	the regularization of all the steps is applied to the weights before the workers touch them.
+	@param n_samples	number of the samples in the round
+*/
+void SGD::beginRound(size_t n_samples) {
+	m_round_rate = rate();
+	for (size_t k = 0; k < n_samples; k++)
+		advance(m_round_rate);
+	m_step += n_samples;
+}
+
+/// two workers may write a weight at the same time (Hogwild)
+void SGD::prepare(size_t worker) {
+	Worker& w = m_Worker[worker];
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		for (size_t k = 0; k < w.touched[b].size(); k++)
+			regularize(m_Block[b], w.touched[b][k]);
+	}
+}
+
+/** Take the step of the current sample of a worker.
+	theta -= eta * gradient on the touched weights, which are then regularized ;
+	their gradient is reset to zero for the next sample.
+	Hogwild: the step is taken without a lock at the rate of the round (beginRound()),
+	and the dense weights are left to endRound().
+*/
+void SGD::update(size_t worker) {
+	bool hogwild = (m_Worker.size() > 1);
+	double eta = (hogwild ? m_round_rate : rate());
+	if (!hogwild)
+		advance(eta);
+
+	Worker& w = m_Worker[worker];
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		Block& block = m_Block[b];
+		double* gradient = w.gradient[b];
+		for (size_t k = 0; k < w.touched[b].size(); k++) {
+			size_t j = w.touched[b][k];
+			block.theta[j] -= eta * gradient[j];
+			regularize(block, j);
+			gradient[j] = 0.0;
+			w.mark[b][j] = 0;
+		}
+		w.touched[b].clear();
+	}
+	if (!hogwild)
+		++m_step;
+}
+
+/** End a round of the workers.
+	The gradients of the dense weights are added in the order of the workers,
+	so that a round does not depend on the timing of the threads.
+*/
+void SGD::endRound() {
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		Block& block = m_Block[b];
+		for (size_t k = 0; k < m_Dense[b].size(); k++) {
+			size_t j = m_Dense[b][k];
+			double g = 0.0;
+			for (size_t w = 0; w < m_Worker.size(); w++) {
+				g += m_Worker[w].gradient[b][j];
+				m_Worker[w].gradient[b][j] = 0.0;
+			}
+			regularize(block, j);
+			block.theta[j] -= m_round_rate * g;
+			regularize(block, j);
+		}
+	}
+}
+
+void SGD::finish() {
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		Block& block = m_Block[b];
+		for (size_t j = 0; j < block.size; j++)
+			regularize(block, j);
+	}
+}
+
+/** Save the weights (after finish()) and the state of the regularization.
+*/
+void SGD::save() {
+	m_saved_theta.resize(m_Block.size());
+	m_saved_applied.resize(m_Block.size());
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		m_saved_theta[b].assign(m_Block[b].theta, m_Block[b].theta + m_Block[b].size);
+		m_saved_applied[b] = m_Block[b].applied;
+	}
+	m_saved_step = m_step;
+	m_saved_total = m_total;
+}
+
+/** Restore the saved weights and halve eta_0.
+	The epoch is taken again with the smaller steps.
+*/
+void SGD::restore() {
+	rewind();
+	m_rate0 *= 0.5;
+}
+
+void SGD::rewind() {
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		copy(m_saved_theta[b].begin(), m_saved_theta[b].end(), m_Block[b].theta);
+		m_Block[b].applied = m_saved_applied[b];
+	}
+	m_step = m_saved_step;
+	m_total = m_saved_total;
+}
+
+double SGD::penalty() const {
+	double sum = 0.0;
+	if (!m_sigma)
+		return sum;
+	for (size_t b = 0; b < m_Block.size(); b++) {
+		const Block& block = m_Block[b];
+		for (size_t j = 0; j < block.size; j++) {
+			double w = block.theta[j];
+			sum += (m_L1 ? fabs(w / m_sigma) : (w * w) / (2 * m_sigma));
+		}
+	}
+	return sum;
+}
+
+/** Shuffle the samples of an epoch.
+	The seed is fixed, so that the training is reproducible.
+*/
+void SGD::shuffle(vector<size_t>& order) {
+	shuffleOrder(order, m_seed);
+}
+
+} // namespace tricrf
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __SGD_H__
+#define __SGD_H__
+
+/// standard headers
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+namespace tricrf {
+
+/** Stochastic gradient descent with lazy regularization.
+	The model accumulates the gradient of a sample (E[p] - E[~p]) in the gradient vectors
+	and touches the weights it writes, so that a step visits only those weights.
+	The regularization of the other weights is deferred until they are touched again:
+	L2 keeps the log of the product of the decays (1 - eta * lambda), and
+	L1 keeps the cumulative penalty u and the penalty q actually applied to each weight.
+	The weights of a model may be split into several blocks (parameter vectors).
+	Learning rate of the k-th sample: eta_k = eta_0 / (1 + lambda * eta_0 * k) with lambda = 1 / (sigma * N)
+	(Bottou, 2012), or eta_k = eta_0 * alpha^(k/N) for a decay alpha. eta_0 may be calibrated
+	on a subsample of the data (see MaxEnt::calibrateRate()).
+	If an epoch makes the objective worse, the model restores the weights saved before it
+	and eta_0 is halved.
+	Hogwild: several workers (threads) take their samples at the same time ; each worker has its own
+	gradient vectors and touched weights, and steps on the shared weights without a lock.
+	A round is a few samples of each worker ; the dense weights of every sample (the transitions)
+	are summed over the samples of the round and stepped at its end (endRound()), since the inference
+	reads them as one matrix.
+	@reference
+		1) L. Bottou, 2010, Large-scale machine learning with stochastic gradient descent, COMPSTAT.
+		2) Y. Tsuruoka, J. Tsujii and S. Ananiadou, 2009, Stochastic gradient descent training for L1-regularized log-linear models with cumulative penalty, ACL-IJCNLP.
+		3) F. Niu, B. Recht, C. Re and S. J. Wright, 2011, Hogwild!: a lock-free approach to parallelizing stochastic gradient descent, NIPS.
+		4) L. Bottou, 2012, Stochastic gradient descent tricks, Neural Networks: Tricks of the Trade.
+	@class SGD
+*/
+class SGD {
+private:
+	struct Block {
+		double* theta;
+		double* gradient;
+		size_t size;
+		std::vector<double> applied;	///< log decay (L2) or penalty q (L1) applied to each weight
+	};
+	std::vector<Block> m_Block;
+
+	/// a single worker takes the steps one by one ; several workers are Hogwild
+	struct Worker {
+		std::vector<double*> gradient;	///< gradient of each block
+		std::vector<std::vector<double> > buffer;	///< thread-local gradients (Hogwild)
+		std::vector<std::vector<char> > mark;		///< touched in the current step
+		std::vector<std::vector<size_t> > touched;	///< weights of the current step
+	};
+	std::vector<Worker> m_Worker;
+	std::vector<std::vector<size_t> > m_Dense;	///< weights of each block stepped by endRound()
+	double m_round_rate;	///< eta of the current round
+
+	double m_sigma;		///< prior (0: no regularization)
+	bool m_L1;
+	double m_rate0;		///< eta_0
+	double m_decay;		///< alpha (0: eta_0 / (1 + lambda * eta_0 * k))
+	size_t m_n_data;	///< N ; samples per epoch
+	double m_lambda;	///< regularization of a step
+	size_t m_step;		///< k
+	double m_total;		///< log decay (L2) or cumulative penalty u (L1) over the steps
+	uint64_t m_seed;	///< xorshift state (shuffling)
+
+	/// snapshot at the beginning of an epoch
+	std::vector<std::vector<double> > m_saved_theta;
+	std::vector<std::vector<double> > m_saved_applied;
+	size_t m_saved_step;
+	double m_saved_total;
+
+	void regularize(Block& block, size_t j);	///< apply the pending regularization to a weight
+	void advance(double eta);	///< regularization of one step
+
+public:
+	SGD(double sigma, bool L1, double rate, double decay, size_t n_data);
+
+	size_t addBlock(double* theta, double* gradient, size_t size);	///< @return block id
+	void setWorkers(size_t n_workers);	///< after the blocks ; 1 for the sequential steps
+
+	/// a sample of a worker: touch(), prepare(), then the model writes gradient() and update()
+	double* gradient(size_t worker, size_t block) { return m_Worker[worker].gradient[block]; };
+	void touch(size_t worker, size_t block, size_t j) {
+		Worker& w = m_Worker[worker];
+		if (!w.mark[block][j]) {
+			w.mark[block][j] = 1;
+			w.touched[block].push_back(j);
+		}
+	};
+	void prepare(size_t worker);	///< bring the touched weights up to date (before the inference)
+	void update(size_t worker);	///< step on the touched weights and clear their gradient
+	void finish();	///< bring every weight up to date (end of an epoch)
+	void save();	///< keep the weights at the beginning of an epoch
+	void restore();	///< go back to the saved weights and halve eta_0 (divergence)
+	void rewind();	///< go back to the saved weights
+
+	/// Hogwild
+	void addDense(size_t block, size_t j);	///< a weight written by every sample ; stepped by endRound()
+	void beginRound(size_t n_samples);	///< advance the steps of the samples of a round
+	void endRound();	///< step on the dense weights with the sum of the workers
+
+	double rate() const;	///< eta of the current step
+	double initialRate() const { return m_rate0; };	///< eta_0
+	void setInitialRate(double rate) { m_rate0 = rate; };
+	bool validRate(double rate) const { return m_sigma == 0 || m_L1 || rate < m_sigma * m_n_data; };	///< the L2 decay of a step is positive
+	double penalty() const;	///< regularization term of the objective
+	void shuffle(std::vector<size_t>& order);
+};
+
+} // namespace tricrf
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Thread.h"
+/// standard headers
+#include <stdexcept>
+
+using namespace std;
+
+namespace tricrf {
+
+/** Constructor.
+	@param n_threads	number of threads (1 means no worker thread)
+*/
+ThreadPool::ThreadPool(size_t n_threads) {
+	m_Size = (n_threads < 1 ? 1 : n_threads);
+	m_Job = NULL;
+	m_Generation = 0;
+	m_Running = 0;
+	m_Quit = false;
+	pthread_mutex_init(&m_Mutex, NULL);
+	pthread_cond_init(&m_Start, NULL);
+	pthread_cond_init(&m_Done, NULL);
+
+	m_Args.resize(m_Size);
+	m_Threads.resize(m_Size);
+	for (size_t i = 1; i < m_Size; i++) {
+		m_Args[i].pool = this;
+		m_Args[i].tid = i;
+		if (pthread_create(&m_Threads[i], NULL, &ThreadPool::worker, &m_Args[i]) != 0)
+			throw runtime_error("cannot create thread");
+	}
+}
+
+/** Destructor.
+*/
+ThreadPool::~ThreadPool() {
+	pthread_mutex_lock(&m_Mutex);
+	m_Quit = true;
+	pthread_cond_broadcast(&m_Start);
+	pthread_mutex_unlock(&m_Mutex);
+	for (size_t i = 1; i < m_Size; i++)
+		pthread_join(m_Threads[i], NULL);
+	pthread_cond_destroy(&m_Done);
+	pthread_cond_destroy(&m_Start);
+	pthread_mutex_destroy(&m_Mutex);
+}
+
+void* ThreadPool::worker(void* arg) {
+	WorkerArg* w = (WorkerArg*)arg;
+	w->pool->loop(w->tid);
+	return NULL;
+}
+
+/** Worker loop.
+	Waits for a new generation of the job, runs it and reports back.
+*/
+void ThreadPool::loop(size_t tid) {
+	size_t generation = 0;
+	while (true) {
+		pthread_mutex_lock(&m_Mutex);
+		while (!m_Quit && m_Generation == generation)
+			pthread_cond_wait(&m_Start, &m_Mutex);
+		if (m_Quit) {
+			pthread_mutex_unlock(&m_Mutex);
+			break;
+		}
+		generation = m_Generation;
+		ThreadJob* job = m_Job;
+		pthread_mutex_unlock(&m_Mutex);
+
+		job->run(tid, m_Size);
+
+		pthread_mutex_lock(&m_Mutex);
+		if (--m_Running == 0)
+			pthread_cond_signal(&m_Done);
+		pthread_mutex_unlock(&m_Mutex);
+	}
+}
+
+/** Run the job.
+	job.run(tid, size()) is called on every thread; the caller runs tid 0.
+	@param job	job to be executed
+*/
+void ThreadPool::run(ThreadJob& job) {
+	if (m_Size == 1) {
+		job.run(0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&m_Mutex);
+	m_Job = &job;
+	m_Running = m_Size - 1;
+	++m_Generation;
+	pthread_cond_broadcast(&m_Start);
+	pthread_mutex_unlock(&m_Mutex);
+
+	job.run(0, m_Size);
+
+	pthread_mutex_lock(&m_Mutex);
+	while (m_Running > 0)
+		pthread_cond_wait(&m_Done, &m_Mutex);
+	m_Job = NULL;
+	pthread_mutex_unlock(&m_Mutex);
+}
+
+} // namespace tricrf
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+/// standard headers
+#include <vector>
+#include <pthread.h>
+
+namespace tricrf {
+
+/** Job for the thread pool.
+	run() is called once on every worker with its thread id.
+	@class ThreadJob
+*/
+class ThreadJob {
+public:
+	virtual ~ThreadJob() {}
+	virtual void run(size_t tid, size_t n_threads) = 0;
+};
+
+/** Fork-join thread pool (pthread).
+	Workers are created once and sleep between the jobs,
+	so a job can be dispatched per iteration (or per sequence) cheaply.
+	The calling thread works as thread 0.
+	@class ThreadPool
+*/
+class ThreadPool {
+private:
+	size_t m_Size;		///< number of threads (including the caller)
+	std::vector<pthread_t> m_Threads;
+	pthread_mutex_t m_Mutex;
+	pthread_cond_t m_Start;
+	pthread_cond_t m_Done;
+	ThreadJob* m_Job;		///< current job
+	size_t m_Generation;	///< job counter
+	size_t m_Running;		///< number of busy workers
+	bool m_Quit;
+
+	struct WorkerArg {
+		ThreadPool* pool;
+		size_t tid;
+	};
+	std::vector<WorkerArg> m_Args;
+
+	static void* worker(void* arg);
+	void loop(size_t tid);
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+public:
+	ThreadPool(size_t n_threads = 1);
+	~ThreadPool();
+
+	size_t size() const { return m_Size; };
+	void run(ThreadJob& job);	///< run the job on all threads and wait
+};
+
+/// [begin, end) of the contiguous block assigned to thread tid
+inline void splitRange(size_t n, size_t tid, size_t n_threads, size_t& begin, size_t& end) {
+	begin = n * tid / n_threads;
+	end = n * (tid + 1) / n_threads;
+}
+
+/** Reduction job.
+	Adds the thread-local buffers (1..n-1) to the target vector in thread order;
+	the vector is split over the threads. Buffer 0 is not used since thread 0 
+	writes the target directly.
+	@class ReduceJob
+*/
+class ReduceJob : public ThreadJob {
+private:
+	double* m_Target;
+	size_t m_Size;
+	std::vector<std::vector<double> >& m_Buffer;
+public:
+	ReduceJob(double* target, size_t size, std::vector<std::vector<double> >& buffer)
+		: m_Target(target), m_Size(size), m_Buffer(buffer) {}
+	void run(size_t tid, size_t n_threads) {
+		size_t begin, end;
+		splitRange(m_Size, tid, n_threads, begin, end);
+		for (size_t t = 1; t < m_Buffer.size(); t++) {
+			const double* buffer = &m_Buffer[t][0];
+			for (size_t i = begin; i < end; i++)
+				m_Target[i] += buffer[i];
+		}
+	}
+};
+
+} // namespace tricrf
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "TriCRF.h"
+#include "Thread.h"
+/// standard headers
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+namespace tricrf {
+
+/** Topic pruning.
+	Drops the topics whose posterior is below the best one divided by the prune threshold.
+	ctx.topic.prune should be sorted in descending order (see getPartitionZ).
+	@param ctx	inference context
+*/
+void TriCRF::pruneTopic(InferenceContext& ctx) const {
+	long double threshold = ctx.topic.prune[0].first / m_prune_threshold;
+	vector<pair<long double, size_t> >::iterator pit = ctx.topic.prune.begin();
+	for (; pit != ctx.topic.prune.end(); pit++) {
+		if (pit->first < threshold) {
+			ctx.topic.prune.erase(pit, ctx.topic.prune.end());
+			break;
+		}
+	}
+}
+
+/** Topic beam.
+	Orders the topic planes of the lattice for the forward pass (ctx.topic.active).
+	Without a beam every plane is kept in order ; otherwise the planes are sorted by their upper bound
+	(ctx.topic.bound, see boundTopic) so that forwardTopics can stop at the first plane out of the beam.
+	@param ctx	inference context
+	@param keep	topic that is always computed (the reference topic in training)
+*/
+void TriCRF::beamTopic(InferenceContext& ctx, size_t keep) const {
+	size_t n_topic = ctx.topic.Gamma.size();
+	ctx.topic.active.clear();
+	if (m_topic_beam <= 0) {
+		for (size_t z = 0; z < n_topic; z++)
+			ctx.topic.active.push_back(z);
+		return;
+	}
+
+	vector<pair<long double, size_t> > order;
+	for (size_t z = 0; z < n_topic; z++) {
+		if (z != keep)
+			order.push_back(make_pair(ctx.topic.bound[z], z));
+	}
+	sort(order.rbegin(), order.rend());
+	if (keep < n_topic)
+		ctx.topic.active.push_back(keep);
+	for (size_t i = 0; i < order.size(); i++)
+		ctx.topic.active.push_back(order[i].second);
+}
+
+/** Forward recursion of the topic planes.
+	With a topic beam, the planes are visited in the order of beamTopic and the visit stops
+	at the first plane whose bound is below the best exact value so far divided by the beam.
+	Such a plane can not be within the beam, so it would be pruned by pruneTopic (prune <= topic_beam) anyway.
+	The planes are computed in waves of one plane per thread (ctx.topic.pool) ; the results of a wave 
+	are then visited in order with the same rule, so that the planes that a single thread would not have 
+	computed are dropped (their alpha is reset) and Z does not depend on the number of threads.
+	Without a beam all the planes are one wave.
+	ctx.topic.active is truncated to the computed planes ; the alpha of the other planes stays zero.
+	@param ctx	inference context
+*/
+void TriCRF::forwardTopics(InferenceContext& ctx) const {
+	size_t wave = ctx.topic.active.size();
+	if (m_topic_beam > 0)
+		wave = (ctx.topic.pool != NULL ? ctx.topic.pool->size() : 1);
+
+	long double threshold = -numeric_limits<long double>::infinity();
+	vector<size_t> topics;
+	vector<long double> value;
+	size_t a = 0;
+	while (a < ctx.topic.active.size()) {
+		topics.clear();
+		for (size_t next = a; next < ctx.topic.active.size() && topics.size() < wave; next++) {
+			if (m_topic_beam > 0 && ctx.topic.bound[ctx.topic.active[next]] < threshold)
+				break;
+			topics.push_back(ctx.topic.active[next]);
+		}
+		if (topics.empty()) {	///< out of the beam
+			ctx.topic.active.resize(a);
+			break;
+		}
+
+		runTopics(ctx, TOPIC_FORWARD, topics, value);
+		for (size_t i = 0; i < value.size(); i++, a++) {
+			if (m_topic_beam > 0 && ctx.topic.bound[topics[i]] < threshold) {	///< not computed by a single thread
+				for (size_t j = i; j < topics.size(); j++)
+					fill(ctx.topic.ZAlpha[topics[j]].begin(), ctx.topic.ZAlpha[topics[j]].end(), 0.0);
+				ctx.topic.active.resize(a);
+				return;
+			}
+			if (m_topic_beam > 0 && value[i] > 0)
+				threshold = max(threshold, log(value[i]) - log(m_topic_beam));
+		}
+	}
+}
+
+/** Thread pool for the topic planes of a sequence.
+	The planes are used only if there are enough of them to keep every thread busy ;
+	otherwise the threads are better used over the sequences (or not at all).
+	@param n_topic	number of the topic planes
+	@return pool (NULL: sequential)
+*/
+ThreadPool* TriCRF::topicPool(size_t n_topic) const {
+	if (m_Pool == NULL || n_topic < 2 * m_Pool->size())
+		return NULL;
+	return m_Pool;
+}
+
+/** Topic-plane job.
+	Each thread takes the next plane (task) until no plane is left ; 
+	every plane writes only its own lattice (ZAlpha[z], ZBeta[z]) and result.
+	@class TopicJob
+*/
+class TopicJob : public ThreadJob {
+private:
+	const TriCRF* m_Model;
+	InferenceContext& m_Context;
+	TriCRF::TopicPass m_Pass;
+	const vector<size_t>& m_Topics;
+	vector<long double>& m_Value;
+	vector<vector<size_t> >* m_Path;
+	size_t m_Next;	///< next task
+public:
+	TopicJob(const TriCRF* model, InferenceContext& ctx, TriCRF::TopicPass pass, const vector<size_t>& topics, 
+		vector<long double>& value, vector<vector<size_t> >* path)
+		: m_Model(model), m_Context(ctx), m_Pass(pass), m_Topics(topics), m_Value(value), m_Path(path), m_Next(0) {}
+	void run(size_t, size_t) {
+		size_t t;
+		while ((t = __sync_fetch_and_add(&m_Next, 1)) < m_Topics.size()) {
+			size_t z = m_Topics[t];
+			if (m_Pass == TriCRF::TOPIC_FORWARD)
+				m_Value[t] = m_Model->forwardTopic(m_Context, z);
+			else if (m_Pass == TriCRF::TOPIC_BACKWARD)
+				m_Model->backwardTopic(m_Context, z);
+			else
+				m_Value[t] = m_Model->viterbiTopic(m_Context, z, (*m_Path)[t]);
+		}
+	}
+};
+
+/** Run a pass over the topic planes of a sequence (on ctx.topic.pool, if any).
+	@param ctx	inference context (the lattices of the planes should be allocated)
+	@param pass	forward, backward or viterbi
+	@param topics	topic planes
+	@param value	result of each plane (Gamma * Z for forward, the best path probability for viterbi)
+	@param path	best path of each plane (viterbi)
+*/
+void TriCRF::runTopics(InferenceContext& ctx, TopicPass pass, const vector<size_t>& topics, 
+		vector<long double>& value, vector<vector<size_t> >* path) const {
+	value.assign(topics.size(), 0.0);
+	if (path != NULL)
+		path->resize(topics.size());
+	TopicJob job(this, ctx, pass, topics, value, path);
+	if (ctx.topic.pool != NULL && topics.size() > 1)
+		ctx.topic.pool->run(job);
+	else
+		job.run(0, 1);
+}
+
+/// a lattice per worker (m_Context for a single one)
+void TriCRF::onlineBegin(size_t n_workers) {
+	m_WorkerContext.assign(n_workers > 1 ? n_workers : 0, InferenceContext());
+}
+
+/// the topic planes have no sparse forward-backward
+void TriCRF::onlineEpoch() {
+}
+
+} // namespace tricrf
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __TRICRF_H__
+#define __TRICRF_H__
+
+/// max headers
+#include "CRF.h"
+/// standard headers
+#include <vector>
+
+namespace tricrf {
+
+/** Triangular-chain Conditional Random Fields (common to the models).
+	A sequence has one lattice per topic (the topic planes, in the topic fields of InferenceContext) ;
+	the planes are independent, so that they are pruned, bounded and run on the threads here,
+	and each model gives the recursion of a single plane.
+	@class TriCRF
+*/
+class TriCRF : public CRF {
+protected:
+	/// Topic pruning
+	void pruneTopic(InferenceContext& ctx) const;	///< Topic pruning
+	void beamTopic(InferenceContext& ctx, size_t keep = (size_t)-1) const;	///< Topic beam (before the forward pass)
+	void forwardTopics(InferenceContext& ctx) const;	///< Forward recursion of the topic planes within the beam
+
+	/// Topic planes of a sequence ; independent, so they run on ctx.topic.pool
+	enum TopicPass { TOPIC_FORWARD, TOPIC_BACKWARD, TOPIC_VITERBI };
+	ThreadPool* topicPool(size_t n_topic) const;
+	void runTopics(InferenceContext& ctx, TopicPass pass, const std::vector<size_t>& topics,
+		std::vector<long double>& value, std::vector<std::vector<size_t> >* path = NULL) const;
+	virtual long double forwardTopic(InferenceContext& ctx, size_t z) const = 0;	///< Forward recursion of a topic plane
+	virtual void backwardTopic(InferenceContext& ctx, size_t z) const = 0;	///< Backward recursion of a topic plane
+	virtual long double viterbiTopic(const InferenceContext& ctx, size_t z, std::vector<size_t>& y_seq) const = 0;	///< Best path of a topic plane
+	friend class TopicJob;
+
+	/// Online estimation ; the planes of a sequence are sequential in a Hogwild worker
+	void onlineBegin(size_t n_workers);
+	void onlineEpoch();
+};	///< TriCRF
+
+} // namespace tricrf
+
+#endif
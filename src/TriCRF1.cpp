@@ -7,9 +7,12 @@
 
 /// max headers
 #include "TriCRF1.h"
+#include "BinaryModel.h"
 #include "Evaluator.h"
 #include "Utility.h"
+#include "Corpus.h"
 #include "LBFGS.h"
+#include "SGD.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -66,6 +69,7 @@ void TriCRF1::clear() {
 	m_ParamTopic.clear();
 	m_Param.clear();
 	m_state_size.clear();
+	m_View.clear();
 }
 
 void TriCRF1::initializeModel() {
@@ -87,39 +91,95 @@ bool TriCRF1::saveModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model saving]\n");
 
-	/// file stream
-    ofstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("unable to open file to write");
-
-    /// header
-    f << "# MAX: A C++ Library for Structured Prediction" << endl;
-	f << "# TriCRF1 Model file (text format)" << endl;
-	f << "# Do not edit this file" << endl;
-	f << "# " << endl << ":" << endl;
-	
+	bool ret;
+	if (m_BinaryModel) {
+		/// binary format
+		BinaryModelWriter f(filename, "TriCRF1");
+		ret = saveParam(f) && saveMapping(f);
+		f.close();
+	} else {
+		/// file stream
+		ofstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("unable to open file to write");
+
+		/// header
+		f << "# MAX: A C++ Library for Structured Prediction" << endl;
+		f << "# TriCRF1 Model file (text format)" << endl;
+		f << "# Do not edit this file" << endl;
+		f << "# " << endl << ":" << endl;
+
+		ret = saveParam(f) && saveMapping(f);
+		f.close();
+	}
+	if (!ret)
+		return false;
+
+	logger->report("  saving time = \t%.3f\n\n", stop_watch.elapsed());
+
+	return true;
+}
+
+/** Save the parameters (topic, each plane and common features).
+	@param f	text or binary model stream
+*/
+template <class Stream>
+bool TriCRF1::saveParam(Stream& f) {
 	if (!m_ParamTopic.save(f))
 		return false;
 	for (size_t i = 0; i < m_topic_size; i++) {
 		if (!m_ParamSeq[i].save(f))
 			return false;
 	}
-	if (!m_Param.save(f)) 
-		return false;
-		
-	map<pair<size_t, size_t>, size_t>::iterator it = m_Mapping.begin();
-	for ( ; it != m_Mapping.end(); it++) {
-		f << it->first.first << " " << it->first.second << " " << it->second << endl;
-	}
-	
-	f.close();
+	return m_Param.save(f);
+}
 
-	logger->report("  saving time = \t%.3f\n\n", stop_watch.elapsed());
+/// Topic mapping ; (z, y) -> y of the plane z
+void TriCRF1::addMapping(size_t z, size_t y, size_t yz) {
+	if (m_Mapping.size() <= z)
+		m_Mapping.resize(z + 1);
+	if (m_Mapping[z].size() <= y)
+		m_Mapping[z].resize(y + 1, NO_STATE);
+	if (m_Mapping[z][y] == NO_STATE)
+		m_Mapping[z][y] = (uint32_t)yz;
+}
+
+/// Extend the tables to every topic and every label of m_Param, and make the reverse mapping
+void TriCRF1::finishMapping() {
+	m_Mapping.resize(m_topic_size);
+	m_RMapping.assign(m_topic_size, vector<uint32_t>());
+	for (size_t z = 0; z < m_topic_size; z++) {
+		m_Mapping[z].resize(m_Param.sizeStateVec(), NO_STATE);
+		m_RMapping[z].assign(m_ParamSeq[z].sizeStateVec(), NO_STATE);
+		for (size_t y = 0; y < m_Mapping[z].size(); y++) {
+			size_t yz = m_Mapping[z][y];
+			if (yz != NO_STATE && yz < m_RMapping[z].size())
+				m_RMapping[z][yz] = (uint32_t)y;
+		}
+	}
+}
 
+bool TriCRF1::saveMapping(ofstream& f) {
+	for (size_t z = 0; z < m_Mapping.size(); z++) {
+		for (size_t y = 0; y < m_Mapping[z].size(); y++) {
+			if (m_Mapping[z][y] != NO_STATE)
+				f << z << " " << y << " " << m_Mapping[z][y] << endl;
+		}
+	}
 	return true;
 }
 
+bool TriCRF1::saveMapping(BinaryModelWriter& f) {
+	uint64_t size[2] = {m_topic_size, m_Param.sizeStateVec()};
+	f.beginSection(BIN_TOPIC_TABLE);
+	f.write(size, sizeof(size));
+	for (size_t z = 0; z < m_topic_size && size[1] > 0; z++)
+		f.write(&m_Mapping[z][0], size[1] * sizeof(uint32_t));
+	f.endSection();
+	return f.good();
+}
+
 /** Load the model.
 	@param filename file to be loaded
 	@return success or fail
@@ -132,28 +192,66 @@ bool TriCRF1::loadModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model loading]\n");
 
-	/// file stream
-    ifstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("fail to open model file");
-
-    /// header
-	size_t count = 0;
-    string line;
-    getline(f, line);
-    while (line.empty() || line[0] == '#') {
-		if (count == 1) {
-			vector<string> tok = tokenize(line);
-			if (tok.size() < 2 || tok[1] != "TriCRF1") {
-				logger->report("|Error| Invalid model files ... \n");
-				return false;
+	bool ret;
+	if (BinaryModelReader::isBinary(filename)) {
+		/// binary format (memory-mapped)
+		BinaryModelReader f(filename);
+		if (f.type() != "TriCRF1") {
+			logger->report("|Error| Invalid model files ... \n");
+			return false;
+		}
+		ret = loadParam(f) && loadMapping(f);
+	} else {
+		/// file stream
+		ifstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("fail to open model file");
+
+		/// header
+		size_t count = 0;
+		string line;
+		getline(f, line);
+		while (line.empty() || line[0] == '#') {
+			if (count == 1) {
+				vector<string> tok = tokenize(line);
+				if (tok.size() < 2 || tok[1] != "TriCRF1") {
+					logger->report("|Error| Invalid model files ... \n");
+					return false;
+				}
 			}
+			getline(f, line);
+			count++;
 		}
-        getline(f, line);
-		count++;
+
+		ret = loadParam(f) && loadMapping(f);
+		f.close();
 	}
+	if (!ret)
+		return false;
+	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
+
+	m_topic_size = m_ParamTopic.sizeStateVec();
+	//m_Param.clear(true);
+
+	for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
+		m_ParamSeq[i].makeStateIndex();
+		m_state_size.push_back(m_ParamSeq[i].sizeStateVec());
+	}
+	//m_ParamTopic.makeStateIndex(false);
+	m_Param.makeStateIndex();
+	calculateEdge();
+
+	//m_state_size2 = m_Param.sizeStateVec();	
+	
+	return true;
+}
 
+/** Load the parameters (topic, each plane and common features).
+	@param f	text or binary model stream
+*/
+template <class Stream>
+bool TriCRF1::loadParam(Stream& f) {
 	if (!m_ParamTopic.load(f))
 		return false;
 	logger->report("  >>Parameters for topic features\n");
@@ -169,32 +267,49 @@ bool TriCRF1::loadModel(const std::string& filename) {
 	}
 	if (!m_Param.load(f))
 		return false;
-	
+	return true;
+}
+
+bool TriCRF1::loadMapping(ifstream& f) {
+	string line;
 	m_Mapping.clear();
-	m_RMapping.clear();
-	while (getline(f, line)) {	
-		
+	while (getline(f, line)) {
 		vector<string> tok = tokenize(line);
 		assert (tok.size() == 3);
-		m_Mapping[make_pair(atoi(tok[0].c_str()), atoi(tok[1].c_str()))] = atoi(tok[2].c_str());
-		m_RMapping[make_pair(atoi(tok[0].c_str()), atoi(tok[2].c_str()))] = atoi(tok[1].c_str());
+		addMapping(atoi(tok[0].c_str()), atoi(tok[1].c_str()), atoi(tok[2].c_str()));
 	}
-	
-	f.close();
-	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
-
-	m_topic_size = m_ParamTopic.sizeStateVec();
-	//m_Param.clear(true);
+	finishMapping();
+	return true;
+}
 
-	for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
-		m_ParamSeq[i].makeStateIndex();
-		m_state_size.push_back(m_ParamSeq[i].sizeStateVec());
+bool TriCRF1::loadMapping(BinaryModelReader& f) {
+	const char* data;
+	uint64_t size;
+	m_Mapping.clear();
+	if (f.nextSection(BIN_TOPIC_TABLE, data, size)) {
+		/// dense table
+		if (size < 2 * sizeof(uint64_t))
+			return false;
+		const uint64_t* dim = (const uint64_t*)data;
+		if (dim[0] != m_topic_size || dim[1] != m_Param.sizeStateVec()
+			|| 2 * sizeof(uint64_t) + dim[0] * dim[1] * sizeof(uint32_t) > size)
+			return false;
+		const uint32_t* table = (const uint32_t*)(dim + 2);
+		m_Mapping.resize(dim[0]);
+		for (size_t z = 0; z < dim[0]; z++)
+			m_Mapping[z].assign(table + z * dim[1], table + (z + 1) * dim[1]);
+	} else {
+		/// (z, y, yz) entries of the earlier models
+		if (!f.nextSection(BIN_TOPIC_MAPPING, data, size) || size < sizeof(uint64_t))
+			return false;
+		uint64_t count = *(const uint64_t*)data;
+		if (sizeof(uint64_t) + count * 3 * sizeof(uint32_t) > size)
+			return false;
+		const uint32_t* entry = (const uint32_t*)(data + sizeof(uint64_t));
+		for (size_t i = 0; i < count; i++, entry += 3)
+			addMapping(entry[0], entry[1], entry[2]);
 	}
-	//m_ParamTopic.makeStateIndex(false);
-	m_Param.makeStateIndex();
-
-	//m_state_size2 = m_Param.sizeStateVec();	
-	
+	finishMapping();
 	return true;
 }
 
@@ -205,59 +320,41 @@ void TriCRF1::readTrainData(const string& filename) {
 	m_Mapping.clear();
 	m_RMapping.clear();
 	
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
+	/// Corpus (text or compiled)
+	vector<StringRef> tokens;
+	CorpusReader corpus(filename, m_Pool);
 
 	size_t seq_count = 0;		
 	size_t topic_id = 0;
 	// Make a state space Y
-	while ( getline(f, line) ) {
-		if ( !line.empty() ) {
-			vector<string> tokens = tokenize(line);
-			if (tokens.size() > 0) {
-				size_t index = 0;
-				string fstr(tokens[index]);
-				vector<string> tok = tokenize(fstr, ":");
-				float fval = 1.0;
-				if (tok.size() > 1) {
-					fval = atof(tok[1].c_str());	///< feature value
-					fstr = tok[0];
-				}
+	while (corpus.next(tokens)) {
+		if (!tokens.empty()) {
+			size_t index = 0;
+			double fval = 1.0;
+			StringRef fstr = parseFeature(tokens[index], fval);	///< label and its value
+			
+			++seq_count;
+			if (seq_count == 1) { ///< this is a topic 
+				size_t n_topic = m_ParamTopic.sizeStateVec();			
+				topic_id = m_ParamTopic.addNewState(fstr);	// outcome id
+				if (topic_id >= n_topic) { ///< new topic label
+					Parameter param;
+					m_ParamSeq.push_back(param);
+				}				
+			} else {
+				size_t yz = m_ParamSeq[topic_id].addNewState(fstr);	// outcome id
+				size_t y = m_Param.addNewState(fstr);
+				addMapping(topic_id, y, yz);
 				
-				++seq_count;
-				if (seq_count == 1) { ///< this is a topic 
-					size_t n_topic = m_ParamTopic.sizeStateVec();			
-					topic_id = m_ParamTopic.addNewState(fstr);	// outcome id
-					if (topic_id >= n_topic) { ///< new topic label
-						Parameter param;
-						m_ParamSeq.push_back(param);
-					}				
-				} else {
-					size_t yz = m_ParamSeq[topic_id].addNewState(fstr);	// outcome id
-					size_t y = m_Param.addNewState(fstr);
-					pair<size_t, size_t> key = make_pair(topic_id, y);
-					if (m_Mapping.find(key) == m_Mapping.end())
-						m_Mapping[key] = yz;
-					/*
-					key = make_pair(topic_id, yz);
-					if (m_RMapping.find(key) == m_RMapping.end())
-						m_RMapping[key] = y;
-					*/
-					
-				}
-								
 			}
+							
 		
 		}
 		else
 			seq_count = 0;
 	}
 	
-	f.clear();
-	f.seekg(0, ios::beg);
+	corpus.rewind();
 	
 	
 	/// initializing
@@ -270,14 +367,11 @@ void TriCRF1::readTrainData(const string& filename) {
 	m_TrainSet.clear();
 	m_TrainSetCount.clear();
 
-	/// To reduce the storage and computation
-	map<vector<vector<string> >, size_t> train_data_map;
-	vector<vector<string> > token_list;
+	DuplicateFilter duplicate(corpus);	///< To reduce the storage and computation (with the topic line, so that a duplicate has the same counts)
 
 	seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {	 ///< sequence break
 			/*
 			TriSequence tt;
 			tt.topic.label = triseq.topic.label;
@@ -289,27 +383,28 @@ void TriCRF1::readTrainData(const string& filename) {
 				tt.seq.push_back(e);
 			}
 			*/
-			if (train_data_map.find(token_list) == train_data_map.end()) {
+			size_t index = duplicate.find(m_TrainSetCount.size());
+			if (index == m_TrainSetCount.size()) {
 				m_TrainSet.append(triseq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
+				m_View.resolve(m_TrainSet.back());
 				m_TrainSetCount.push_back(1.0);
 				
 				//vector<TriSequence> temp;
 				//temp.push_back(tt);
 				//m_TrainLabelSet.push_back(temp);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				m_TrainSetCount[index] += 1.0;
 
 				//m_TrainLabelSet[train_data_map[token_list]].push_back(tt);
 			}
 			triseq.seq.clear();
-			token_list.clear();
 			prev_label = "";
 			seq_count = 0;
 			++count;
 		} else {
 			++seq_count;
 		
+			duplicate.add(tokens);
 			if (seq_count == 1) { ///< this is a topic 
 				size_t n_topic = m_ParamTopic.sizeStateVec();
 				triseq.topic = packEvent(tokens, &m_ParamTopic);	///< wanrning: There are no common element in topic classes and sequence classes.
@@ -327,7 +422,6 @@ void TriCRF1::readTrainData(const string& filename) {
 				//vector<string> tokens2 = tokens;
 				//tokens2.erase(tokens2.begin());
 				//token_list.push_back(tokens2);
-				token_list.push_back(tokens);
 
 				/// State transition features
 				/// This can be extended to state-dependent observation features. (See Sutton and McCallum, 2006)
@@ -357,19 +451,13 @@ void TriCRF1::readTrainData(const string& filename) {
 				/// Topic-Sequence state features
 				/// (See Jeong and Lee, 2006 and Jeong and Lee, 2007)
 				/*
-				size_t pid = m_ParamTopic.addNewObs("@" + m_ParamTopic.getState().second[triseq.topic.label]);
+				size_t pid = m_ParamTopic.addNewObs("@" + m_ParamTopic.getStateVec()[triseq.topic.label]);
 				m_ParamTopic.updateParam(ev2.label, pid, ev2.fval);
 				*/
 
 				//prev_label = tokens[0];
-				string fstr(tokens[0]);
-				vector<string> tok = tokenize(fstr, ":");
 				double fval = 1.0;
-				if (tok.size() > 1) {
-					fval = atof(tok[1].c_str());	///< feature value
-					fstr = tok[0];
-				}				
-				prev_label = fstr;
+				prev_label = parseFeature(tokens[0], fval).str();
 			}
 		}	// else
 
@@ -394,6 +482,8 @@ void TriCRF1::readTrainData(const string& filename) {
 
 	//m_ParamTopic.makeStateIndex(false);
 	m_Param.makeStateIndex();
+	finishMapping();
+	buildView();
 
 }
 
@@ -401,11 +491,9 @@ void TriCRF1::readTrainData(const string& filename) {
 */
 void TriCRF1::readDevData(const string& filename) {
 
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
+	/// Corpus (text or compiled)
+	vector<StringRef> tokens;
+	CorpusReader corpus(filename, m_Pool);
 	
 	/// initializing
 	TriStringSequence triseq;
@@ -417,38 +505,35 @@ void TriCRF1::readDevData(const string& filename) {
 	m_DevSet.clear();
 	m_DevSetCount.clear();
 
-	/// To reduce the storage and computation
-	map<vector<vector<string> >, size_t> dev_data_map;
-	vector<vector<string> > token_list;
+	DuplicateFilter duplicate(corpus);	///< To reduce the storage and computation
 
 	size_t seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
-			if (dev_data_map.find(token_list) == dev_data_map.end()) {
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {	 ///< sequence break
+			size_t index = duplicate.find(m_DevSetCount.size());
+			if (index == m_DevSetCount.size()) {
 				m_DevSet.append(triseq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
+				m_View.resolve(m_DevSet.back());
 				m_DevSetCount.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				m_DevSetCount[index] += 1.0;
 			}
 			triseq.seq.clear();
-			token_list.clear();
 			prev_label = "";
 			seq_count = 0;
 			++count;
 		} else {
 			++seq_count;
-			token_list.push_back(tokens);
+			duplicate.add(tokens);
 			if (seq_count == 1) { ///< this is a topic 
 				triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
-				topic = tokens[0];
+				topic = tokens[0].str();
 			} else {
 				size_t z = (triseq.topic.label < m_ParamTopic.sizeStateVec() ? triseq.topic.label : m_default_oid);
 				StringEvent ev = packStringEvent(tokens,  &m_ParamSeq[z], true);	///< observation features
 				triseq.seq.push_back(ev);	///< append
 
-				prev_label = tokens[0];
+				prev_label = tokens[0].str();
 			}
 		}	// else
 
@@ -456,6 +541,7 @@ void TriCRF1::readDevData(const string& filename) {
 
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
+	buildView();
 
 }
 
@@ -467,17 +553,16 @@ void TriCRF1::calculateEdge() {
 	double* theta_topic = m_ParamTopic.getWeight();		
 	
 	/// Factor matrix initialization
+	vector<vector<double> > score(m_topic_size);	///< linear scores
 	m_M.resize(m_topic_size);
-	for (size_t z = 0; z < m_topic_size; z++) {
-		m_M[z].resize(m_state_size[z] * m_state_size[z]);
-		fill(m_M[z].begin(), m_M[z].end(), 1.0);
-	}
+	for (size_t z = 0; z < m_topic_size; z++)
+		score[z].resize(m_state_size[z] * m_state_size[z], 0.0);
 
 	/// Calculation
 	for (size_t z = 0; z < m_topic_size; z++) {
 		vector<StateParam>::iterator iter = m_ParamSeq[z].m_StateIndex.begin();
 		for (; iter != m_ParamSeq[z].m_StateIndex.end(); ++iter) {
-			m_M[z][ZMAT2(z, iter->y1,iter->y2)] *= exp(theta_seq[z][iter->fid] /** iter->fval*/);	 
+			score[z][ZMAT2(z, iter->y1,iter->y2)] += theta_seq[z][iter->fid] /** iter->fval*/;	 
 		}
 
 	} ///< for each z
@@ -487,16 +572,25 @@ void TriCRF1::calculateEdge() {
 	for (size_t z = 0; z < m_topic_size; z++) {
 		vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
 		for (; iter != m_Param.m_StateIndex.end(); ++iter) {
-			pair<size_t, size_t> key1 = make_pair(z, iter->y1);
-			pair<size_t, size_t> key2 = make_pair(z, iter->y2);
-			
-			if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
+			size_t y1 = m_Mapping[z][iter->y1];
+			size_t y2 = m_Mapping[z][iter->y2];
+			if (y1 == NO_STATE || y2 == NO_STATE)
 				continue;
-			size_t y1 = m_Mapping[key1];
-			size_t y2 = m_Mapping[key2];
-			m_M[z][ZMAT2(z, y1, y2)] *= exp(theta_share[iter->fid] /** iter->fval*/);	 
+			score[z][ZMAT2(z, y1, y2)] += theta_share[iter->fid] /** iter->fval*/;	 
 		}	
 	}
+	for (size_t z = 0; z < m_topic_size; z++)
+		expScore(score[z], m_M[z]);
+
+	/// Column maxima (upper bound of the topic planes)
+	m_MaxM.resize(m_topic_size);
+	for (size_t z = 0; z < m_topic_size; z++) {
+		m_MaxM[z].assign(m_state_size[z], 0.0);
+		for (size_t j = 0; j < m_state_size[z]; j++) {
+			for (size_t k = 0; k < m_state_size[z]; k++)
+				m_MaxM[z][k] = max(m_MaxM[z][k], m_M[z][ZMAT2(z, j, k)]);
+		}
+	}
 	
 	/*
 	m_Z.resize(m_topic_size * m_state_size2);
@@ -509,121 +603,176 @@ void TriCRF1::calculateEdge() {
 		
 }
 
+/** Map the features of the data to every plane (the sequence planes and the shared plane).
+*/
+void TriCRF1::buildView() {
+	vector<const Parameter*> planes;
+	for (size_t z = 0; z < m_topic_size; z++)
+		planes.push_back(&m_ParamSeq[z]);
+	planes.push_back(&m_Param);
+	m_View.build(planes);
+}
+
+/** Observation index of a node.
+	@param z	plane (m_topic_size for the shared plane)
+*/
+vector<ObsParam> TriCRF1::makeObsIndex(const TriStringSequence& triseq, size_t i, size_t z) const {
+	const Parameter& param = (z < m_topic_size ? m_ParamSeq[z] : m_Param);
+	if (triseq.resolved)
+		return param.makeObsIndex(triseq.seq[i].ids, m_View.remap(z));
+	return param.makeObsIndex(triseq.seq[i].obs);
+}
+
 /**	Calculate the factors.
 	References 
 		Jeong and Lee, Triangular-chain Conditional Random Fields, (Submitted), IEEE TASLP.
 */
-void TriCRF1::calculateFactors(TriStringSequence &triseq) {
+void TriCRF1::calculateFactors(const TriStringSequence &triseq, InferenceContext& ctx) const {
 	/// Initialization
-	m_seq_size = triseq.seq.size() + 1;	///< sequence length
-	vector<double*> theta_seq;
+	ctx.seq_size = triseq.seq.size() + 1;	///< sequence length
+	vector<const double*> theta_seq;
 	for (size_t z = 0; z < m_topic_size; z++) 
 		theta_seq.push_back(m_ParamSeq[z].getWeight());
-	double* theta_topic = m_ParamTopic.getWeight();
-	double* theta_share = m_Param.getWeight();
+	const double* theta_topic = m_ParamTopic.getWeight();
+	const double* theta_share = m_Param.getWeight();
 	
-	m_R.resize(m_topic_size);
-	for (size_t z = 0; z < m_topic_size; z++) {
-		m_R[z].resize(m_seq_size * m_state_size[z]);
-		fill(m_R[z].begin(), m_R[z].end(), 1.0);
-	}
+	ctx.topic.ZR.resize(m_topic_size);
 
 	/// Calculation
 	for (size_t z = 0; z < m_topic_size; z++) {
-		for (size_t i = 0; i < m_seq_size-1; i++) {
+		ctx.score.assign(ctx.seq_size * m_state_size[z], 0.0);	///< linear scores
+		for (size_t i = 0; i < ctx.seq_size-1; i++) {
 			/// Observation factor
-			vector<ObsParam> obs_param = m_ParamSeq[z].makeObsIndex(triseq.seq[i].obs);
+			vector<ObsParam> obs_param = makeObsIndex(triseq, i, z);
 			vector<ObsParam>::iterator iter = obs_param.begin();
 			for(; iter != obs_param.end(); ++iter) {
-				m_R[z][ZMAT2(z, i, iter->y)] *= exp(theta_seq[z][iter->fid] /** iter->fval*/);
+				ctx.score[ZMAT2(z, i, iter->y)] += theta_seq[z][iter->fid] /** iter->fval*/;
 			}
 			
 
-			obs_param = m_Param.makeObsIndex(triseq.seq[i].obs);
+			obs_param = makeObsIndex(triseq, i, m_topic_size);
 			iter = obs_param.begin();
 			for(; iter != obs_param.end(); ++iter) {
-				pair<size_t, size_t> key = make_pair(z, iter->y);
-				if (m_Mapping.find(key) == m_Mapping.end())
+				size_t y = m_Mapping[z][iter->y];
+				if (y == NO_STATE)
 					continue;
-				size_t y = m_Mapping[key];
-				m_R[z][ZMAT2(z, i, y)] *= exp(theta_share[iter->fid] /** iter->fval*/);
+				ctx.score[ZMAT2(z, i, y)] += theta_share[iter->fid] /** iter->fval*/;
 			}
 			
 			
 
 		}	///< for 
+		expScore(ctx.score, ctx.topic.ZR[z]);
 	} ///< for each z
 
 	/// Gamma 
-	m_Gamma.resize(m_topic_size, 1.0);
-	fill(m_Gamma.begin(), m_Gamma.end(), 1.0);
+	ctx.topic.Gamma.resize(m_topic_size, 0.0);
+	fill(ctx.topic.Gamma.begin(), ctx.topic.Gamma.end(), 0.0);
 	
 	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
 	vector<ObsParam>::iterator iter2 = obs_param.begin();
 	for(; iter2 != obs_param.end(); ++iter2) {
-		m_Gamma[iter2->y] *= exp(theta_topic[iter2->fid] /** iter2->fval*/);
+		ctx.topic.Gamma[iter2->y] += theta_topic[iter2->fid] /** iter2->fval*/;
 	}
+	expScore(ctx.topic.Gamma);
+
+	if (m_topic_beam > 0)
+		boundTopic(ctx);
 }
 
-/**	Forward Recursion.
-	Computing and storing the alpha value.
+/**	Upper bound of each topic plane (the first stage of the topic beam).
+	Replacing the transitions into each state by their maximum (m_MaxM) bounds alpha
+	by a product of sums over the states, so the bound takes O(T*S) per plane instead of O(T*S^2).
+	ctx.topic.bound[z] = log(Gamma[z] * bound of Z_z).
 */
-void TriCRF1::forward() {
-	m_Alpha.resize(m_topic_size);
+void TriCRF1::boundTopic(InferenceContext& ctx) const {
+	size_t last = ctx.seq_size - 1;
+	ctx.topic.bound.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
-		m_Alpha[z].resize(m_seq_size * m_state_size[z]);
-		fill(m_Alpha[z].begin(), m_Alpha[z].end(), 0.0);
+		long double bound = log(ctx.topic.Gamma[z]);
+		for (size_t i = 0; i <= last; i++) {
+			/// from the start state at first ; into the end state at last
+			const long double* M = (i == 0 ? &m_M[z][ZMAT2(z, m_default_oid, 0)] : &m_MaxM[z][0]);
+			size_t j = (i == last ? m_default_oid : 0);
+			size_t j_end = (i == last ? m_default_oid + 1 : m_state_size[z]);
+			long double sum = 0.0;
+			for (; j < j_end; j++)
+				sum += ctx.topic.ZR[z][ZMAT2(z, i, j)] * M[j];
+			bound += log(sum);
+		}
+		ctx.topic.bound[z] = bound;
 	}
+}
 
+/**	Forward Recursion.
+	Computing and storing the alpha value (of the topic planes in ctx.topic.active).
+*/
+void TriCRF1::forward(InferenceContext& ctx) const {
+	ctx.topic.ZAlpha.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
-		for (size_t j = 0; j < m_state_size[z]; j++) {
-				m_Alpha[z][ZMAT2(z, 0, j)] += m_R[z][ZMAT2(z, 0, j)] * m_M[z][ZMAT2(z, m_default_oid, j)]; // * m_Z[MAT(z, m_RMapping[make_pair(z, j)])];
-		}
+		ctx.topic.ZAlpha[z].resize(ctx.seq_size * m_state_size[z]);
+		fill(ctx.topic.ZAlpha[z].begin(), ctx.topic.ZAlpha[z].end(), 0.0);
 	}
 
-	for (size_t z = 0; z < m_topic_size; z++) {
-		for (size_t i = 1; i < m_seq_size; i++) {
-			for (size_t j = 0; j < m_state_size[z]; j++) {
-				long double prob = m_R[z][ZMAT2(z, i, j)]; // * m_Z[MAT(z, m_RMapping[make_pair(z, j)])]; 
-				
-				if (prob > 0) {
-					for (size_t k = 0; k < m_state_size[z]; k++) {
-							m_Alpha[z][ZMAT2(z, i, j)] += m_Alpha[z][ZMAT2(z, i-1, k)] * m_M[z][ZMAT2(z, k, j)] * prob;
-					}
+	forwardTopics(ctx);
+}
+
+/**	Forward recursion of a topic plane.
+	@return Gamma * Z of the plane
+*/
+long double TriCRF1::forwardTopic(InferenceContext& ctx, size_t z) const {
+	for (size_t j = 0; j < m_state_size[z]; j++) {
+			ctx.topic.ZAlpha[z][ZMAT2(z, 0, j)] += ctx.topic.ZR[z][ZMAT2(z, 0, j)] * m_M[z][ZMAT2(z, m_default_oid, j)]; // * m_Z[MAT(z, m_RMapping[z][j])];
+	}
+
+	for (size_t i = 1; i < ctx.seq_size; i++) {
+		for (size_t j = 0; j < m_state_size[z]; j++) {
+			long double prob = ctx.topic.ZR[z][ZMAT2(z, i, j)]; // * m_Z[MAT(z, m_RMapping[z][j])];
+			
+			if (prob > 0) {
+				for (size_t k = 0; k < m_state_size[z]; k++) {
+						ctx.topic.ZAlpha[z][ZMAT2(z, i, j)] += ctx.topic.ZAlpha[z][ZMAT2(z, i-1, k)] * m_M[z][ZMAT2(z, k, j)] * prob;
 				}
 			}
 		}
 	}
+	return ctx.topic.ZAlpha[z][ZMAT2(z, ctx.seq_size-1, m_default_oid)] * ctx.topic.Gamma[z];
 }
 
 /**	Backward Recursion.
-	Computing and storing the beta value.
+	Computing and storing the beta value (of the topic planes in ctx.topic.prune).
 */
-void TriCRF1::backward() {
-	m_Beta.resize(m_topic_size);
+void TriCRF1::backward(InferenceContext& ctx) const {
+	ctx.topic.ZBeta.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
-		m_Beta[z].resize(m_seq_size * m_state_size[z]);
-		fill(m_Beta[z].begin(), m_Beta[z].end(), 0.0);
+		ctx.topic.ZBeta[z].resize(ctx.seq_size * m_state_size[z]);
+		fill(ctx.topic.ZBeta[z].begin(), ctx.topic.ZBeta[z].end(), 0.0);
 	}
 
 	/// initializing
 	for (size_t z = 0; z < m_topic_size; z++) {
-		m_Beta[z][ZMAT2(z, m_seq_size-1, m_default_oid)] = 1.0;
+		ctx.topic.ZBeta[z][ZMAT2(z, ctx.seq_size-1, m_default_oid)] = 1.0;
 	}
 
 	///for (size_t z = 0; z < m_topic_size; z++) {
-	for (size_t prune = 0; prune < m_prune.size(); prune++) {
-		size_t z = m_prune[prune].second;
-
-	    for (size_t i = m_seq_size-1; i >= 1; i--) {
-		    for (size_t k = 0; k < m_state_size[z]; k++) {
-				long double prob = m_R[z][ZMAT2(z, i, k)]; // * m_Z[MAT(z, m_RMapping[make_pair(z, k)])];
-				if (prob > 0) {
-					for (size_t j = 0; j < m_state_size[z]; j++) {
-							m_Beta[z][ZMAT2(z, i-1, j)] += m_Beta[z][ZMAT2(z, i, k)] * m_M[z][ZMAT2(z, j, k)] * prob;
-					}
+	vector<size_t> topics;
+	for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++)
+		topics.push_back(ctx.topic.prune[prune].second);
+	vector<long double> dummy;
+	runTopics(ctx, TOPIC_BACKWARD, topics, dummy);
+}
+
+/**	Backward recursion of a topic plane.
+*/
+void TriCRF1::backwardTopic(InferenceContext& ctx, size_t z) const {
+    for (size_t i = ctx.seq_size-1; i >= 1; i--) {
+	    for (size_t k = 0; k < m_state_size[z]; k++) {
+			long double prob = ctx.topic.ZR[z][ZMAT2(z, i, k)]; // * m_Z[MAT(z, m_RMapping[z][k])];
+			if (prob > 0) {
+				for (size_t j = 0; j < m_state_size[z]; j++) {
+						ctx.topic.ZBeta[z][ZMAT2(z, i-1, j)] += ctx.topic.ZBeta[z][ZMAT2(z, i, k)] * m_M[z][ZMAT2(z, j, k)] * prob;
 				}
-            }
+			}
         }
     }
 }
@@ -631,20 +780,21 @@ void TriCRF1::backward() {
 /**	Partition function (Z).
 	@return normalizing constant 
 */
-long double TriCRF1::getPartitionZ() {
-	m_prune.clear();
+long double TriCRF1::getPartitionZ(InferenceContext& ctx) const {
+	ctx.topic.prune.clear();
 	long double zval = 0.0;
 
-	for (size_t z = 0; z < m_topic_size; z++) {
-		long double prob = m_Alpha[z][ZMAT2(z, m_seq_size-1, m_default_oid)] * m_Gamma[z];
+	for (size_t a = 0; a < ctx.topic.active.size(); a++) {
+		size_t z = ctx.topic.active[a];
+		long double prob = ctx.topic.ZAlpha[z][ZMAT2(z, ctx.seq_size-1, m_default_oid)] * ctx.topic.Gamma[z];
 		zval += prob;
-		m_prune.push_back(make_pair(prob, z));
+		ctx.topic.prune.push_back(make_pair(prob, z));
 	}
 	/// for pruning
-	for (size_t z = 0; z < m_topic_size; z++) {
-		m_prune[z].first /= zval;
+	for (size_t a = 0; a < ctx.topic.prune.size(); a++) {
+		ctx.topic.prune[a].first /= zval;
 	}
-	sort(m_prune.rbegin(), m_prune.rend());
+	sort(ctx.topic.prune.rbegin(), ctx.topic.prune.rend());
 
 	return zval;
 }
@@ -653,20 +803,20 @@ long double TriCRF1::getPartitionZ() {
 	@param seq			given data (y, x)
 	@return probability
 */
-long double TriCRF1::calculateProb(TriStringSequence& triseq) {
-	long double zval = getPartitionZ();
+long double TriCRF1::calculateProb(const TriStringSequence& triseq, InferenceContext& ctx) const {
+	long double zval = getPartitionZ(ctx);
 
     long double seq_prob = 1.0;
     size_t prev_y = m_default_oid;
     size_t y;
 	size_t z = triseq.topic.label;
-    for (size_t i=0; i < m_seq_size; i++) {
-        if (i < m_seq_size-1) {
+    for (size_t i=0; i < ctx.seq_size; i++) {
+        if (i < ctx.seq_size-1) {
             y = triseq.seq[i].label;
         } else {
             y = m_default_oid;
         }
-        seq_prob *= m_R[z][ZMAT2(z, i,y)] * m_M[z][ZMAT2(z, prev_y, y)]; // * m_Z[MAT(z, m_RMapping[make_pair(z, y)])];
+        seq_prob *= ctx.topic.ZR[z][ZMAT2(z, i,y)] * m_M[z][ZMAT2(z, prev_y, y)]; // * m_Z[MAT(z, m_RMapping[z][y])];
         prev_y = y;
        
     }
@@ -674,7 +824,7 @@ long double TriCRF1::calculateProb(TriStringSequence& triseq) {
         cerr << "seq_prob==0 ";
     }
 
-    return seq_prob * m_Gamma[z] / zval;
+    return seq_prob * ctx.topic.Gamma[z] / zval;
 }
 
 /** Viterbi search to find the best probable output sequence.
@@ -682,78 +832,289 @@ long double TriCRF1::calculateProb(TriStringSequence& triseq) {
  @param prob		dummy probability vector
  @return outcome sequence
 */
-vector<size_t> TriCRF1::viterbiSearch(size_t& max_z, long double& prob) {
+vector<size_t> TriCRF1::viterbiSearch(InferenceContext& ctx, size_t& max_z, long double& prob) const {
 	/// Initialization
 	long double max_prob = -10000.0;
 	max_z = m_default_oid;
 	vector<size_t> max_y;
-	vector<vector<size_t> > psi;
-    vector<vector<long double> > delta;
 
 	/// Search
 	///for (size_t z = 0; z < m_topic_size; z++) {
-	for (size_t prune = 0; prune < m_prune.size(); prune++) {
-		size_t z = m_prune[prune].second;
-
-		delta.clear();
-		psi.clear();
-		for (size_t i=0; i < m_seq_size; i++) {
-			vector<size_t> psi_i;
-			vector<long double> delta_i;
-			for (size_t j=0; j < m_state_size[z]; j++) {
-				long double max = -10000.0;
-				size_t max_k = 0;
-				if (i == 0) {
-					max = m_R[z][ZMAT2(z, i, j)] * m_M[z][ZMAT2(z, m_default_oid, j)]; // * m_Z[MAT(z, m_RMapping[make_pair(z, j)])];
-					max_k = m_default_oid;
-				} else {
-					for (size_t k=0; k < m_state_size[z]; k++) {
-						double val = delta[i-1][k] * m_R[z][ZMAT2(z, i, j)] * m_M[z][ZMAT2(z, k, j)]; // * m_Z[MAT(z, m_RMapping[make_pair(z, j)])];
-						if (val > max) {
-							max = val;
-							max_k = k;
-						}
+	vector<size_t> topics;
+	for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++)
+		topics.push_back(ctx.topic.prune[prune].second);
+	vector<long double> topic_prob;
+	vector<vector<size_t> > topic_y;
+	runTopics(ctx, TOPIC_VITERBI, topics, topic_prob, &topic_y);
+
+	for (size_t t = 0; t < topics.size(); t++) {
+		if (topic_prob[t] > max_prob) {
+			max_prob = topic_prob[t];
+			max_z = topics[t];
+			max_y.swap(topic_y[t]);
+		}
+	} ///< for each z
+
+	prob = max_prob;
+	return max_y;
+
+}
+
+/** Viterbi search of a topic plane.
+	@param z		topic plane
+	@param y_seq	best path of the plane
+	@return probability of the path (with Gamma)
+*/
+long double TriCRF1::viterbiTopic(const InferenceContext& ctx, size_t z, vector<size_t>& y_seq) const {
+	vector<vector<size_t> > psi;
+	vector<vector<long double> > delta;
+	for (size_t i=0; i < ctx.seq_size; i++) {
+		vector<size_t> psi_i;
+		vector<long double> delta_i;
+		for (size_t j=0; j < m_state_size[z]; j++) {
+			long double max = -10000.0;
+			size_t max_k = 0;
+			if (i == 0) {
+				max = ctx.topic.ZR[z][ZMAT2(z, i, j)] * m_M[z][ZMAT2(z, m_default_oid, j)]; // * m_Z[MAT(z, m_RMapping[z][j])];
+				max_k = m_default_oid;
+			} else {
+				for (size_t k=0; k < m_state_size[z]; k++) {
+					double val = delta[i-1][k] * ctx.topic.ZR[z][ZMAT2(z, i, j)] * m_M[z][ZMAT2(z, k, j)]; // * m_Z[MAT(z, m_RMapping[z][j])];
+					if (val > max) {
+						max = val;
+						max_k = k;
 					}
 				}
+			}
 
-				delta_i.push_back(max);
-				psi_i.push_back(max_k);
+			delta_i.push_back(max);
+			psi_i.push_back(max_k);
+		}
+		delta.push_back(delta_i);
+		psi.push_back(psi_i);
+
+	} ///< for each i
+
+	/// Back-tracking
+	y_seq.clear();
+	size_t prev_y = m_default_oid;
+	for (size_t i = ctx.seq_size-1; i >= 1; i--) {
+		size_t y = psi[i][prev_y];
+		y_seq.push_back(y);
+		prev_y = y;
+	}
+	reverse(y_seq.begin(), y_seq.end());
+	double tmp_prob = delta[ctx.seq_size-1][m_default_oid] * ctx.topic.Gamma[z];
+	return tmp_prob;
+}
+
+
+/** Accumulate the expectation of a training sequence.
+	Runs the forward-backward and Viterbi, adds the expectation (times count) to the gradients
+	and appends the sequence to the evaluators (topic and sequence).
+	@param prune_topic	prune the topics before the backward pass
+*/
+void TriCRF1::accumulateGradient(const TriStringSequence& triseq, double count, InferenceContext& ctx, bool prune_topic,
+	double* gradient_topic, vector<double*>& gradient_seq, double* gradient_share, Evaluator& eval1, Evaluator& eval2) {
+	/// Forward-Backward  
+	calculateFactors(triseq, ctx);
+	beamTopic(ctx, triseq.topic.label);
+	forward(ctx);
+	long double zval = getPartitionZ(ctx);
+
+	////////////////////////////////////////////////////////////////////
+	/// pruning
+	////////////////////////////////////////////////////////////////////
+	if (prune_topic)
+		pruneTopic(ctx);
+
+	backward(ctx);
+	/// Evaluation
+	long double dummy_prob;
+	size_t max_z;
+	vector<size_t> y_seq = viterbiSearch(ctx, max_z, dummy_prob);
+	assert(y_seq.size() == triseq.seq.size());
+
+	// calculate Y sequence
+	long double y_seq_prob = calculateProb(triseq, ctx);
+	if (!finite((double)y_seq_prob)) {
+		cerr << "calculateProb:" << y_seq_prob << endl;
+	}
+
+	size_t prev_outcome = m_default_oid;
+	vector<string> reference, hypothesis;
+	double fval = triseq.topic.fval;
+	for (size_t i = 0; i < triseq.seq.size(); ++i) {	 /// for each node in sequence
+		
+		size_t outcome = triseq.seq[i].label;
+		string outcome_s = m_ParamSeq[triseq.topic.label].getStateVec()[outcome];
+		string y_seq_s = m_ParamSeq[max_z].getStateVec()[y_seq[i]];
+		reference.push_back(outcome_s);
+		hypothesis.push_back(y_seq_s);
+
+		/// calculate the expectation
+		/// E[p] - E[~p]
+
+		/// f(y,x)
+		///for (size_t z = 0; z < m_topic_size; z++) {
+		for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++) {
+			size_t z = ctx.topic.prune[prune].second;
+
+			vector<ObsParam> obs_param = makeObsIndex(triseq, i, z);
+			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+					long double prob = ctx.topic.ZAlpha[z][ZMAT2(z, i, iter->y)] * ctx.topic.ZBeta[z][ZMAT2(z, i, iter->y)] * ctx.topic.Gamma[z] / zval;
+					for (size_t c = 0; c < count; c++)
+						gradient_seq[z][iter->fid] += prob * iter->fval * count;
 			}
-			delta.push_back(delta_i);
-			psi.push_back(psi_i);
-
-		} ///< for each i
-
-		/// Back-tracking
-		vector<size_t> y_seq;
-		size_t prev_y = m_default_oid;
-		for (size_t i = m_seq_size-1; i >= 1; i--) {
-			size_t y = psi[i][prev_y];
-			y_seq.push_back(y);
-			prev_y = y;
+
+			obs_param = makeObsIndex(triseq, i, m_topic_size);
+			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+					size_t y = m_Mapping[z][iter->y];
+					if (y == NO_STATE)
+						continue;
+					long double prob = ctx.topic.ZAlpha[z][ZMAT2(z, i, y)] * ctx.topic.ZBeta[z][ZMAT2(z, i, y)] * ctx.topic.Gamma[z] / zval;
+					for (size_t c = 0; c < count; c++)
+						gradient_share[iter->fid] += prob * iter->fval * count;
+			}					
+		}
+
+		/// f(y,y)
+		if (i > 0) {
+			///for (size_t z = 0; z < m_topic_size; z++) {
+			for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++) {
+				size_t z = ctx.topic.prune[prune].second;
+
+				vector<StateParam>::iterator iter = m_ParamSeq[z].m_StateIndex.begin();
+				for (; iter != m_ParamSeq[z].m_StateIndex.end(); ++iter) {
+					long double a_y;
+					long double prob_sum = 0.0;
+					if (i == 0) {
+						if (iter->y1 == m_default_oid) a_y = 1.0;
+						else a_y = 0.0;
+					} else {
+						a_y = ctx.topic.ZAlpha[z][ZMAT2(z, i-1, iter->y1)];
+					}
+					long double b_y = ctx.topic.ZBeta[z][ZMAT2(z, i, iter->y2)];
+					long double m_yy = ctx.topic.ZR[z][ZMAT2(z, i, iter->y2)] * m_M[z][ZMAT2(z, iter->y1,iter->y2)];// * m_Z[MAT(z, m_RMapping[z][iter->y2])];
+					long double prob = a_y * b_y * m_yy * ctx.topic.Gamma[z] / zval;
+					for (size_t c = 0; c < count; c++)
+						gradient_seq[z][iter->fid] += prob * iter->fval * count;
+				} ///< for each edge
+				
+				
+				iter = m_Param.m_StateIndex.begin();
+				for (; iter != m_Param.m_StateIndex.end(); ++iter) {
+					size_t y1 = m_Mapping[z][iter->y1];
+					size_t y2 = m_Mapping[z][iter->y2];
+					if (y1 == NO_STATE || y2 == NO_STATE)
+						continue;
+					
+					long double a_y;
+					long double prob_sum = 0.0;
+					if (i == 0) {
+						if (iter->y1 == m_default_oid) a_y = 1.0;
+						else a_y = 0.0;
+					} else {
+						a_y = ctx.topic.ZAlpha[z][ZMAT2(z, i-1, y1)];
+					}
+					long double b_y = ctx.topic.ZBeta[z][ZMAT2(z, i, y2)];
+					long double m_yy = ctx.topic.ZR[z][ZMAT2(z, i, y2)] * m_M[z][ZMAT2(z, y1, y2)];// * m_Z[MAT(z, iter->y2)];
+					long double prob = a_y * b_y * m_yy * ctx.topic.Gamma[z] / zval;
+					for (size_t c = 0; c < count; c++)
+						gradient_share[iter->fid] += prob * iter->fval * count;
+				} ///< for each edge
+
+
+			} ///< for z
+		}	///< if ( i > 0)
+		prev_outcome = outcome;
+		fval = triseq.seq[i].fval;
+		
+		/*
+		/// f(y,z)
+		for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
+			size_t index = ZMAT2(iter->y1, i, m_Mapping[iter->y1][iter->y2]);
+			long double prob = ctx.topic.ZAlpha[iter->y1][index] * ctx.topic.ZBeta[iter->y1][index] * ctx.topic.Gamma[iter->y1] / zval;
+			gradient_topic[iter->fid] += prob * iter->fval;
 		}
-		reverse(y_seq.begin(), y_seq.end());
-		double tmp_prob = delta[m_seq_size-1][m_default_oid] * m_Gamma[z];
+		*/
 		
-		if (tmp_prob > max_prob) {
-			max_prob = tmp_prob;
-			max_z = z;
-			max_y = y_seq;
+	} ///< for each node in sequence
+	
+	/// f(z,x)
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+		long double prob = ctx.topic.ZAlpha[iter->y][ZMAT2(iter->y, ctx.seq_size-1, m_default_oid)] * ctx.topic.Gamma[iter->y] / zval;
+		for (size_t c = 0; c < count ; c++)
+			gradient_topic[iter->fid] += prob * iter->fval * count;
+	}
+	
+	for (size_t c = 0; c < count; c++) {
+		eval2.addLikelihood(y_seq_prob);	/// loglikelihood
+		eval2.append(m_Param, reference, hypothesis);	/// evaluation (accuracy and f1 score)
+		vector<size_t> reference1, hypothesis1;
+		reference1.push_back(triseq.topic.label);
+		hypothesis1.push_back(max_z);
+		eval1.addLikelihood(y_seq_prob);	/// loglikelihood
+		eval1.append(reference1, hypothesis1);
+	}
+}
+
+/** Evaluate the dev set with the current weights.
+	@param dev_eval1	evaluator (topic)
+	@param dev_eval2	evaluator (sequence)
+*/
+void TriCRF1::evaluateDev(InferenceContext& ctx, Evaluator& dev_eval1, Evaluator& dev_eval2) {
+	vector<TriStringSequence>::iterator it = m_DevSet.begin();
+	vector<double>::iterator count_it = m_DevSetCount.begin();
+	for (; it != m_DevSet.end(); ++it, ++count_it) {
+		double count = *count_it;
+		calculateFactors(*it, ctx);
+		beamTopic(ctx);
+		forward(ctx);
+		long double zval = getPartitionZ(ctx);
+		long double dummy_prob;
+		size_t max_z;
+		vector<size_t> y_seq = viterbiSearch(ctx, max_z, dummy_prob);
+		assert(y_seq.size() == it->seq.size());
+
+		size_t prev_outcome = m_default_oid;
+		vector<string> reference, hypothesis;
+		for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
+			size_t outcome = it->seq[i].label;
+
+			string outcome_s;
+			/// If there are non-attested labels in dev, test sets, then ...
+			if (m_ParamTopic.sizeStateVec() <= it->topic.label || m_ParamSeq[it->topic.label].sizeStateVec() <= outcome) 
+				outcome_s = m_Param.getStateVec()[m_default_oid];
+			else
+				outcome_s = m_ParamSeq[it->topic.label].getStateVec()[outcome];
+			//if (m_ParamTopic.sizeStateVec() <= max_z || m_ParamSeq[max_z].sizeStateVec() <= y_seq[i]) 
+			//	continue;
+			string y_seq_s = m_ParamSeq[max_z].getStateVec()[y_seq[i]];
+			reference.push_back(outcome_s);
+			hypothesis.push_back(y_seq_s);
 		}
-	} ///< for each z
 
-	prob = max_prob;
-	return max_y;
+		for (size_t c = 0; c < count; c++) {
+			dev_eval2.append(m_Param, reference, hypothesis);	
+			vector<size_t> reference1, hypothesis1;
+			reference1.push_back(it->topic.label);
+			hypothesis1.push_back(max_z);
+			dev_eval1.append(reference1, hypothesis1);
+		}
 
+	} ///< for each dev
 }
 
-
 /** Training with LBFGS optimizer.
 	@param max_iter	maximum number of iteration
 	@param sigma	Gaussian prior variance
 */
 bool TriCRF1::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta) {
-	LBFGS lbfgs;	///< LBFGS optimizer
+	InferenceContext& ctx = m_Context;
+	ctx.topic.pool = topicPool(m_topic_size);	///< topic planes of a sequence in parallel
+	LBFGS lbfgs(m_lbfgs_history, m_lbfgs_float);	///< LBFGS optimizer
 
 	/// Parameter weight setting
 	size_t n_theta = m_ParamTopic.size();
@@ -795,7 +1156,9 @@ bool TriCRF1::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 	/// Reporting
 	logger->report("[Parameter estimation]\n");
-	logger->report("  Method = \t\tLBFGS\n");
+	logger->report("  Method = \t\t%s\n", (sigma && L1 ? "OWL-QN" : "LBFGS"));
+	if (m_lbfgs_history != 5 || m_lbfgs_float)
+		logger->report("  History = \t\t%d%s\n", (int)m_lbfgs_history, (m_lbfgs_float ? " (float)" : ""));
 	logger->report("  Regularization = \t%s\n", (sigma ? (L1 ? "L1":"L2") : "none"));
 	logger->report("  Penalty value = \t%.2f\n\n", sigma);
 	logger->report("  >>Parameters for topic features\n");
@@ -810,12 +1173,6 @@ bool TriCRF1::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 	double old_obj = 1e+37;
 	int converge = 0;
 
-	double time_for_factor = 0.0;
-	double time_for_forward = 0.0;
-	double time_for_backward = 0.0;
-	double time_for_evaluation = 0.0;
-	double time_for_estimating = 0.0;
-	
 	/// Training iteration
     for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
 
@@ -841,171 +1198,7 @@ bool TriCRF1::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		vector<double>::iterator count_it = m_TrainSetCount.begin();
 		vector<vector<TriSequence> >::iterator label_it = m_TrainLabelSet.begin();
         for (; it != m_TrainSet.end(); ++it, ++count_it, ++label_it) {
-			double count = *count_it;
-			/// Forward-Backward  
-			timer stop_watch;
-			calculateFactors(*it);
-			time_for_factor += stop_watch.elapsed();
-			stop_watch.restart();
-  			forward();
-			time_for_forward += stop_watch.elapsed();
-			long double zval = getPartitionZ();
-
-			////////////////////////////////////////////////////////////////////
-			/// pruning
-			////////////////////////////////////////////////////////////////////
-			long double threshold = m_prune[0].first / m_prune_threshold;
-			if (niter > 0) {
-				vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
-				for (; pit != m_prune.end(); pit++) {
-					if (pit->first < threshold) {
-						m_prune.erase(pit, m_prune.end());
-						break;
-					}
-				}
-			}
-
-			stop_watch.restart();
-			backward();
-			time_for_backward += stop_watch.elapsed();
-			/// Evaluation
-			stop_watch.restart();
-            long double dummy_prob;
-			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == it->seq.size());
-			time_for_evaluation += stop_watch.elapsed();
-
-			// calculate Y sequence
-			long double y_seq_prob = calculateProb(*it);
-            if (!finite((double)y_seq_prob)) {
-                cerr << "calculateProb:" << y_seq_prob << endl;
-            }
-
-			stop_watch.restart();
-			size_t prev_outcome = m_default_oid;
-			vector<string> reference, hypothesis;
-			double fval = it->topic.fval;
-			for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
-				
-				size_t outcome = it->seq[i].label;
-				string outcome_s = m_ParamSeq[it->topic.label].getState().second[outcome];
-				string y_seq_s = m_ParamSeq[max_z].getState().second[y_seq[i]];
-				reference.push_back(outcome_s);
-				hypothesis.push_back(y_seq_s);
-
-				/// calculate the expectation
-				/// E[p] - E[~p]
-
-				/// f(y,x)
-				///for (size_t z = 0; z < m_topic_size; z++) {
-				for (size_t prune = 0; prune < m_prune.size(); prune++) {
-					size_t z = m_prune[prune].second;
-
-					vector<ObsParam> obs_param = m_ParamSeq[z].makeObsIndex(it->seq[i].obs);
-					for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-							long double prob = m_Alpha[z][ZMAT2(z, i, iter->y)] * m_Beta[z][ZMAT2(z, i, iter->y)] * m_Gamma[z] / zval;
-							for (size_t c = 0; c < count; c++)
-								gradient_seq[z][iter->fid] += prob * iter->fval * count;
-					}
-
-					obs_param = m_Param.makeObsIndex(it->seq[i].obs);
-					for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-							pair<size_t, size_t> key = make_pair(z, iter->y);
-							if (m_Mapping.find(key) == m_Mapping.end())
-								continue;
-							size_t y = m_Mapping[key];
-							long double prob = m_Alpha[z][ZMAT2(z, i, y)] * m_Beta[z][ZMAT2(z, i, y)] * m_Gamma[z] / zval;
-							for (size_t c = 0; c < count; c++)
-								gradient_share[iter->fid] += prob * iter->fval * count;
-					}					
-				}
-
-				/// f(y,y)
-				if (i > 0) {
-					///for (size_t z = 0; z < m_topic_size; z++) {
-					for (size_t prune = 0; prune < m_prune.size(); prune++) {
-						size_t z = m_prune[prune].second;
-
-						vector<StateParam>::iterator iter = m_ParamSeq[z].m_StateIndex.begin();
-						for (; iter != m_ParamSeq[z].m_StateIndex.end(); ++iter) {
-							long double a_y;
-							long double prob_sum = 0.0;
-							if (i == 0) {
-								if (iter->y1 == m_default_oid) a_y = 1.0;
-								else a_y = 0.0;
-							} else {
-								a_y = m_Alpha[z][ZMAT2(z, i-1, iter->y1)];
-							}
-							long double b_y = m_Beta[z][ZMAT2(z, i, iter->y2)];
-							long double m_yy = m_R[z][ZMAT2(z, i, iter->y2)] * m_M[z][ZMAT2(z, iter->y1,iter->y2)];// * m_Z[MAT(z, m_RMapping[make_pair(z, iter->y2)])];
-							long double prob = a_y * b_y * m_yy * m_Gamma[z] / zval;
-							for (size_t c = 0; c < count; c++)
-								gradient_seq[z][iter->fid] += prob * iter->fval * count;
-						} ///< for each edge
-						
-						
-						iter = m_Param.m_StateIndex.begin();
-						for (; iter != m_Param.m_StateIndex.end(); ++iter) {
-							pair<size_t, size_t> key1 = make_pair(z, iter->y1);
-							pair<size_t, size_t> key2 = make_pair(z, iter->y2);
-			
-							if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
-								continue;
-							size_t y1 = m_Mapping[key1];
-							size_t y2 = m_Mapping[key2];
-							
-							long double a_y;
-							long double prob_sum = 0.0;
-							if (i == 0) {
-								if (iter->y1 == m_default_oid) a_y = 1.0;
-								else a_y = 0.0;
-							} else {
-								a_y = m_Alpha[z][ZMAT2(z, i-1, y1)];
-							}
-							long double b_y = m_Beta[z][ZMAT2(z, i, y2)];
-							long double m_yy = m_R[z][ZMAT2(z, i, y2)] * m_M[z][ZMAT2(z, y1, y2)];// * m_Z[MAT(z, iter->y2)];
-							long double prob = a_y * b_y * m_yy * m_Gamma[z] / zval;
-							for (size_t c = 0; c < count; c++)
-								gradient_share[iter->fid] += prob * iter->fval * count;
-						} ///< for each edge
-
-
-					} ///< for z
-				}	///< if ( i > 0)
-				prev_outcome = outcome;
-				fval = it->seq[i].fval;
-				
-				/*
-				/// f(y,z)
-				for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-					size_t index = ZMAT2(iter->y1, i, m_Mapping[make_pair(iter->y1, iter->y2)]);
-					long double prob = m_Alpha[iter->y1][index] * m_Beta[iter->y1][index] * m_Gamma[iter->y1] / zval;
-					gradient_topic[iter->fid] += prob * iter->fval;
-				}
-				*/
-				
-			} ///< for each node in sequence
-			
-			/// f(z,x)
-			vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(it->topic.obs);
-			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-				long double prob = m_Alpha[iter->y][ZMAT2(iter->y, m_seq_size-1, m_default_oid)] * m_Gamma[iter->y] / zval;
-				for (size_t c = 0; c < count ; c++)
-					gradient_topic[iter->fid] += prob * iter->fval * count;
-			}
-			
-			for (size_t c = 0; c < count; c++) {
-				eval2.addLikelihood(y_seq_prob);	/// loglikelihood
-				eval2.append(m_Param, reference, hypothesis);	/// evaluation (accuracy and f1 score)
-				vector<size_t> reference1, hypothesis1;
-				reference1.push_back(it->topic.label);
-				hypothesis1.push_back(max_z);
-				eval1.addLikelihood(y_seq_prob);	/// loglikelihood
-				eval1.append(reference1, hypothesis1);
-			}
-			time_for_estimating += stop_watch.elapsed();
-			
+			accumulateGradient(*it, *count_it, ctx, niter > 0, gradient_topic, gradient_seq, gradient_share, eval1, eval2);
 		} ///< for m_TrainSet
 
 		/////////////////////////////////////////////////////////////////////////////////
@@ -1020,45 +1213,7 @@ bool TriCRF1::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		timer stop_watch;
 		double time_for_dev = 0.0;
 		/// for each dev data
-        it = m_DevSet.begin();
-		count_it = m_DevSetCount.begin();
-        for (; it != m_DevSet.end(); ++it, ++count_it) {
-			double count = *count_it;
-			calculateFactors(*it);
-  			forward();
-			long double zval = getPartitionZ();
-            long double dummy_prob;
-			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == it->seq.size());
-
-			size_t prev_outcome = m_default_oid;
-			vector<string> reference, hypothesis;
-			for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
-				size_t outcome = it->seq[i].label;
-
-				string outcome_s;
-				/// If there are non-attested labels in dev, test sets, then ...
-				if (m_ParamTopic.sizeStateVec() <= it->topic.label || m_ParamSeq[it->topic.label].sizeStateVec() <= outcome) 
-					outcome_s = m_Param.getState().second[m_default_oid];
-				else
-					outcome_s = m_ParamSeq[it->topic.label].getState().second[outcome];
-				//if (m_ParamTopic.sizeStateVec() <= max_z || m_ParamSeq[max_z].sizeStateVec() <= y_seq[i]) 
-				//	continue;
-				string y_seq_s = m_ParamSeq[max_z].getState().second[y_seq[i]];
-				reference.push_back(outcome_s);
-				hypothesis.push_back(y_seq_s);
-			}
-
-			for (size_t c = 0; c < count; c++) {
-				dev_eval2.append(m_Param, reference, hypothesis);	
-				vector<size_t> reference1, hypothesis1;
-				reference1.push_back(it->topic.label);
-				hypothesis1.push_back(max_z);
-				dev_eval1.append(reference1, hypothesis1);
-			}
-
-		} ///< for each dev
+		evaluateDev(ctx, dev_eval1, dev_eval2);
 		time_for_dev = stop_watch.elapsed();
 
 		////////////////////////////////////////////////////////////////////////////
@@ -1165,12 +1320,192 @@ bool TriCRF1::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 	return true;
 }
 
+/** Subtract the empirical counts of a training sequence from the gradients.
+	The features of its topic and of its labels in the plane of the topic
+	(the same features as the expectation of accumulateGradient()).
+*/
+void TriCRF1::accumulateEmpirical(const TriStringSequence& triseq, double count, 
+	double* gradient_topic, vector<double*>& gradient_seq, double* gradient_share) const {
+	size_t z = triseq.topic.label;
+	for (size_t i = 0; i < triseq.seq.size(); ++i) {
+		size_t y = triseq.seq[i].label;
+
+		/// f(y,x)
+		vector<ObsParam> obs_param = makeObsIndex(triseq, i, z);
+		for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+			if (iter->y == y)
+				gradient_seq[z][iter->fid] -= iter->fval * count;
+		}
+		obs_param = makeObsIndex(triseq, i, m_topic_size);
+		for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+			if (m_Mapping[z][iter->y] == y)
+				gradient_share[iter->fid] -= iter->fval * count;
+		}
+
+		/// f(y,y)
+		if (i > 0) {
+			size_t prev_y = triseq.seq[i-1].label;
+			vector<StateParam>::const_iterator iter = m_ParamSeq[z].m_StateIndex.begin();
+			for (; iter != m_ParamSeq[z].m_StateIndex.end(); ++iter) {
+				if (iter->y1 == prev_y && iter->y2 == y)
+					gradient_seq[z][iter->fid] -= iter->fval * count;
+			}
+			for (iter = m_Param.m_StateIndex.begin(); iter != m_Param.m_StateIndex.end(); ++iter) {
+				if (m_Mapping[z][iter->y1] == prev_y && m_Mapping[z][iter->y2] == y)
+					gradient_share[iter->fid] -= iter->fval * count;
+			}
+		}
+	}
+
+	/// f(z,x)
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+		if (iter->y == z)
+			gradient_topic[iter->fid] -= iter->fval * count;
+	}
+}
+
+void TriCRF1::onlineBlocks(vector<Parameter*>& block) {
+	block.push_back(&m_ParamTopic);
+	for (size_t z = 0; z < m_topic_size; z++)
+		block.push_back(&m_ParamSeq[z]);
+	block.push_back(&m_Param);
+}
+
+/// the transitions of every plane
+void TriCRF1::onlineDense(vector<vector<size_t> >& dense) {
+	for (size_t z = 0; z <= m_topic_size; z++) {
+		const vector<StateParam>& edge = (z < m_topic_size ? m_ParamSeq[z].m_StateIndex : m_Param.m_StateIndex);
+		for (size_t j = 0; j < edge.size(); j++)
+			dense[z + 1].push_back(edge[j].fid);
+	}
+}
+
+void TriCRF1::onlineEvaluators(vector<Evaluator>& eval) {
+	eval.push_back(Evaluator(m_ParamTopic, false));	///< Evaluator (topic)
+	eval.push_back(Evaluator(m_Param));	///< Evaluator (sequence)
+}
+
+/// the topic planes of a sequence in parallel (a single worker)
+void TriCRF1::onlineBegin(size_t n_workers) {
+	TriCRF::onlineBegin(n_workers);
+	m_Context.topic.pool = topicPool(m_topic_size);
+}
+
+void TriCRF1::reportParam() {
+	logger->report("  >>Parameters for topic features\n");
+	m_ParamTopic.print(logger);
+	for (size_t z = 0; z < m_topic_size; z++) {
+		logger->report("  >>Parameters for %d plane\n", z);
+		m_ParamSeq[z].print(logger);
+	}
+}
+
+void TriCRF1::touchSample(SGD& sgd, size_t worker, size_t s) {
+	const TriStringSequence& triseq = m_TrainSet[s];
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for (size_t j = 0; j < obs_param.size(); j++)
+		sgd.touch(worker, 0, obs_param[j].fid);
+	for (size_t i = 0; i < triseq.seq.size(); i++) {
+		for (size_t z = 0; z <= m_topic_size; z++) {
+			obs_param = makeObsIndex(triseq, i, z);
+			for (size_t j = 0; j < obs_param.size(); j++)
+				sgd.touch(worker, z + 1, obs_param[j].fid);
+		}
+	}
+}
+
+/// the topics are pruned from the second epoch
+void TriCRF1::gradientSample(SGD& sgd, size_t worker, size_t s, vector<Evaluator>& eval, size_t epoch) {
+	const TriStringSequence& triseq = m_TrainSet[s];
+	vector<double*> gradient_seq;
+	for (size_t z = 0; z < m_topic_size; z++)
+		gradient_seq.push_back(sgd.gradient(worker, z + 1));
+	double* gradient_topic = sgd.gradient(worker, 0);
+	double* gradient_share = sgd.gradient(worker, m_topic_size + 1);
+	accumulateGradient(triseq, 1.0, workerContext(worker), epoch > 0, gradient_topic, gradient_seq, gradient_share, eval[0], eval[1]);
+	accumulateEmpirical(triseq, 1.0, gradient_topic, gradient_seq, gradient_share);
+}
+
+/** A sequence is decoded with the current weights (decode() ; the forward pass gives the topic beam) ;
+	the loss of MIRA is the wrong topic and the wrong labels.
+	@return	1 if the topic or a label is wrong
+*/
+size_t TriCRF1::mistakeSample(size_t s, vector<Evaluator>& eval, bool& changed) {
+	TriStringSequence& triseq = m_TrainSet[s];
+	size_t z = triseq.topic.label;
+	size_t max_z;
+	long double dummy_prob;
+	vector<size_t> y_seq = decode(triseq, m_Context, max_z, dummy_prob);
+
+	/// the labels of the planes are compared by their names
+	size_t n_wrong = (max_z != z ? 1 : 0);
+	vector<string> reference, hypothesis;
+	for (size_t i = 0; i < triseq.seq.size(); ++i) {
+		reference.push_back(m_ParamSeq[z].getStateVec()[triseq.seq[i].label]);
+		hypothesis.push_back(m_ParamSeq[max_z].getStateVec()[y_seq[i]]);
+		if (reference.back() != hypothesis.back())
+			++n_wrong;
+	}
+	eval[1].append(m_Param, reference, hypothesis);
+	vector<size_t> reference1, hypothesis1;
+	reference1.push_back(z);
+	hypothesis1.push_back(max_z);
+	eval[0].append(reference1, hypothesis1);
+
+	if (n_wrong == 0) {
+		changed = m_Perceptron.update(0.0);
+		return 0;
+	}
+
+	/// the weights of the sequence in the planes of the two topics
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for (size_t j = 0; j < obs_param.size(); j++)
+		m_Perceptron.touch(0, obs_param[j].fid);
+	size_t planes[3] = {z, max_z, m_topic_size};
+	for (size_t p = 0; p < 3; p++) {
+		for (size_t i = 0; i < triseq.seq.size(); i++) {
+			obs_param = makeObsIndex(triseq, i, planes[p]);
+			for (size_t j = 0; j < obs_param.size(); j++)
+				m_Perceptron.touch(planes[p] + 1, obs_param[j].fid);
+		}
+		const vector<StateParam>& edge = (planes[p] < m_topic_size ? m_ParamSeq[planes[p]].m_StateIndex : m_Param.m_StateIndex);
+		for (size_t j = 0; j < edge.size(); j++)
+			m_Perceptron.touch(planes[p] + 1, edge[j].fid);
+	}
+
+	/// f(x,y^) - f(x,y) ; the predicted labels are put in the sequence for a while
+	vector<double*> gradient_seq;
+	for (size_t p = 0; p < m_topic_size; p++)
+		gradient_seq.push_back(m_ParamSeq[p].getGradient());
+	vector<size_t> label(triseq.seq.size());
+	for (size_t i = 0; i < triseq.seq.size(); ++i) {
+		label[i] = triseq.seq[i].label;
+		triseq.seq[i].label = y_seq[i];
+	}
+	triseq.topic.label = max_z;
+	accumulateEmpirical(triseq, -1.0, m_ParamTopic.getGradient(), gradient_seq, m_Param.getGradient());
+	for (size_t i = 0; i < triseq.seq.size(); ++i)
+		triseq.seq[i].label = label[i];
+	triseq.topic.label = z;
+	accumulateEmpirical(triseq, 1.0, m_ParamTopic.getGradient(), gradient_seq, m_Param.getGradient());
+	changed = m_Perceptron.update((double)n_wrong);
+	return 1;
+}
+
+bool TriCRF1::evaluateDev(vector<Evaluator>& dev_eval) {
+	evaluateDev(m_Context, dev_eval[0], dev_eval[1]);
+	return m_DevSet.size() > 0;
+}
+
 /** Training with Psuedo-likelihood.
 	@param max_iter	maximum number of iteration
 	@param sigma	Gaussian prior variance
 */
 bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
-	LBFGS lbfgs1, lbfgs2;	///< LBFGS optimizer
+	InferenceContext& ctx = m_Context;
+	ctx.topic.pool = topicPool(m_topic_size);	///< topic planes of a sequence in parallel
+	LBFGS lbfgs1(m_lbfgs_history, m_lbfgs_float), lbfgs2(m_lbfgs_history, m_lbfgs_float);	///< LBFGS optimizer
 
 	/// Parameter weight setting
 	size_t n_theta = 0;
@@ -1271,7 +1606,7 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 			for (size_t i = 0; i < it->seq.size(); ++i) {			
 				for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); 
 					iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-					if (iter->y2 == m_RMapping[make_pair(iter->y1, it->seq[i].label)])
+					if (iter->y2 == m_RMapping[iter->y1][it->seq[i].label])
 						prob_topic[iter->y1] += theta_topic[iter->fid];
 				}	
 			}
@@ -1305,7 +1640,7 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 			for (size_t i = 0; i < it->seq.size(); ++i) {			
 				for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); 
 					iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-					if (iter->y2 == m_RMapping[make_pair(iter->y1, it->seq[i].label)])
+					if (iter->y2 == m_RMapping[iter->y1][it->seq[i].label])
 						gradient_topic[iter->fid] += prob_topic[iter->y1] * it->topic.fval;  //iter->fval * count;					
 				}	
 			}
@@ -1324,16 +1659,16 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 				fill(prob_seq.begin(), prob_seq.end(), 0.0);
 
 				/// w * f (for all classes)
-				vector<ObsParam> obs_param = m_ParamSeq[it->topic.label].makeObsIndex(it->seq[i].obs);
+				vector<ObsParam> obs_param = makeObsIndex(*it, i, it->topic.label);
 				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
 					prob_seq[iter->y] += theta_seq[it->topic.label][iter->fid] * 1.0; //iter->fval;
 				}
-				obs_param = m_Param.makeObsIndex(it->seq[i].obs);
+				obs_param = makeObsIndex(*it, i, m_topic_size);
 				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					pair<size_t, size_t> key = make_pair(it->topic.label, iter->y);
-					if (m_Mapping.find(key) == m_Mapping.end()) 
+					size_t y = m_Mapping[it->topic.label][iter->y];
+					if (y == NO_STATE)
 						continue;
-					prob_seq[m_Mapping[key]] += theta_share[iter->fid] * 1.0; //iter->fval;
+					prob_seq[y] += theta_share[iter->fid] * 1.0; //iter->fval;
 				}
 				
 				for (vector<StateParam>::iterator iter = m_ParamSeq[it->topic.label].m_StateIndex.begin(); iter != m_ParamSeq[it->topic.label].m_StateIndex.end(); ++iter) {
@@ -1342,13 +1677,10 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 				}
 				
 				for (vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin(); iter != m_Param.m_StateIndex.end(); ++iter) {
-					pair<size_t, size_t> key1 = make_pair(it->topic.label, iter->y1);
-					pair<size_t, size_t> key2 = make_pair(it->topic.label, iter->y2);
-			
-					if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
+					size_t y1 = m_Mapping[it->topic.label][iter->y1];
+					size_t y2 = m_Mapping[it->topic.label][iter->y2];
+					if (y1 == NO_STATE || y2 == NO_STATE)
 						continue;
-					size_t y1 = m_Mapping[key1];
-					size_t y2 = m_Mapping[key2];
 				
 					if (y1 == prev_label)
 						prob_seq[y2] += theta_share[iter->fid] * 1.0; //iter->fval;
@@ -1370,19 +1702,19 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 					prob_seq[j] /= sum;
 				}
 				
-				string outcome_s = m_ParamSeq[it->topic.label].getState().second[it->seq[i].label];
-				string y_seq_s = m_ParamSeq[it->topic.label].getState().second[max_y];
+				string outcome_s = m_ParamSeq[it->topic.label].getStateVec()[it->seq[i].label];
+				string y_seq_s = m_ParamSeq[it->topic.label].getStateVec()[max_y];
 				reference2.push_back(outcome_s);
 				hypothesis2.push_back(y_seq_s);
 
 				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					pair<size_t, size_t> key = make_pair(it->topic.label, iter->y);
-					if (m_Mapping.find(key) == m_Mapping.end()) 
+					size_t y = m_Mapping[it->topic.label][iter->y];
+					if (y == NO_STATE)
 						continue;
-					gradient_share[iter->fid] += prob_seq[m_Mapping[key]] * iter->fval * count;
+					gradient_share[iter->fid] += prob_seq[y] * iter->fval * count;
 				}
 
-				obs_param = m_ParamSeq[it->topic.label].makeObsIndex(it->seq[i].obs);
+				obs_param = makeObsIndex(*it, i, it->topic.label);
 				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
 					gradient_seq[it->topic.label][iter->fid] += prob_seq[iter->y] * iter->fval * count;
 				}
@@ -1393,13 +1725,10 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 				}
 				
 				for (vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin(); iter != m_Param.m_StateIndex.end(); ++iter) {
-					pair<size_t, size_t> key1 = make_pair(it->topic.label, iter->y1);
-					pair<size_t, size_t> key2 = make_pair(it->topic.label, iter->y2);
-			
-					if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
+					size_t y1 = m_Mapping[it->topic.label][iter->y1];
+					size_t y2 = m_Mapping[it->topic.label][iter->y2];
+					if (y1 == NO_STATE || y2 == NO_STATE)
 						continue;
-					size_t y1 = m_Mapping[key1];
-					size_t y2 = m_Mapping[key2];
 				
 					if (y1 == prev_label)
 						gradient_share[iter->fid] = prob_seq[y2] * iter->fval * count;
@@ -1439,12 +1768,13 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 		count_it = m_DevSetCount.begin();
         for (; it != m_DevSet.end(); ++it, ++count_it) {
 			double count = *count_it;
-			calculateFactors(*it);
-  			forward();
-			long double zval = getPartitionZ();
+			calculateFactors(*it, ctx);
+			beamTopic(ctx);
+  			forward(ctx);
+			long double zval = getPartitionZ(ctx);
             long double dummy_prob;
 			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
+			vector<size_t> y_seq = viterbiSearch(ctx, max_z, dummy_prob);
 			assert(y_seq.size() == it->seq.size());
 
 			size_t prev_outcome = m_default_oid;
@@ -1455,12 +1785,12 @@ bool TriCRF1::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 				string outcome_s;
 				/// If there are non-attested labels in dev, test sets, then ...
 				if (m_ParamTopic.sizeStateVec() <= it->topic.label || m_ParamSeq[it->topic.label].sizeStateVec() <= outcome) 
-					outcome_s = m_Param.getState().second[m_default_oid];
+					outcome_s = m_Param.getStateVec()[m_default_oid];
 				else
-					outcome_s = m_ParamSeq[it->topic.label].getState().second[outcome];
+					outcome_s = m_ParamSeq[it->topic.label].getStateVec()[outcome];
 				//if (m_ParamTopic.sizeStateVec() <= max_z || m_ParamSeq[max_z].sizeStateVec() <= y_seq[i]) 
 				//	continue;
-				string y_seq_s = m_ParamSeq[max_z].getState().second[y_seq[i]];
+				string y_seq_s = m_ParamSeq[max_z].getStateVec()[y_seq[i]];
 				reference.push_back(outcome_s);
 				hypothesis.push_back(y_seq_s);
 			}
@@ -1603,12 +1933,61 @@ bool TriCRF1::pretrain(size_t max_iter, double sigma, bool L1) {
 }
 
 bool TriCRF1::train(size_t max_iter, double sigma, bool L1) { 
+	if (m_Estimator == ESTIMATE_SGD)
+		return estimateWithSGD(max_iter, sigma, L1);
+	if (m_Estimator == ESTIMATE_PERCEPTRON || m_Estimator == ESTIMATE_MIRA)
+		return estimateWithPerceptron(max_iter);
 	return estimateWithLBFGS(max_iter, sigma, L1); 
 }
 
+/** Decode a sequence.
+	Reentrant ; the model is not modified and the lattices are kept in ctx.
+	@param triseq	sequence to be decoded
+	@param ctx	inference context (one per thread)
+	@param max_z	best topic
+	@param prob	probability of the best path
+	@return best label sequence (of the best topic)
+*/
+vector<size_t> TriCRF1::decode(const TriStringSequence& triseq, InferenceContext& ctx, size_t& max_z, long double& prob) const {
+	calculateFactors(triseq, ctx);
+	beamTopic(ctx);
+	forward(ctx);
+	getPartitionZ(ctx);
+	pruneTopic(ctx);
+
+	vector<size_t> y_seq = viterbiSearch(ctx, max_z, prob);
+	assert(y_seq.size() == triseq.seq.size());
+	return y_seq;
+}
+
+/** Decoding job.
+	Decodes a batch of sequences with the shared model; each thread has its own context.
+	@class TriCRF1DecodeJob
+*/
+class TriCRF1DecodeJob : public ThreadJob {
+private:
+	const TriCRF1* m_Model;
+	vector<TriStringSequence>& m_Batch;
+	vector<InferenceContext>& m_Context;
+	vector<vector<size_t> >& m_Output;
+	vector<size_t>& m_Topic;
+public:
+	TriCRF1DecodeJob(const TriCRF1* model, vector<TriStringSequence>& batch, vector<InferenceContext>& ctx, vector<vector<size_t> >& output, vector<size_t>& topic)
+		: m_Model(model), m_Batch(batch), m_Context(ctx), m_Output(output), m_Topic(topic) {}
+	void run(size_t tid, size_t n_threads) {
+		size_t begin, end;
+		splitRange(m_Batch.size(), tid, n_threads, begin, end);
+		for (size_t i = begin; i < end; ++i) {
+			long double prob;
+			m_Output[i] = m_Model->decode(m_Batch[i], m_Context[tid], m_Topic[i], prob);
+		}
+	}
+};
+
 bool TriCRF1::test(const std::string& filename, const std::string& outputfile, bool confidence) {
 	/// File stream
 	string line;
+	vector<StringRef> tokens;	///< tokens of the line (refer to the line)
 	ifstream f(filename.c_str());
 	if (!f)
 		throw runtime_error("cannot open data file");
@@ -1619,7 +1998,7 @@ bool TriCRF1::test(const std::string& filename, const std::string& outputfile, b
 	if (outputfile != "") {
 		out.open(outputfile.c_str());
 		out.precision(20);
-		state_vec = m_ParamTopic.getState().second;
+		state_vec = m_ParamTopic.getStateVec();
 	}
 
 	/// initializing
@@ -1642,33 +2021,57 @@ bool TriCRF1::test(const std::string& filename, const std::string& outputfile, b
 	size_t seq_count = 0;
 	
 	calculateEdge();
-	
-	/// reading the text
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty()) {
-			/// test
-			calculateFactors(triseq);
-  			forward();
-			long double zval = getPartitionZ();
-            long double dummy_prob;
 
-			////////////////////////////////////////////////////////////////////
-			/// pruning
-			////////////////////////////////////////////////////////////////////
-			long double threshold = m_prune[0].first / m_prune_threshold;
-			vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
-			for (; pit != m_prune.end(); pit++) {
-				if (pit->first < threshold) {
-					m_prune.erase(pit, m_prune.end());
-					break;
-				}
+	/// the sequences are decoded in batches (in parallel) and written in order
+	size_t batch_size = 256 * sizeThreads();
+	vector<TriStringSequence> batch;
+	vector<vector<size_t> > batch_output;
+	vector<size_t> batch_topic;
+	/// with many topics the threads share the planes of each sequence ; otherwise they share the batch
+	ThreadPool* topic_pool = topicPool(m_topic_size);
+	vector<InferenceContext> thread_ctx(topic_pool != NULL ? 1 : sizeThreads());
+	thread_ctx[0].topic.pool = topic_pool;
+	bool eof = false;
+
+	while (!eof) {
+		/// reading the text
+		batch.clear();
+		while (batch.size() < batch_size) {
+			if (!getline(f,line)) {
+				eof = true;
+				break;
 			}
+			tokenize(StringRef(line), " 	", tokens);
+			if (line.empty()) {
+				batch.push_back(triseq);
+				triseq.seq.clear();
+				seq_count = 0;
+			} else {
+				++seq_count;
+				if (seq_count == 1) { ///< this is a topic 
+					triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
+				} else {
+					size_t z = (triseq.topic.label < m_ParamTopic.sizeStateVec() ? triseq.topic.label : m_default_oid);
+					StringEvent ev = packStringEvent(tokens,  &m_ParamSeq[z], true);	///< observation features
+					triseq.seq.push_back(ev);	///< append
+				}
 
-			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == triseq.seq.size());
+			}	///< else
+		}	///< while
+
+		/// test
+		batch_output.resize(batch.size());
+		batch_topic.resize(batch.size());
+		TriCRF1DecodeJob job(this, batch, thread_ctx, batch_output, batch_topic);
+		if (topic_pool != NULL)
+			job.run(0, 1);
+		else
+			runParallel(job);
 
+		for (size_t n = 0; n < batch.size(); n++) {
+			TriStringSequence& triseq = batch[n];
+			size_t max_z = batch_topic[n];
+			vector<size_t>& y_seq = batch_output[n];
 			vector<size_t> reference1, hypothesis1;
 			reference1.push_back(triseq.topic.label);
 			hypothesis1.push_back(max_z);
@@ -1677,7 +2080,7 @@ bool TriCRF1::test(const std::string& filename, const std::string& outputfile, b
 				out << state_vec[max_z];
 				/*
 				if (confidence) {
-					double prob = m_Alpha[max_z][ZMAT2(max_z, m_seq_size-1, m_default_oid)] * m_Gamma[max_z] / zval;
+					double prob = ctx.topic.ZAlpha[max_z][ZMAT2(max_z, ctx.seq_size-1, m_default_oid)] * ctx.topic.Gamma[max_z] / zval;
 					out << " " << prob;
 				}
 				*/
@@ -1692,10 +2095,10 @@ bool TriCRF1::test(const std::string& filename, const std::string& outputfile, b
 				string outcome_s;
 				/// If there are non-attested labels in dev, test sets, then ...
 				if (m_ParamTopic.sizeStateVec() <= triseq.topic.label || m_ParamSeq[triseq.topic.label].sizeStateVec() <= outcome) 
-					outcome_s = m_Param.getState().second[m_default_oid];
+					outcome_s = m_Param.getStateVec()[m_default_oid];
 				else
-					outcome_s = m_ParamSeq[triseq.topic.label].getState().second[outcome];
-				string y_seq_s = m_ParamSeq[max_z].getState().second[y_seq[i]];
+					outcome_s = m_ParamSeq[triseq.topic.label].getStateVec()[outcome];
+				string y_seq_s = m_ParamSeq[max_z].getStateVec()[y_seq[i]];
 
 				reference.push_back(outcome_s);
 				hypothesis.push_back(y_seq_s);
@@ -1706,8 +2109,8 @@ bool TriCRF1::test(const std::string& filename, const std::string& outputfile, b
 					if (confidence) {
 						double norm = 0.0;
 						for (size_t j = 0; j < m_state_size[max_z]; j++)
-							norm += m_R[max_z][ZMAT2(max_z, i, j)] * m_M[max_z][ZMAT2(max_z, prev_y,j)]; 
-						double prob = m_R[max_z][ZMAT2(max_z, i, y_seq[i])] * m_M[max_z][ZMAT2(max_z, prev_y,y_seq[i])] / norm;
+							norm += ctx.topic.ZR[max_z][ZMAT2(max_z, i, j)] * m_M[max_z][ZMAT2(max_z, prev_y,j)]; 
+						double prob = ctx.topic.ZR[max_z][ZMAT2(max_z, i, y_seq[i])] * m_M[max_z][ZMAT2(max_z, prev_y,y_seq[i])] / norm;
 						out << " " << prob;
 						prev_y = y_seq[i];
 					}
@@ -1721,20 +2124,8 @@ bool TriCRF1::test(const std::string& filename, const std::string& outputfile, b
 			test_eval2.append(m_Param, reference, hypothesis);
 			evals[triseq.topic.label].append(m_ParamSeq[triseq.topic.label], reference, hypothesis);		
 
-			triseq.seq.clear();
-			seq_count = 0;
 			++count;
-		} else {
-			++seq_count;
-			if (seq_count == 1) { ///< this is a topic 
-				triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
-			} else {
-				size_t z = (triseq.topic.label < m_ParamTopic.sizeStateVec() ? triseq.topic.label : m_default_oid);
-				StringEvent ev = packStringEvent(tokens,  &m_ParamSeq[z], true);	///< observation features
-				triseq.seq.push_back(ev);	///< append
-			}
-
-		}	///< else
+		}
 	}	///< while
 
 	test_eval1.calculateF1();
@@ -1757,11 +2148,12 @@ bool TriCRF1::test(const std::string& filename, const std::string& outputfile, b
 	test_eval2.Print(logger);
 	logger->report("\n-------------PER TOPIC CLASS-------------------------------------------\n");
 	for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
-		logger->report("%s MicroF1 = \t\t%8.3f\n", m_ParamTopic.getState().second[i].c_str(), evals[i].getMicroF1()[2]);	
-		logger->report("- Domain = %s ----------------------------------------------------\n", m_ParamTopic.getState().second[i].c_str());
+		logger->report("%s MicroF1 = \t\t%8.3f\n", m_ParamTopic.getStateVec()[i].c_str(), evals[i].getMicroF1()[2]);	
+		logger->report("- Domain = %s ----------------------------------------------------\n", m_ParamTopic.getStateVec()[i].c_str());
 		evals[i].Print(logger);
 	}
 	
+	return true;
 }
 
 }	///< namespace tricrf
@@ -9,18 +9,19 @@
 #define __TRICRF1_H__
 
 /// max headers
-#include "CRF.h"
+#include "TriCRF.h"
 /// standard headers
 #include <vector>
 #include <string>
 #include <map>
+#include <fstream>
 
 namespace tricrf {
 
 /** Triangular-chain Conditional Random Fields (Model1).
 	@class TriCRF1
 */
-class TriCRF1 : public CRF {
+class TriCRF1 : public TriCRF {
 protected:
 	/// Data sets
 	Data<TriStringSequence> m_TrainSet;	 ///< Train data
@@ -28,17 +29,17 @@ protected:
 	std::vector<std::vector<TriSequence> > m_TrainLabelSet;
 	
 	std::vector<std::vector<long double> > m_M;			///< M matrix ; edge transition 
-	std::vector<std::vector<long double> > m_R;			///< R matrix ; node observation
-	std::vector<std::vector<long double> > m_Alpha;	///< Alpha matrix
-	std::vector<std::vector<long double> > m_Beta;		///< Beta matrix
-	std::vector<long double> m_Gamma;			///< Gamma matrix ; topic prior
+	std::vector<std::vector<long double> > m_MaxM;	///< column maxima of M (topic beam)
 	std::vector<long double> m_Z;			///< Z matrix ; topic prior	
 
 	/// Parameters
 	std::vector<Parameter> m_ParamSeq;
 	Parameter m_ParamTopic;
-	std::map<std::pair<size_t, size_t>, size_t> m_Mapping;
-	std::map<std::pair<size_t, size_t>, size_t> m_RMapping;
+	std::vector<std::vector<uint32_t> > m_Mapping;	///< [z][y] -> y of the plane z (NO_STATE if not in the plane)
+	std::vector<std::vector<uint32_t> > m_RMapping;	///< [z][y of the plane z] -> y
+	void addMapping(size_t z, size_t y, size_t yz);
+	void finishMapping();
+	FeatureView m_View;	///< features of the train and dev data for every plane (m_topic_size: m_Param)
 
 	/// Variables for computation
 	size_t m_topic_size;
@@ -46,18 +47,48 @@ protected:
 	size_t m_state_size2;
 
 	/// Inference
-	void calculateFactors(TriStringSequence &seq);	///< Calculating the factors
+	void buildView();
+	std::vector<ObsParam> makeObsIndex(const TriStringSequence& triseq, size_t i, size_t z) const;	///< node i in the plane z
+	void calculateFactors(const TriStringSequence &seq, InferenceContext& ctx) const;	///< Calculating the factors
 	void calculateEdge();
-	void forward();	 ///< Forward recursion
-	void backward();	///< Backward recursion
-	long double getPartitionZ();	///< Z
-	long double calculateProb(TriStringSequence& seq);	///< Prob(y|x)
-	std::vector<size_t> viterbiSearch(size_t& max_z, long double& prob);	///< Find the best path
+	void boundTopic(InferenceContext& ctx) const;	///< Upper bound of each plane (topic beam)
+	void forward(InferenceContext& ctx) const;	 ///< Forward recursion
+	long double forwardTopic(InferenceContext& ctx, size_t z) const;	///< Forward recursion of a topic plane
+	void backward(InferenceContext& ctx) const;	///< Backward recursion
+	long double getPartitionZ(InferenceContext& ctx) const;	///< Z (and the topic posterior)
+	long double calculateProb(const TriStringSequence& seq, InferenceContext& ctx) const;	///< Prob(y|x)
+	std::vector<size_t> viterbiSearch(InferenceContext& ctx, size_t& max_z, long double& prob) const;	///< Find the best path
+	void backwardTopic(InferenceContext& ctx, size_t z) const;	///< Backward recursion of a topic plane
+	long double viterbiTopic(const InferenceContext& ctx, size_t z, std::vector<size_t>& y_seq) const;	///< Best path of a topic plane
+
+	/// Model
+	template <class Stream> bool loadParam(Stream& f);	///< text or binary stream
+	template <class Stream> bool saveParam(Stream& f);
+	bool loadMapping(std::ifstream& f);
+	bool loadMapping(BinaryModelReader& f);
+	bool saveMapping(std::ofstream& f);
+	bool saveMapping(BinaryModelWriter& f);
 
 	/// Parameter Estimation
+	void accumulateGradient(const TriStringSequence& triseq, double count, InferenceContext& ctx, bool prune_topic,
+		double* gradient_topic, std::vector<double*>& gradient_seq, double* gradient_share, Evaluator& eval1, Evaluator& eval2);
+	void accumulateEmpirical(const TriStringSequence& triseq, double count, 
+		double* gradient_topic, std::vector<double*>& gradient_seq, double* gradient_share) const;
+	void evaluateDev(InferenceContext& ctx, Evaluator& dev_eval1, Evaluator& dev_eval2);
 	bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
 	bool estimateWithPL(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
 
+	/// Online estimation (see MaxEnt::estimateWithSGD) ; blocks: topic, planes (1..m_topic_size) and the shared plane
+	void onlineBlocks(std::vector<Parameter*>& block);
+	void onlineDense(std::vector<std::vector<size_t> >& dense);
+	void onlineEvaluators(std::vector<Evaluator>& eval);
+	void onlineBegin(size_t n_workers);
+	void reportParam();
+	void touchSample(SGD& sgd, size_t worker, size_t s);
+	void gradientSample(SGD& sgd, size_t worker, size_t s, std::vector<Evaluator>& eval, size_t epoch);
+	size_t mistakeSample(size_t s, std::vector<Evaluator>& eval, bool& changed);
+	bool evaluateDev(std::vector<Evaluator>& dev_eval);
+
 public:
 	TriCRF1();
 	TriCRF1(Logger *logger);
@@ -78,6 +109,10 @@ public:
 
 	/// Testing
 	bool test(const std::string& filename, const std::string& outputfile = "", bool confidence = false);	
+
+	/// Reentrant inference ; the model is read-only and all the scratch memory is in ctx
+	/// (calculateEdge() should be called once before)
+	std::vector<size_t> decode(const TriStringSequence& seq, InferenceContext& ctx, size_t& max_z, long double& prob) const;
 	
 	Parameter& getTopicParam() { return m_ParamTopic; };
 	std::vector<Parameter>& getSeqParam() { return m_ParamSeq; };
@@ -7,9 +7,12 @@
 
 /// max headers
 #include "TriCRF2.h"
+#include "BinaryModel.h"
 #include "Evaluator.h"
 #include "Utility.h"
+#include "Corpus.h"
 #include "LBFGS.h"
+#include "SGD.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -79,23 +82,30 @@ bool TriCRF2::saveModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model saving]\n");
 
-	/// file stream
-    ofstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("unable to open file to write");
-
-    /// header
-    f << "# MAX: A C++ Library for Structured Prediction" << endl;
-	f << "# TriCRF2 Model file (text format)" << endl;
-	f << "# Do not edit this file" << endl;
-	f << "# " << endl << ":" << endl;
-	
-	if (!m_ParamTopic.save(f))
-		return false;
-	if (!m_ParamSeq.save(f))
+	bool ret;
+	if (m_BinaryModel) {
+		/// binary format
+		BinaryModelWriter f(filename, "TriCRF2");
+		ret = m_ParamTopic.save(f) && m_ParamSeq.save(f);
+		f.close();
+	} else {
+		/// file stream
+		ofstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("unable to open file to write");
+
+		/// header
+		f << "# MAX: A C++ Library for Structured Prediction" << endl;
+		f << "# TriCRF2 Model file (text format)" << endl;
+		f << "# Do not edit this file" << endl;
+		f << "# " << endl << ":" << endl;
+
+		ret = m_ParamTopic.save(f) && m_ParamSeq.save(f);
+		f.close();
+	}
+	if (!ret)
 		return false;
-	f.close();
 
 	logger->report("  saving time = \t%.3f\n\n", stop_watch.elapsed());
 
@@ -114,39 +124,48 @@ bool TriCRF2::loadModel(const std::string& filename) {
 	timer stop_watch;
 	logger->report("[Model loading]\n");
 
-	/// file stream
-    ifstream f(filename.c_str());
-    f.precision(20);
-    if (!f)
-        throw runtime_error("fail to open model file");
-
-    /// header
-	size_t count = 0;
-    string line;
-    getline(f, line);
-    while (line.empty() || line[0] == '#') {
-		if (count == 1) {
-			vector<string> tok = tokenize(line);
-			if (tok.size() < 2 || tok[1] != "TriCRF2") {
-				logger->report("|Error| Invalid model files ... \n");
-				return false;
+	bool ret;
+	if (BinaryModelReader::isBinary(filename)) {
+		/// binary format (memory-mapped)
+		BinaryModelReader f(filename);
+		if (f.type() != "TriCRF2") {
+			logger->report("|Error| Invalid model files ... \n");
+			return false;
+		}
+		ret = m_ParamTopic.load(f) && m_ParamSeq.load(f);
+	} else {
+		/// file stream
+		ifstream f(filename.c_str());
+		f.precision(20);
+		if (!f)
+			throw runtime_error("fail to open model file");
+
+		/// header
+		size_t count = 0;
+		string line;
+		getline(f, line);
+		while (line.empty() || line[0] == '#') {
+			if (count == 1) {
+				vector<string> tok = tokenize(line);
+				if (tok.size() < 2 || tok[1] != "TriCRF2") {
+					logger->report("|Error| Invalid model files ... \n");
+					return false;
+				}
 			}
+			getline(f, line);
+			count++;
 		}
-        getline(f, line);
-		count++;
-	}
 
-	if (!m_ParamTopic.load(f))
+		ret = m_ParamTopic.load(f) && m_ParamSeq.load(f);
+		f.close();
+	}
+	if (!ret)
 		return false;
 	logger->report("  >>Parameters for topic features\n");
 	m_ParamTopic.print(logger);
-
-	if (!m_ParamSeq.load(f))
-		return false;
 	logger->report("  >>Parameters for sequence features\n");
 	m_ParamSeq.print(logger);
 
-	f.close();
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 
 	m_ParamTopic.makeStateIndex(false);
@@ -155,6 +174,7 @@ bool TriCRF2::loadModel(const std::string& filename) {
 	m_topic_size = m_ParamTopic.sizeStateVec();
 
 	createIndex();
+	calculateEdge();
 
 	return true;
 }
@@ -163,11 +183,9 @@ bool TriCRF2::loadModel(const std::string& filename) {
 */
 void TriCRF2::readTrainData(const string& filename) {
 
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
+	/// Corpus (text or compiled)
+	vector<StringRef> tokens;
+	CorpusReader corpus(filename, m_Pool);
 	
 	/// initializing
 	TriSequence triseq;
@@ -179,32 +197,28 @@ void TriCRF2::readTrainData(const string& filename) {
 	m_TrainSet.clear();
 	m_TrainSetCount.clear();
 
-	/// To reduce the storage and computation
-	map<vector<vector<string> >, size_t> train_data_map;
-	vector<vector<string> > token_list;
+	DuplicateFilter duplicate(corpus);	///< To reduce the storage and computation
 
 	size_t seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
-			if (train_data_map.find(token_list) == train_data_map.end()) {
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {	 ///< sequence break
+			size_t index = duplicate.find(m_TrainSetCount.size());
+			if (index == m_TrainSetCount.size()) {
 				m_TrainSet.append(triseq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
 				m_TrainSetCount.push_back(1.0);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				m_TrainSetCount[index] += 1.0;
 			}
 			triseq.seq.clear();
-			token_list.clear();
 			prev_label = "";
 			seq_count = 0;
 			++count;
 		} else {
 			++seq_count;
-			token_list.push_back(tokens);
+			duplicate.add(tokens);
 			if (seq_count == 1) { ///< this is a topic 
 				triseq.topic = packEvent(tokens, &m_ParamTopic);	///< wanrning: There are no common element in topic classes and sequence classes.
-				topic = tokens[0];
+				topic = tokens[0].str();
 			} else {
 				Event ev = packEvent(tokens,  &m_ParamSeq);	///< observation features
 				triseq.seq.push_back(ev);	///< append
@@ -220,7 +234,7 @@ void TriCRF2::readTrainData(const string& filename) {
 				size_t pid = m_ParamTopic.addNewObs("@" + topic);
 				m_ParamTopic.updateParam(ev.label, pid, ev.fval);
 
-				prev_label = tokens[0];
+				prev_label = tokens[0].str();
 			}
 		}	// else
 
@@ -241,11 +255,9 @@ void TriCRF2::readTrainData(const string& filename) {
 */
 void TriCRF2::readDevData(const string& filename) {
 
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
+	/// Corpus (text or compiled)
+	vector<StringRef> tokens;
+	CorpusReader corpus(filename, m_Pool);
 	
 	/// initializing
 	TriSequence triseq;
@@ -257,37 +269,33 @@ void TriCRF2::readDevData(const string& filename) {
 	m_DevSet.clear();
 	m_DevSetCount.clear();
 
-	/// To reduce the storage and computation
-	map<vector<vector<string> >, size_t> dev_data_map;
-	vector<vector<string> > token_list;
+	DuplicateFilter duplicate(corpus);	///< To reduce the storage and computation
 
 	size_t seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
-			if (dev_data_map.find(token_list) == dev_data_map.end()) {
+	while (corpus.next(tokens)) {
+		if (tokens.empty()) {	 ///< sequence break
+			size_t index = duplicate.find(m_DevSetCount.size());
+			if (index == m_DevSetCount.size()) {
 				m_DevSet.append(triseq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
 				m_DevSetCount.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				m_DevSetCount[index] += 1.0;
 			}
 			triseq.seq.clear();
-			token_list.clear();
 			prev_label = "";
 			seq_count = 0;
 			++count;
 		} else {
 			++seq_count;
-			token_list.push_back(tokens);
+			duplicate.add(tokens);
 			if (seq_count == 1) { ///< this is a topic 
 				triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
-				topic = tokens[0];
+				topic = tokens[0].str();
 			} else {
 				Event ev = packEvent(tokens,  &m_ParamSeq, true);	///< observation features
 				triseq.seq.push_back(ev);	///< append
 
-				prev_label = tokens[0];
+				prev_label = tokens[0].str();
 			}
 		}	// else
 
@@ -300,13 +308,29 @@ void TriCRF2::readDevData(const string& filename) {
 
 void TriCRF2::calculateEdge() {
 	double* theta_seq = m_ParamSeq.getWeight();
-	m_M.resize(m_state_size * m_state_size);
-	fill(m_M.begin(), m_M.end(), 1.0);
+	vector<double> score(m_state_size * m_state_size, 0.0);	///< linear scores
 
 	vector<StateParam>::iterator iter = m_ParamSeq.m_StateIndex.begin();
 	for (; iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
-		m_M[MAT2(iter->y1,iter->y2)] *= exp(theta_seq[iter->fid] * iter->fval);	 
+		score[MAT2(iter->y1,iter->y2)] += theta_seq[iter->fid] * iter->fval;	 
+	}
+	expScore(score, m_M);
+
+	/// Column maxima (upper bound of the topic planes)
+	m_MaxM.assign(m_state_size, 0.0);
+	for (size_t j = 0; j < m_state_size; j++) {
+		for (size_t k = 0; k < m_state_size; k++)
+			m_MaxM[k] = max(m_MaxM[k], m_M[MAT2(j, k)]);
 	}
+
+	/// Topic factor (independent of the sequence)
+	double* theta_topic = m_ParamTopic.getWeight();
+	score.assign(m_topic_size * m_state_size, 0.0);
+	iter = m_ParamTopic.m_StateIndex.begin();
+	for (; iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
+		score[MAT2(iter->y1, iter->y2)] += theta_topic[iter->fid] * iter->fval;
+	}
+	expScore(score, m_Z);
 }
 
 
@@ -314,203 +338,231 @@ void TriCRF2::calculateEdge() {
 	References 
 		Jeong and Lee, Triangular-chain Conditional Random Fields, (Submitted), IEEE TASLP.
 */
-void TriCRF2::calculateFactors(TriSequence &triseq) {
+void TriCRF2::calculateFactors(const TriSequence &triseq, InferenceContext& ctx) const {
 	/// Initialization
-	m_seq_size = triseq.seq.size() + 1;	///< sequence length
-	double* theta_seq = m_ParamSeq.getWeight();
-	double* theta_topic = m_ParamTopic.getWeight();
+	ctx.seq_size = triseq.seq.size() + 1;	///< sequence length
+	const double* theta_seq = m_ParamSeq.getWeight();
+	const double* theta_topic = m_ParamTopic.getWeight();
 
 	/// Factor matrix initialization
-	m_R.resize(m_seq_size * m_state_size);
-	m_Z.resize(m_topic_size * m_state_size);
-	fill(m_R.begin(), m_R.end(), 1.0);
-	fill(m_Z.begin(), m_Z.end(), 1.0);
+	ctx.score.resize(ctx.seq_size * m_state_size);
+	fill(ctx.score.begin(), ctx.score.end(), 0.0);	///< linear scores
 
 	/// Calculation
-	for (size_t i = 0; i < m_seq_size-1; i++) {
+	for (size_t i = 0; i < ctx.seq_size-1; i++) {
 		/// Observation factor
 		vector<ObsParam> obs_param = m_ParamSeq.makeObsIndex(triseq.seq[i].obs);
 		vector<ObsParam>::iterator iter = obs_param.begin();
 		for(; iter != obs_param.end(); ++iter) {
-			m_R[MAT2(i, iter->y)] *= exp(theta_seq[iter->fid] * iter->fval);
+			ctx.score[MAT2(i, iter->y)] += theta_seq[iter->fid] * iter->fval;
 		}
 		
 		/// State factor
 		//if (i > 0) {
-		//	vector<StateParam>::iterator iter = m_ParamSeq.m_StateIndex.begin();
+		//	vector<StateParam>::const_iterator iter = m_ParamSeq.m_StateIndex.begin();
 		//	for (; iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
 		//		m_M[MAT3(i,iter->y1,iter->y2)] *= exp(theta_seq[iter->fid] * iter->fval);	 
 		//	}
 		//} ///< if
 
 	}	///< for 
-
-	/// Topic factor
-	vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin();
-	for (; iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-		m_Z[MAT2(iter->y1, iter->y2)] *= exp(theta_topic[iter->fid] * iter->fval);
-	}
+	expScore(ctx.score, ctx.R);
 
 	/// Gamma 
-	m_Gamma.resize(m_topic_size, 1.0);
-	fill(m_Gamma.begin(), m_Gamma.end(), 1.0);
+	ctx.topic.Gamma.resize(m_topic_size, 0.0);
+	fill(ctx.topic.Gamma.begin(), ctx.topic.Gamma.end(), 0.0);
 	
 	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
 	vector<ObsParam>::iterator iter2 = obs_param.begin();
 	for(; iter2 != obs_param.end(); ++iter2) {
-		m_Gamma[iter2->y] *= exp(theta_topic[iter2->fid] * iter2->fval);
+		ctx.topic.Gamma[iter2->y] += theta_topic[iter2->fid] * iter2->fval;
 	}
+	expScore(ctx.topic.Gamma);
+
+	if (m_topic_beam > 0)
+		boundTopic(ctx);
 }
 
 /**	Calculate the factors.
 	References 
 		Jeong and Lee, Triangular-chain Conditional Random Fields, (Submitted), IEEE TASLP.
 */
-void TriCRF2::calculateFactors(TriStringSequence &triseq) {
+void TriCRF2::calculateFactors(const TriStringSequence &triseq, InferenceContext& ctx) const {
 	/// Initialization
-	m_seq_size = triseq.seq.size() + 1;	///< sequence length
-	double* theta_seq = m_ParamSeq.getWeight();
-	double* theta_topic = m_ParamTopic.getWeight();
+	ctx.seq_size = triseq.seq.size() + 1;	///< sequence length
+	const double* theta_seq = m_ParamSeq.getWeight();
+	const double* theta_topic = m_ParamTopic.getWeight();
 
 	/// Factor matrix initialization
-	m_R.resize(m_seq_size * m_state_size);
-	m_Z.resize(m_topic_size * m_state_size);
-	fill(m_R.begin(), m_R.end(), 1.0);
-	fill(m_Z.begin(), m_Z.end(), 1.0);
+	ctx.score.resize(ctx.seq_size * m_state_size);
+	fill(ctx.score.begin(), ctx.score.end(), 0.0);	///< linear scores
 
 	/// Calculation
-	for (size_t i = 0; i < m_seq_size-1; i++) {
+	for (size_t i = 0; i < ctx.seq_size-1; i++) {
 		/// Observation factor
 		vector<ObsParam> obs_param = m_ParamSeq.makeObsIndex(triseq.seq[i].obs);
 		vector<ObsParam>::iterator iter = obs_param.begin();
 		for(; iter != obs_param.end(); ++iter) {
-			m_R[MAT2(i, iter->y)] *= exp(theta_seq[iter->fid] * iter->fval);
+			ctx.score[MAT2(i, iter->y)] += theta_seq[iter->fid] * iter->fval;
 		}
 		
 		/// State factor
 		//if (i > 0) {
-		//	vector<StateParam>::iterator iter = m_ParamSeq.m_StateIndex.begin();
+		//	vector<StateParam>::const_iterator iter = m_ParamSeq.m_StateIndex.begin();
 		//	for (; iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
 		//		m_M[MAT3(i,iter->y1,iter->y2)] *= exp(theta_seq[iter->fid] * iter->fval);	 
 		//	}
 		//} ///< if
 
 	}	///< for 
-
-	/// Topic factor
-	vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin();
-	for (; iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-		m_Z[MAT2(iter->y1, iter->y2)] *= exp(theta_topic[iter->fid] * iter->fval);
-	}
+	expScore(ctx.score, ctx.R);
 
 	/// Gamma 
-	m_Gamma.resize(m_topic_size, 1.0);
-	fill(m_Gamma.begin(), m_Gamma.end(), 1.0);
+	ctx.topic.Gamma.resize(m_topic_size, 0.0);
+	fill(ctx.topic.Gamma.begin(), ctx.topic.Gamma.end(), 0.0);
 	
 	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
 	vector<ObsParam>::iterator iter2 = obs_param.begin();
 	for(; iter2 != obs_param.end(); ++iter2) {
-		m_Gamma[iter2->y] *= exp(theta_topic[iter2->fid] * iter2->fval);
+		ctx.topic.Gamma[iter2->y] += theta_topic[iter2->fid] * iter2->fval;
 	}
+	expScore(ctx.topic.Gamma);
+
+	if (m_topic_beam > 0)
+		boundTopic(ctx);
 }
 
-/**	Forward Recursion.
-	Computing and storing the alpha value.
+/**	Upper bound of each topic plane (the first stage of the topic beam).
+	Replacing the transitions into each state by their maximum (m_MaxM) bounds alpha
+	by a product of sums over the states, so the bound takes O(T*S) per plane instead of O(T*S^2).
+	ctx.topic.bound[z] = log(Gamma[z] * bound of Z_z).
 */
-void TriCRF2::forward() {
-	//m_Alpha.resize(m_topic_size* m_seq_size * m_state_size);
-	//fill(m_Alpha.begin(), m_Alpha.end(), 0.0);
-	m_Alpha.resize(m_topic_size);
+void TriCRF2::boundTopic(InferenceContext& ctx) const {
+	size_t last = ctx.seq_size - 1;
+	ctx.topic.bound.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
-		m_Alpha[z].resize(m_seq_size * m_zy_size[z]);
-		fill(m_Alpha[z].begin(), m_Alpha[z].end(), 0.0);
+		long double bound = log(ctx.topic.Gamma[z]);
+		for (size_t i = 0; i <= last; i++) {
+			/// from the start state at first ; into the end state at last
+			const long double* M = (i == 0 ? &m_M[MAT2(m_default_oid, 0)] : &m_MaxM[0]);
+			size_t n = (i == last ? 1 : m_y_state[z].size());
+			long double sum = 0.0;
+			for (size_t s = 0; s < n; s++) {
+				size_t j = m_y_state[z][s].y2;
+				sum += ctx.R[MAT2(i, j)] * m_Z[MAT2(z, j)] * M[j];
+			}
+			bound += log(sum);
+		}
+		ctx.topic.bound[z] = bound;
 	}
+}
 
+/**	Forward Recursion.
+	Computing and storing the alpha value (of the topic planes in ctx.topic.active).
+*/
+void TriCRF2::forward(InferenceContext& ctx) const {
+	//ctx.topic.ZAlpha.resize(m_topic_size* ctx.seq_size * m_state_size);
+	//fill(ctx.topic.ZAlpha.begin(), ctx.topic.ZAlpha.end(), 0.0);
+	ctx.topic.ZAlpha.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
-		//for (size_t j = 0; j < m_state_size; j++) {
-		for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-			size_t j = iter->y2;
-			long double prob = m_R[MAT2(0, j)] * m_M[MAT2(m_default_oid, j)];
-			m_Alpha[z][TCRF2_MAT2(m_zy_size[z], 0, iter->y1)] += prob * m_Z[MAT2(z, j)];
-		}
+		ctx.topic.ZAlpha[z].resize(ctx.seq_size * m_zy_size[z]);
+		fill(ctx.topic.ZAlpha[z].begin(), ctx.topic.ZAlpha[z].end(), 0.0);
 	}
 
-	for (size_t z = 0; z < m_topic_size; z++) {
-		for (size_t i = 1; i < m_seq_size; i++) {
-			//for (size_t j = 0; j < m_state_size; j++) {
-			for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-				size_t j = iter->y2;
-				long double prob = m_R[MAT2(i, j)] * m_Z[MAT2(z, j)];
-				if (prob > 0) {
-					//for (size_t k = 0; k < m_state_size; k++) {
-					for (vector<StateParam>::iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
-						size_t k = iter2->y2;
-						m_Alpha[z][TCRF2_MAT2(m_zy_size[z],i, iter->y1)] += 
-										m_Alpha[z][TCRF2_MAT2(m_zy_size[z], i-1, iter2->y1)] * m_M[MAT2(k, j)] * prob;
-					} ///< for k
-				} // if prob > 0
-			} ///< for j
-		}  ///< for i
-	}  ///< for z
+	forwardTopics(ctx);
+}
 
+/**	Forward recursion of a topic plane.
+	@return Gamma * Z of the plane
+*/
+long double TriCRF2::forwardTopic(InferenceContext& ctx, size_t z) const {
+	//for (size_t j = 0; j < m_state_size; j++) {
+	for (vector<StateParam>::const_iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
+		size_t j = iter->y2;
+		long double prob = ctx.R[MAT2(0, j)] * m_M[MAT2(m_default_oid, j)];
+		ctx.topic.ZAlpha[z][TCRF2_MAT2(m_zy_size[z], 0, iter->y1)] += prob * m_Z[MAT2(z, j)];
+	}
+
+	for (size_t i = 1; i < ctx.seq_size; i++) {
+		//for (size_t j = 0; j < m_state_size; j++) {
+		for (vector<StateParam>::const_iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
+			size_t j = iter->y2;
+			long double prob = ctx.R[MAT2(i, j)] * m_Z[MAT2(z, j)];
+			if (prob > 0) {
+				//for (size_t k = 0; k < m_state_size; k++) {
+				for (vector<StateParam>::const_iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
+					size_t k = iter2->y2;
+					ctx.topic.ZAlpha[z][TCRF2_MAT2(m_zy_size[z],i, iter->y1)] += 
+									ctx.topic.ZAlpha[z][TCRF2_MAT2(m_zy_size[z], i-1, iter2->y1)] * m_M[MAT2(k, j)] * prob;
+				} ///< for k
+			} // if prob > 0
+		} ///< for j
+	}  ///< for i
+	return ctx.topic.ZAlpha[z][TCRF2_MAT2(m_zy_size[z], ctx.seq_size-1, m_y_state[z][0].y1)] * ctx.topic.Gamma[z];
 }
 
 /**	Backward Recursion.
 	Computing and storing the beta value.
 */
-void TriCRF2::backward() {
-	//m_Beta.resize(m_topic_size * m_seq_size * m_state_size);
-	//fill(m_Beta.begin(), m_Beta.end(), 0.0);
-	m_Beta.resize(m_topic_size);
+void TriCRF2::backward(InferenceContext& ctx) const {
+	//ctx.topic.ZBeta.resize(m_topic_size * ctx.seq_size * m_state_size);
+	//fill(ctx.topic.ZBeta.begin(), ctx.topic.ZBeta.end(), 0.0);
+	ctx.topic.ZBeta.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
-		m_Beta[z].resize(m_seq_size * m_zy_size[z]);
-		fill(m_Beta[z].begin(), m_Beta[z].end(), 0.0);
+		ctx.topic.ZBeta[z].resize(ctx.seq_size * m_zy_size[z]);
+		fill(ctx.topic.ZBeta[z].begin(), ctx.topic.ZBeta[z].end(), 0.0);
 	}
 
 	for (size_t z = 0; z < m_topic_size; z++) {
-		m_Beta[z][TCRF2_MAT2(m_zy_size[z], m_seq_size-1, m_y_state[z][0].y1)] = 1.0;
+		ctx.topic.ZBeta[z][TCRF2_MAT2(m_zy_size[z], ctx.seq_size-1, m_y_state[z][0].y1)] = 1.0;
 	}
 
 	//for (size_t z = 0; z < m_topic_size; z++) { // original
-	for (size_t prune = 0; prune < m_prune.size(); prune++) {
-		size_t z = m_prune[prune].second;
-
-		for (size_t i = m_seq_size-1; i >= 1; i--) {
-			//for (size_t k = 0; k < m_state_size; k++) {
-			for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-				size_t k = iter->y2;
-				long double prob = m_R[MAT2(i, k)] * m_Z[MAT2(z, k)]; 
-				if (prob > 0) {
-					//for (size_t j = 0; j < m_state_size; j++) {
-					for (vector<StateParam>::iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
-						size_t j = iter2->y2;
-						m_Beta[z][TCRF2_MAT2(m_zy_size[z], i-1, iter2->y1)] += 
-										m_Beta[z][TCRF2_MAT2(m_zy_size[z], i, iter->y1)] * m_M[MAT2(j, k)] * prob;
-					} ///< for j
-				} ///< if prob > 0
-            } ///< for k
-        } ///< for i
-    } ///< for z
+	vector<size_t> topics;
+	for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++)
+		topics.push_back(ctx.topic.prune[prune].second);
+	vector<long double> dummy;
+	runTopics(ctx, TOPIC_BACKWARD, topics, dummy);
+}
 
+/**	Backward recursion of a topic plane.
+*/
+void TriCRF2::backwardTopic(InferenceContext& ctx, size_t z) const {
+	for (size_t i = ctx.seq_size-1; i >= 1; i--) {
+		//for (size_t k = 0; k < m_state_size; k++) {
+		for (vector<StateParam>::const_iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
+			size_t k = iter->y2;
+			long double prob = ctx.R[MAT2(i, k)] * m_Z[MAT2(z, k)]; 
+			if (prob > 0) {
+				//for (size_t j = 0; j < m_state_size; j++) {
+				for (vector<StateParam>::const_iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
+					size_t j = iter2->y2;
+					ctx.topic.ZBeta[z][TCRF2_MAT2(m_zy_size[z], i-1, iter2->y1)] += 
+									ctx.topic.ZBeta[z][TCRF2_MAT2(m_zy_size[z], i, iter->y1)] * m_M[MAT2(j, k)] * prob;
+				} ///< for j
+			} ///< if prob > 0
+		} ///< for k
+	} ///< for i
 }
 
 /**	Partition function (Z).
 	@return normalizing constant 
 */
-long double TriCRF2::getPartitionZ() {
-	m_prune.clear();
+long double TriCRF2::getPartitionZ(InferenceContext& ctx) const {
+	ctx.topic.prune.clear();
 	long double zval = 0.0;
 
-	for (size_t z = 0; z < m_topic_size; z++) {
-		long double prob = m_Alpha[z][TCRF2_MAT2(m_zy_size[z], m_seq_size-1, m_y_state[z][0].y1)] * m_Gamma[z];
+	for (size_t a = 0; a < ctx.topic.active.size(); a++) {
+		size_t z = ctx.topic.active[a];
+		long double prob = ctx.topic.ZAlpha[z][TCRF2_MAT2(m_zy_size[z], ctx.seq_size-1, m_y_state[z][0].y1)] * ctx.topic.Gamma[z];
 		zval += prob;
-		m_prune.push_back(make_pair(prob, z));
+		ctx.topic.prune.push_back(make_pair(prob, z));
 	}
 	/// for pruning
-	for (size_t z = 0; z < m_topic_size; z++) {
-		m_prune[z].first /= zval;
+	for (size_t a = 0; a < ctx.topic.prune.size(); a++) {
+		ctx.topic.prune[a].first /= zval;
 	}
-	sort(m_prune.rbegin(), m_prune.rend());
+	sort(ctx.topic.prune.rbegin(), ctx.topic.prune.rend());
 
 	return zval;
 }
@@ -519,19 +571,19 @@ long double TriCRF2::getPartitionZ() {
 	@param seq			given data (y, x)
 	@return probability
 */
-long double TriCRF2::calculateProb(TriSequence& triseq) {
-	long double z = getPartitionZ();
+long double TriCRF2::calculateProb(const TriSequence& triseq, InferenceContext& ctx) const {
+	long double z = getPartitionZ(ctx);
 
     long double seq_prob = 1.0;
     size_t prev_y = m_default_oid;
     size_t y;
-    for (size_t i=0; i < m_seq_size; i++) {
-        if (i < m_seq_size-1) {
+    for (size_t i=0; i < ctx.seq_size; i++) {
+        if (i < ctx.seq_size-1) {
             y = triseq.seq[i].label;
         } else {
             y = m_y_state[triseq.topic.label][0].y2;
         }
-        seq_prob *= m_R[MAT2(i,y)] * m_M[MAT2(prev_y,y)] * m_Z[MAT2(triseq.topic.label, y)];
+        seq_prob *= ctx.R[MAT2(i,y)] * m_M[MAT2(prev_y,y)] * m_Z[MAT2(triseq.topic.label, y)];
         prev_y = y;
        
     }
@@ -539,7 +591,7 @@ long double TriCRF2::calculateProb(TriSequence& triseq) {
         cerr << "seq_prob==0 ";
     }
 
-    return seq_prob * m_Gamma[triseq.topic.label] / z;
+    return seq_prob * ctx.topic.Gamma[triseq.topic.label] / z;
 }
 
 /** Viterbi search to find the best probable output sequence.
@@ -547,81 +599,91 @@ long double TriCRF2::calculateProb(TriSequence& triseq) {
  @param prob		dummy probability vector
  @return outcome sequence
 */
-vector<size_t> TriCRF2::viterbiSearch(size_t& max_z, long double& prob) {
+vector<size_t> TriCRF2::viterbiSearch(InferenceContext& ctx, size_t& max_z, long double& prob) const {
 	/// Initialization
 	long double max_prob = -10000.0;
 	max_z = m_default_oid;
 	vector<size_t> max_y;
 
+	/// Search
+	///for (size_t z = 0; z < m_topic_size; z++) {
+	vector<size_t> topics;
+	for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++)
+		topics.push_back(ctx.topic.prune[prune].second);
+	vector<long double> topic_prob;
+	vector<vector<size_t> > topic_y;
+	runTopics(ctx, TOPIC_VITERBI, topics, topic_prob, &topic_y);
+
+	for (size_t t = 0; t < topics.size(); t++) {
+		if (topic_prob[t] > max_prob) {
+			max_prob = topic_prob[t];
+			max_z = topics[t];
+			max_y.swap(topic_y[t]);
+		}
+	} ///< for each z
+
+	prob = max_prob;
+	return max_y;
+
+}
+
+/** Viterbi search of a topic plane.
+	@param z		topic plane
+	@param y_seq	best path of the plane
+	@return probability of the path (with Gamma)
+*/
+long double TriCRF2::viterbiTopic(const InferenceContext& ctx, size_t z, vector<size_t>& y_seq) const {
 	vector<size_t> psi_x(m_state_size) ;
 	vector<long double> delta_x(m_state_size);
 	fill(psi_x.begin(), psi_x.end(), m_state_size);
 	fill(delta_x.begin(), delta_x.begin(), 0.0);
 
-	/// Search
-	///for (size_t z = 0; z < m_topic_size; z++) {
-	for (size_t prune = 0; prune < m_prune.size(); prune++) {
-		size_t z = m_prune[prune].second;
-
-		vector<vector<size_t> > psi;
-		vector<vector<long double> > delta;
-
-		for (size_t i=0; i < m_seq_size; i++) {
-			vector<size_t> psi_i= psi_x;
-			vector<long double> delta_i = delta_x;
-
-			//for (size_t j=0; j < m_state_size; j++) {
-			for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-				size_t j = iter->y2;
-				long double max = -10000.0;
-				size_t max_k = m_y_state[z][0].y2;
-				if (i == 0) {
-					max = m_R[MAT2(i, j)] * m_M[MAT2(m_default_oid, j)] * m_Z[MAT2(z, j)];
-					max_k = m_default_oid;
-				} else {
-					long double p = m_R[MAT2(i,j)] * m_Z[MAT2(z, j)];
-					//for (size_t k=0; k < m_state_size; k++) {
-					for (vector<StateParam>::iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
-						size_t k = iter2->y2;
-						double val = delta[i-1][k] *  m_M[MAT2(k,j)] * p;
-						if (val > max) {
-							max = val;
-							max_k = k;
-						}
+	vector<vector<size_t> > psi;
+	vector<vector<long double> > delta;
+
+	for (size_t i=0; i < ctx.seq_size; i++) {
+		vector<size_t> psi_i= psi_x;
+		vector<long double> delta_i = delta_x;
+
+		//for (size_t j=0; j < m_state_size; j++) {
+		for (vector<StateParam>::const_iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
+			size_t j = iter->y2;
+			long double max = -10000.0;
+			size_t max_k = m_y_state[z][0].y2;
+			if (i == 0) {
+				max = ctx.R[MAT2(i, j)] * m_M[MAT2(m_default_oid, j)] * m_Z[MAT2(z, j)];
+				max_k = m_default_oid;
+			} else {
+				long double p = ctx.R[MAT2(i,j)] * m_Z[MAT2(z, j)];
+				//for (size_t k=0; k < m_state_size; k++) {
+				for (vector<StateParam>::const_iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
+					size_t k = iter2->y2;
+					double val = delta[i-1][k] *  m_M[MAT2(k,j)] * p;
+					if (val > max) {
+						max = val;
+						max_k = k;
 					}
 				}
-				
-				delta_i[j] = max;
-				psi_i[j] = max_k;
-				//delta_i.push_back(max);
-				//psi_i.push_back(max_k);
 			}
-			delta.push_back(delta_i);
-			psi.push_back(psi_i);
-		} ///< for each i
-
-		/// Back-tracking
-		vector<size_t> y_seq;
-		size_t prev_y = m_y_state[z][0].y2;
-		for (size_t i = m_seq_size-1; i >= 1; i--) {
-			//cout << prev_y << " " << psi[i][prev_y] << endl;
-			size_t y = psi[i][prev_y];
-			y_seq.push_back(y);
-			prev_y = y;
-		}
-		reverse(y_seq.begin(), y_seq.end());
-		double tmp_prob = delta[m_seq_size-1][m_y_state[z][0].y2] * m_Gamma[z];
-		
-		if (tmp_prob > max_prob) {
-			max_prob = tmp_prob;
-			max_z = z;
-			max_y = y_seq;
+			
+			delta_i[j] = max;
+			psi_i[j] = max_k;
 		}
-
-	} ///< for each z
-	prob = max_prob;
-	return max_y;
-
+		delta.push_back(delta_i);
+		psi.push_back(psi_i);
+	} ///< for each i
+
+	/// Back-tracking
+	y_seq.clear();
+	size_t prev_y = m_y_state[z][0].y2;
+	for (size_t i = ctx.seq_size-1; i >= 1; i--) {
+		size_t y = psi[i][prev_y];
+		y_seq.push_back(y);
+		prev_y = y;
+	}
+	reverse(y_seq.begin(), y_seq.end());
+	double tmp_prob = delta[ctx.seq_size-1][m_y_state[z][0].y2] * ctx.topic.Gamma[z];
+	return tmp_prob;
 }
 
 void TriCRF2::createIndex() {
@@ -646,12 +708,170 @@ void TriCRF2::createIndex() {
 	}
 }
 
+/** Accumulate the expectation of a training sequence.
+	Runs the forward-backward and Viterbi, adds the expectation (times count) to the gradients
+	and appends the sequence to the evaluators (topic and sequence).
+	@param prune_topic	prune the topics before the backward pass
+*/
+void TriCRF2::accumulateGradient(const TriSequence& triseq, double count, InferenceContext& ctx, bool prune_topic,
+	double* gradient_topic, double* gradient_seq, Evaluator& eval1, Evaluator& eval2) {
+	/// Forward-Backward  
+	calculateFactors(triseq, ctx);
+	beamTopic(ctx, triseq.topic.label);
+	forward(ctx);
+	long double zval = getPartitionZ(ctx);
+
+	////////////////////////////////////////////////////////////////////
+	/// pruning
+	////////////////////////////////////////////////////////////////////
+	if (prune_topic)
+		pruneTopic(ctx);
+
+	backward(ctx);
+
+	/// Evaluation
+	long double dummy_prob;
+	size_t max_z;
+	vector<size_t> y_seq = viterbiSearch(ctx, max_z, dummy_prob);
+	assert(y_seq.size() == triseq.seq.size());
+
+	/// calculate Y sequence
+	long double y_seq_prob = calculateProb(triseq, ctx);
+	if (!finite((double)y_seq_prob)) {
+		cerr << "calculateProb:" << y_seq_prob << endl;
+	}
+
+	size_t prev_outcome = m_default_oid;
+	vector<size_t> reference, hypothesis;
+	for (size_t i = 0; i < triseq.seq.size(); ++i) {	 /// for each node in sequence
+		
+		size_t outcome = triseq.seq[i].label;
+		reference.push_back(outcome);
+		hypothesis.push_back(y_seq[i]);
+
+		/// calculate the expectation
+		/// E[p] - E[~p]
+
+		/// f(y,x)
+		vector<ObsParam> obs_param = m_ParamSeq.makeObsIndex(triseq.seq[i].obs);
+		for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+			long double prob_sum = 0.0;
+			size_t new_y;
+			//for (size_t z = 0; z < m_topic_size; z++) {
+			for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++) {
+				size_t z = ctx.topic.prune[prune].second;
+
+				if ((new_y = m_zy_index[z][iter->y]) < m_state_size) { 
+					size_t index = TCRF2_MAT2(m_zy_size[z], i, new_y);
+					prob_sum += ctx.topic.ZAlpha[z][index] * 	ctx.topic.ZBeta[z][index] * 	ctx.topic.Gamma[z] / zval;
+				} ///< if
+			}
+			gradient_seq[iter->fid] += prob_sum * iter->fval * count;
+		}
+
+		/// f(y,y)
+		if (i > 0) {
+			vector<StateParam>::iterator iter = m_ParamSeq.m_StateIndex.begin();
+			for (; iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
+				long double a_y;
+				long double prob_sum = 0.0;
+				// for (size_t z = 0; z < m_topic_size; z++) {
+				for (size_t prune = 0; prune < ctx.topic.prune.size(); prune++) {
+					size_t z = ctx.topic.prune[prune].second;
+
+					size_t new_y1, new_y2;
+					new_y1 = new_y2 = m_state_size;
+					if ( (new_y1 = m_zy_index[z][iter->y1]) < m_state_size && (new_y2 = m_zy_index[z][iter->y2]) < m_state_size) {
+						if (i == 0) {
+							if (iter->y1 == m_default_oid) a_y = 1.0;
+							else a_y = 0.0;
+						} else {
+							a_y = ctx.topic.ZAlpha[z][TCRF2_MAT2(m_zy_size[z], i-1, new_y1)];
+						}
+						long double b_y = ctx.topic.ZBeta[z][TCRF2_MAT2(m_zy_size[z], i, new_y2)];
+						long double m_yy = ctx.R[MAT2(i,iter->y2)] * m_M[MAT2(iter->y1,iter->y2)] * m_Z[MAT2(z, iter->y2)];
+						long double prob = a_y * b_y * m_yy * ctx.topic.Gamma[z] / zval;
+						prob_sum += prob;
+					} ///< if
+				} ///< for z
+				gradient_seq[iter->fid] += prob_sum * iter->fval * count;
+			} ///< for each edge
+		}	///< if ( i > 0)
+		prev_outcome = outcome;
+		
+		/// f(y,z)
+		for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
+			size_t new_y;
+			if ( (new_y = m_zy_index[iter->y1][iter->y2]) < m_state_size) {
+				size_t index = TCRF2_MAT2(m_zy_size[iter->y1], i, new_y);
+				long double prob = ctx.topic.ZAlpha[iter->y1][index] * 	ctx.topic.ZBeta[iter->y1][index] * ctx.topic.Gamma[iter->y1] / zval;
+				gradient_topic[iter->fid] += prob * iter->fval * count;
+			}
+		}		
+
+	} ///< for each node in sequence
+	
+	/// f(z,x)
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+		long double prob = ctx.topic.ZAlpha[iter->y][TCRF2_MAT2(m_zy_size[iter->y], ctx.seq_size-1, m_default_oid)] * ctx.topic.Gamma[iter->y] / zval;
+		gradient_topic[iter->fid] += prob * iter->fval * count;
+	}
+	
+	for (size_t c = 0; c < count; c++) {
+		eval2.addLikelihood(y_seq_prob);	/// loglikelihood
+		eval2.append(reference, hypothesis);	/// evaluation (accuracy and f1 score)
+		vector<size_t> reference1, hypothesis1;
+		reference1.push_back(triseq.topic.label);
+		hypothesis1.push_back(max_z);
+		eval1.addLikelihood(y_seq_prob);	/// loglikelihood
+		eval1.append(reference1, hypothesis1);
+	}
+}
+
+/** Evaluate the dev set with the current weights.
+	@param dev_eval1	evaluator (topic)
+	@param dev_eval2	evaluator (sequence)
+*/
+void TriCRF2::evaluateDev(InferenceContext& ctx, Evaluator& dev_eval1, Evaluator& dev_eval2) {
+	vector<TriSequence>::iterator it = m_DevSet.begin();
+	vector<double>::iterator count_it = m_DevSetCount.begin();
+	for (; it != m_DevSet.end(); ++it, ++count_it) {
+		double count = *count_it;
+		calculateFactors(*it, ctx);
+		beamTopic(ctx);
+		forward(ctx);
+		long double zval = getPartitionZ(ctx);
+		long double dummy_prob;
+		size_t max_z;
+		vector<size_t> y_seq = viterbiSearch(ctx, max_z, dummy_prob);
+		assert(y_seq.size() == it->seq.size());
+
+		size_t prev_outcome = m_default_oid;
+		vector<size_t> reference, hypothesis;
+		for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
+			size_t outcome = it->seq[i].label;
+			reference.push_back(outcome);
+			hypothesis.push_back(y_seq[i]);
+		}
+		for (size_t c = 0; c < count; c++) {
+			dev_eval2.append(reference, hypothesis);	
+			vector<size_t> reference1, hypothesis1;
+			reference1.push_back(it->topic.label);
+			hypothesis1.push_back(max_z);
+			dev_eval1.append(reference1, hypothesis1);
+		}
+
+	} ///< for each dev
+}
+
 /** Training with LBFGS optimizer.
 	@param max_iter	maximum number of iteration
 	@param sigma	Gaussian prior variance
 */
 bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta) {
-	LBFGS lbfgs;	///< LBFGS optimizer
+	InferenceContext& ctx = m_Context;
+	LBFGS lbfgs(m_lbfgs_history, m_lbfgs_float);	///< LBFGS optimizer
 
 	/// Parameter weight setting
 	size_t n_theta = m_ParamTopic.size() + m_ParamSeq.size();
@@ -675,7 +895,9 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 	/// Reporting
 	logger->report("[Parameter estimation]\n");
-	logger->report("  Method = \t\tLBFGS\n");
+	logger->report("  Method = \t\t%s\n", (sigma && L1 ? "OWL-QN" : "LBFGS"));
+	if (m_lbfgs_history != 5 || m_lbfgs_float)
+		logger->report("  History = \t\t%d%s\n", (int)m_lbfgs_history, (m_lbfgs_float ? " (float)" : ""));
 	logger->report("  Regularization = \t%s\n", (sigma ? (L1 ? "L1":"L2") : "none"));
 	logger->report("  Penalty value = \t%.2f\n\n", sigma);
 	logger->report("  >>Parameters for topic features\n");
@@ -688,12 +910,6 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 	double old_obj = 1e+37;
 	int converge = 0;
 
-	double time_for_factor = 0.0;
-	double time_for_forward = 0.0;
-	double time_for_backward = 0.0;
-	double time_for_evaluation = 0.0;
-	double time_for_estimating = 0.0;
-	
 	createIndex();
 
 	/// Training iteration
@@ -713,138 +929,7 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
         vector<TriSequence>::iterator it = m_TrainSet.begin();
 		vector<double>::iterator count_it = m_TrainSetCount.begin();
         for (; it != m_TrainSet.end(); ++it, ++count_it) {
-			double count = *count_it;
-			/// Forward-Backward  
-			timer stop_watch;
-			calculateFactors(*it);
-			time_for_factor += stop_watch.elapsed();
-			stop_watch.restart();
-  			forward();
-			time_for_forward += stop_watch.elapsed();
-			long double zval = getPartitionZ();
-
-			////////////////////////////////////////////////////////////////////
-			/// pruning
-			////////////////////////////////////////////////////////////////////
-			long double threshold = m_prune[0].first / m_prune_threshold;
-			if (niter > 0) {
-				vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
-				for (; pit != m_prune.end(); pit++) {
-					if (pit->first < threshold) {
-						m_prune.erase(pit, m_prune.end());
-						break;
-					}
-				}
-			}
-
-			stop_watch.restart();
-			backward();
-			time_for_backward += stop_watch.elapsed();
-
-			/// Evaluation
-            long double dummy_prob;
-			size_t max_z;
-			stop_watch.restart();
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == it->seq.size());
-			time_for_evaluation += stop_watch.elapsed();
-
-			/// calculate Y sequence
-			long double y_seq_prob = calculateProb(*it);
-            if (!finite((double)y_seq_prob)) {
-                cerr << "calculateProb:" << y_seq_prob << endl;
-            }
-
-			stop_watch.restart();
-			size_t prev_outcome = m_default_oid;
-			vector<size_t> reference, hypothesis;
-			for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
-				
-				size_t outcome = it->seq[i].label;
-				reference.push_back(outcome);
-				hypothesis.push_back(y_seq[i]);
-
-				/// calculate the expectation
-				/// E[p] - E[~p]
-
-				/// f(y,x)
-				vector<ObsParam> obs_param = m_ParamSeq.makeObsIndex(it->seq[i].obs);
-				for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					long double prob_sum = 0.0;
-					size_t new_y;
-					//for (size_t z = 0; z < m_topic_size; z++) {
-					for (size_t prune = 0; prune < m_prune.size(); prune++) {
-						size_t z = m_prune[prune].second;
-
-						if ((new_y = m_zy_index[z][iter->y]) < m_state_size) { 
-							size_t index = TCRF2_MAT2(m_zy_size[z], i, new_y);
-							prob_sum += m_Alpha[z][index] * 	m_Beta[z][index] * 	m_Gamma[z] / zval;
-						} ///< if
-					}
-					gradient_seq[iter->fid] += prob_sum * iter->fval * count;
-				}
-
-				/// f(y,y)
-				if (i > 0) {
-					vector<StateParam>::iterator iter = m_ParamSeq.m_StateIndex.begin();
-					for (; iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
-						long double a_y;
-						long double prob_sum = 0.0;
-						// for (size_t z = 0; z < m_topic_size; z++) {
-						for (size_t prune = 0; prune < m_prune.size(); prune++) {
-							size_t z = m_prune[prune].second;
-
-							size_t new_y1, new_y2;
-							new_y1 = new_y2 = m_state_size;
-							if ( (new_y1 = m_zy_index[z][iter->y1]) < m_state_size && (new_y2 = m_zy_index[z][iter->y2]) < m_state_size) {
-								if (i == 0) {
-									if (iter->y1 == m_default_oid) a_y = 1.0;
-									else a_y = 0.0;
-								} else {
-									a_y = m_Alpha[z][TCRF2_MAT2(m_zy_size[z], i-1, new_y1)];
-								}
-								long double b_y = m_Beta[z][TCRF2_MAT2(m_zy_size[z], i, new_y2)];
-								long double m_yy = m_R[MAT2(i,iter->y2)] * m_M[MAT2(iter->y1,iter->y2)] * m_Z[MAT2(z, iter->y2)];
-								long double prob = a_y * b_y * m_yy * m_Gamma[z] / zval;
-								prob_sum += prob;
-							} ///< if
-						} ///< for z
-						gradient_seq[iter->fid] += prob_sum * iter->fval * count;
-					} ///< for each edge
-				}	///< if ( i > 0)
-				prev_outcome = outcome;
-				
-				/// f(y,z)
-				for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-					size_t new_y;
-					if ( (new_y = m_zy_index[iter->y1][iter->y2]) < m_state_size) {
-						size_t index = TCRF2_MAT2(m_zy_size[iter->y1], i, new_y);
-						long double prob = m_Alpha[iter->y1][index] * 	m_Beta[iter->y1][index] * m_Gamma[iter->y1] / zval;
-						gradient_topic[iter->fid] += prob * iter->fval * count;
-					}
-				}		
-
-			} ///< for each node in sequence
-			
-			/// f(z,x)
-			vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(it->topic.obs);
-			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-				long double prob = m_Alpha[iter->y][TCRF2_MAT2(m_zy_size[iter->y], m_seq_size-1, m_default_oid)] * m_Gamma[iter->y] / zval;
-				gradient_topic[iter->fid] += prob * iter->fval * count;
-			}
-			
-			for (size_t c = 0; c < count; c++) {
-				eval2.addLikelihood(y_seq_prob);	/// loglikelihood
-				eval2.append(reference, hypothesis);	/// evaluation (accuracy and f1 score)
-				vector<size_t> reference1, hypothesis1;
-				reference1.push_back(it->topic.label);
-				hypothesis1.push_back(max_z);
-				eval1.addLikelihood(y_seq_prob);	/// loglikelihood
-				eval1.append(reference1, hypothesis1);
-			}
-
-			time_for_estimating += stop_watch.elapsed();
-
+			accumulateGradient(*it, *count_it, ctx, niter > 0, gradient_topic, gradient_seq, eval1, eval2);
 		} ///< for m_TrainSet
 
 		/////////////////////////////////////////////////////////////////////////////////
@@ -854,38 +939,7 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		Evaluator dev_eval2(m_ParamSeq);		///< Evaluator (sequence)
 		dev_eval1.initialize();	///< evaluator intialization
 		dev_eval2.initialize(); 
-		timer stop_watch;
-		double time_for_dev = 0.0;
-		/// for each dev data
-        it = m_DevSet.begin();
-		count_it = m_DevSetCount.begin();
-        for (; it != m_DevSet.end(); ++it, ++count_it) {
-			double count = *count_it;
-			calculateFactors(*it);
-  			forward();
-			long double zval = getPartitionZ();
-            long double dummy_prob;
-			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == it->seq.size());
-
-			size_t prev_outcome = m_default_oid;
-			vector<size_t> reference, hypothesis;
-			for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
-				size_t outcome = it->seq[i].label;
-				reference.push_back(outcome);
-				hypothesis.push_back(y_seq[i]);
-			}
-			for (size_t c = 0; c < count; c++) {
-				dev_eval2.append(reference, hypothesis);	
-				vector<size_t> reference1, hypothesis1;
-				reference1.push_back(it->topic.label);
-				hypothesis1.push_back(max_z);
-				dev_eval1.append(reference1, hypothesis1);
-			}
-
-		} ///< for each dev
-		time_for_dev = stop_watch.elapsed();
+		evaluateDev(ctx, dev_eval1, dev_eval2);
 
 		/// Parameter Merging
 		size_t tmp_i = 0;
@@ -968,12 +1022,172 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 }
 
+/** Subtract the empirical counts of a training sequence from the gradients.
+	The features of its topic and of its labels (the same features as the expectation of accumulateGradient()).
+*/
+void TriCRF2::accumulateEmpirical(const TriSequence& triseq, double count, double* gradient_topic, double* gradient_seq) const {
+	size_t z = triseq.topic.label;
+	for (size_t i = 0; i < triseq.seq.size(); ++i) {
+		size_t y = triseq.seq[i].label;
+
+		/// f(y,x)
+		vector<ObsParam> obs_param = m_ParamSeq.makeObsIndex(triseq.seq[i].obs);
+		for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+			if (iter->y == y)
+				gradient_seq[iter->fid] -= iter->fval * count;
+		}
+
+		/// f(y,y)
+		if (i > 0) {
+			size_t prev_y = triseq.seq[i-1].label;
+			vector<StateParam>::const_iterator iter = m_ParamSeq.m_StateIndex.begin();
+			for (; iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
+				if (iter->y1 == prev_y && iter->y2 == y)
+					gradient_seq[iter->fid] -= iter->fval * count;
+			}
+		}
+
+		/// f(y,z)
+		vector<StateParam>::const_iterator iter = m_ParamTopic.m_StateIndex.begin();
+		for (; iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
+			if (iter->y1 == z && iter->y2 == y)
+				gradient_topic[iter->fid] -= iter->fval * count;
+		}
+	}
+
+	/// f(z,x)
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
+		if (iter->y == z)
+			gradient_topic[iter->fid] -= iter->fval * count;
+	}
+}
+
+void TriCRF2::onlineBlocks(vector<Parameter*>& block) {
+	block.push_back(&m_ParamTopic);
+	block.push_back(&m_ParamSeq);
+}
+
+/// every transition and topic-label weight
+void TriCRF2::onlineDense(vector<vector<size_t> >& dense) {
+	for (size_t j = 0; j < m_ParamTopic.m_StateIndex.size(); j++)
+		dense[0].push_back(m_ParamTopic.m_StateIndex[j].fid);
+	for (size_t j = 0; j < m_ParamSeq.m_StateIndex.size(); j++)
+		dense[1].push_back(m_ParamSeq.m_StateIndex[j].fid);
+}
+
+void TriCRF2::onlineEvaluators(vector<Evaluator>& eval) {
+	eval.push_back(Evaluator(m_ParamTopic, false));	///< Evaluator (topic)
+	eval.push_back(Evaluator(m_ParamSeq));	///< Evaluator (sequence)
+}
+
+void TriCRF2::onlineBegin(size_t n_workers) {
+	TriCRF::onlineBegin(n_workers);
+	createIndex();
+}
+
+void TriCRF2::reportParam() {
+	logger->report("  >>Parameters for topic features\n");
+	m_ParamTopic.print(logger);
+	logger->report("  >>Parameters for sequence features\n");
+	m_ParamSeq.print(logger);
+}
+
+void TriCRF2::touchSample(SGD& sgd, size_t worker, size_t s) {
+	const TriSequence& triseq = m_TrainSet[s];
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for (size_t j = 0; j < obs_param.size(); j++)
+		sgd.touch(worker, 0, obs_param[j].fid);
+	for (size_t i = 0; i < triseq.seq.size(); i++) {
+		obs_param = m_ParamSeq.makeObsIndex(triseq.seq[i].obs);
+		for (size_t j = 0; j < obs_param.size(); j++)
+			sgd.touch(worker, 1, obs_param[j].fid);
+	}
+}
+
+/// the topics are pruned from the second epoch
+void TriCRF2::gradientSample(SGD& sgd, size_t worker, size_t s, vector<Evaluator>& eval, size_t epoch) {
+	const TriSequence& triseq = m_TrainSet[s];
+	double* gradient_topic = sgd.gradient(worker, 0);
+	double* gradient_seq = sgd.gradient(worker, 1);
+	accumulateGradient(triseq, 1.0, workerContext(worker), epoch > 0, gradient_topic, gradient_seq, eval[0], eval[1]);
+	accumulateEmpirical(triseq, 1.0, gradient_topic, gradient_seq);
+}
+
+/** A sequence is decoded with the current weights (the forward pass gives the topic beam) ;
+	the loss of MIRA is the wrong topic and the wrong labels.
+	@return	1 if the topic or a label is wrong
+*/
+size_t TriCRF2::mistakeSample(size_t s, vector<Evaluator>& eval, bool& changed) {
+	TriSequence& triseq = m_TrainSet[s];
+	InferenceContext& ctx = m_Context;
+	size_t z = triseq.topic.label;
+
+	calculateFactors(triseq, ctx);
+	beamTopic(ctx);
+	forward(ctx);
+	getPartitionZ(ctx);
+	long double dummy_prob;
+	size_t max_z;
+	vector<size_t> y_seq = viterbiSearch(ctx, max_z, dummy_prob);
+
+	size_t n_wrong = (max_z != z ? 1 : 0);
+	vector<size_t> reference;
+	for (size_t i = 0; i < triseq.seq.size(); ++i) {
+		reference.push_back(triseq.seq[i].label);
+		if (y_seq[i] != reference[i])
+			++n_wrong;
+	}
+	eval[1].append(reference, y_seq);
+	vector<size_t> reference1, hypothesis1;
+	reference1.push_back(z);
+	hypothesis1.push_back(max_z);
+	eval[0].append(reference1, hypothesis1);
+
+	if (n_wrong == 0) {
+		changed = m_Perceptron.update(0.0);
+		return 0;
+	}
+
+	/// the weights of the sequence ; every transition and topic-label weight
+	vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(triseq.topic.obs);
+	for (size_t j = 0; j < obs_param.size(); j++)
+		m_Perceptron.touch(0, obs_param[j].fid);
+	for (size_t i = 0; i < triseq.seq.size(); i++) {
+		obs_param = m_ParamSeq.makeObsIndex(triseq.seq[i].obs);
+		for (size_t j = 0; j < obs_param.size(); j++)
+			m_Perceptron.touch(1, obs_param[j].fid);
+	}
+	for (size_t j = 0; j < m_ParamTopic.m_StateIndex.size(); j++)
+		m_Perceptron.touch(0, m_ParamTopic.m_StateIndex[j].fid);
+	for (size_t j = 0; j < m_ParamSeq.m_StateIndex.size(); j++)
+		m_Perceptron.touch(1, m_ParamSeq.m_StateIndex[j].fid);
+
+	/// f(x,y^) - f(x,y) ; the predicted labels are put in the sequence for a while
+	for (size_t i = 0; i < triseq.seq.size(); ++i)
+		triseq.seq[i].label = y_seq[i];
+	triseq.topic.label = max_z;
+	accumulateEmpirical(triseq, -1.0, m_ParamTopic.getGradient(), m_ParamSeq.getGradient());
+	for (size_t i = 0; i < triseq.seq.size(); ++i)
+		triseq.seq[i].label = reference[i];
+	triseq.topic.label = z;
+	accumulateEmpirical(triseq, 1.0, m_ParamTopic.getGradient(), m_ParamSeq.getGradient());
+	changed = m_Perceptron.update((double)n_wrong);
+	return 1;
+}
+
+bool TriCRF2::evaluateDev(vector<Evaluator>& dev_eval) {
+	evaluateDev(m_Context, dev_eval[0], dev_eval[1]);
+	return m_DevSet.size() > 0;
+}
+
 /** Training with Psuedo-likelihood.
 	@param max_iter	maximum number of iteration
 	@param sigma	Gaussian prior variance
 */
 bool TriCRF2::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
-	LBFGS lbfgs1, lbfgs2;	///< LBFGS optimizer
+	InferenceContext& ctx = m_Context;
+	LBFGS lbfgs1(m_lbfgs_history, m_lbfgs_float), lbfgs2(m_lbfgs_history, m_lbfgs_float);	///< LBFGS optimizer
 
 	double* theta_topic = m_ParamTopic.getWeight();
 	double* theta_seq = m_ParamSeq.getWeight();
@@ -1148,17 +1362,19 @@ bool TriCRF2::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 		dev_eval2.initialize(); 
 		stop_watch.restart();
 		double time_for_dev = 0.0;
+		calculateEdge();
 		/// for each dev data
         it = m_DevSet.begin();
 		count_it = m_DevSetCount.begin();
         for (; it != m_DevSet.end(); ++it, ++count_it) {
 			double count = *count_it;
-			calculateFactors(*it);
-  			forward();
-			long double zval = getPartitionZ();
+			calculateFactors(*it, ctx);
+			beamTopic(ctx);
+  			forward(ctx);
+			long double zval = getPartitionZ(ctx);
             long double dummy_prob;
 			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
+			vector<size_t> y_seq = viterbiSearch(ctx, max_z, dummy_prob);
 			assert(y_seq.size() == it->seq.size());
 
 			size_t prev_outcome = m_default_oid;
@@ -1290,12 +1506,61 @@ bool TriCRF2::pretrain(size_t max_iter, double sigma, bool L1) {
 }
 
 bool TriCRF2::train(size_t max_iter, double sigma, bool L1) { 
-		return estimateWithLBFGS(max_iter, sigma, L1);
+	if (m_Estimator == ESTIMATE_SGD)
+		return estimateWithSGD(max_iter, sigma, L1);
+	if (m_Estimator == ESTIMATE_PERCEPTRON || m_Estimator == ESTIMATE_MIRA)
+		return estimateWithPerceptron(max_iter);
+	return estimateWithLBFGS(max_iter, sigma, L1);
+}
+
+/** Decode a sequence.
+	Reentrant ; the model is not modified and the lattices are kept in ctx.
+	@param triseq	sequence to be decoded
+	@param ctx	inference context (one per thread)
+	@param max_z	best topic
+	@param prob	probability of the best path
+	@return best label sequence (of the best topic)
+*/
+vector<size_t> TriCRF2::decode(const TriStringSequence& triseq, InferenceContext& ctx, size_t& max_z, long double& prob) const {
+	calculateFactors(triseq, ctx);
+	beamTopic(ctx);
+	forward(ctx);
+	getPartitionZ(ctx);
+	pruneTopic(ctx);
+
+	vector<size_t> y_seq = viterbiSearch(ctx, max_z, prob);
+	assert(y_seq.size() == triseq.seq.size());
+	return y_seq;
 }
 
+/** Decoding job.
+	Decodes a batch of sequences with the shared model; each thread has its own context.
+	@class TriCRF2DecodeJob
+*/
+class TriCRF2DecodeJob : public ThreadJob {
+private:
+	const TriCRF2* m_Model;
+	vector<TriStringSequence>& m_Batch;
+	vector<InferenceContext>& m_Context;
+	vector<vector<size_t> >& m_Output;
+	vector<size_t>& m_Topic;
+public:
+	TriCRF2DecodeJob(const TriCRF2* model, vector<TriStringSequence>& batch, vector<InferenceContext>& ctx, vector<vector<size_t> >& output, vector<size_t>& topic)
+		: m_Model(model), m_Batch(batch), m_Context(ctx), m_Output(output), m_Topic(topic) {}
+	void run(size_t tid, size_t n_threads) {
+		size_t begin, end;
+		splitRange(m_Batch.size(), tid, n_threads, begin, end);
+		for (size_t i = begin; i < end; ++i) {
+			long double prob;
+			m_Output[i] = m_Model->decode(m_Batch[i], m_Context[tid], m_Topic[i], prob);
+		}
+	}
+};
+
 bool TriCRF2::test(const std::string& filename, const std::string& outputfile, bool confidence) {
 	/// File stream
 	string line;
+	vector<StringRef> tokens;	///< tokens of the line (refer to the line)
 	ifstream f(filename.c_str());
 	if (!f)
 		throw runtime_error("cannot open data file");
@@ -1306,8 +1571,8 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 	if (outputfile != "") {
 		out.open(outputfile.c_str());
 		out.precision(20);
-		state_vec = m_ParamTopic.getState().second;
-		seq_state_vec = m_ParamSeq.getState().second;
+		state_vec = m_ParamTopic.getStateVec();
+		seq_state_vec = m_ParamSeq.getStateVec();
 	}
 
 	/// initializing
@@ -1323,32 +1588,49 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 
 	calculateEdge();
 
-	/// reading the text
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty()) {
-			/// test
-			calculateFactors(triseq);
-  			forward();
-			long double zval = getPartitionZ();
-            long double dummy_prob;
-
-			////////////////////////////////////////////////////////////////////
-			/// pruning
-			////////////////////////////////////////////////////////////////////
-			long double threshold = m_prune[0].first / m_prune_threshold;
-			vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
-			for (; pit != m_prune.end(); pit++) {
-				if (pit->first < threshold) {
-					m_prune.erase(pit, m_prune.end());
-					break;
-				}
+	/// the sequences are decoded in batches (in parallel) and written in order
+	size_t batch_size = 256 * sizeThreads();
+	vector<TriStringSequence> batch;
+	vector<vector<size_t> > batch_output;
+	vector<size_t> batch_topic;
+	vector<InferenceContext> thread_ctx(sizeThreads());
+	bool eof = false;
+
+	while (!eof) {
+		/// reading the text
+		batch.clear();
+		while (batch.size() < batch_size) {
+			if (!getline(f,line)) {
+				eof = true;
+				break;
 			}
+			tokenize(StringRef(line), " 	", tokens);
+			if (line.empty()) {
+				batch.push_back(triseq);
+				triseq.seq.clear();
+				seq_count = 0;
+			} else {
+				++seq_count;
+				if (seq_count == 1) { ///< this is a topic 
+					triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
+				} else {
+					StringEvent ev = packStringEvent(tokens, &m_ParamSeq, true);	///< observation features
+					triseq.seq.push_back(ev);	///< append
+				}
 
-			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == triseq.size());
+			}	///< else
+		}	///< while
+
+		/// test
+		batch_output.resize(batch.size());
+		batch_topic.resize(batch.size());
+		TriCRF2DecodeJob job(this, batch, thread_ctx, batch_output, batch_topic);
+		runParallel(job);
 
+		for (size_t n = 0; n < batch.size(); n++) {
+			TriStringSequence& triseq = batch[n];
+			size_t max_z = batch_topic[n];
+			vector<size_t>& y_seq = batch_output[n];
 			vector<size_t> reference1, hypothesis1;
 			reference1.push_back(triseq.topic.label);
 			hypothesis1.push_back(max_z);
@@ -1357,13 +1639,13 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 				out << state_vec[max_z];
 				/*
 				if (confidence) {
-					double prob = m_Alpha[max_z][TCRF2_MAT2(m_zy_size[max_z], m_seq_size-1, m_y_state[max_z][0].y1)] * m_Gamma[max_z] / zval;
+					double prob = ctx.topic.ZAlpha[max_z][TCRF2_MAT2(m_zy_size[max_z], ctx.seq_size-1, m_y_state[max_z][0].y1)] * ctx.topic.Gamma[max_z] / zval;
 					out << " " << prob;
 				}
 				*/
 				out << endl;
 			}
-			
+		
 			size_t prev_y = m_default_oid;
 			vector<string> reference, hypothesis;
 			StringSequence::iterator it = triseq.seq.begin();
@@ -1371,10 +1653,10 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 				size_t outcome = triseq.seq[i].label;
 				string outcome_s;
 				if (m_ParamSeq.sizeStateVec() <= outcome) 
-					outcome_s = m_ParamSeq.getState().second[m_default_oid];
+					outcome_s = m_ParamSeq.getStateVec()[m_default_oid];
 				else
-					outcome_s = m_ParamSeq.getState().second[outcome];
-				string y_seq_s = m_ParamSeq.getState().second[y_seq[i]];
+					outcome_s = m_ParamSeq.getStateVec()[outcome];
+				string y_seq_s = m_ParamSeq.getStateVec()[y_seq[i]];
 
 				reference.push_back(outcome_s);
 				hypothesis.push_back(y_seq_s);
@@ -1385,8 +1667,8 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 					if (confidence) {
 						double norm = 0.0;
 						for (size_t j = 0; j < m_y_state.size(); j++)
-							norm += m_R[MAT2(i, j)] * m_M[MAT2(prev_y, j)] * m_Z[MAT2(max_z, j)]; 
-						double prob = m_R[MAT2(i, y_seq[i])] * m_M[MAT2( prev_y, y_seq[i])] * m_Z[MAT2(max_z, y_seq[i])] / norm;
+							norm += ctx.R[MAT2(i, j)] * m_M[MAT2(prev_y, j)] * m_Z[MAT2(max_z, j)]; 
+						double prob = ctx.R[MAT2(i, y_seq[i])] * m_M[MAT2( prev_y, y_seq[i])] * m_Z[MAT2(max_z, y_seq[i])] / norm;
 						out << " " << prob;
 						prev_y = y_seq[i];
 					}
@@ -1399,21 +1681,8 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 
 			test_eval2.append(m_ParamSeq, reference, hypothesis);	
 
-			triseq.seq.clear();
-			seq_count = 0;
 			++count;
-		} else {
-			++seq_count;
-			if (seq_count == 1) { ///< this is a topic 
-				triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
-			} else {
-				StringEvent ev = packStringEvent(tokens, &m_ParamSeq, true);	///< observation features
-				triseq.seq.push_back(ev);	///< append
-			}
-
-		}	///< else
-		
-		
+		}
 	}	///< while
 
 	test_eval1.calculateF1();
@@ -1428,6 +1697,8 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 	logger->report("  Acc = \t\t%8.3f\n", test_eval2.getAccuracy());
 	logger->report("  MicroF1 = \t\t%8.3f\n", test_eval2.getMicroF1()[2]);
 	logger->report("  MacroF1 = \t\t%8.3f\n", test_eval2.getMacroF1()[2]);
+
+	return true;
 }
 
 }	///< namespace tricrf
@@ -9,7 +9,7 @@
 #define __TRICRF2_H__
 
 /// max headers
-#include "CRF.h"
+#include "TriCRF.h"
 /// standard headers
 #include <vector>
 #include <string>
@@ -20,16 +20,14 @@ namespace tricrf {
 /** Triangular-chain Conditional Random Fields (Model2).
 	@class TriCRF
 */
-class TriCRF2 : public CRF {
+class TriCRF2 : public TriCRF {
 protected:
 	/// Data sets
 	Data<TriSequence> m_TrainSet;	 ///< Train data
 	Data<TriSequence> m_DevSet;	///< Development data (held-out data)
 	
-	std::vector<long double> m_Z;			///< Z matrix ; topic prior
-	std::vector<std::vector<long double> > m_Alpha;	///< Alpha matrix
-	std::vector<std::vector<long double> > m_Beta;		///< Beta matrix
-	std::vector<long double> m_Gamma;			///< Gamma matrix ; topic prior
+	std::vector<long double> m_Z;			///< Z matrix ; topic-label factor
+	std::vector<long double> m_MaxM;		///< column maxima of M (topic beam)
 
 	/// for improving the speed
 	std::vector<std::vector<size_t> > m_zy_index;
@@ -46,18 +44,37 @@ protected:
 	size_t m_topic_size;
 
 	/// Inference
-	void calculateFactors(TriSequence &seq);	///< Calculating the factors
-	void calculateFactors(TriStringSequence &seq);	///< Calculating the factors
+	void calculateFactors(const TriSequence &seq, InferenceContext& ctx) const;	///< Calculating the factors
+	void calculateFactors(const TriStringSequence &seq, InferenceContext& ctx) const;	///< Calculating the factors
 	void calculateEdge();
-	void forward();	 ///< Forward recursion
-	void backward();	///< Backward recursion
-	long double getPartitionZ();	///< Z
-	long double calculateProb(TriSequence& seq);	///< Prob(y|x)
-	std::vector<size_t> viterbiSearch(size_t& max_z, long double& prob);	///< Find the best path
+	void boundTopic(InferenceContext& ctx) const;	///< Upper bound of each plane (topic beam)
+	void forward(InferenceContext& ctx) const;	 ///< Forward recursion
+	long double forwardTopic(InferenceContext& ctx, size_t z) const;	///< Forward recursion of a topic plane
+	void backward(InferenceContext& ctx) const;	///< Backward recursion
+	void backwardTopic(InferenceContext& ctx, size_t z) const;	///< Backward recursion of a topic plane
+	long double getPartitionZ(InferenceContext& ctx) const;	///< Z (and the topic posterior)
+	long double calculateProb(const TriSequence& seq, InferenceContext& ctx) const;	///< Prob(y|x)
+	std::vector<size_t> viterbiSearch(InferenceContext& ctx, size_t& max_z, long double& prob) const;	///< Find the best path
+	long double viterbiTopic(const InferenceContext& ctx, size_t z, std::vector<size_t>& y_seq) const;	///< Best path of a topic plane
 
 	/// Parameter Estimation
+	void accumulateGradient(const TriSequence& triseq, double count, InferenceContext& ctx, bool prune_topic,
+		double* gradient_topic, double* gradient_seq, Evaluator& eval1, Evaluator& eval2);
+	void accumulateEmpirical(const TriSequence& triseq, double count, double* gradient_topic, double* gradient_seq) const;
+	void evaluateDev(InferenceContext& ctx, Evaluator& dev_eval1, Evaluator& dev_eval2);
 	bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
 	bool estimateWithPL(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
+
+	/// Online estimation (see MaxEnt::estimateWithSGD) ; blocks: topic and sequence
+	void onlineBlocks(std::vector<Parameter*>& block);
+	void onlineDense(std::vector<std::vector<size_t> >& dense);
+	void onlineEvaluators(std::vector<Evaluator>& eval);
+	void onlineBegin(size_t n_workers);
+	void reportParam();
+	void touchSample(SGD& sgd, size_t worker, size_t s);
+	void gradientSample(SGD& sgd, size_t worker, size_t s, std::vector<Evaluator>& eval, size_t epoch);
+	size_t mistakeSample(size_t s, std::vector<Evaluator>& eval, bool& changed);
+	bool evaluateDev(std::vector<Evaluator>& dev_eval);
 		
 public:
 	TriCRF2();
@@ -80,6 +97,10 @@ public:
 	/// Testing
 	bool test(const std::string& filename, const std::string& outputfile = "", bool confidence = false);	
 
+	/// Reentrant inference ; the model is read-only and all the scratch memory is in ctx
+	/// (calculateEdge() should be called once before)
+	std::vector<size_t> decode(const TriStringSequence& seq, InferenceContext& ctx, size_t& max_z, long double& prob) const;
+
 };	///< TriCRF2
 
 } // namespace tricrf
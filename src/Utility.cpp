@@ -18,6 +18,8 @@
 #include <fstream>
 #include <time.h>
 #include <stdio.h>
+#include <cstring>
+#include <cstdlib>
 
 using namespace std;
 
@@ -40,6 +42,114 @@ vector<string> tokenize(const string& str, const string& delimiters) {
 	return tokens;
 } 
 
+static inline bool isDelimiter(char c, const char* delimiters) {
+	return c != '\0' && strchr(delimiters, c) != NULL;
+}
+
+/** Tokenize a string without copies.
+	The tokens are the same as tokenize(), but they refer to the characters of str.
+	@param	str	a string to be tokenized
+	@param	delimiters	delimeter(s) 
+	@param	tokens	tokens (the vector is reused)
+*/
+void tokenize(const StringRef& str, const char* delimiters, vector<StringRef>& tokens) {
+	tokens.clear();
+	const char* p = str.data;
+	const char* end = str.data + str.size;
+	while (p < end) {
+		if (isDelimiter(*p, delimiters)) {
+			++p;
+			continue;
+		}
+		const char* q = p;
+		while (q < end && !isDelimiter(*q, delimiters))
+			++q;
+		tokens.push_back(StringRef(p, q - p));
+		p = q;
+	}
+}
+
+/** Parse a floating point number.
+	A plain decimal ([+-]digits[.digits]) with up to 15 digits is m / 10^k with
+	the exact m and 10^k, which is correctly rounded as strtod() ; the other
+	forms are given to atof().
+	@param	str	characters of the number
+	@return	the same value as atof()
+*/
+double parseFloat(const StringRef& str) {
+	static const double power10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15};
+	const char* p = str.data;
+	const char* end = str.data + str.size;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+	unsigned long long m = 0;
+	size_t n_digit = 0, n_frac = 0;
+	bool dot = false;
+	for (; p < end; ++p) {
+		if (*p >= '0' && *p <= '9') {
+			m = m * 10 + (*p - '0');
+			++n_digit;
+			if (dot)
+				++n_frac;
+		} else if (*p == '.' && !dot)
+			dot = true;
+		else
+			break;
+	}
+	if (p == end && n_digit > 0 && n_digit <= 15) {
+		double value = (double)m / power10[n_frac];
+		return negative ? -value : value;
+	}
+
+	/// other forms (exponent, long mantissa, trailing characters, ...)
+	char buf[64];
+	if (str.size < sizeof(buf)) {
+		memcpy(buf, str.data, str.size);
+		buf[str.size] = '\0';
+		return atof(buf);
+	}
+	return atof(str.str().c_str());
+}
+
+/** Split the feature and its value.
+	@param	token	"feature" or "feature:value"
+	@param	fval	feature value (unchanged if no value is given)
+	@return	feature
+*/
+StringRef parseFeature(const StringRef& token, double& fval) {
+	/// the first two non-empty fields separated by ':'
+	const char* p = token.data;
+	const char* end = token.data + token.size;
+	StringRef field[2];
+	size_t n = 0;
+	while (p < end && n < 2) {
+		if (*p == ':') {
+			++p;
+			continue;
+		}
+		const char* q = (const char*)memchr(p, ':', end - p);
+		if (q == NULL)
+			q = end;
+		field[n++] = StringRef(p, q - p);
+		p = q;
+	}
+	if (n < 2)
+		return token;
+	fval = parseFloat(field[1]);
+	return field[0];
+}
+
+void shuffleOrder(vector<size_t>& order, uint64_t& seed) {
+	for (size_t i = order.size(); i > 1; i--) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		swap(order[i-1], order[seed % i]);
+	}
+}
+
 /** Logger.
 */
 Logger::Logger() {
@@ -90,11 +200,13 @@ int Logger::report(const char *fmt, ...) {
 		va_list argptr;
 		va_start(argptr, fmt);
 		ret = vfprintf(m_File, fmt, argptr);
-		/// standard out
+		va_end(argptr);
+		/// standard out (the argument list is consumed by the first call)
 		if (m_Level > 1) {
+			va_start(argptr, fmt);
 			vfprintf(stderr, fmt, argptr);
+			va_end(argptr);
 		}
-		va_end(argptr);
 	}
 	fflush(m_File);
 
@@ -114,10 +226,12 @@ int Logger::report(size_t level, const char *fmt, ...) {
 		va_list argptr;
 		va_start(argptr, fmt);
 		ret = vfprintf(m_File, fmt, argptr);
+		va_end(argptr);
 		if (level > 1) {
+			va_start(argptr, fmt);
 			vfprintf(stderr, fmt, argptr);
+			va_end(argptr);
 		}
-		va_end(argptr);
 	}
 	fflush(m_File);
 
@@ -18,13 +18,44 @@
 #include <cfloat>
 #include <fstream>
 #include <stdarg.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 namespace tricrf {
 
 #define MAX_HEADER "===============================================\n  TriCRF - Triangular-chain CRF\n===============================================\n"
 
+/** Reference to a part of a string (not owned).
+	The referred characters should live while the reference is used.
+	@class StringRef
+*/
+struct StringRef {
+	const char* data;
+	size_t size;
+
+	StringRef() : data(""), size(0) {}
+	StringRef(const char* str) : data(str), size(std::char_traits<char>::length(str)) {}
+	StringRef(const char* str, size_t len) : data(str), size(len) {}
+	StringRef(const std::string& str) : data(str.data()), size(str.size()) {}
+
+	bool empty() const { return size == 0; };
+	std::string str() const { return std::string(data, size); };
+	bool operator==(const StringRef& ref) const { return size == ref.size && std::char_traits<char>::compare(data, ref.data, size) == 0; };
+	bool operator!=(const StringRef& ref) const { return !(*this == ref); };
+};
+
 /// tokenizer
 std::vector<std::string> tokenize(const std::string& str, const std::string& delimiters = " \t");
+/// tokenizer without copies ; the tokens refer to the characters of str
+void tokenize(const StringRef& str, const char* delimiters, std::vector<StringRef>& tokens);
+
+/// atof() of the characters ; exact fast path for the plain decimals
+double parseFloat(const StringRef& str);
+/// "feature:value" ; same as tokenize(token, ":") with the value set only if it is given
+StringRef parseFeature(const StringRef& token, double& fval);
+
+/// Fisher-Yates shuffle (xorshift64) ; the same seed gives the same order
+void shuffleOrder(std::vector<size_t>& order, uint64_t& seed);
 
 /// Logger
 class Logger {
@@ -73,6 +104,21 @@ private:
 	std::clock_t _start_time;
 }; // timer
 
+/// wall-clock timer ; the timer above measures the CPU time of the whole process,
+/// which is summed over the threads
+class wall_timer {
+ public:
+	wall_timer() { restart(); }
+	void   restart() { gettimeofday(&_start_time, NULL); }
+	double elapsed() const { 
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		return double(now.tv_sec - _start_time.tv_sec) + double(now.tv_usec - _start_time.tv_usec) * 1E-06;
+	}
+private:
+	struct timeval _start_time;
+}; // wall_timer
+
 /// finite testing function
 #if defined(_MSC_VER) || defined(__BORLANDC__)
 inline int finite(double x) { return _finite(x); }
@@ -81,6 +127,22 @@ inline int finite(double x) { return _finite(x); }
 /// log zero
 const double LOG_ZERO = log(DBL_MIN);
 
+/// exponentiate the accumulated linear scores ; exp() is called once per cell
+/// (the cells without any active feature are simply set to 1)
+template <class T>
+inline void expScore(const std::vector<double>& score, std::vector<T>& factor) {
+	factor.resize(score.size());
+	for (size_t i = 0, n = score.size(); i < n; i++)
+		factor[i] = (score[i] == 0.0) ? 1.0 : exp(score[i]);
+}
+
+/// in place
+template <class T>
+inline void expScore(std::vector<T>& score) {
+	for (size_t i = 0, n = score.size(); i < n; i++)
+		score[i] = (score[i] == 0.0) ? 1.0 : exp((double)score[i]);
+}
+
 } // namespace tricrf
 
 #endif
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/** Numerical equivalence of the reduced precision lattices.
+	For every sequence of a training file, the double and float forward-backward (the SIMD kernels
+	of Lattice.cpp) is compared with the long double reference: the scaled alpha and beta
+	and log Z = sum_i log scale[i]. The weights are random (fixed seed), so that the factors are not trivial.
+	The float/double dot and axpy of LBFGS are compared with the scalar loops.
+	The exp that fills the factors of the reduced precision lattices is compared with exp().
+	usage: lattice_test data_file
+*/
+
+/// max headers
+#include "CRF.h"
+#include "Lattice.h"
+/// standard headers
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+using namespace tricrf;
+
+class LatticeTest : public CRF {
+private:
+	struct Error {
+		double log_z;	///< relative error of log Z
+		double alpha;	///< absolute error of the scaled alpha
+		double beta;	///< absolute error of the scaled beta
+		Error() : log_z(0.0), alpha(0.0), beta(0.0) {}
+	};
+
+	static long double logZ(const InferenceContext& ctx) {
+		long double log_z = 0.0;
+		for (size_t i = 0; i < ctx.seq_size; i++)
+			log_z += log(ctx.scale[i]);
+		return log_z;
+	}
+
+	static double maxDiff(const vector<long double>& x, const vector<long double>& y, size_t n) {
+		double diff = 0.0;
+		for (size_t i = 0; i < n; i++)
+			diff = max(diff, (double)fabsl(x[i] - y[i]));
+		return diff;
+	}
+
+	/// the float x / double y kernels (LBFGS history) against the scalar loops, over the lengths of the tails
+	static double compareMixed() {
+		double err = 0.0;
+		vector<float> x(40);
+		vector<double> y(40), z(40);
+		for (size_t n = 0; n <= x.size(); n++) {
+			double dot = 0.0;
+			for (size_t i = 0; i < n; i++) {
+				x[i] = (float)(2.0 * rand() / RAND_MAX - 1.0);
+				y[i] = z[i] = 2.0 * rand() / RAND_MAX - 1.0;
+				dot += (double)x[i] * y[i];
+				z[i] += 0.5 * x[i];
+			}
+			err = max(err, fabs(latticeDot(&x[0], &y[0], n) - dot));
+			latticeAxpy(0.5, &x[0], &y[0], n);
+			for (size_t i = 0; i < n; i++)
+				err = max(err, fabs(y[i] - z[i]));
+		}
+		return err;
+	}
+
+	/// relative error of latticeExp() against exp(), over the lengths of the tails and the range of the scores
+	static double compareExp() {
+		double err = 0.0;
+		vector<double> x(40), y(40);
+		for (size_t n = 0; n <= x.size(); n++) {
+			for (size_t i = 0; i < n; i++)
+				x[i] = 1500.0 * rand() / RAND_MAX - 750.0;
+			if (n > 0)
+				x[0] = 0.0;
+			latticeExp(&x[0], &y[0], n);
+			for (size_t i = 0; i < n; i++) {
+				double e = exp(x[i]);
+				if (e == 0.0 || e > DBL_MAX || e < DBL_MIN)	///< 0, inf or gradual underflow
+					err = max(err, (e == y[i] || fabs(e - y[i]) <= DBL_MIN * DBL_EPSILON) ? 0.0 : 1.0);
+				else
+					err = max(err, fabs(y[i] - e) / e);
+			}
+		}
+		for (size_t i = 0; i < 100000; i++) {	///< the scores of the factors are small
+			x[0] = 40.0 * rand() / RAND_MAX - 20.0;
+			latticeExp(&x[0], &y[0], 1);
+			err = max(err, fabs(y[0] - exp(x[0])) / exp(x[0]));
+		}
+		return err;
+	}
+
+	Error compare(LatticePrecision precision) {
+		Error err;
+		setPrecision(precision);
+		calculateEdge();	///< copies the transitions into m_M2d or m_M2f
+		InferenceContext ref, ctx;
+		for (size_t s = 0; s < m_TrainSet.size(); s++) {
+			const Sequence& seq = m_TrainSet[s];
+			m_Precision = LATTICE_LONG_DOUBLE;
+			calculateFactors(seq, ref);
+			forward(ref);
+			backward(ref);
+			m_Precision = precision;
+			calculateFactors(seq, ctx);
+			forward(ctx);
+			backward(ctx);
+
+			size_t n = ctx.seq_size * m_state_size;
+			long double z_ref = logZ(ref);
+			err.log_z = max(err.log_z, (double)(fabsl(logZ(ctx) - z_ref) / max(fabsl(z_ref), 1.0L)));
+			err.alpha = max(err.alpha, maxDiff(ctx.Alpha, ref.Alpha, n));
+			err.beta = max(err.beta, maxDiff(ctx.Beta, ref.Beta, n));
+		}
+		return err;
+	}
+
+public:
+	LatticeTest(Logger* logger) : CRF(logger) {}
+
+	int run(const string& filename) {
+		readTrainData(filename);
+
+		/// random weights in [-1, 1]
+		double* theta = m_Param.getWeight();
+		srand(1);
+		for (size_t i = 0; i < m_Param.size(); i++)
+			theta[i] = 2.0 * rand() / RAND_MAX - 1.0;
+		makeSparseIndex();	///< every transition is active
+
+		printf("%lu sequences, %lu states, %s kernel\n", (unsigned long)m_TrainSet.size(), (unsigned long)m_state_size, latticeKernel());
+
+		int failed = 0;
+		const LatticePrecision precision[2] = { LATTICE_DOUBLE, LATTICE_FLOAT };
+		const double tol[2] = { 1e-12, 1e-5 };	///< log Z (relative), alpha and beta (absolute) ; well above the rounding of the kernels
+		for (size_t p = 0; p < 2; p++) {
+			Error err = compare(precision[p]);
+			bool ok = (err.log_z <= tol[p] && err.alpha <= tol[p] && err.beta <= tol[p]);
+			printf("%-12s log Z %.3e  alpha %.3e  beta %.3e  (tolerance %.0e) %s\n", precisionName(precision[p]),
+				err.log_z, err.alpha, err.beta, tol[p], (ok ? "ok" : "FAILED"));
+			if (!ok)
+				failed++;
+		}
+		double exp_err = compareExp();
+		bool exp_ok = (exp_err <= 4 * DBL_EPSILON);
+		printf("%-12s exp %.3e  (tolerance %.0e) %s\n", "double", exp_err, 4 * DBL_EPSILON, (exp_ok ? "ok" : "FAILED"));
+		if (!exp_ok)
+			failed++;
+		double err = compareMixed();
+		bool ok = (err <= 1e-12);
+		printf("%-12s dot, axpy %.3e  (tolerance %.0e) %s\n", "float/double", err, 1e-12, (ok ? "ok" : "FAILED"));
+		if (!ok)
+			failed++;
+		return failed;
+	}
+};
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s data_file\n", argv[0]);
+		return 2;
+	}
+	Logger logger("/dev/null");
+	LatticeTest test(&logger);
+	return test.run(argv[1]) == 0 ? 0 : 1;
+}
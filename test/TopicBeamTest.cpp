@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/** Topic beam on the threads.
+	For every sequence of a training file (TriCRF1), the forward pass of the topic planes within a tight
+	topic beam is run on a single thread and in waves on n threads ; the computed planes (ctx.topic.active),
+	their alpha and Z should be identical. The weights are random (fixed seed), so that the beam cuts.
+	usage: topic_beam_test data_file [n_threads]
+*/
+
+/// max headers
+#include "TriCRF1.h"
+/// standard headers
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+using namespace tricrf;
+
+class TopicBeamTest : public TriCRF1 {
+private:
+	static void randomize(Parameter& param) {
+		double* theta = param.getWeight();
+		for (size_t i = 0; i < param.size(); i++)
+			theta[i] = 2.0 * rand() / RAND_MAX - 1.0;
+	}
+
+	/// number of the sequences whose lattices differ
+	size_t compare(double beam, size_t& computed, size_t& planes) {
+		setTopicBeam(beam);
+		InferenceContext ctx1, ctxn;
+		ctxn.topic.pool = m_Pool;	///< even with fewer planes than topicPool asks for
+		size_t failed = 0;
+		for (size_t s = 0; s < m_TrainSet.size(); s++) {
+			const TriStringSequence& triseq = m_TrainSet[s];
+			calculateFactors(triseq, ctx1);
+			beamTopic(ctx1);
+			forward(ctx1);
+			long double z1 = getPartitionZ(ctx1);
+
+			calculateFactors(triseq, ctxn);
+			beamTopic(ctxn);
+			forward(ctxn);
+			long double zn = getPartitionZ(ctxn);
+
+			bool same = (z1 == zn && ctx1.topic.active == ctxn.topic.active);
+			for (size_t z = 0; same && z < m_topic_size; z++)
+				same = (ctx1.topic.ZAlpha[z] == ctxn.topic.ZAlpha[z]);
+			if (!same)
+				failed++;
+			computed += ctx1.topic.active.size();
+			planes += m_topic_size;
+		}
+		return failed;
+	}
+
+public:
+	TopicBeamTest(Logger* logger) { setLogger(logger); }
+
+	int run(const string& filename, size_t n_threads) {
+		setThreads(n_threads);
+		readTrainData(filename);
+		initializeModel();
+
+		/// random weights in [-1, 1]
+		srand(1);
+		randomize(m_ParamTopic);
+		for (size_t z = 0; z < m_topic_size; z++)
+			randomize(m_ParamSeq[z]);
+		randomize(m_Param);
+		calculateEdge();
+
+		printf("%lu sequences, %lu topics, 1 vs %lu threads\n", (unsigned long)m_TrainSet.size(), (unsigned long)m_topic_size, (unsigned long)sizeThreads());
+
+		int failed = 0;
+		const double beam[2] = { 10.0, 2.0 };
+		for (size_t b = 0; b < 2; b++) {
+			size_t computed = 0, planes = 0;
+			size_t n_diff = compare(beam[b], computed, planes);
+			printf("topic_beam %-4g %lu of %lu planes computed, %lu sequences differ %s\n", beam[b],
+				(unsigned long)computed, (unsigned long)planes, (unsigned long)n_diff, (n_diff == 0 ? "ok" : "FAILED"));
+			if (n_diff > 0)
+				failed++;
+		}
+		return failed;
+	}
+};
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s data_file [n_threads]\n", argv[0]);
+		return 2;
+	}
+	size_t n_threads = (argc > 2 ? atoi(argv[2]) : 4);
+	Logger logger("/dev/null");
+	TopicBeamTest test(&logger);
+	return test.run(argv[1], n_threads) == 0 ? 0 : 1;
+}